@@ -0,0 +1,328 @@
+//
+// Interned roles and permissions, and the users resolved by the guard.
+//
+
+#ifndef WPP_ACCESS_CONTROL_H
+#define WPP_ACCESS_CONTROL_H
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string/trim.hpp>
+
+#include "utils/json.hpp"
+
+namespace wpp {
+    using json = nlohmann::json;
+
+    // Roles or permissions as bits
+    constexpr size_t max_access_names = 256;
+    using access_set = std::bitset<max_access_names>;
+
+    // Names of roles (or permissions) interned to small IDs. Names are
+    // registered while the application is set up and only read while it
+    // serves, so lookups take no lock.
+    class access_registry {
+        public:
+            static constexpr size_t npos = static_cast<size_t>(-1);
+
+            // The ID of name, registering it if needed
+            size_t intern(const std::string &name) {
+                const std::string trimmed = boost::algorithm::trim_copy(name);
+                auto it = ids_.find(trimmed);
+                if (it != ids_.end()) {
+                    return it->second;
+                }
+                if (names_.size() == max_access_names) {
+                    throw std::length_error("More than " + std::to_string(max_access_names) + " roles or permissions");
+                }
+                ids_.emplace(trimmed, names_.size());
+                names_.push_back(trimmed);
+                return names_.size() - 1;
+            }
+
+            // The ID of name, or npos if it was not interned
+            size_t find(const std::string &name) const {
+                auto it = ids_.find(name);
+                return it == ids_.end() ? npos : it->second;
+            }
+
+            // The set of a list of names such as "admin|editor" (or with
+            // commas). False if one of them was not interned.
+            bool mask(const std::string &names, access_set &out) const {
+                size_t pos = 0;
+                while (pos <= names.size()) {
+                    size_t end = names.find_first_of("|,", pos);
+                    if (end == std::string::npos) {
+                        end = names.size();
+                    }
+                    const std::string name = boost::algorithm::trim_copy(names.substr(pos, end - pos));
+                    if (!name.empty()) {
+                        const size_t id = find(name);
+                        if (id == npos) {
+                            return false;
+                        }
+                        out.set(id);
+                    }
+                    pos = end + 1;
+                }
+                return true;
+            }
+
+            const std::string &name(size_t id) const {
+                return names_.at(id);
+            }
+
+            size_t size() const {
+                return names_.size();
+            }
+
+        private:
+            std::unordered_map<std::string, size_t> ids_;
+            std::vector<std::string> names_;
+    };
+
+    // A user as the guard callback returned it, with its "role" and
+    // "permission" fields resolved once: interned names become bits and
+    // the others are kept sorted, so checks never touch the json.
+    class principal {
+        public:
+            principal(json user, const access_registry &roles, const access_registry &permissions)
+                    : user_(std::move(user)), role_registry_(&roles), permission_registry_(&permissions) {
+                if (user_.is_object()) {
+                    collect(user_, "role", roles, roles_, other_roles_);
+                    collect(user_, "permission", permissions, permissions_, other_permissions_);
+                }
+            }
+
+            const json &user() const {
+                return user_;
+            }
+
+            bool authenticated() const {
+                return !user_.is_null();
+            }
+
+            const access_set &roles() const {
+                return roles_;
+            }
+
+            const access_set &permissions() const {
+                return permissions_;
+            }
+
+            bool has_role(const std::string &name) const {
+                return has(name, *role_registry_, roles_, other_roles_);
+            }
+
+            bool has_permission(const std::string &name) const {
+                return has(name, *permission_registry_, permissions_, other_permissions_);
+            }
+
+            bool has_any_role(const access_set &mask) const {
+                return (roles_ & mask).any();
+            }
+
+            bool has_any_permission(const access_set &mask) const {
+                return (permissions_ & mask).any();
+            }
+
+            bool has_all_permissions(const access_set &mask) const {
+                return (permissions_ & mask) == mask;
+            }
+
+        private:
+            static void collect(const json &user, const char *field, const access_registry &registry,
+                                access_set &bits, std::vector<std::string> &others) {
+                auto it = user.find(field);
+                if (it == user.end()) {
+                    return;
+                }
+                auto add = [&](const json &value) {
+                    if (!value.is_string()) {
+                        return;
+                    }
+                    const std::string name = boost::algorithm::trim_copy(value.get<std::string>());
+                    const size_t id = registry.find(name);
+                    if (id != access_registry::npos) {
+                        bits.set(id);
+                    } else {
+                        others.push_back(name);
+                    }
+                };
+                if (it->is_array()) {
+                    for (const json &value : *it) {
+                        add(value);
+                    }
+                } else {
+                    add(*it);
+                }
+                std::sort(others.begin(), others.end());
+            }
+
+            static bool has(const std::string &name, const access_registry &registry, const access_set &bits,
+                            const std::vector<std::string> &others) {
+                size_t id = registry.find(name);
+                if (id != access_registry::npos) {
+                    return bits.test(id);
+                }
+                const std::string trimmed = boost::algorithm::trim_copy(name);
+                id = registry.find(trimmed);
+                if (id != access_registry::npos) {
+                    return bits.test(id);
+                }
+                return std::binary_search(others.begin(), others.end(), trimmed);
+            }
+
+            json user_;
+            access_set roles_;
+            access_set permissions_;
+            // Names that were not interned
+            std::vector<std::string> other_roles_;
+            std::vector<std::string> other_permissions_;
+            const access_registry *role_registry_;
+            const access_registry *permission_registry_;
+    };
+
+    // Resolved users by session, so the guard callback (usually a database
+    // query) runs once per session and TTL instead of once per request.
+    // Entries are dropped when they expire, when invalidated, or when a
+    // full shard needs room.
+    class user_cache {
+        public:
+            struct settings {
+                // Zero disables the cache
+                std::chrono::milliseconds ttl{std::chrono::seconds(0)};
+                size_t max_entries{100000};
+            };
+
+            using clock = std::chrono::steady_clock;
+
+            // Call before the server starts
+            void configure(settings s) {
+                settings_ = s;
+            }
+
+            bool enabled() const {
+                return settings_.ttl.count() > 0;
+            }
+
+            std::shared_ptr<const principal> get(const std::string &session) {
+                shard &s = shard_of(session);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto it = s.users.find(session);
+                if (it == s.users.end()) {
+                    misses_.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                if (it->second.expires <= clock::now()) {
+                    s.users.erase(it);
+                    misses_.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return it->second.user;
+            }
+
+            void put(const std::string &session, std::shared_ptr<const principal> user) {
+                shard &s = shard_of(session);
+                const auto now = clock::now();
+                const size_t max_per_shard = std::max<size_t>(1, settings_.max_entries / shard_count);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.users.size() >= max_per_shard && !s.users.count(session)) {
+                    for (auto it = s.users.begin(); it != s.users.end();) {
+                        it = it->second.expires <= now ? s.users.erase(it) : std::next(it);
+                    }
+                    if (s.users.size() >= max_per_shard) {
+                        s.users.erase(s.users.begin());
+                    }
+                }
+                s.users[session] = {std::move(user), now + settings_.ttl};
+            }
+
+            // Forget the user of a session, as after a logout
+            void invalidate(const std::string &session) {
+                shard &s = shard_of(session);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                s.users.erase(session);
+            }
+
+            // Forget the users for which pred is true, as when the roles of
+            // a user change. Returns how many entries were dropped.
+            size_t invalidate_if(const std::function<bool(const json &user)> &pred) {
+                size_t n = 0;
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    for (auto it = s.users.begin(); it != s.users.end();) {
+                        if (pred(it->second.user->user())) {
+                            it = s.users.erase(it);
+                            ++n;
+                        } else {
+                            ++it;
+                        }
+                    }
+                }
+                return n;
+            }
+
+            void clear() {
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    s.users.clear();
+                }
+            }
+
+            size_t size() const {
+                size_t n = 0;
+                for (const shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    n += s.users.size();
+                }
+                return n;
+            }
+
+            size_t hits() const {
+                return hits_.load(std::memory_order_relaxed);
+            }
+
+            size_t misses() const {
+                return misses_.load(std::memory_order_relaxed);
+            }
+
+        private:
+            static constexpr size_t shard_count = 16;
+
+            struct entry {
+                std::shared_ptr<const principal> user;
+                clock::time_point expires;
+            };
+
+            struct shard {
+                mutable std::mutex mutex;
+                std::unordered_map<std::string, entry> users;
+            };
+
+            shard &shard_of(const std::string &session) {
+                return shards_[std::hash<std::string>()(session) % shard_count];
+            }
+
+            settings settings_;
+            shard shards_[shard_count];
+            std::atomic<size_t> hits_{0};
+            std::atomic<size_t> misses_{0};
+    };
+
+}
+
+#endif //WPP_ACCESS_CONTROL_H
@@ -0,0 +1,282 @@
+//
+// Connection admission and load shedding for the http server.
+//
+
+#ifndef WPP_ADMISSION_CONTROL_H
+#define WPP_ADMISSION_CONTROL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+namespace wpp {
+
+    // Keeps the server responsive when it receives more work than it can do.
+    // The listener asks for a connection slot before launching a session,
+    // the sessions ask for a request slot before dispatching a handler and
+    // the shedder (CoDel) watches how long requests wait between the end of
+    // the read and the dispatch. Requests rejected here are answered with a
+    // precomputed 503, which costs no allocation and no handler time.
+    class admission_control {
+        public:
+            using clock = std::chrono::steady_clock;
+
+            struct settings {
+                // 0 means unlimited
+                size_t max_connections{0};
+                // 0 means unlimited
+                size_t max_in_flight_requests{0};
+                // new connections per second (0 means unlimited)
+                double accept_rate{0.0};
+                // connections we can accept in a burst above the rate
+                size_t accept_burst{64};
+                // acceptable time between reading a request and dispatching it
+                std::chrono::milliseconds queue_delay_target{5};
+                // window in which the delay has to stay above the target before we shed
+                std::chrono::milliseconds queue_delay_interval{100};
+                // value of the Retry-After header in the 503 response
+                std::chrono::seconds retry_after{1};
+            };
+
+            // Connection slot owned by a session. Releases itself on destruction
+            // so the count is right however the session ends.
+            class connection_slot {
+                public:
+                    connection_slot() = default;
+
+                    explicit connection_slot(admission_control* owner) : owner_(owner) {}
+
+                    connection_slot(connection_slot&& other) noexcept : owner_(other.owner_) {
+                        other.owner_ = nullptr;
+                    }
+
+                    connection_slot& operator=(connection_slot&& other) noexcept {
+                        if (this != &other) {
+                            release();
+                            owner_ = other.owner_;
+                            other.owner_ = nullptr;
+                        }
+                        return *this;
+                    }
+
+                    connection_slot(const connection_slot&) = delete;
+                    connection_slot& operator=(const connection_slot&) = delete;
+
+                    ~connection_slot() {
+                        release();
+                    }
+
+                    explicit operator bool() const {
+                        return owner_ != nullptr;
+                    }
+
+                    void release() {
+                        if (owner_) {
+                            owner_->release_connection();
+                            owner_ = nullptr;
+                        }
+                    }
+
+                private:
+                    admission_control* owner_{nullptr};
+            };
+
+            admission_control() {
+                configure(settings{});
+            }
+
+            explicit admission_control(settings s) {
+                configure(s);
+            }
+
+            // Should be called before the server starts
+            void configure(settings s) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                settings_ = s;
+                tokens_ = static_cast<double>(settings_.accept_burst);
+                last_refill_ = clock::now();
+                overloaded_response_ =
+                        "HTTP/1.1 503 Service Unavailable\r\n"
+                        "Retry-After: " + std::to_string(settings_.retry_after.count()) + "\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: 19\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "Service Unavailable";
+            }
+
+            const settings& get_settings() const {
+                return settings_;
+            }
+
+            ///////////////////////////////////////////////////////////////
+            //                       CONNECTIONS                         //
+            ///////////////////////////////////////////////////////////////
+            // Returns an empty slot if the server is already at max_connections
+            connection_slot try_acquire_connection() {
+                const size_t limit = settings_.max_connections;
+                size_t current = connections_.load(std::memory_order_relaxed);
+                do {
+                    if (limit != 0 && current >= limit) {
+                        rejected_connections_.fetch_add(1, std::memory_order_relaxed);
+                        return connection_slot{};
+                    }
+                } while (!connections_.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+                return connection_slot(this);
+            }
+
+            void release_connection() {
+                connections_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            size_t connections() const {
+                return connections_.load(std::memory_order_relaxed);
+            }
+
+            // Token bucket for the accept rate.
+            // Returns zero if a connection can be accepted now, or how long
+            // the listener should wait before accepting the next one.
+            clock::duration accept_delay() {
+                if (settings_.accept_rate <= 0.0) {
+                    return clock::duration::zero();
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                const clock::time_point now = clock::now();
+                const double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+                last_refill_ = now;
+                tokens_ = std::min(static_cast<double>(settings_.accept_burst),
+                                   tokens_ + elapsed * settings_.accept_rate);
+                if (tokens_ >= 1.0) {
+                    tokens_ -= 1.0;
+                    return clock::duration::zero();
+                }
+                const double missing = (1.0 - tokens_) / settings_.accept_rate;
+                return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(missing));
+            }
+
+            ///////////////////////////////////////////////////////////////
+            //                         REQUESTS                          //
+            ///////////////////////////////////////////////////////////////
+            // Decides if a request that was read at `read_time` can be dispatched.
+            // Returns false if the request should be answered with the 503.
+            bool admit_request(clock::time_point read_time) {
+                const clock::time_point now = clock::now();
+                if (should_shed(now - read_time, now)) {
+                    shed_requests_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                const size_t limit = settings_.max_in_flight_requests;
+                size_t current = in_flight_.load(std::memory_order_relaxed);
+                do {
+                    if (limit != 0 && current >= limit) {
+                        shed_requests_.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                } while (!in_flight_.compare_exchange_weak(current, current + 1, std::memory_order_relaxed));
+                return true;
+            }
+
+            // Called when the response of an admitted request was written
+            void release_request() {
+                in_flight_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+            size_t in_flight_requests() const {
+                return in_flight_.load(std::memory_order_relaxed);
+            }
+
+            // Raw HTTP/1.1 503 with Retry-After. Written as is to the stream.
+            const std::string& overloaded_response() const {
+                return overloaded_response_;
+            }
+
+            ///////////////////////////////////////////////////////////////
+            //                        STATISTICS                         //
+            ///////////////////////////////////////////////////////////////
+            size_t rejected_connections() const {
+                return rejected_connections_.load(std::memory_order_relaxed);
+            }
+
+            size_t shed_requests() const {
+                return shed_requests_.load(std::memory_order_relaxed);
+            }
+
+        private:
+            // CoDel control law: the queue is only considered bad if the delay
+            // stays above the target for a whole interval. Once dropping, the
+            // next drop comes after interval/sqrt(count), so shedding gets more
+            // aggressive while the delay does not go down.
+            bool should_shed(clock::duration sojourn, clock::time_point now) {
+                if (settings_.queue_delay_target.count() <= 0) {
+                    return false;
+                }
+                // Requests that did not wait only take the lock
+                // when they have a state to reset
+                if (sojourn < settings_.queue_delay_target &&
+                    !above_target_.load(std::memory_order_relaxed)) {
+                    return false;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (sojourn < settings_.queue_delay_target) {
+                    first_above_time_ = clock::time_point{};
+                    dropping_ = false;
+                    above_target_.store(false, std::memory_order_relaxed);
+                    return false;
+                }
+                if (first_above_time_ == clock::time_point{}) {
+                    first_above_time_ = now + settings_.queue_delay_interval;
+                    above_target_.store(true, std::memory_order_relaxed);
+                    return false;
+                }
+                if (now < first_above_time_) {
+                    return false;
+                }
+                if (!dropping_) {
+                    dropping_ = true;
+                    // start close to the last drop rate if we were dropping recently
+                    drop_count_ = (drop_count_ > 2 && now - drop_next_ < 16 * settings_.queue_delay_interval)
+                                  ? drop_count_ - 2 : 1;
+                    drop_next_ = control_law(now);
+                    return true;
+                }
+                if (now >= drop_next_) {
+                    ++drop_count_;
+                    drop_next_ = control_law(drop_next_);
+                    return true;
+                }
+                return false;
+            }
+
+            clock::time_point control_law(clock::time_point t) const {
+                const auto interval = std::chrono::duration_cast<clock::duration>(settings_.queue_delay_interval);
+                return t + clock::duration(static_cast<clock::duration::rep>(
+                        interval.count() / std::sqrt(static_cast<double>(drop_count_))));
+            }
+
+            settings settings_;
+            std::string overloaded_response_;
+
+            std::atomic<size_t> connections_{0};
+            std::atomic<size_t> in_flight_{0};
+            std::atomic<size_t> rejected_connections_{0};
+            std::atomic<size_t> shed_requests_{0};
+
+            // accept rate and codel state
+            std::mutex mutex_;
+            double tokens_{0.0};
+            clock::time_point last_refill_;
+            clock::time_point first_above_time_{};
+            clock::time_point drop_next_{};
+            size_t drop_count_{0};
+            bool dropping_{false};
+            // first_above_time_ is set
+            std::atomic<bool> above_target_{false};
+    };
+
+}
+
+#endif //WPP_ADMISSION_CONTROL_H
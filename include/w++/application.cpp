@@ -131,6 +131,7 @@
 
     self_t &session_name(string name) {
         this->session_name_ = name;
+        this->_response_cache.bypass_cookie(name);
         return *this;
     }
 
@@ -139,7 +140,11 @@
     };
 
     self_t &guard_call_back(std::function<json(wpp::request &)> __guard_call_back) {
-        this->_guard_call_back = __guard_call_back;
+        this->_guard_user_provider = __guard_call_back;
+        // The guard gets the user through resolve_user, which caches it
+        this->_guard_call_back = [this](wpp::request &req) {
+            return this->resolve_user(req)->user();
+        };
         return *this;
     }
 
@@ -167,26 +172,16 @@
     }
 
     self_t &lambda(string name, std::function<std::string(const std::string &)> f) {
-        this->_lambdas[string("@") + name] = wpp::mustache_data{wpp::basic_lambda<std::string>(f)};
-        return *this;
-    }
-
-    self_t &lambda(string name, std::function<std::string(const std::string &, wpp::renderer &)> f) {
-        this->_lambdas[string("@") + name] = wpp::mustache_data{basic_lambda2<std::string>{f}};
+        this->_views.lambda(name, f);
         return *this;
     }
 
-    wpp::response::view view(string filename, wpp::json json_data) {
-        return wpp::response::view(filename, json_data, this->_templates_root_path, this->_lambdas, this->_view_data, this->_pre_processed_views,
-                              this->_pre_processed_partials);
+    wpp::response view(string filename, wpp::json json_data) {
+        return render(filename, std::move(json_data));
     }
 
-    wpp::response::view view(string filename, wpp::json json_data, wpp::request &req) {
-        for (wpp::json::iterator it = req.view_bag.begin(); it != req.view_bag.end(); ++it) {
-            json_data.emplace(it.key(), it.value());
-        }
-        return wpp::response::view(filename, json_data, this->_templates_root_path, this->_lambdas, this->_view_data, this->_pre_processed_views,
-                              this->_pre_processed_partials);
+    wpp::response view(string filename, wpp::json json_data, wpp::request &req) {
+        return render(filename, std::move(json_data), req);
     }
 
     self_t &view_data(std::string filename, std::function<wpp::json()> func) {
@@ -241,6 +236,432 @@
         return cache_;
     }
 
+    void wpp::application::add_view_data(const string &filename, wpp::json &json_data) {
+        std::unordered_map<std::string, std::function<wpp::json()>>::iterator data_iter = this->_view_data.find(filename);
+        if (data_iter != this->_view_data.end()) {
+            wpp::json view_data = data_iter->second();
+            for (wpp::json::iterator it = view_data.begin(); it != view_data.end(); ++it) {
+                json_data.emplace(it.key(), it.value());
+            }
+        }
+    }
+
+    void wpp::application::add_view_data(const string &filename, wpp::views::render_context &context) {
+        std::unordered_map<std::string, std::function<wpp::json()>>::iterator data_iter = this->_view_data.find(filename);
+        if (data_iter != this->_view_data.end()) {
+            context.merge(data_iter->second());
+        }
+    }
+
+    wpp::response wpp::application::render(string filename, wpp::json json_data) {
+        wpp::response res;
+        add_view_data(filename, json_data);
+        // straight into the body, which is what the server sends
+        if (this->_views.render(filename, json_data, res.body)) {
+            res.headers.emplace("Content-Type", "text/html; charset=utf-8");
+        } else {
+            res.code = wpp::status_code::server_error_internal_server_error;
+            res.body = "Template not found: " + filename;
+        }
+        return res;
+    }
+
+    wpp::response wpp::application::render(string filename, wpp::json json_data, wpp::request &req) {
+        for (wpp::json::iterator it = req.view_bag.begin(); it != req.view_bag.end(); ++it) {
+            json_data.emplace(it.key(), it.value());
+        }
+        return render(filename, std::move(json_data));
+    }
+
+    void wpp::application::render_stream(string filename, wpp::json json_data, wpp::response &res, wpp::request &req) {
+        for (wpp::json::iterator it = req.view_bag.begin(); it != req.view_bag.end(); ++it) {
+            json_data.emplace(it.key(), it.value());
+        }
+        add_view_data(filename, json_data);
+        // The template is found before the stream is opened, in the set it
+        // is rendered from, so a reload cannot make the render fail after
+        // the sink sent its 200
+        std::shared_ptr<const wpp::views::plan_set> set = this->_views.current();
+        const uint32_t slot = set->slot(filename);
+        if (!set->contains(slot)) {
+            res.code = wpp::status_code::server_error_internal_server_error;
+            res.body = "Template not found: " + filename;
+            return;
+        }
+        res.headers.emplace("Content-Type", "text/html; charset=utf-8");
+        std::shared_ptr<wpp::chunked_writer> writer = req.stream();
+        if (writer) {
+            wpp::views::chunked_sink sink(writer);
+            wpp::views::render(*set, slot, json_data, sink);
+            sink.finish();
+        } else {
+            wpp::views::render(*set, slot, json_data, res.body);
+        }
+    }
+
+    bool wpp::application::render(string filename, const wpp::json &json_data, wpp::views::output_sink &out) {
+        return this->_views.render(filename, json_data, out);
+    }
+
+    wpp::response wpp::application::render(string filename, wpp::views::render_context &context) {
+        wpp::response res;
+        add_view_data(filename, context);
+        if (this->_views.render(filename, context, res.body)) {
+            res.headers.emplace("Content-Type", "text/html; charset=utf-8");
+        } else {
+            res.code = wpp::status_code::server_error_internal_server_error;
+            res.body = "Template not found: " + filename;
+        }
+        return res;
+    }
+
+    wpp::response wpp::application::render(string filename, wpp::views::render_context &context, wpp::request &req) {
+        // under the values of the handler, as with json
+        context.merge(req.view_bag);
+        return render(filename, context);
+    }
+
+    self_t &wpp::application::view_lambda(string name, wpp::views::scoped_lambda f) {
+        this->_views.lambda(name, std::move(f));
+        return *this;
+    }
+
+    self_t &wpp::application::pure_lambda(string name, std::function<std::string(const std::string &)> f, size_t max_entries) {
+        this->_views.pure_lambda(name, std::move(f), max_entries);
+        return *this;
+    }
+
+    self_t &wpp::application::view_data(std::string filename, std::function<wpp::json()> func, std::chrono::milliseconds ttl,
+                                        std::chrono::milliseconds stale_while_revalidate, std::string key) {
+        if (key.empty()) {
+            key = filename;
+        }
+        std::shared_ptr<wpp::views::data_provider> provider;
+        {
+            std::lock_guard<std::mutex> lock(this->_view_data_mutex);
+            std::shared_ptr<wpp::views::data_provider> &p = this->_view_data_providers[key];
+            if (!p) {
+                // refreshes run on the blocking pool, off the I/O threads
+                p = std::make_shared<wpp::views::data_provider>(
+                        std::move(func), ttl, stale_while_revalidate,
+                        [this](std::function<void()> task) { this->blocking_pool().enqueue(std::move(task)); });
+            }
+            provider = p;
+        }
+        this->_view_data[filename] = [provider]() { return *provider->get(); };
+        return *this;
+    }
+
+    self_t &wpp::application::invalidate_view_data(std::string key) {
+        std::shared_ptr<wpp::views::data_provider> provider;
+        {
+            std::lock_guard<std::mutex> lock(this->_view_data_mutex);
+            std::unordered_map<std::string, std::shared_ptr<wpp::views::data_provider>>::iterator it = this->_view_data_providers.find(key);
+            if (it != this->_view_data_providers.end()) {
+                provider = it->second;
+            }
+        }
+        if (provider) {
+            provider->invalidate();
+        }
+        return *this;
+    }
+
+    self_t &wpp::application::invalidate_fragment(string view, string key) {
+        this->_views.fragments().invalidate(view, key);
+        return *this;
+    }
+
+    self_t &wpp::application::invalidate_fragments(string view, string key_prefix) {
+        this->_views.fragments().invalidate_prefix(view, key_prefix);
+        return *this;
+    }
+
+    self_t &wpp::application::hot_reload_views(bool on_off) {
+        this->_hot_reload_views = on_off;
+        return *this;
+    }
+
+    wpp::views::plan_registry &wpp::application::get_views() {
+        return this->_views;
+    }
+
+    self_t &wpp::application::max_connections(size_t n) {
+        wpp::admission_control::settings s = this->_admission_control.get_settings();
+        s.max_connections = n;
+        this->_admission_control.configure(s);
+        return *this;
+    }
+
+    self_t &wpp::application::max_in_flight_requests(size_t n) {
+        wpp::admission_control::settings s = this->_admission_control.get_settings();
+        s.max_in_flight_requests = n;
+        this->_admission_control.configure(s);
+        return *this;
+    }
+
+    self_t &wpp::application::accept_rate(double connections_per_second, size_t burst) {
+        wpp::admission_control::settings s = this->_admission_control.get_settings();
+        s.accept_rate = connections_per_second;
+        s.accept_burst = burst;
+        this->_admission_control.configure(s);
+        return *this;
+    }
+
+    self_t &wpp::application::queue_delay_target(std::chrono::milliseconds target, std::chrono::milliseconds interval) {
+        wpp::admission_control::settings s = this->_admission_control.get_settings();
+        s.queue_delay_target = target;
+        s.queue_delay_interval = interval;
+        this->_admission_control.configure(s);
+        return *this;
+    }
+
+    wpp::admission_control &wpp::application::get_admission_control() {
+        return this->_admission_control;
+    }
+
+    self_t &wpp::application::timeouts(wpp::server_timeouts t) {
+        this->_timeouts = t;
+        return *this;
+    }
+
+    wpp::server_timeouts &wpp::application::timeouts() {
+        return this->_timeouts;
+    }
+
+    self_t &wpp::application::pipeline_depth(size_t n) {
+        this->_pipeline_depth = std::max<size_t>(1, n);
+        return *this;
+    }
+
+    size_t wpp::application::pipeline_depth() {
+        return this->_pipeline_depth;
+    }
+
+    self_t &wpp::application::body_limit(size_t bytes) {
+        this->_body_limit = bytes;
+        return *this;
+    }
+
+    size_t wpp::application::body_limit() {
+        return this->_body_limit;
+    }
+
+    self_t &wpp::application::cache_responses(wpp::response_cache::settings s) {
+        this->_response_cache.configure(std::move(s));
+        // pages of a session are never served from or stored in the cache
+        this->_response_cache.bypass_cookie(this->session_name());
+        this->middleware("cache", [this](wpp::response &res, wpp::request &req, std::string parameter,
+                                         wpp::resource_function &next) {
+            auto header = [&req](const std::string &name) {
+                return req.get_header_value_icase(name);
+            };
+            wpp::response_cache &cache = this->_response_cache;
+            const auto authenticated = [&req]() {
+                return req._principal && req._principal->authenticated();
+            };
+            if (req.method_requested != wpp::method::get || cache.bypass(header) ||
+                !this->session_key(req).empty() || authenticated()) {
+                next(res, req);
+                return;
+            }
+            next(res, req);
+            // streamed and asynchronous responses are not complete here,
+            // and a guard may have found a user while routing
+            if (req.deferred() || res.code != wpp::status_code::success_ok || authenticated()) {
+                return;
+            }
+            std::vector<std::pair<std::string, std::string>> fields;
+            std::vector<std::string> tags;
+            for (auto it = res.headers.begin(); it != res.headers.end();) {
+                if (boost::iequals(it->first, "Set-Cookie")) {
+                    return;
+                }
+                if (boost::iequals(it->first, "Cache-Control") &&
+                    (boost::icontains(it->second, "no-store") || boost::icontains(it->second, "private"))) {
+                    return;
+                }
+                if (boost::iequals(it->first, "Surrogate-Key")) {
+                    // tags are for us, not for the client
+                    boost::split(tags, it->second, boost::is_any_of(" "), boost::token_compress_on);
+                    it = res.headers.erase(it);
+                    continue;
+                }
+                if (!boost::iequals(it->first, "Content-Length") && !boost::iequals(it->first, "Connection") &&
+                    !boost::iequals(it->first, "Transfer-Encoding")) {
+                    fields.emplace_back(it->first, it->second);
+                }
+                ++it;
+            }
+            const std::string target = req.query_string.empty() ? req.url_ : req.url_ + "?" + req.query_string;
+            cache.store(header("Host"), target, wpp::response_cache::policy::parse(parameter, cache.get_settings()),
+                        header, static_cast<int>(res.code), std::move(fields), res.body, std::move(tags));
+        });
+        return *this;
+    }
+
+    self_t &wpp::application::invalidate_response(string target) {
+        this->_response_cache.invalidate(target);
+        return *this;
+    }
+
+    self_t &wpp::application::invalidate_response_tag(string tag) {
+        this->_response_cache.invalidate_tag(tag);
+        return *this;
+    }
+
+    wpp::response_cache &wpp::application::get_response_cache() {
+        return this->_response_cache;
+    }
+
+    self_t &wpp::application::etag_responses() {
+        this->middleware("etag", [](wpp::response &res, wpp::request &req, std::string,
+                                    wpp::resource_function &next) {
+            next(res, req);
+            if (req.method_requested != wpp::method::get || req.deferred() || res.code != wpp::status_code::success_ok) {
+                return;
+            }
+            // the handler set one from its own validator
+            for (auto &h : res.headers) {
+                if (boost::iequals(h.first, "ETag")) {
+                    return;
+                }
+            }
+            const std::string tag = wpp::etag_of(res.body);
+            res.headers.emplace("ETag", tag);
+            if (wpp::etag_matches(req.get_header_value_icase("If-None-Match"), tag)) {
+                res.code = wpp::status_code::redirection_not_modified;
+                res.body.clear();
+            }
+        });
+        return *this;
+    }
+
+    bool wpp::application::not_modified(wpp::response &res, wpp::request &req, const string &validator) {
+        const std::string tag = wpp::weak_etag_of(validator);
+        res.headers.emplace("ETag", tag);
+        if (wpp::etag_matches(req.get_header_value_icase("If-None-Match"), tag)) {
+            res.code = wpp::status_code::redirection_not_modified;
+            res.body.clear();
+            return true;
+        }
+        return false;
+    }
+
+    bool wpp::application::not_modified(wpp::response &res, wpp::request &req,
+                                        std::chrono::system_clock::time_point updated_at) {
+        return this->not_modified(res, req, std::to_string(
+                std::chrono::duration_cast<std::chrono::microseconds>(updated_at.time_since_epoch()).count()));
+    }
+
+    self_t &wpp::application::http2(bool on_off) {
+        this->_http2 = on_off;
+        return *this;
+    }
+
+    bool wpp::application::http2() {
+        return this->_http2;
+    }
+
+    wpp::websocket_route wpp::application::websocket(std::string rule) {
+        auto endpoint = std::make_shared<wpp::websocket_endpoint>();
+        resource_function accept_upgrade = [endpoint](wpp::response &res, wpp::request &req) {
+            req._websocket = endpoint;
+            // What clients that did not come through the upgrade get
+            res.code = wpp::status_code::client_error_upgrade_required;
+            res.headers.emplace("Upgrade", "websocket");
+            res.headers.emplace("Connection", "Upgrade");
+        };
+        return wpp::websocket_route(endpoint, this->route2p({wpp::method::get}, rule, accept_upgrade));
+    }
+
+    std::shared_ptr<const wpp::websocket_endpoint> wpp::application::websocket_upgrade(wpp::response &res, wpp::request &req) {
+        res.parent_application = this;
+        req.parent_application = this;
+        // the middleware of the route may need the user of the session
+        this->load_session(req);
+        std::tuple<bool, unsigned, wpp::routing_params> found = this->_route_trie.find(req.url_, req.method_requested);
+        if (!std::get<0>(found)) {
+            this->error(wpp::status_code::client_error_not_found, res, req);
+            return nullptr;
+        }
+        req.query_parameters = std::move(std::get<2>(found));
+        req.current_route = &this->_routes[std::get<1>(found)];
+        req.current_route->_func(res, req);
+        return req._websocket;
+    }
+
+    wpp::websocket_route &wpp::websocket_route::middleware(std::string name) {
+        this->route_->middleware(std::move(name));
+        return *this;
+    }
+
+    wpp::websocket_route &wpp::websocket_route::name(std::string route_name) {
+        this->route_->name(std::move(route_name));
+        return *this;
+    }
+
+    self_t &wpp::application::tls_session_cache(size_t size, std::chrono::seconds lifetime) {
+        wpp::tls_manager::settings s = this->_tls.get_settings();
+        s.session_cache_size = size;
+        s.session_lifetime = lifetime;
+        this->_tls.configure(s);
+        return *this;
+    }
+
+    self_t &wpp::application::tls_ticket_keys(std::chrono::seconds lifetime, size_t keys_kept) {
+        wpp::tls_manager::settings s = this->_tls.get_settings();
+        s.session_tickets = lifetime.count() > 0;
+        s.ticket_key_lifetime = lifetime;
+        s.ticket_keys_kept = keys_kept;
+        this->_tls.configure(s);
+        return *this;
+    }
+
+    self_t &wpp::application::ecdsa_certificate(string certificate_file, string key_file) {
+        wpp::tls_manager::settings s = this->_tls.get_settings();
+        s.ecdsa_certificate_file = std::move(certificate_file);
+        s.ecdsa_key_file = std::move(key_file);
+        this->_tls.configure(s);
+        return *this;
+    }
+
+    self_t &wpp::application::handshake_threads(size_t n) {
+        wpp::tls_manager::settings s = this->_tls.get_settings();
+        s.handshake_threads = n;
+        this->_tls.configure(s);
+        return *this;
+    }
+
+    wpp::tls_manager &wpp::application::get_tls() {
+        return this->_tls;
+    }
+
+    boost::asio::io_context &wpp::application::io_context() {
+        return *this->_io_context;
+    }
+
+    self_t &wpp::application::blocking_threads(size_t n) {
+        this->_blocking_threads = n;
+        return *this;
+    }
+
+    ThreadPool &wpp::application::blocking_pool() {
+        std::call_once(this->_blocking_pool_flag, [this]() {
+            this->_blocking_pool = std::make_unique<ThreadPool>(std::max<size_t>(1, this->_blocking_threads));
+        });
+        return *this->_blocking_pool;
+    }
+
+    void wpp::application::after(std::chrono::steady_clock::duration d, std::function<void()> then) {
+        auto timer = std::make_shared<boost::asio::steady_timer>(*this->_io_context, d);
+        timer->async_wait([timer, then](const boost::system::error_code &ec) {
+            if (!ec) {
+                then();
+            }
+        });
+    }
+
     void setup_trie() {
         for (int i = 0; i < this->_routes.size(); ++i) {
             // include name in app set for faster lookup
@@ -253,10 +674,12 @@
     }
 
     self_t &set_keys() {
-        // Load the necessary cipher
+        // Load the necessary ciphers
         EVP_add_cipher(EVP_aes_256_cbc());
+        EVP_add_cipher(EVP_aes_256_gcm());
         // set keys
         gen_params(key, iv);
+        _session_codec = session_codec(key);
         // return itself
         return *this;
     }
@@ -293,7 +716,21 @@
         success = false;
         // deserialize
         wpp::secure_string cyphered_text = std::move(text.c_str());
-        static const char *const lut = "0123456789abcdef";
+        static const struct hex_table {
+            signed char values[256];
+
+            hex_table() : values() {
+                for (int c = 0; c < 256; ++c) {
+                    values[c] = -1;
+                }
+                for (int d = 0; d < 10; ++d) {
+                    values['0' + d] = static_cast<signed char>(d);
+                }
+                for (int d = 0; d < 6; ++d) {
+                    values['a' + d] = static_cast<signed char>(10 + d);
+                }
+            }
+        } lut;
         size_t len = cyphered_text.length();
         if (len & 1) {
             return string{""};
@@ -301,20 +738,13 @@
         wpp::secure_string unserialized_cyphered_text;
         unserialized_cyphered_text.reserve(len / 2);
         for (size_t i = 0; i < len; i += 2) {
-            char a = cyphered_text[i];
-            const char *p = std::lower_bound(lut, lut + 16, a);
-            if (*p != a) {
-                //return string("not a hex digit");
-                return string("");
-            }
-
-            char b = cyphered_text[i + 1];
-            const char *q = std::lower_bound(lut, lut + 16, b);
-            if (*q != b) {
+            const signed char p = lut.values[static_cast<unsigned char>(cyphered_text[i])];
+            const signed char q = lut.values[static_cast<unsigned char>(cyphered_text[i + 1])];
+            if (p < 0 || q < 0) {
                 //return string("not a hex digit");
                 return string("");
             }
-            unserialized_cyphered_text.push_back(((p - lut) << 4) | (q - lut));
+            unserialized_cyphered_text.push_back(static_cast<char>((p << 4) | q));
         }
         wpp::secure_string returned_text;
         // decrypt
@@ -342,6 +772,233 @@
         return digested_message;
     }
 
+    string wpp::application::seal_session(const json &session) {
+        return _session_codec.seal(session);
+    }
+
+    bool wpp::application::open_session(const string &cookie, json &session) {
+        return _session_codec.open(cookie, session);
+    }
+
+    self_t &wpp::application::roles(const std::vector<string> &names) {
+        for (const string &name : names) {
+            this->_roles.intern(name);
+        }
+        this->middleware("role", [this](wpp::response &res, wpp::request &req, std::string parameter,
+                                        wpp::resource_function &next) {
+            auto user = this->resolve_user(req);
+            access_set mask;
+            bool allowed = false;
+            if (this->_roles.mask(parameter, mask)) {
+                allowed = user->has_any_role(mask);
+            } else {
+                std::vector<string> names;
+                boost::split(names, parameter, boost::is_any_of("|,"));
+                allowed = std::any_of(names.begin(), names.end(), [&](const string &name) {
+                    return user->has_role(name);
+                });
+            }
+            if (allowed) {
+                next(res, req);
+            } else {
+                this->error(user->authenticated() ? wpp::status_code::client_error_forbidden
+                                                  : wpp::status_code::client_error_unauthorized, res, req);
+            }
+        });
+        return *this;
+    }
+
+    self_t &wpp::application::permissions(const std::vector<string> &names) {
+        for (const string &name : names) {
+            this->_permissions.intern(name);
+        }
+        this->middleware("permission", [this](wpp::response &res, wpp::request &req, std::string parameter,
+                                              wpp::resource_function &next) {
+            auto user = this->resolve_user(req);
+            access_set mask;
+            bool allowed = false;
+            if (this->_permissions.mask(parameter, mask)) {
+                allowed = user->has_any_permission(mask);
+            } else {
+                std::vector<string> names;
+                boost::split(names, parameter, boost::is_any_of("|,"));
+                allowed = std::any_of(names.begin(), names.end(), [&](const string &name) {
+                    return user->has_permission(name);
+                });
+            }
+            if (allowed) {
+                next(res, req);
+            } else {
+                this->error(user->authenticated() ? wpp::status_code::client_error_forbidden
+                                                  : wpp::status_code::client_error_unauthorized, res, req);
+            }
+        });
+        return *this;
+    }
+
+    wpp::access_registry &wpp::application::get_roles() {
+        return this->_roles;
+    }
+
+    wpp::access_registry &wpp::application::get_permissions() {
+        return this->_permissions;
+    }
+
+    self_t &wpp::application::cache_users(wpp::user_cache::settings s) {
+        this->_user_cache.configure(s);
+        return *this;
+    }
+
+    wpp::user_cache &wpp::application::get_user_cache() {
+        return this->_user_cache;
+    }
+
+    std::shared_ptr<const wpp::principal> wpp::application::resolve_user(wpp::request &req) {
+        if (req._principal) {
+            return req._principal;
+        }
+        const string key = this->session_key(req);
+        const bool cached = this->_user_cache.enabled() && !key.empty();
+        if (cached) {
+            req._principal = this->_user_cache.get(key);
+            if (req._principal) {
+                return req._principal;
+            }
+        }
+        json user = this->_guard_user_provider ? this->_guard_user_provider(req) : json(nullptr);
+        req._principal = std::make_shared<const wpp::principal>(std::move(user), this->_roles, this->_permissions);
+        // Guests are not cached, so a login is seen on the next request
+        if (cached && req._principal->authenticated()) {
+            this->_user_cache.put(key, req._principal);
+        }
+        return req._principal;
+    }
+
+    self_t &wpp::application::forget_user(wpp::request &req) {
+        const string key = this->session_key(req);
+        if (!key.empty()) {
+            this->_user_cache.invalidate(key);
+        }
+        req._principal.reset();
+        return *this;
+    }
+
+    size_t wpp::application::forget_users_if(const std::function<bool(const json &)> &pred) {
+        return this->_user_cache.invalidate_if(pred);
+    }
+
+    string wpp::application::session_key(wpp::request &req) {
+        if (!req._session_id.empty()) {
+            return req._session_id;
+        }
+        return req.get_cookie(this->session_name_);
+    }
+
+    self_t &wpp::application::server_side_sessions(std::shared_ptr<session_store::backend> persistence) {
+        session_store::settings s;
+        s.idle = std::chrono::duration_cast<std::chrono::milliseconds>(this->max_session_inactive_time_);
+        this->_session_store = std::make_unique<wpp::session_store>(s);
+        this->_session_store->attach(*this->_io_context);
+        if (persistence) {
+            this->_session_store->persist(std::move(persistence));
+        }
+        return *this;
+    }
+
+    wpp::session_store *wpp::application::get_session_store() {
+        return this->_session_store.get();
+    }
+
+    self_t &wpp::application::load_session(wpp::request &req) {
+        req.session_data = json::object();
+        req._session_dirty = false;
+        req._session_regenerate = false;
+        req._session_id.clear();
+        auto cookie = req.cookie_jar.find(this->session_name_);
+        if (cookie == req.cookie_jar.end()) {
+            return *this;
+        }
+        if (this->_session_store) {
+            json session;
+            if (this->_session_store->load(cookie->second, session) && session.is_object()) {
+                req._session_id = cookie->second;
+                req.session_data = std::move(session);
+                req.session_age_flashed();
+            }
+            return *this;
+        }
+        json session;
+        session_codec::clock::time_point issued;
+        if (!_session_codec.open(cookie->second, session, &issued) || !session.is_object()) {
+            return *this;
+        }
+        const auto idle = session_codec::clock::now() - issued;
+        if (idle > this->max_session_inactive_time_) {
+            // Expired: the empty session replaces the cookie
+            req._session_dirty = true;
+            return *this;
+        }
+        req.session_data = std::move(session);
+        req.session_age_flashed();
+        if (idle > this->max_session_inactive_time_ / 2) {
+            req.session_mark_modified();
+        }
+        return *this;
+    }
+
+    self_t &wpp::application::save_session(wpp::response &res, wpp::request &req) {
+        if (!req.session_modified()) {
+            return *this;
+        }
+        // A user cached for the session may have logged in or out
+        if (this->_user_cache.enabled()) {
+            const string key = this->session_key(req);
+            if (!key.empty()) {
+                this->_user_cache.invalidate(key);
+            }
+        }
+        req._session_dirty = false;
+        const bool regenerate = req._session_regenerate;
+        req._session_regenerate = false;
+        const bool empty = !req.session_data.is_object() || req.session_data.empty();
+        string cookie = this->session_name_ + "=";
+        if (this->_session_store) {
+            // The cookie only changes when the session is created, moved
+            // to a new ID or removed
+            if (empty) {
+                if (req._session_id.empty()) {
+                    return *this;
+                }
+                this->_session_store->erase(req._session_id);
+                req._session_id.clear();
+                cookie += "; Max-Age=0";
+            } else if (!req._session_id.empty() && !regenerate) {
+                this->_session_store->save(req._session_id, req.session_data);
+                return *this;
+            } else if (!req._session_id.empty()) {
+                req._session_id = this->_session_store->regenerate(req._session_id);
+                this->_session_store->save(req._session_id, req.session_data);
+                cookie += req._session_id;
+            } else {
+                req._session_id = session_store::new_id();
+                this->_session_store->save(req._session_id, req.session_data);
+                cookie += req._session_id;
+            }
+        } else if (!empty) {
+            const auto max_age = std::chrono::duration_cast<std::chrono::seconds>(this->max_session_inactive_time_);
+            cookie += _session_codec.seal(req.session_data);
+            cookie += "; Max-Age=" + std::to_string(max_age.count());
+        } else {
+            cookie += "; Max-Age=0";
+        }
+        cookie += "; Path=/; HttpOnly; SameSite=Lax";
+        if (this->secure()) {
+            cookie += "; Secure";
+        }
+        res.headers.emplace("Set-Cookie", std::move(cookie));
+        return *this;
+    }
+
     wpp::route_properties &redirect(std::string from, std::string to) {
         resource_function func = [this, to](wpp::response &res, wpp::request &req) {
             auto to_route = this->route(to);
@@ -11,6 +11,7 @@
 #include <sstream>
 #include <thread>
 #include <memory>
+#include <mutex>
 #include <unordered_set>
 #include <unordered_map>
 #include <iostream>
@@ -23,12 +24,15 @@
 #include <utils/traits.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
 
 #include <boost/beast/http.hpp> //Beast Version
 
 #include "utils/stl_shortcuts.h"
 #include "utils/container_overloads.h"
 #include "utils/container_utils.h"
+#include "utils/thread_pool.h"
 #include "utils/include/simple_server/server_http.hpp"
 #include "utils/include/simple_server/server_https.hpp"
 // #include "utils/logging.h"
@@ -39,9 +43,20 @@
 #include "route_properties.h"
 #include "trie.h"
 #include "cache.h"
+#include "admission_control.h"
+#include "response_cache.h"
+#include "etag.h"
+#include "async.h"
+#include "sse.h"
+#include "websocket.h"
+#include "io_backend.h"
+#include "server_timeouts.h"
+#include "tls_manager.h"
+#include "view.h"
 #include "encryption.h"
+#include "session_codec.h"
+#include "session_store.h"
 #include "cookie_parser.h"
-//#include "http_server.h"
 
 namespace wpp {
 
@@ -170,6 +185,88 @@ namespace wpp {
             return this->route({method::trace}, rule, func);
         }
 
+        // Asynchronous routes
+        // The handler either receives a completion to call when the response is ready:
+        // void(response&, request&, completion)
+        // or, with C++20, it is a coroutine:
+        // async_task(response&, request&)
+        // The worker thread is free to serve other connections in the meantime.
+        template<class FUNC>
+        route_properties &async_route(std::initializer_list<wpp::method> l, std::string rule, FUNC func) {
+            return this->route2p(l, rule, make_async_resource(func));
+        }
+
+        template<class FUNC>
+        route_properties &async_any(std::string rule, FUNC func) {
+            return this->async_route(
+                    {method::get, method::delete_, method::head, method::post, method::put, method::options,
+                     method::connect, method::trace}, rule, func);
+        }
+
+        template<class FUNC>
+        route_properties &async_get(std::string rule, FUNC func) {
+            return this->async_route({method::get}, rule, func);
+        }
+
+        template<class FUNC>
+        route_properties &async_post(std::string rule, FUNC func) {
+            return this->async_route({method::post}, rule, func);
+        }
+
+        template<class FUNC>
+        route_properties &async_put(std::string rule, FUNC func) {
+            return this->async_route({method::put}, rule, func);
+        }
+
+        template<class FUNC>
+        route_properties &async_delete_(std::string rule, FUNC func) {
+            return this->async_route({method::delete_}, rule, func);
+        }
+
+        // Server-Sent Events endpoint. The handler receives the stream of the
+        // client and usually subscribes it to an sse_hub.
+        route_properties &sse(std::string rule,
+                              std::function<void(wpp::request &, std::shared_ptr<sse_stream>)> func,
+                              sse_stream::overflow policy = sse_stream::overflow::drop,
+                              size_t max_queued = 64) {
+            resource_function canonical_func = [this, func, policy, max_queued](wpp::response &res, wpp::request &req) {
+                res.headers.emplace("Content-Type", "text/event-stream");
+                res.headers.emplace("Cache-Control", "no-cache");
+                // tell proxies not to buffer the stream
+                res.headers.emplace("X-Accel-Buffering", "no");
+                func(req, std::make_shared<sse_stream>(this->io_context(), req.take_connection(), policy, max_queued));
+            };
+            return this->route2p({method::get}, rule, canonical_func);
+        }
+
+        // WebSocket route: the upgrade request is routed like a GET request
+        // and goes through the middleware of the route
+        websocket_route websocket(std::string rule);
+
+        // Run an upgrade request through routing and middleware. Returns the
+        // endpoint if the upgrade was accepted, otherwise `res` is the answer.
+        std::shared_ptr<const websocket_endpoint> websocket_upgrade(wpp::response &res, wpp::request &req);
+
+        // void(response&, request&, completion)
+        template<typename FUNC, typename std::enable_if<
+                std::is_invocable<FUNC &, wpp::response &, wpp::request &, wpp::completion>::value>::type * = nullptr>
+        static resource_function make_async_resource(FUNC func) {
+            return [func](wpp::response &res, wpp::request &req) {
+                func(res, req, req.defer());
+            };
+        }
+
+#ifdef WPP_HAS_COROUTINES
+        // async_task(response&, request&)
+        template<typename FUNC, typename std::enable_if<
+                std::is_same<std::invoke_result_t<FUNC &, wpp::response &, wpp::request &>, wpp::async_task>::value>::type * = nullptr>
+        static resource_function make_async_resource(FUNC func) {
+            return [func](wpp::response &res, wpp::request &req) {
+                func(res, req).start(req.defer());
+            };
+        }
+#endif
+
 
         // Canonical Form
         // Defining behaviour for 2 parameters (canonical form):
@@ -1119,17 +1216,62 @@ namespace wpp {
         string &session_name();
         self_t& guard_call_back(std::function<json(wpp::request&)> __guard_call_back);
         std::function<json(wpp::request&)> &guard_call_back();
+        // Roles and permissions known in advance, as IDs. Users are checked
+        // against them with bitsets, and the "role" and "permission"
+        // middleware (such as "role:admin|editor") can check routes.
+        self_t &roles(const std::vector<string> &names);
+        self_t &permissions(const std::vector<string> &names);
+        access_registry &get_roles();
+        access_registry &get_permissions();
+        // Keep the users of the guard callback by session for s.ttl
+        self_t &cache_users(user_cache::settings s = {std::chrono::minutes(1), 100000});
+        user_cache &get_user_cache();
+        // The user of req: from the request, the cache or the guard callback
+        std::shared_ptr<const principal> resolve_user(request &req);
+        // Users cached for a session are dropped when the session changes.
+        // Call this when users change otherwise, so they are resolved again.
+        self_t &forget_user(request &req);
+        size_t forget_users_if(const std::function<bool(const json &)> &pred);
         self_t &max_session_inactive_time(std::chrono::duration<double, std::milli> time);
         std::chrono::duration<double, std::milli> &max_session_inactive_time();
         self_t &templates_root_path(string path);
         self_t &user_agent_parser_root_path(string path)
         self_t &lambda(string name, std::function<std::string(const std::string&)> f);
-        self_t &lambda(string name, std::function<std::string(const std::string&,renderer&)> f);
-
-        response::view view(string filename, wpp::json json_data);
-        response::view view(string filename, wpp::json json_data, request& req);
+        // For lambdas that only depend on their argument, like url helpers:
+        // results are memoized and literal uses are folded into the templates
+        self_t &pure_lambda(string name, std::function<std::string(const std::string&)> f, size_t max_entries = 4096);
+
+        // The same as render()
+        response view(string filename, wpp::json json_data);
+        response view(string filename, wpp::json json_data, request& req);
+
+        // Render with the templates compiled when the server starts, or
+        // with the functions generated by wpp_compile_templates() if the
+        // template was compiled into the binary
+        response render(string filename, wpp::json json_data);
+        response render(string filename, wpp::json json_data, request& req);
+        // Send the page with chunked encoding while it is being rendered
+        void render_stream(string filename, wpp::json json_data, response& res, request& req);
+        bool render(string filename, const wpp::json& json_data, views::output_sink& out);
+        // Render a page built as a render_context instead of json
+        response render(string filename, views::render_context& context);
+        response render(string filename, views::render_context& context, request& req);
+        self_t &view_lambda(string name, views::scoped_lambda f);
+        // Drop fragments of the {{#@cache key ttl}} sections of a template
+        // by key or key prefix
+        self_t &invalidate_fragment(string view, string key);
+        self_t &invalidate_fragments(string view, string key_prefix = "");
+        // Rebuild templates when they change on disk (development)
+        self_t &hot_reload_views(bool on_off = true);
+        views::plan_registry &get_views();
 
         self_t& view_data(std::string filename, std::function<wpp::json()> func);
+        // Computed at most once per ttl. Stale data is served for up to
+        // stale_while_revalidate while it is refreshed in the background.
+        // Views registered with the same key share the data.
+        self_t& view_data(std::string filename, std::function<wpp::json()> func, std::chrono::milliseconds ttl,
+                          std::chrono::milliseconds stale_while_revalidate = 0ms, std::string key = "");
+        self_t& invalidate_view_data(std::string key);
         self_t &multithreaded(bool on_off = true);
 
         string url_for(string route_name);
@@ -1139,6 +1281,95 @@ namespace wpp {
         self_t &redirect(string route_name, wpp::response &res, wpp::request &req);
         cache& get_cache();
 
+        // Admission control (limits are applied when the server starts)
+        self_t &max_connections(size_t n);
+        self_t &max_in_flight_requests(size_t n);
+        self_t &accept_rate(double connections_per_second, size_t burst = 64);
+        self_t &queue_delay_target(std::chrono::milliseconds target, std::chrono::milliseconds interval = 100ms);
+        admission_control& get_admission_control();
+
+        // Connection timeouts of the server
+        self_t &timeouts(server_timeouts t);
+        server_timeouts &timeouts();
+
+        // Pipelined requests of a connection whose handlers run at the
+        // same time. Responses are still written in request order.
+        self_t &pipeline_depth(size_t n);
+        size_t pipeline_depth();
+
+        // Largest request body accepted, over HTTP/1 and per HTTP/2 stream
+        self_t &body_limit(size_t bytes);
+        size_t body_limit();
+
+        // Keep complete responses of the routes with the "cache" middleware
+        // and answer them before routing (see response_cache.h)
+        self_t &cache_responses(response_cache::settings s = {});
+        self_t &invalidate_response(string target);
+        self_t &invalidate_response_tag(string tag);
+        response_cache &get_response_cache();
+
+        // Routes with the "etag" middleware get an ETag hashed from their
+        // body and answer 304 when the client has it. List it after "cache".
+        self_t &etag_responses();
+        // In a handler, before building the body: set an ETag from a cheap
+        // validator (row version, update time) and answer 304 if the
+        // client has it
+        //     if (app.not_modified(res, req, std::to_string(post.version))) return;
+        bool not_modified(response &res, request &req, const string &validator);
+        bool not_modified(response &res, request &req, std::chrono::system_clock::time_point updated_at);
+
+        // Serve HTTP/2 (h2 over TLS and h2c with prior knowledge)
+        // when built with WPP_ENABLE_HTTP2
+        self_t &http2(bool on_off = true);
+        bool http2();
+
+        // TLS handshakes (applied to the listener context when the server starts)
+        self_t &tls_session_cache(size_t size, std::chrono::seconds lifetime = 2h);
+        self_t &tls_ticket_keys(std::chrono::seconds lifetime, size_t keys_kept = 3);
+        self_t &ecdsa_certificate(string certificate_file, string key_file);
+        self_t &handshake_threads(size_t n);
+        tls_manager &get_tls();
+
+        // Executor of the server, shared with asynchronous routes
+        boost::asio::io_context &io_context();
+        // Threads for blocking work of asynchronous routes (database queries, etc)
+        self_t &blocking_threads(size_t n);
+        ThreadPool &blocking_pool();
+        // Call `then` on the server executor after `d`
+        void after(std::chrono::steady_clock::duration d, std::function<void()> then);
+
+        // Run blocking `work` on the blocking pool and then call `then(result)`
+        // on the server executor. If `work` throws, `then` is never called, so a
+        // completion captured by it is dropped and the client gets a 500.
+        template<class Work, class Then>
+        void offload(Work work, Then then) {
+            boost::asio::io_context &ioc = this->io_context();
+            this->blocking_pool().enqueue([&ioc, work = std::move(work), then = std::move(then)]() mutable {
+                if constexpr (std::is_void<decltype(work())>::value) {
+                    work();
+                    boost::asio::post(ioc, std::move(then));
+                } else {
+                    auto result = std::make_shared<decltype(work())>(work());
+                    boost::asio::post(ioc, [then = std::move(then), result]() mutable {
+                        then(std::move(*result));
+                    });
+                }
+            });
+        }
+
+#ifdef WPP_HAS_COROUTINES
+        // co_await versions for coroutine routes
+        template<class Work>
+        offload_awaitable<Work> co_offload(Work work) {
+            return offload_awaitable<Work>([this](std::function<void()> f) { this->blocking_pool().enqueue(std::move(f)); },
+                                           this->io_context(), std::move(work));
+        }
+
+        sleep_awaitable co_sleep(std::chrono::steady_clock::duration d) {
+            return sleep_awaitable(this->io_context(), d);
+        }
+#endif
+
         void setup_trie();
 
         template <typename Pointer_to_Server_Request = std::shared_ptr<SimpleWeb::Server<SimpleWeb::HTTP>::Request>>
@@ -1162,9 +1393,15 @@ namespace wpp {
             // Query string
             req.query_string = std::move(request->query_string);
             req.request_parameters = QueryString::parse(req.query_string);
-            // Posted content
+            parse_posted_parameters(req);
+        }
+
+        // Add the fields of a posted form to the request parameters. Its
+        // _method field overrides the method of the request.
+        static void parse_posted_parameters(wpp::request &req) {
             unordered_multimap<std::string, std::string>::iterator content_iterator = req.headers.find("Content-Type");
-            if (req.method_requested != method::get && !req.body.empty() && content_iterator->second == "application/x-www-form-urlencoded"){
+            if (req.method_requested != method::get && !req.body.empty() && content_iterator != req.headers.end() &&
+                content_iterator->second == "application/x-www-form-urlencoded"){
                 // todo: Recognize other POST Content-Types (json and encrypted file)
                 CaseInsensitiveMultimap post_params = QueryString::parse(req.body);
                 std::move(post_params.begin(),post_params.end(),std::inserter(req.request_parameters,req.request_parameters.end()));
@@ -1176,11 +1413,43 @@ namespace wpp {
             }
         }
 
-        // Trick to define a recursive function within this scope (for example purposes)
-        // the trick reads a piece of data and sends little by little
+        // Sends a file 128 KB at a time: each block is read with the
+        // file_reader (through io_uring when the server is built with it)
+        // once the previous one was sent
         template <class HttpServer>
         class FileServer {
         public:
+            static void
+            read_and_send(const std::shared_ptr<typename HttpServer::Response> &response,
+                          const std::shared_ptr<file_reader> &file,
+                          std::shared_ptr<std::vector<char>> buffer = nullptr,
+                          std::uint64_t offset = 0) {
+                if (offset >= file->size()) {
+                    return;
+                }
+                if (!buffer) {
+                    buffer = std::make_shared<std::vector<char>>(1024 * 128);
+                }
+                file->async_read_at(offset, buffer->data(), buffer->size(),
+                                    [response, file, buffer, offset](const boost::system::error_code &ec, size_t n) {
+                    if (ec || n == 0) {
+                        cerr << "Could not read the file: " << ec.message() << endl;
+                        return;
+                    }
+                    // write copies the block, so the buffer can be read into again
+                    response->write(buffer->data(), static_cast<streamsize>(n));
+                    response->send([response, file, buffer, next = offset + n](const SimpleWeb::error_code &ec) {
+                        if (!ec) {
+                            read_and_send(response, file, buffer, next);
+                        } else {
+                            cerr << "Connection interrupted" << endl;
+                        }
+                    });
+                });
+            }
+
+            // A stream the route opened itself has no path to give to a
+            // file_reader, so it is read in place
             static void
             read_and_send(const std::shared_ptr<typename HttpServer::Response> &response,
                           const std::shared_ptr<ifstream> &ifs) {
@@ -1208,10 +1477,230 @@ namespace wpp {
             }
         };
 
+        // The path of the file under assets_root_path() for a url, or ""
+        std::string asset_path(const std::string &url) {
+            if (url.empty() || url.front() != '/' || url.find("..") != std::string::npos) {
+                return "";
+            }
+            std::string path = this->_assets_root_path + url;
+            boost::system::error_code ec;
+            if (!boost::filesystem::is_regular_file(path, ec)) {
+                return "";
+            }
+            return path;
+        }
+
+        // The file under assets_root_path() for a url, or nullptr
+        std::shared_ptr<file_reader> open_asset(const std::string &url) {
+            const std::string path = asset_path(url);
+            if (path.empty()) {
+                return nullptr;
+            }
+            auto file = std::make_shared<file_reader>(*this->_io_context, path);
+            return file->is_open() ? file : nullptr;
+        }
+
+        // Write a static file to the server response
+        template<class HttpServer>
+        static void write_asset(const std::shared_ptr<file_reader> &file, const std::string &url, bool head_only,
+                                const std::shared_ptr<typename HttpServer::Response> &response) {
+            SimpleWeb::CaseInsensitiveMultimap header;
+            header.emplace("Content-Length", to_string(file->size()));
+            header.emplace("Content-Type", asset_content_type(url));
+            response->write(header);
+            if (!head_only) {
+                FileServer<HttpServer>::read_and_send(response, file);
+            }
+        }
+
+        // Write a wpp::response to the server response
+        template<class HttpServer>
+        static void write_response(wpp::response &res, const std::shared_ptr<typename HttpServer::Response> &response) {
+            if (res._file_response && res._file_response->good()){
+                // filesize
+                auto length = res._file_response->tellg();
+                // go to beggining
+                res._file_response->seekg(0, ios::beg);
+                SimpleWeb::CaseInsensitiveMultimap header;
+                header.emplace("Content-Length", to_string(length));
+                response->write(header);
+                FileServer<HttpServer>::read_and_send(response, res._file_response);
+            } else {
+                response->write((SimpleWeb::StatusCode) ((int) res.code), res.body, SimpleWeb::CaseInsensitiveMultimap(res.headers.begin(), res.headers.end()));
+            }
+        }
+
+        // Write the cached response to a GET or HEAD, if there is one. A
+        // stale one is written while its route runs again on the worker
+        // pool, and its middleware stores the new version.
+        template<class HttpServer>
+        bool serve_cached(const std::shared_ptr<wpp::request> &req_ptr,
+                          const std::shared_ptr<typename HttpServer::Response> &response) {
+            wpp::request &req = *req_ptr;
+            wpp::response_cache &cache = this->_response_cache;
+            if (cache.empty() || (req.method_requested != method::get && req.method_requested != method::head)) {
+                return false;
+            }
+            auto header = [&req](const std::string &name) {
+                return req.get_header_value_icase(name);
+            };
+            if (cache.bypass(header)) {
+                return false;
+            }
+            const std::string target = req.query_string.empty() ? req.url_ : req.url_ + "?" + req.query_string;
+            wpp::response_cache::hit hit = cache.lookup(header("Host"), target, header);
+            if (!hit) {
+                return false;
+            }
+            if (!hit.response->etag.empty()) {
+                const std::string tags = header("If-None-Match");
+                hit.not_modified = !tags.empty() && wpp::etag_matches(tags, hit.response->etag);
+            }
+            if (hit.refresh) {
+                auto r = std::make_shared<wpp::request>(req);
+                r->method_requested = method::get;
+                r->method_string = "GET";
+                this->blocking_pool().enqueue([this, r]() {
+                    this->serve(r, std::make_shared<wpp::response>(), []() {}, {}, []() { return false; });
+                });
+            }
+            const std::string connection = header("Connection");
+            const bool close = boost::iequals(connection, "close") ||
+                               (req.http_version == "1.0" && !boost::iequals(connection, "keep-alive"));
+            response->close_connection_after_response = close;
+            *response << (hit.not_modified ? hit.response->not_modified_head : hit.response->head)
+                      << (close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
+            if (!hit.not_modified && req.method_requested != method::head) {
+                response->write(hit.response->body.data(), static_cast<std::streamsize>(hit.response->body.size()));
+            }
+            return true;
+        }
+
+        // Connect a chunked_writer to the server response
+        template<class HttpServer>
+        static chunked_writer::sink stream_sink(const std::shared_ptr<wpp::response> &res, const std::shared_ptr<typename HttpServer::Response> &response) {
+            chunked_writer::sink s;
+            s.write_head = [res, response]() {
+                SimpleWeb::CaseInsensitiveMultimap header(res->headers.begin(), res->headers.end());
+                header.erase("Content-Length");
+                header.emplace("Transfer-Encoding", "chunked");
+                response->write((SimpleWeb::StatusCode) ((int) res->code), header);
+            };
+            s.write = [response](const std::string &data) {
+                response->write(data.data(), static_cast<std::streamsize>(data.size()));
+            };
+            s.send = [response](std::function<void(bool)> done) {
+                response->send([done](const SimpleWeb::error_code &ec) {
+                    done(!ec);
+                });
+            };
+            return s;
+        }
+
+        // Run a route handler. `send` writes the response when the handler
+        // returns or, if the handler deferred it, when its completion is called.
+        // Handlers can also take over the connection with `open_sink`.
+        void dispatch(resource_function &handler,
+                      const std::shared_ptr<wpp::response> &res,
+                      const std::shared_ptr<wpp::request> &req,
+                      std::function<void()> send,
+                      std::function<chunked_writer::sink()> open_sink = {}) {
+            auto state = std::make_shared<completion::state>();
+            state->executor = this->_io_context.get();
+            state->send = send;
+            state->open_sink = std::move(open_sink);
+            state->fail = [res]() {
+                res->code = wpp::status_code::server_error_internal_server_error;
+                res->body.clear();
+                res->_file_response.reset();
+            };
+            req->_completion = state;
+            handler(*res, *req);
+            if (!req->deferred()) {
+                state->done = true;
+                send();
+            }
+        }
+
+        // Answer a request with its route, a static asset, the default
+        // resource or a 404. `send` and `open_sink` write the response on
+        // the connection, `serve_asset` writes the asset of the url and
+        // returns false if there is none.
+        void serve(const std::shared_ptr<wpp::request> &req_ptr,
+                   const std::shared_ptr<wpp::response> &res_ptr,
+                   std::function<void()> send,
+                   std::function<chunked_writer::sink()> open_sink,
+                   const std::function<bool()> &serve_asset) {
+            wpp::request &req = *req_ptr;
+            wpp::response &res = *res_ptr;
+            res.parent_application = this;
+
+            // The session cookie goes out with the head of the response
+            this->load_session(req);
+            send = [this, req_ptr, res_ptr, write = std::move(send)]() {
+                this->save_session(*res_ptr, *req_ptr);
+                write();
+            };
+            if (open_sink) {
+                open_sink = [this, req_ptr, res_ptr, open = std::move(open_sink)]() {
+                    this->save_session(*res_ptr, *req_ptr);
+                    return open();
+                };
+            }
+
+            // Look for the route request
+            std::tuple<bool, unsigned, routing_params> wpp_reply = this->_route_trie.find(
+                    req.url_, req.method_requested);
+            req.query_parameters = std::move(std::get<2>(wpp_reply));
+            const unsigned route_pos = std::get<1>(wpp_reply);
+            const bool a_valid_route_was_found = std::get<0>(wpp_reply);
+            // Response to the request
+            if (a_valid_route_was_found) {
+                // Process request
+                std::cout << req.method_string << " Request: " << req.url_ << std::endl;
+                req.current_route = &this->_routes[route_pos];
+                // Write response
+                this->dispatch(this->_routes[route_pos]._func, res_ptr, req_ptr,
+                               [this, res_ptr, send, route_pos]() {
+                    send();
+                    std::cout << "Response: " << (int) res_ptr->code << " on route \""
+                              << this->_routes[route_pos]._name << "\"" << std::endl;
+                }, std::move(open_sink));
+            } else if (serve_asset()) {
+                // Static assets
+            } else if (this->default_resource_[(int) req.method_requested]) {
+                resource_function& backup_handle = *this->default_resource_[(int) req.method_requested];
+                auto r = std::make_shared<route_properties>(req.url_,vector<method>{req.method_requested},backup_handle);
+                req.current_route = r.get();
+                req.current_route->name("backup_route");
+                this->dispatch(backup_handle, res_ptr, req_ptr,
+                               [res_ptr, send, r]() {
+                    res_ptr->write_cookie_headers();
+                    send();
+                }, [res_ptr, open_sink]() {
+                    res_ptr->write_cookie_headers();
+                    return open_sink ? open_sink() : chunked_writer::sink{};
+                });
+            } else {
+                this->error(wpp::status_code::client_error_not_found, res, req);
+                res.write_cookie_headers();
+                send();
+            }
+        }
+
         template<class HttpServer>
         HttpServer* return_server_object();
 
-        self_t &start() {
+        // Serve the application with the listener of http_server.h:
+        // HTTP/1.1 with pipelining, HTTP/2, TLS with session resumption,
+        // WebSockets, timeouts and admission control. Routes that stream
+        // get their responses whole there: req.stream() is null.
+        self_t &start();
+
+        // Serve the application with Simple-Web-Server. Its connections
+        // have none of the settings of the listener, only routes that
+        // stream and the assets read with the io backend.
+        self_t &start_simple_server() {
             if (!this->secure()){
                 return start_aux<SimpleWeb::Server<SimpleWeb::HTTP>>();
             } else {
@@ -1219,10 +1708,8 @@ namespace wpp {
             }
         }
 
-        template <class HttpServer>
-        self_t &start_aux() {
-            //std::cout << "http://localhost:" << this->_port << "/" << std::endl;
-            std::cout << this->web_root_path() << std::endl;
+        // Bind the middleware to the routes and compile the templates
+        void prepare_routes() {
             // sort routes
             utils::sort(_routes, [](route_properties &a, route_properties &b) { return a._uri < b._uri; });
             // optimize data in a trie
@@ -1263,6 +1750,34 @@ namespace wpp {
                 }
             }
 
+            // Compile the templates before the first request. Their
+            // fragments live in the cache of the application.
+            this->_views.fragments().store_in(this->cache_, "view:fragment:");
+            this->_views.load(this->_templates_root_path);
+            if (this->_hot_reload_views) {
+                this->_views.watch();
+            }
+        }
+
+        // Run the io_context on the threads of the server until it stops
+        void run_io_context() {
+            const size_t number_of_threads = this->_multithreaded ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+            std::vector<std::thread> threads;
+            for (size_t j = 1; j < number_of_threads; ++j) {
+                threads.emplace_back([this]() { this->_io_context->run(); });
+            }
+            this->_io_context->run();
+            for (auto &&t : threads) {
+                t.join();
+            }
+        }
+
+        template <class HttpServer>
+        self_t &start_aux() {
+            //std::cout << "http://localhost:" << this->_port << "/" << std::endl;
+            std::cout << this->web_root_path() << std::endl;
+            prepare_routes();
+
             // Apply settings
             using namespace std;
 
@@ -1280,62 +1795,29 @@ namespace wpp {
                         (method) i)] = [&this_application,i](std::shared_ptr<typename HttpServer::Response> response,
                                                              std::shared_ptr<typename HttpServer::Request> request) {
 
-                    wpp::request req;
-                    wpp::response res;
-                    res.parent_application = &this_application;
-                    this_application.simple_server_to_wpp_request(this_application, request, req);
-
-                    // Look for the route request
-                    std::tuple<bool, unsigned, routing_params> wpp_reply = this_application._route_trie.find(
-                            req.url_, req.method_requested);
-                    req.query_parameters = std::move(std::get<2>(wpp_reply));
-                    const unsigned route_pos = std::get<1>(wpp_reply);
-                    const bool a_valid_route_was_found = std::get<0>(wpp_reply);
-                    //std::cout << method_string((method) i) << " Request on " << req.url_ << std::endl;
-                    // Response to the request
-                    if (a_valid_route_was_found) {
-                        // Process request
-                        std::cout << method_string((method) i) << " Request: " << req.url_ << std::endl;
-                        req.current_route = &this_application._routes[route_pos];
-                        this_application._routes[route_pos]._func(res, req);
-                        // Write response
-                        if (res._file_response && res._file_response->good()){
-                            // filesize
-                            auto length = res._file_response->tellg();
-                            // go to beggining
-                            res._file_response->seekg(0, ios::beg);
-                            SimpleWeb::CaseInsensitiveMultimap header;
-                            header.emplace("Content-Length", to_string(length));
-                            response->write(header);
-                            FileServer<HttpServer>::read_and_send(response, res._file_response);
-                        } else {
-                            response->write((SimpleWeb::StatusCode) ((int) res.code), res.body, SimpleWeb::CaseInsensitiveMultimap(res.headers.begin(), res.headers.end()));
-
+                    // Asynchronous routes keep the request and the response alive
+                    auto req_ptr = std::make_shared<wpp::request>();
+                    auto res_ptr = std::make_shared<wpp::response>();
+                    this_application.simple_server_to_wpp_request(this_application, request, *req_ptr);
+                    // Answered from the response cache, without a route
+                    if (this_application.serve_cached<HttpServer>(req_ptr, response)) {
+                        return;
+                    }
+                    this_application.serve(req_ptr, res_ptr, [res_ptr, response]() {
+                        write_response<HttpServer>(*res_ptr, response);
+                    }, [res_ptr, response]() {
+                        return stream_sink<HttpServer>(res_ptr, response);
+                    }, [&this_application, req_ptr, response, i]() {
+                        if (i != (int) method::get && i != (int) method::head) {
+                            return false;
                         }
-                        std::cout << "Response: " << (int) res.code << " on route \""
-                                  << this_application._routes[std::get<1>(wpp_reply)]._name << "\"" << std::endl;
-                    } else if (this_application.default_resource_[i]) {
-                        resource_function& backup_handle = *this_application.default_resource_[i];
-                        route_properties r = route_properties(req.url_,{wpp::method(i)},backup_handle);
-                        req.current_route = &r;
-                        req.current_route->name("backup_route");
-                        backup_handle(res, req);
-                        res.write_cookie_headers();
-                        if (res._file_response && res._file_response->good()){
-                            auto length = res._file_response->tellg();
-                            res._file_response->seekg(0, ios::beg);
-                            SimpleWeb::CaseInsensitiveMultimap header;
-                            header.emplace("Content-Length", to_string(length));
-                            response->write(header);
-                            FileServer<HttpServer>::read_and_send(response, res._file_response);
-                        } else {
-                            response->write((SimpleWeb::StatusCode) ((int) res.code), res.body, SimpleWeb::CaseInsensitiveMultimap(res.headers.begin(), res.headers.end()));
+                        std::shared_ptr<file_reader> asset = this_application.open_asset(req_ptr->url_);
+                        if (!asset) {
+                            return false;
                         }
-                    } else {
-                        this_application.error(wpp::status_code::client_error_not_found, res, req);
-                        res.write_cookie_headers();
-                        response->write((SimpleWeb::StatusCode) ((int) res.code), res.body, SimpleWeb::CaseInsensitiveMultimap(res.headers.begin(), res.headers.end()));
-                    }
+                        write_asset<HttpServer>(asset, req_ptr->url_, i == (int) method::head, response);
+                        return true;
+                    });
                 };
             }
 
@@ -1344,7 +1826,11 @@ namespace wpp {
                 std::cout << ec.message() << std::endl;
             };
 
+            // The io_context is shared with asynchronous routes, so we run it
+            // ourselves instead of letting the server create its own
+            server->io_service = this->_io_context;
             server->start();
+            run_io_context();
             return *this;
         }
 
@@ -1355,6 +1841,28 @@ namespace wpp {
         string decrypt(string text, bool& success);
         string digest(string message);
 
+        // Sessions travel in a cookie sealed with the keys of set_keys(),
+        // unless they are kept on the server. Then the cookie only holds
+        // an ID and sessions expire after max_session_inactive_time, so
+        // call this after setting it. With persistence, such as a
+        // wpp::db::sqlite_session_backend, sessions are written behind to
+        // storage and survive restarts.
+        self_t &server_side_sessions(std::shared_ptr<session_store::backend> persistence = nullptr);
+        session_store *get_session_store();
+        string seal_session(const json &session);
+        bool open_session(const string &cookie, json &session);
+        // Opens the session cookie of req into session_data and ages its
+        // flashed data. Cookies idle for max_session_inactive_time are
+        // dropped.
+        self_t &load_session(request &req);
+        // Sends the session cookie again only if the handler modified the
+        // session, or when it is halfway to expiring. Server-side sessions
+        // get a new ID after request::session_regenerate() (a guard calls
+        // it when a user logs in).
+        self_t &save_session(response &res, request &req);
+        // What identifies the session of req: its server-side ID or its cookie
+        string session_key(request &req);
+
     private:
         ///////////////////////////////////////////////////////////////
         //                         MODEL                             //
@@ -1366,11 +1874,13 @@ namespace wpp {
         ///////////////////////////////////////////////////////////////
         string _templates_root_path = "view/templates";
         string _user_agent_parser_root_path = "";
-        basic_data<response::view::string_type> _lambdas;
         std::unordered_map<std::string,std::function<wpp::json()>> _view_data;
-        unordered_map<std::string, response::pre_processed_view> _pre_processed_views;
-        std::unordered_map<mustache::string_type, response::pre_processed_partial<mustache::string_type>>
-                _pre_processed_partials;
+        std::unordered_map<std::string, std::shared_ptr<views::data_provider>> _view_data_providers;
+        std::mutex _view_data_mutex;
+        views::plan_registry _views;
+        bool _hot_reload_views{false};
+        void add_view_data(const string& filename, wpp::json& json_data);
+        void add_view_data(const string& filename, views::render_context& context);
 
         ///////////////////////////////////////////////////////////////
         //                      CONTROLLER                           //
@@ -1394,6 +1904,10 @@ namespace wpp {
         std::function<void(wpp::request, const boost::system::error_code &)> on_error_;
         // Guard callback (function the return user data in json format so routes can control access)
         std::function<json(wpp::request&)> _guard_call_back;
+        std::function<json(wpp::request&)> _guard_user_provider;
+        access_registry _roles;
+        access_registry _permissions;
+        user_cache _user_cache;
 
         ///////////////////////////////////////////////////////////////
         //                          SETTINGS                         //
@@ -1401,14 +1915,30 @@ namespace wpp {
         // Settings
         unsigned _port = 8080;
         bool _multithreaded = true;
+        bool _http2 = true;
         string _web_root_path = "localhost:8080";
         // Application utilities
         size_t _cache_size{100000};
         std::chrono::duration<double, std::milli> _cache_time{24h};
         class cache cache_{24h, 10000};
+        // Load shedding
+        admission_control _admission_control;
+        server_timeouts _timeouts;
+        size_t _pipeline_depth{8};
+        size_t _body_limit{1024 * 1024};
+        wpp::response_cache _response_cache;
+        tls_manager _tls;
+        // Executors
+        std::shared_ptr<boost::asio::io_context> _io_context{std::make_shared<boost::asio::io_context>()};
+        size_t _blocking_threads{std::max(4u, std::thread::hardware_concurrency())};
+        std::unique_ptr<ThreadPool> _blocking_pool;
+        std::once_flag _blocking_pool_flag;
+        // Server-side sessions (after the io_context, whose timing wheel they use)
+        std::unique_ptr<wpp::session_store> _session_store;
         // Chryptographic keys
         vector<byte> key;
         vector<byte> iv;
+        session_codec _session_codec;
         string _key_file;
         string _certificate_file;
         // Cache
@@ -0,0 +1,215 @@
+//
+// Asynchronous route handlers.
+//
+
+#ifndef WPP_ASYNC_H
+#define WPP_ASYNC_H
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/optional.hpp>
+
+#include "chunked_writer.h"
+
+// C++20 coroutines are optional. Without them, asynchronous
+// routes receive a completion callback instead.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define WPP_HAS_COROUTINES
+#endif
+#endif
+
+namespace wpp {
+    class response;
+    struct request;
+
+    // Sends the response of an asynchronous route.
+    //
+    // The handler returns right away and keeps a copy of the completion. When the
+    // response is ready (from any thread), calling the completion posts the write
+    // to the server executor. Copies share the same state: the first call sends,
+    // later calls do nothing. If the last copy is dropped without being called,
+    // the client gets a 500 instead of a connection that hangs forever.
+    class completion {
+        public:
+            struct state {
+                boost::asio::io_context* executor{nullptr};
+                // Writes the response. Always runs on the executor.
+                std::function<void()> send;
+                // Turns the response into a 500
+                std::function<void()> fail;
+                // Takes over the connection to stream the body
+                std::function<chunked_writer::sink()> open_sink;
+                std::atomic<bool> done{false};
+
+                ~state() {
+                    if (!done.exchange(true) && send && executor) {
+                        boost::asio::post(*executor, [fail = std::move(fail), send = std::move(send)]() {
+                            if (fail) {
+                                fail();
+                            }
+                            send();
+                        });
+                    }
+                }
+            };
+
+            completion() = default;
+
+            explicit completion(std::shared_ptr<state> s) : state_(std::move(s)) {}
+
+            // Send the response
+            void operator()() const {
+                if (state_ && !state_->done.exchange(true) && state_->send) {
+                    boost::asio::post(*state_->executor, state_->send);
+                }
+            }
+
+            // False when the route is not running inside the server
+            explicit operator bool() const {
+                return state_ != nullptr;
+            }
+
+        private:
+            std::shared_ptr<state> state_;
+    };
+
+    using async_resource_function = std::function<void(wpp::response &, wpp::request &, wpp::completion)>;
+
+#ifdef WPP_HAS_COROUTINES
+    // Return type of coroutine route handlers:
+    //
+    //     app.async_get("report", [&](wpp::response& res, wpp::request& req) -> wpp::async_task {
+    //         auto rows = co_await app.co_offload([]{ return slow_query(); });
+    //         res.body = rows.dump();
+    //     });
+    //
+    // The coroutine starts suspended and is started by the server with the
+    // completion of the request, which it calls when the body returns.
+    class async_task {
+        public:
+            struct promise_type {
+                wpp::completion done;
+
+                async_task get_return_object() {
+                    return async_task(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+
+                std::suspend_always initial_suspend() noexcept { return {}; }
+
+                std::suspend_never final_suspend() noexcept { return {}; }
+
+                void return_void() {
+                    done();
+                }
+
+                // Dropping the completion answers with a 500
+                void unhandled_exception() noexcept {
+                    done = wpp::completion{};
+                }
+            };
+
+            async_task(const async_task&) = delete;
+            async_task& operator=(const async_task&) = delete;
+
+            async_task(async_task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+            ~async_task() {
+                if (handle_) {
+                    handle_.destroy();
+                }
+            }
+
+            // Run the coroutine until its first suspension point.
+            // The frame owns itself from here on.
+            void start(wpp::completion done) {
+                auto h = std::exchange(handle_, nullptr);
+                h.promise().done = std::move(done);
+                h.resume();
+            }
+
+        private:
+            explicit async_task(std::coroutine_handle<promise_type> h) : handle_(h) {}
+
+            std::coroutine_handle<promise_type> handle_;
+    };
+
+    // co_await a timer on the server executor
+    class sleep_awaitable {
+        public:
+            sleep_awaitable(boost::asio::io_context& ioc, std::chrono::steady_clock::duration d)
+                    : timer_(ioc, d) {}
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> h) {
+                timer_.async_wait([h](const boost::system::error_code&) { h.resume(); });
+            }
+
+            void await_resume() const noexcept {}
+
+        private:
+            boost::asio::steady_timer timer_;
+    };
+
+    // co_await blocking work (a database query, a synchronous HTTP call) on the
+    // worker pool. The coroutine resumes on the server executor with the result.
+    template<class Work>
+    class offload_awaitable {
+        public:
+            using result_type = decltype(std::declval<Work &>()());
+            using submit_function = std::function<void(std::function<void()>)>;
+
+            offload_awaitable(submit_function submit, boost::asio::io_context& ioc, Work work)
+                    : submit_(std::move(submit)), ioc_(ioc), work_(std::move(work)) {}
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> h) {
+                submit_([this, h]() {
+                    try {
+                        if constexpr (std::is_void<result_type>::value) {
+                            work_();
+                        } else {
+                            result_.emplace(work_());
+                        }
+                    } catch (...) {
+                        error_ = std::current_exception();
+                    }
+                    boost::asio::post(ioc_, [h]() { h.resume(); });
+                });
+            }
+
+            result_type await_resume() {
+                if (error_) {
+                    std::rethrow_exception(error_);
+                }
+                if constexpr (!std::is_void<result_type>::value) {
+                    return std::move(*result_);
+                }
+            }
+
+        private:
+            using storage_type = typename std::conditional<std::is_void<result_type>::value, bool, result_type>::type;
+
+            submit_function submit_;
+            boost::asio::io_context& ioc_;
+            Work work_;
+            boost::optional<storage_type> result_;
+            std::exception_ptr error_;
+    };
+#endif
+
+}
+
+#endif //WPP_ASYNC_H
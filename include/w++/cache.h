@@ -0,0 +1,368 @@
+//
+// Concurrent cache of the application, with TTLs and CLOCK eviction.
+//
+
+#ifndef WPP_CACHE_H
+#define WPP_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace wpp {
+
+    // Values by key, shared by the handlers of all worker threads.
+    //
+    // Keys are spread over lock-striped shards. Each shard has a
+    // shared_mutex, so hits on the same shard only share a reader lock:
+    // eviction is CLOCK (second chance), where a hit just sets the
+    // reference bit of the entry instead of moving it in a list. A full
+    // shard sweeps its hand over the entries, dropping expired entries and
+    // those not used since the last sweep.
+    //
+    // Capacity is bounded by entries and by bytes (keys, values and an
+    // estimate of the bookkeeping), both split evenly among shards.
+    // Every entry has its own TTL, and the hit, miss, eviction and
+    // expiration counters are kept per shard, so they do not bounce a
+    // cache line between threads either.
+    class cache {
+        public:
+            using clock = std::chrono::steady_clock;
+            using value_type = std::shared_ptr<const std::string>;
+
+            struct settings {
+                // Time to live of entries put without one
+                std::chrono::milliseconds ttl{std::chrono::hours(24)};
+                size_t max_entries{10000};
+                size_t max_bytes{size_t(64) << 20};
+            };
+
+            struct statistics {
+                size_t hits{0};
+                size_t misses{0};
+                size_t evictions{0};
+                size_t expirations{0};
+                size_t entries{0};
+                size_t bytes{0};
+
+                double hit_rate() const {
+                    return hits + misses ? double(hits) / double(hits + misses) : 0.0;
+                }
+            };
+
+            // Approximate bytes of bookkeeping per entry
+            static constexpr size_t entry_overhead = 96;
+
+            cache() : cache(settings{}) {}
+
+            cache(std::chrono::duration<double, std::milli> ttl, size_t max_entries, size_t max_bytes = size_t(64) << 20)
+                    : cache(settings{std::chrono::duration_cast<std::chrono::milliseconds>(ttl), max_entries, max_bytes}) {}
+
+            explicit cache(settings s) {
+                configure(s);
+            }
+
+            cache(const cache &) = delete;
+            cache &operator=(const cache &) = delete;
+
+            // Drops every entry. Call before the server starts.
+            void configure(settings s) {
+                s.max_entries = std::max<size_t>(1, s.max_entries);
+                settings_ = s;
+                // Enough shards to spread the threads, but not so many that
+                // small caches end up with shards too small for an entry
+                shard_count_ = 1;
+                while (shard_count_ < max_shards && shard_count_ * 2 * 16 <= s.max_entries &&
+                       shard_count_ * 2 * min_shard_bytes <= s.max_bytes) {
+                    shard_count_ *= 2;
+                }
+                entries_per_shard_ = (s.max_entries + shard_count_ - 1) / shard_count_;
+                bytes_per_shard_ = std::max<size_t>(1, s.max_bytes / shard_count_);
+                shards_.reset(new shard[shard_count_]);
+            }
+
+            const settings &get_settings() const {
+                return settings_;
+            }
+
+            // The value of key, or nullptr if it is missing or expired
+            value_type get(const std::string &key) {
+                shard &s = shard_of(key);
+                std::shared_lock<std::shared_mutex> lock(s.mutex);
+                auto it = s.index.find(key);
+                if (it == s.index.end()) {
+                    s.misses.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                const entry &e = it->second;
+                if (e.expires <= coarse_now()) {
+                    // Removed by the hand or by the next put
+                    s.misses.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                if (!e.referenced.load(std::memory_order_relaxed)) {
+                    e.referenced.store(true, std::memory_order_relaxed);
+                }
+                s.hits.fetch_add(1, std::memory_order_relaxed);
+                return e.value;
+            }
+
+            bool contains(const std::string &key) const {
+                const shard &s = shard_of(key);
+                std::shared_lock<std::shared_mutex> lock(s.mutex);
+                auto it = s.index.find(key);
+                return it != s.index.end() && it->second.expires > coarse_now();
+            }
+
+            // False if the entry is larger than a shard can hold
+            bool put(const std::string &key, std::string value) {
+                return put(key, std::move(value), settings_.ttl);
+            }
+
+            template <class Rep, class Period>
+            bool put(const std::string &key, std::string value, std::chrono::duration<Rep, Period> ttl) {
+                return insert(key, std::make_shared<const std::string>(std::move(value)),
+                              std::chrono::duration_cast<clock::duration>(ttl));
+            }
+
+            // The value of key, computed by make() and put on a miss.
+            // Concurrent misses may all call make().
+            template <class Rep, class Period, class F>
+            value_type remember(const std::string &key, std::chrono::duration<Rep, Period> ttl, F &&make) {
+                value_type v = get(key);
+                if (!v) {
+                    v = std::make_shared<const std::string>(make());
+                    insert(key, v, std::chrono::duration_cast<clock::duration>(ttl));
+                }
+                return v;
+            }
+
+            bool erase(const std::string &key) {
+                shard &s = shard_of(key);
+                std::unique_lock<std::shared_mutex> lock(s.mutex);
+                auto it = s.index.find(key);
+                if (it == s.index.end()) {
+                    return false;
+                }
+                remove(s, it);
+                return true;
+            }
+
+            // Drops the entries whose key satisfies pred
+            size_t erase_if(const std::function<bool(const std::string &key)> &pred) {
+                size_t n = 0;
+                for (size_t i = 0; i < shard_count_; ++i) {
+                    shard &s = shards_[i];
+                    std::unique_lock<std::shared_mutex> lock(s.mutex);
+                    for (auto it = s.index.begin(); it != s.index.end();) {
+                        if (pred(it->first)) {
+                            remove(s, it++);
+                            ++n;
+                        } else {
+                            ++it;
+                        }
+                    }
+                }
+                return n;
+            }
+
+            void clear() {
+                for (size_t i = 0; i < shard_count_; ++i) {
+                    shard &s = shards_[i];
+                    std::unique_lock<std::shared_mutex> lock(s.mutex);
+                    s.index.clear();
+                    s.ring.clear();
+                    s.free.clear();
+                    s.hand = 0;
+                    s.count = 0;
+                    s.bytes = 0;
+                }
+            }
+
+            size_t size() const {
+                size_t n = 0;
+                for (size_t i = 0; i < shard_count_; ++i) {
+                    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+                    n += shards_[i].count;
+                }
+                return n;
+            }
+
+            size_t bytes() const {
+                size_t n = 0;
+                for (size_t i = 0; i < shard_count_; ++i) {
+                    std::shared_lock<std::shared_mutex> lock(shards_[i].mutex);
+                    n += shards_[i].bytes;
+                }
+                return n;
+            }
+
+            statistics stats() const {
+                statistics r;
+                for (size_t i = 0; i < shard_count_; ++i) {
+                    const shard &s = shards_[i];
+                    r.hits += s.hits.load(std::memory_order_relaxed);
+                    r.misses += s.misses.load(std::memory_order_relaxed);
+                    r.evictions += s.evictions.load(std::memory_order_relaxed);
+                    r.expirations += s.expirations.load(std::memory_order_relaxed);
+                    std::shared_lock<std::shared_mutex> lock(s.mutex);
+                    r.entries += s.count;
+                    r.bytes += s.bytes;
+                }
+                return r;
+            }
+
+        private:
+            static constexpr size_t max_shards = 64;
+            static constexpr size_t min_shard_bytes = 256 << 10;
+
+            struct entry {
+                value_type value;
+                clock::time_point expires;
+                size_t bytes{0};
+                // Position in the ring of the shard
+                size_t position{0};
+                // Set by hits under the reader lock
+                mutable std::atomic<bool> referenced{false};
+            };
+
+            using index_type = std::unordered_map<std::string, entry>;
+
+            struct alignas(64) shard {
+                mutable std::shared_mutex mutex;
+                // Entries live in the nodes of the index, so a hit touches
+                // nothing else. The ring points to them in CLOCK order.
+                index_type index;
+                std::vector<index_type::value_type *> ring;
+                std::vector<size_t> free;
+                size_t hand{0};
+                size_t count{0};
+                size_t bytes{0};
+                std::atomic<size_t> hits{0};
+                std::atomic<size_t> misses{0};
+                std::atomic<size_t> evictions{0};
+                std::atomic<size_t> expirations{0};
+            };
+
+            // The time for TTLs. Every hit reads it, and a coarse clock is
+            // several times cheaper than steady_clock where there is one.
+            static clock::time_point coarse_now() {
+#ifdef CLOCK_MONOTONIC_COARSE
+                timespec ts;
+                clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+                return clock::time_point(std::chrono::duration_cast<clock::duration>(
+                        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+#else
+                return clock::now();
+#endif
+            }
+
+            size_t shard_index(const std::string &key) const {
+                uint64_t h = std::hash<std::string>()(key);
+                // The map of the shard uses the low bits of the same hash
+                h ^= h >> 29;
+                h *= 0xbf58476d1ce4e5b9ull;
+                h ^= h >> 32;
+                return static_cast<size_t>(h & (shard_count_ - 1));
+            }
+
+            shard &shard_of(const std::string &key) {
+                return shards_[shard_index(key)];
+            }
+
+            const shard &shard_of(const std::string &key) const {
+                return shards_[shard_index(key)];
+            }
+
+            bool insert(const std::string &key, value_type value, clock::duration ttl) {
+                const size_t bytes = key.size() + value->size() + entry_overhead;
+                if (bytes > bytes_per_shard_) {
+                    return false;
+                }
+                const clock::time_point now = coarse_now();
+                shard &s = shard_of(key);
+                std::unique_lock<std::shared_mutex> lock(s.mutex);
+                auto it = s.index.find(key);
+                if (it != s.index.end()) {
+                    remove(s, it);
+                }
+                while (s.count >= entries_per_shard_ || s.bytes + bytes > bytes_per_shard_) {
+                    evict_one(s, now);
+                }
+                size_t position;
+                if (!s.free.empty()) {
+                    position = s.free.back();
+                    s.free.pop_back();
+                } else {
+                    position = s.ring.size();
+                    s.ring.push_back(nullptr);
+                }
+                auto &node = *s.index.emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                              std::forward_as_tuple()).first;
+                entry &e = node.second;
+                e.value = std::move(value);
+                e.expires = now + ttl;
+                e.bytes = bytes;
+                e.position = position;
+                s.ring[position] = &node;
+                ++s.count;
+                s.bytes += bytes;
+                return true;
+            }
+
+            // Requires the writer lock
+            void remove(shard &s, index_type::iterator it) {
+                s.ring[it->second.position] = nullptr;
+                s.free.push_back(it->second.position);
+                s.bytes -= it->second.bytes;
+                --s.count;
+                s.index.erase(it);
+            }
+
+            // Requires the writer lock and an entry. Moves the hand to the
+            // first entry that expired or was not referenced since the hand
+            // last passed, clearing the bits on the way, and drops it.
+            void evict_one(shard &s, clock::time_point now) {
+                for (;;) {
+                    if (s.hand >= s.ring.size()) {
+                        s.hand = 0;
+                    }
+                    index_type::value_type *node = s.ring[s.hand++];
+                    if (!node) {
+                        continue;
+                    }
+                    entry &e = node->second;
+                    if (e.expires <= now) {
+                        s.expirations.fetch_add(1, std::memory_order_relaxed);
+                    } else if (e.referenced.exchange(false, std::memory_order_relaxed)) {
+                        continue;
+                    } else {
+                        s.evictions.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    remove(s, s.index.find(node->first));
+                    return;
+                }
+            }
+
+            settings settings_;
+            size_t shard_count_{1};
+            size_t entries_per_shard_{1};
+            size_t bytes_per_shard_{1};
+            std::unique_ptr<shard[]> shards_;
+    };
+
+}
+
+#endif //WPP_CACHE_H
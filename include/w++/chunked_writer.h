@@ -0,0 +1,271 @@
+//
+// Streaming response body with Transfer-Encoding: chunked.
+//
+
+#ifndef WPP_CHUNKED_WRITER_H
+#define WPP_CHUNKED_WRITER_H
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+namespace wpp {
+
+    // Writes a response body piece by piece instead of building it in memory.
+    //
+    //     app.get("export.csv", [&](wpp::response& res, wpp::request& req) {
+    //         res.headers.emplace("Content-Type", "text/csv");
+    //         auto cursor = std::make_shared<size_t>(0);
+    //         req.stream()->generate([cursor](wpp::chunked_writer& w) {
+    //             w.write(csv_line(*cursor));
+    //             return ++*cursor < total_lines;
+    //         });
+    //     });
+    //
+    // Status and headers are taken from the response on the first write.
+    // Pieces are buffered and sent while the socket accepts them. Once the
+    // buffer goes above the high watermark, write() returns false and the
+    // producer should wait for on_writable() (generate() does this for you),
+    // so memory per response stays around the watermark however large the
+    // body is. The writer can be used from any thread. Sends happen on the
+    // server executor.
+    class chunked_writer : public std::enable_shared_from_this<chunked_writer> {
+        public:
+            // How the writer talks to the connection. Always called on the executor.
+            struct sink {
+                // Queue the status line and headers
+                std::function<void()> write_head;
+                // Queue bytes of the body
+                std::function<void(const std::string &)> write;
+                // Send what was queued and call back with false if the client is gone
+                std::function<void(std::function<void(bool)>)> send;
+            };
+
+            chunked_writer(boost::asio::io_context &ioc, sink s, size_t high_watermark = 64 * 1024)
+                    : ioc_(ioc), sink_(std::move(s)), high_watermark_(high_watermark) {}
+
+            chunked_writer(const chunked_writer &) = delete;
+            chunked_writer &operator=(const chunked_writer &) = delete;
+
+            // A writer dropped without end() ends the body where it is. The
+            // last reference can go on any thread, so the sink is called on
+            // the executor and released there.
+            ~chunked_writer() {
+                if (ended_ || failed_ || !sink_.write) {
+                    return;
+                }
+                boost::asio::post(ioc_, [s = std::move(sink_), data = pending_ + last_chunk(),
+                                         write_head = !head_written_]() {
+                    if (write_head) {
+                        s.write_head();
+                    }
+                    s.write(data);
+                });
+            }
+
+            // Queue a piece of the body.
+            // Returns false if the producer should wait for on_writable().
+            bool write(const char *data, size_t n) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (ended_ || failed_) {
+                    return false;
+                }
+                // an empty chunk would end the body
+                if (n != 0) {
+                    frame(data, n, pending_);
+                    ++writes_;
+                    schedule_flush();
+                }
+                return below_watermark();
+            }
+
+            bool write(const std::string &data) {
+                return write(data.data(), data.size());
+            }
+
+            // Send the last chunk. The connection goes back to the server afterwards.
+            void end() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (ended_ || failed_) {
+                    return;
+                }
+                ended_ = true;
+                produce_ = nullptr;
+                pending_.append(last_chunk());
+                schedule_flush();
+            }
+
+            // Called once, on the executor, when everything queued was sent
+            void on_writable(std::function<void()> f) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (!flushing_ && pending_.empty() && !ended_ && !failed_) {
+                    lock.unlock();
+                    boost::asio::post(ioc_, std::move(f));
+                    return;
+                }
+                on_writable_ = std::move(f);
+            }
+
+            // Pull the body from `produce`, which writes the next pieces and
+            // returns false after the last one. It is called again whenever the
+            // socket drained, and end() is called for you. A call that returns
+            // true without writing means "no data yet": the producer is not
+            // called again until resume() or the next write() is sent.
+            void generate(std::function<bool(chunked_writer &)> produce) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    produce_ = std::move(produce);
+                }
+                resume();
+            }
+
+            // Call the producer of generate() again, as when it has new data
+            void resume() {
+                boost::asio::post(ioc_, [self = shared_from_this()]() { self->pump(); });
+            }
+
+            // False once the client disconnected
+            bool good() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return !failed_;
+            }
+
+            bool writable() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return below_watermark();
+            }
+
+            // Append `data` to `out` as one chunk
+            static void frame(const char *data, size_t n, std::string &out) {
+                char size_line[20];
+                const int len = std::snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+                out.append(size_line, static_cast<size_t>(len));
+                out.append(data, n);
+                out.append("\r\n", 2);
+            }
+
+            // The last chunk of a body
+            static const char *last_chunk() {
+                return "0\r\n\r\n";
+            }
+
+        private:
+            bool below_watermark() const {
+                return pending_.size() + in_flight_ < high_watermark_;
+            }
+
+            // Requires the lock
+            void schedule_flush() {
+                if (flushing_) {
+                    // the bytes go out with the next send
+                    return;
+                }
+                flushing_ = true;
+                boost::asio::post(ioc_, [self = shared_from_this()]() { self->do_flush(); });
+            }
+
+            void do_flush() {
+                std::string data;
+                bool write_head = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    data.swap(pending_);
+                    in_flight_ = data.size();
+                    write_head = !head_written_;
+                    head_written_ = true;
+                }
+                if (write_head) {
+                    sink_.write_head();
+                }
+                sink_.write(data);
+                sink_.send([self = shared_from_this()](bool ok) { self->on_sent(ok); });
+            }
+
+            void on_sent(bool ok) {
+                std::function<void()> notify;
+                bool more_to_produce = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    in_flight_ = 0;
+                    if (!ok) {
+                        failed_ = true;
+                        flushing_ = false;
+                        pending_.clear();
+                        produce_ = nullptr;
+                        notify = std::move(on_writable_);
+                        sink_ = sink{};
+                    } else if (!pending_.empty()) {
+                        // writes arrived while we were sending
+                        flushing_ = false;
+                        schedule_flush();
+                    } else {
+                        flushing_ = false;
+                        if (ended_) {
+                            // releasing the connection finishes the response
+                            sink_ = sink{};
+                            return;
+                        }
+                        notify = std::move(on_writable_);
+                        more_to_produce = static_cast<bool>(produce_);
+                    }
+                }
+                if (notify) {
+                    notify();
+                }
+                if (more_to_produce) {
+                    pump();
+                }
+            }
+
+            // Call the producer until it is done, the buffer is full or it
+            // has nothing to write for now
+            void pump() {
+                for (;;) {
+                    std::function<bool(chunked_writer &)> produce;
+                    size_t writes;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        if (!produce_ || ended_ || failed_ || !below_watermark()) {
+                            return;
+                        }
+                        produce = produce_;
+                        writes = writes_;
+                    }
+                    if (!produce(*this)) {
+                        end();
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (writes_ == writes) {
+                        // Nothing yet: wait for resume() instead of spinning
+                        return;
+                    }
+                }
+            }
+
+            boost::asio::io_context &ioc_;
+            sink sink_;
+            const size_t high_watermark_;
+
+            mutable std::mutex mutex_;
+            std::string pending_;
+            size_t in_flight_{0};
+            // Non-empty pieces written so far
+            size_t writes_{0};
+            bool flushing_{false};
+            bool head_written_{false};
+            bool ended_{false};
+            bool failed_{false};
+            std::function<void()> on_writable_;
+            std::function<bool(chunked_writer &)> produce_;
+    };
+
+}
+
+#endif //WPP_CHUNKED_WRITER_H
@@ -0,0 +1,352 @@
+//
+// Stream wrapper that coalesces small writes into batched socket writes.
+//
+
+#ifndef WPP_COALESCING_STREAM_HPP
+#define WPP_COALESCING_STREAM_HPP
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+#include <boost/version.hpp>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace wpp {
+
+    // Moved out of the websocket namespace in Boost 1.70
+#if BOOST_VERSION >= 107000
+    using websocket_role = boost::beast::role_type;
+#else
+    using websocket_role = boost::beast::websocket::role_type;
+#endif
+
+    // Write buffers shared by all connections. An idle connection gives its
+    // buffers back, so memory follows the number of busy connections rather
+    // than the number of open ones.
+    class write_buffer_pool {
+        public:
+            explicit write_buffer_pool(size_t max_pooled = 4096) : max_pooled_(max_pooled) {}
+
+            static write_buffer_pool &shared() {
+                static write_buffer_pool pool;
+                return pool;
+            }
+
+            std::string acquire() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (free_.empty()) {
+                    return std::string();
+                }
+                std::string b = std::move(free_.back());
+                free_.pop_back();
+                return b;
+            }
+
+            void release(std::string &b) {
+                if (b.capacity() == 0) {
+                    return;
+                }
+                b.clear();
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (free_.size() < max_pooled_) {
+                    free_.push_back(std::move(b));
+                }
+                b = std::string();
+            }
+
+        private:
+            const size_t max_pooled_;
+            std::mutex mutex_;
+            std::vector<std::string> free_;
+    };
+
+    // Wraps the stream under a websocket::stream. Small writes are copied to
+    // a buffer and completed right away, and the buffer is sent with one
+    // socket write while the previous one is in flight. Messages written
+    // back to back (a broadcast, a burst of updates) leave in one batch
+    // instead of one system call each, and control frames written by the
+    // websocket stream are ordered with them.
+    //
+    // Writes larger than `copy_limit`, or writes made while more than
+    // `high_watermark` bytes are buffered, wait for the buffer to drain, so
+    // a slow reader stalls the writer instead of growing the buffer.
+    //
+    // Socket writes complete on the strand of the session, which the
+    // websocket stream and the TLS stream under it expect.
+    template<class NextLayer>
+    class coalescing_stream {
+        public:
+            using strand_type = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+        private:
+            struct op_base;
+
+            struct state {
+                template<class Arg>
+                state(Arg &&arg, strand_type const &st) : next(std::forward<Arg>(arg)), strand(st) {}
+
+                NextLayer next;
+                strand_type strand;
+                size_t copy_limit{16 * 1024};
+                size_t high_watermark{64 * 1024};
+                std::mutex mutex;
+                std::string pending;
+                std::string inflight;
+                bool flushing{false};
+                boost::system::error_code error;
+                std::unique_ptr<op_base> waiting;
+            };
+
+            struct op_base {
+                virtual ~op_base() = default;
+                virtual void start(std::shared_ptr<state> s, std::unique_ptr<op_base> self) = 0;
+                virtual void fail(state &s, boost::system::error_code ec) = 0;
+            };
+
+            template<class Buffers, class Handler>
+            struct write_op : op_base {
+                Buffers buffers;
+                Handler handler;
+
+                write_op(Buffers const &b, Handler &&h) : buffers(b), handler(std::move(h)) {}
+
+                void start(std::shared_ptr<state> s, std::unique_ptr<op_base> self) override {
+                    state &st = *s;
+                    boost::asio::async_write(st.next, buffers, boost::asio::bind_executor(
+                                             st.strand,
+                                             [s = std::move(s), self = std::move(self)](
+                                                     boost::system::error_code ec, std::size_t n) mutable {
+                                                 auto &op = static_cast<write_op &>(*self);
+                                                 {
+                                                     std::unique_lock<std::mutex> lock(s->mutex);
+                                                     s->flushing = false;
+                                                     if (ec) {
+                                                         s->error = ec;
+                                                     } else {
+                                                         flush(s, lock);
+                                                     }
+                                                 }
+                                                 complete(*s, std::move(op.handler), ec, n);
+                                             }));
+                }
+
+                void fail(state &s, boost::system::error_code ec) override {
+                    complete(s, std::move(handler), ec, 0);
+                }
+            };
+
+            // Closes the connection once the frames before it are written
+            template<class Handler>
+            struct teardown_op : op_base {
+                websocket_role role;
+                Handler handler;
+
+                teardown_op(websocket_role r, Handler &&h) : role(r), handler(std::move(h)) {}
+
+                void start(std::shared_ptr<state> s, std::unique_ptr<op_base> self) override {
+                    using boost::beast::websocket::async_teardown;
+                    state &st = *s;
+                    async_teardown(role, st.next, boost::asio::bind_executor(
+                                   st.strand,
+                                   [s = std::move(s), self = std::move(self)](boost::system::error_code ec) mutable {
+                                       auto &op = static_cast<teardown_op &>(*self);
+                                       {
+                                           std::lock_guard<std::mutex> lock(s->mutex);
+                                           s->flushing = false;
+                                       }
+                                       boost::asio::post(s->next.get_executor(),
+                                                         boost::beast::bind_handler(std::move(op.handler), ec));
+                                   }));
+                }
+
+                void fail(state &s, boost::system::error_code ec) override {
+                    boost::asio::post(s.next.get_executor(), boost::beast::bind_handler(std::move(handler), ec));
+                }
+            };
+
+            // Posting keeps the associated executor (the strand) of the handler
+            template<class Handler>
+            static void complete(state &s, Handler &&h, boost::system::error_code ec, std::size_t n) {
+                boost::asio::post(s.next.get_executor(), boost::beast::bind_handler(std::move(h), ec, n));
+            }
+
+            // Requires the lock. Sends the buffer, or the write that waits for it.
+            static void flush(const std::shared_ptr<state> &s, std::unique_lock<std::mutex> &) {
+                if (s->flushing) {
+                    return;
+                }
+                if (!s->pending.empty()) {
+                    s->flushing = true;
+                    std::swap(s->pending, s->inflight);
+                    boost::asio::async_write(s->next, boost::asio::buffer(s->inflight), boost::asio::bind_executor(
+                                             s->strand,
+                                             [s](boost::system::error_code ec, std::size_t) {
+                                                 std::unique_lock<std::mutex> lock(s->mutex);
+                                                 s->flushing = false;
+                                                 s->inflight.clear();
+                                                 if (ec) {
+                                                     s->error = ec;
+                                                     if (s->waiting) {
+                                                         auto op = std::move(s->waiting);
+                                                         op->fail(*s, ec);
+                                                     }
+                                                     return;
+                                                 }
+                                                 flush(s, lock);
+                                             }));
+                    return;
+                }
+                if (s->waiting) {
+                    s->flushing = true;
+                    auto op = std::move(s->waiting);
+                    op_base &o = *op;
+                    o.start(s, std::move(op));
+                    return;
+                }
+                // Idle: give the buffers back
+                write_buffer_pool::shared().release(s->pending);
+                write_buffer_pool::shared().release(s->inflight);
+            }
+
+            std::shared_ptr<state> s_;
+
+        public:
+            using next_layer_type = typename std::remove_reference<NextLayer>::type;
+            using lowest_layer_type = typename next_layer_type::lowest_layer_type;
+            using executor_type = typename next_layer_type::executor_type;
+
+            template<class Arg>
+            coalescing_stream(Arg &&arg, strand_type const &strand)
+                    : s_(std::make_shared<state>(std::forward<Arg>(arg), strand)) {}
+
+            coalescing_stream(coalescing_stream &&) = default;
+            coalescing_stream &operator=(coalescing_stream &&) = default;
+
+            void set_limits(size_t copy_limit, size_t high_watermark) {
+                std::lock_guard<std::mutex> lock(s_->mutex);
+                s_->copy_limit = copy_limit;
+                s_->high_watermark = high_watermark;
+            }
+
+            // Bytes accepted but not written to the socket yet
+            size_t buffered() const {
+                std::lock_guard<std::mutex> lock(s_->mutex);
+                return s_->pending.size() + s_->inflight.size();
+            }
+
+            executor_type get_executor() noexcept {
+                return s_->next.get_executor();
+            }
+
+            next_layer_type &next_layer() {
+                return s_->next;
+            }
+
+            next_layer_type const &next_layer() const {
+                return s_->next;
+            }
+
+            lowest_layer_type &lowest_layer() {
+                return s_->next.lowest_layer();
+            }
+
+            template<class MutableBufferSequence>
+            std::size_t read_some(MutableBufferSequence const &buffers, boost::system::error_code &ec) {
+                return s_->next.read_some(buffers, ec);
+            }
+
+            template<class MutableBufferSequence>
+            std::size_t read_some(MutableBufferSequence const &buffers) {
+                return s_->next.read_some(buffers);
+            }
+
+            template<class MutableBufferSequence, class ReadHandler>
+            BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(boost::system::error_code, std::size_t))
+            async_read_some(MutableBufferSequence const &buffers, BOOST_ASIO_MOVE_ARG(ReadHandler) handler) {
+                return s_->next.async_read_some(buffers, BOOST_ASIO_MOVE_CAST(ReadHandler)(handler));
+            }
+
+            // Synchronous writes go straight to the socket once the buffer is sent
+            template<class ConstBufferSequence>
+            std::size_t write_some(ConstBufferSequence const &buffers, boost::system::error_code &ec) {
+                return s_->next.write_some(buffers, ec);
+            }
+
+            template<class ConstBufferSequence>
+            std::size_t write_some(ConstBufferSequence const &buffers) {
+                return s_->next.write_some(buffers);
+            }
+
+            template<class ConstBufferSequence, class WriteHandler>
+            BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(boost::system::error_code, std::size_t))
+            async_write_some(ConstBufferSequence const &buffers, BOOST_ASIO_MOVE_ARG(WriteHandler) handler) {
+                using handler_type = BOOST_ASIO_HANDLER_TYPE(WriteHandler, void(boost::system::error_code, std::size_t));
+                boost::asio::async_completion<WriteHandler, void(boost::system::error_code, std::size_t)> init{handler};
+                const std::size_t n = boost::asio::buffer_size(buffers);
+
+                std::unique_lock<std::mutex> lock(s_->mutex);
+                if (s_->error) {
+                    complete(*s_, std::move(init.completion_handler), s_->error, 0);
+                } else if (n <= s_->copy_limit && s_->pending.size() + s_->inflight.size() + n <= s_->high_watermark) {
+                    if (s_->pending.capacity() == 0) {
+                        s_->pending = write_buffer_pool::shared().acquire();
+                    }
+                    const std::size_t offset = s_->pending.size();
+                    s_->pending.resize(offset + n);
+                    boost::asio::buffer_copy(boost::asio::buffer(&s_->pending[offset], n), buffers);
+                    complete(*s_, std::move(init.completion_handler), boost::system::error_code{}, n);
+                    flush(s_, lock);
+                } else {
+                    // The websocket stream has one write at a time, so at most one waits
+                    s_->waiting = std::unique_ptr<op_base>(
+                            new write_op<ConstBufferSequence, handler_type>(buffers, std::move(init.completion_handler)));
+                    flush(s_, lock);
+                }
+                return init.result.get();
+            }
+
+            template<class Stream>
+            friend void teardown(websocket_role role,
+                                 coalescing_stream<Stream> &stream, boost::system::error_code &ec);
+
+            template<class Stream, class TeardownHandler>
+            friend void async_teardown(websocket_role role,
+                                       coalescing_stream<Stream> &stream, TeardownHandler &&handler);
+    };
+
+    // Closing the connection is done by the wrapped stream
+
+    template<class Stream>
+    inline void teardown(websocket_role role,
+                         coalescing_stream<Stream> &stream, boost::system::error_code &ec) {
+        using boost::beast::websocket::teardown;
+        teardown(role, stream.s_->next, ec);
+    }
+
+    template<class Stream, class TeardownHandler>
+    inline void async_teardown(websocket_role role,
+                               coalescing_stream<Stream> &stream, TeardownHandler &&handler) {
+        using op_type = typename coalescing_stream<Stream>::template teardown_op<typename std::decay<TeardownHandler>::type>;
+        auto &s = stream.s_;
+        std::unique_lock<std::mutex> lock(s->mutex);
+        // The close frame may still be in the buffer
+        s->waiting = std::unique_ptr<typename coalescing_stream<Stream>::op_base>(
+                new op_type(role, std::forward<TeardownHandler>(handler)));
+        coalescing_stream<Stream>::flush(s, lock);
+    }
+
+}
+
+#endif //WPP_COALESCING_STREAM_HPP
@@ -0,0 +1,146 @@
+//
+// SQLite storage for the write-behind of the session store.
+//
+
+#ifndef WPP_SQLITE_SESSION_BACKEND_H
+#define WPP_SQLITE_SESSION_BACKEND_H
+
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "../session_store.h"
+
+namespace wpp {
+    namespace db {
+
+        // Sessions in one table of a SQLite file:
+        //
+        //     id TEXT PRIMARY KEY, data BLOB (CBOR), last_activity INTEGER (ms)
+        //
+        // Each flush of the store is a single transaction with prepared
+        // statements, so writing behind hundreds of sessions costs one sync.
+        class sqlite_session_backend : public session_store::backend {
+            public:
+                explicit sqlite_session_backend(const std::string &data_source, std::string table = "sessions")
+                        : table_(std::move(table)) {
+                    if (sqlite3_open_v2(data_source.c_str(), &db_, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                                        nullptr) != SQLITE_OK) {
+                        const std::string error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+                        sqlite3_close(db_);
+                        db_ = nullptr;
+                        throw std::runtime_error("Can't open the session database: " + error);
+                    }
+                    sqlite3_busy_timeout(db_, 60 * 1000);
+                    exec("PRAGMA journal_mode=WAL");
+                    exec("CREATE TABLE IF NOT EXISTS " + table_ +
+                         " (id TEXT PRIMARY KEY, data BLOB NOT NULL, last_activity INTEGER NOT NULL)");
+                    upsert_ = prepare("INSERT OR REPLACE INTO " + table_ + " (id, data, last_activity) VALUES (?, ?, ?)");
+                    delete_ = prepare("DELETE FROM " + table_ + " WHERE id = ?");
+                }
+
+                sqlite_session_backend(const sqlite_session_backend &) = delete;
+                sqlite_session_backend &operator=(const sqlite_session_backend &) = delete;
+
+                ~sqlite_session_backend() override {
+                    sqlite3_finalize(upsert_);
+                    sqlite3_finalize(delete_);
+                    sqlite3_close(db_);
+                }
+
+                bool load(const std::function<void(session_store::record &&)> &f) override {
+                    sqlite3_stmt *select = prepare("SELECT id, data, last_activity FROM " + table_);
+                    if (!select) {
+                        return false;
+                    }
+                    int rc;
+                    while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+                        session_store::record r;
+                        r.id.assign(reinterpret_cast<const char *>(sqlite3_column_text(select, 0)),
+                                    sqlite3_column_bytes(select, 0));
+                        const auto *blob = static_cast<const uint8_t *>(sqlite3_column_blob(select, 1));
+                        r.data.assign(blob, blob + sqlite3_column_bytes(select, 1));
+                        r.last_activity = session_store::system_clock::time_point(
+                                std::chrono::milliseconds(sqlite3_column_int64(select, 2)));
+                        f(std::move(r));
+                    }
+                    sqlite3_finalize(select);
+                    return rc == SQLITE_DONE;
+                }
+
+                bool write(const std::vector<session_store::record> &changed,
+                           const std::vector<std::string> &removed) override {
+                    if (!exec("BEGIN")) {
+                        return false;
+                    }
+                    bool ok = true;
+                    for (const session_store::record &r : changed) {
+                        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                r.last_activity.time_since_epoch()).count();
+                        sqlite3_bind_text(upsert_, 1, r.id.data(), static_cast<int>(r.id.size()), SQLITE_STATIC);
+                        sqlite3_bind_blob(upsert_, 2, r.data.data(), static_cast<int>(r.data.size()), SQLITE_STATIC);
+                        sqlite3_bind_int64(upsert_, 3, ms);
+                        ok = step(upsert_) && ok;
+                    }
+                    for (const std::string &id : removed) {
+                        sqlite3_bind_text(delete_, 1, id.data(), static_cast<int>(id.size()), SQLITE_STATIC);
+                        ok = step(delete_) && ok;
+                    }
+                    if (!ok) {
+                        exec("ROLLBACK");
+                        return false;
+                    }
+                    return exec("COMMIT");
+                }
+
+                const std::string &error_string() const {
+                    return error_;
+                }
+
+            private:
+                bool exec(const std::string &sql) {
+                    char *errmsg = nullptr;
+                    if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+                        error_ = errmsg ? errmsg : sqlite3_errmsg(db_);
+                        sqlite3_free(errmsg);
+                        return false;
+                    }
+                    return true;
+                }
+
+                sqlite3_stmt *prepare(const std::string &sql) {
+                    sqlite3_stmt *stmt = nullptr;
+                    if (sqlite3_prepare_v2(db_, sql.c_str(), static_cast<int>(sql.size()), &stmt, nullptr) != SQLITE_OK) {
+                        error_ = sqlite3_errmsg(db_);
+                        return nullptr;
+                    }
+                    return stmt;
+                }
+
+                bool step(sqlite3_stmt *stmt) {
+                    const int rc = stmt ? sqlite3_step(stmt) : SQLITE_MISUSE;
+                    if (rc != SQLITE_DONE && stmt) {
+                        error_ = sqlite3_errmsg(db_);
+                    }
+                    if (stmt) {
+                        sqlite3_reset(stmt);
+                        sqlite3_clear_bindings(stmt);
+                    }
+                    return rc == SQLITE_DONE;
+                }
+
+                sqlite3 *db_{nullptr};
+                std::string table_;
+                sqlite3_stmt *upsert_{nullptr};
+                sqlite3_stmt *delete_{nullptr};
+                std::string error_;
+        };
+
+    }
+}
+
+#endif //WPP_SQLITE_SESSION_BACKEND_H
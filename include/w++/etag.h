@@ -0,0 +1,158 @@
+//
+// Entity tags of dynamic responses.
+//
+
+#ifndef WPP_ETAG_H
+#define WPP_ETAG_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace wpp {
+
+    namespace detail {
+        constexpr uint64_t xxh_prime1 = 0x9E3779B185EBCA87ull;
+        constexpr uint64_t xxh_prime2 = 0xC2B2AE3D27D4EB4Full;
+        constexpr uint64_t xxh_prime3 = 0x165667B19E3779F9ull;
+        constexpr uint64_t xxh_prime4 = 0x85EBCA77C2B2AE63ull;
+        constexpr uint64_t xxh_prime5 = 0x27D4EB2F165667C5ull;
+
+        inline uint64_t xxh_rotl(uint64_t x, int r) {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        inline uint64_t xxh_read64(const unsigned char *p) {
+            uint64_t v;
+            std::memcpy(&v, p, 8);
+            return v;
+        }
+
+        inline uint32_t xxh_read32(const unsigned char *p) {
+            uint32_t v;
+            std::memcpy(&v, p, 4);
+            return v;
+        }
+
+        inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+            acc += input * xxh_prime2;
+            return xxh_rotl(acc, 31) * xxh_prime1;
+        }
+
+        inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+            acc ^= xxh_round(0, v);
+            return acc * xxh_prime1 + xxh_prime4;
+        }
+    }
+
+    // XXH64 (little endian): several GB/s, so hashing a page costs far
+    // less than rendering it. Not for anything an attacker could exploit.
+    inline uint64_t xxhash64(const void *data, size_t n, uint64_t seed = 0) {
+        using namespace detail;
+        const auto *p = static_cast<const unsigned char *>(data);
+        const unsigned char *const end = p + n;
+        uint64_t h;
+        if (n >= 32) {
+            uint64_t v1 = seed + xxh_prime1 + xxh_prime2;
+            uint64_t v2 = seed + xxh_prime2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - xxh_prime1;
+            const unsigned char *const limit = end - 32;
+            do {
+                v1 = xxh_round(v1, xxh_read64(p));
+                v2 = xxh_round(v2, xxh_read64(p + 8));
+                v3 = xxh_round(v3, xxh_read64(p + 16));
+                v4 = xxh_round(v4, xxh_read64(p + 24));
+                p += 32;
+            } while (p <= limit);
+            h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+            h = xxh_merge(h, v1);
+            h = xxh_merge(h, v2);
+            h = xxh_merge(h, v3);
+            h = xxh_merge(h, v4);
+        } else {
+            h = seed + xxh_prime5;
+        }
+        h += n;
+        for (; p + 8 <= end; p += 8) {
+            h ^= xxh_round(0, xxh_read64(p));
+            h = xxh_rotl(h, 27) * xxh_prime1 + xxh_prime4;
+        }
+        if (p + 4 <= end) {
+            h ^= static_cast<uint64_t>(xxh_read32(p)) * xxh_prime1;
+            h = xxh_rotl(h, 23) * xxh_prime2 + xxh_prime3;
+            p += 4;
+        }
+        for (; p < end; ++p) {
+            h ^= *p * xxh_prime5;
+            h = xxh_rotl(h, 11) * xxh_prime1;
+        }
+        h ^= h >> 33;
+        h *= xxh_prime2;
+        h ^= h >> 29;
+        h *= xxh_prime3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    // A strong tag for a body: "<16 hex digits>"
+    inline std::string etag_of(const char *data, size_t n) {
+        static const char digits[] = "0123456789abcdef";
+        const uint64_t h = xxhash64(data, n);
+        std::string tag(18, '"');
+        for (int i = 0; i < 16; ++i) {
+            tag[16 - i] = digits[(h >> (4 * i)) & 0xf];
+        }
+        return tag;
+    }
+
+    inline std::string etag_of(const std::string &body) {
+        return etag_of(body.data(), body.size());
+    }
+
+    // A weak tag for a validator of the handler, such as a row version or
+    // an update time: W/"<16 hex digits>"
+    inline std::string weak_etag_of(const std::string &validator) {
+        return "W/" + etag_of(validator);
+    }
+
+    // If-None-Match lists tag (or is *). The comparison is weak, as
+    // RFC 7232 asks for GET and HEAD.
+    inline bool etag_matches(const std::string &if_none_match, const std::string &tag) {
+        auto opaque = [](const char *s, size_t n) {
+            if (n >= 2 && s[0] == 'W' && s[1] == '/') {
+                s += 2;
+                n -= 2;
+            }
+            return std::string(s, n);
+        };
+        const std::string wanted = opaque(tag.data(), tag.size());
+        size_t pos = 0;
+        while (pos < if_none_match.size()) {
+            while (pos < if_none_match.size() && (if_none_match[pos] == ' ' || if_none_match[pos] == ',')) {
+                ++pos;
+            }
+            size_t end = if_none_match.find(',', pos);
+            if (end == std::string::npos) {
+                end = if_none_match.size();
+            }
+            size_t last = end;
+            while (last > pos && if_none_match[last - 1] == ' ') {
+                --last;
+            }
+            if (last - pos == 1 && if_none_match[pos] == '*') {
+                return true;
+            }
+            if (last > pos && opaque(if_none_match.data() + pos, last - pos) == wanted) {
+                return true;
+            }
+            pos = end;
+        }
+        return false;
+    }
+
+}
+
+#endif //WPP_ETAG_H
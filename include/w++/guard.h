@@ -13,6 +13,9 @@ namespace wpp {
         protected:
             // The currently authenticated user.
             json _user{nullptr};
+            // The same user with its roles and permissions resolved, when
+            // the callback is the one of the application
+            std::shared_ptr<const wpp::principal> _principal;
             // The user provider implementation.
             // user_provider provider;
             // The guard callback that generates a user in json format
@@ -26,6 +29,10 @@ namespace wpp {
             guard(std::function<wpp::json(wpp::request&)> callback, wpp::request& request_) : _callback(callback), _request(request_){
                 _request.auth = this;
                 this->_user = _callback(_request);
+                // Only the callback of the application resolves this user
+                if (_request._principal && _request._principal->user() == this->_user) {
+                    this->_principal = _request._principal;
+                }
             };
 
             // Determine if the current user is authenticated.
@@ -59,10 +66,15 @@ namespace wpp {
                 return json{nullptr};
             }
 
-            // Set the current user
+            // Set the current user. A login moves the session to a new
+            // ID, so the ID of the session before it cannot be reused.
             self_t& set_user(json __user)
             {
+                if (!__user.is_null() && __user != this->_user) {
+                    _request.session_regenerate();
+                }
                 this->_user = __user;
+                this->_principal.reset();
                 return *this;
             }
 
@@ -93,6 +105,14 @@ namespace wpp {
             }
 
             bool has_role(vector<string> names){
+                if (this->_principal) {
+                    for (const string& name: names){
+                        if (this->_principal->has_role(name)){
+                            return true;
+                        }
+                    }
+                    return false;
+                }
                 if (this->check()) {
                     if (this->_user.count("role")){
                         for (string& name: names){
@@ -121,6 +141,14 @@ namespace wpp {
             }
 
             bool has_permission(vector<string> names){
+                if (this->_principal) {
+                    for (const string& name: names){
+                        if (this->_principal->has_permission(name)){
+                            return true;
+                        }
+                    }
+                    return false;
+                }
                 if (this->check()) {
                     if (this->_user.count("permission")){
                         for (string& name: names) {
@@ -144,6 +172,19 @@ namespace wpp {
                 return false;
             }
 
+            // Checks against interned IDs (see application::roles): only bit tests
+            bool has_any_role(const access_set& mask){
+                return this->_principal && this->_principal->has_any_role(mask);
+            }
+
+            bool has_any_permission(const access_set& mask){
+                return this->_principal && this->_principal->has_any_permission(mask);
+            }
+
+            bool has_all_permissions(const access_set& mask){
+                return this->_principal && this->_principal->has_all_permissions(mask);
+            }
+
     };
 }
 
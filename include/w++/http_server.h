@@ -5,9 +5,17 @@
 #ifndef HTTP_SERVER_HTTP_SERVER_H
 #define HTTP_SERVER_HTTP_SERVER_H
 
+#include "admission_control.h"
+#include "coalescing_stream.hpp"
+#include "etag.h"
+#include "response_cache.h"
 #include "detect_ssl.hpp"
 #include "server_certificate.hpp"
+#include "server_timeouts.h"
 #include "ssl_stream.hpp"
+#include "timing_wheel.h"
+#include "tls_manager.h"
+#include "websocket.h"
 #include "application.hpp"
 
 #include <boost/beast/core.hpp>
@@ -15,22 +23,37 @@
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/ssl/stream.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/make_unique.hpp>
+#include <boost/optional.hpp>
 #include <boost/config.hpp>
 #include <algorithm>
+#include <atomic>
+#include <array>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
 
+#ifdef WPP_ENABLE_HTTP2
+#include <boost/algorithm/string/case_conv.hpp>
+#include <nghttp2/nghttp2.h>
+#endif
+
 
 using tcp = boost::asio::ip::tcp;               // from <boost/asio/ip/tcp.hpp>
 namespace ssl = boost::asio::ssl;               // from <boost/asio/ssl.hpp>
@@ -82,18 +105,221 @@ handle_request(
 //------------------------------------------------------------------------------
 
 // Report a failure
-
-static void
-fail(boost::system::error_code ec, char const* what);
+static
+void
+fail(boost::system::error_code ec, char const* what)
+{
+    std::cerr << what << ": " << ec.message() << "\n";
+}
 
 
 //------------------------------------------------------------------------------
 
-// Echoes back all received WebSocket messages.
+// Fill a wpp::request from a parsed HTTP request, the way
+// the routes see it on the other server paths
+template<class Body, class Allocator>
+void
+to_wpp_request(
+        wpp::application& app,
+        http::request<Body, http::basic_fields<Allocator>> const& req,
+        wpp::request& r)
+{
+    r.parent_application = &app;
+    r.method_string = std::string(req.method_string().data(), req.method_string().size());
+    r.method_requested = wpp::method_enum(r.method_string);
+    r.http_version = std::to_string(req.version() / 10) + "." + std::to_string(req.version() % 10);
+    std::string const target(req.target().data(), req.target().size());
+    std::size_t const query = target.find('?');
+    r.url_ = target.substr(0, query);
+    if(query != std::string::npos)
+        r.query_string = target.substr(query + 1);
+    for(auto const& field : req)
+        r.headers.emplace(
+                std::string(field.name_string().data(), field.name_string().size()),
+                std::string(field.value().data(), field.value().size()));
+    r.parse_cookies();
+    r.request_parameters = wpp::QueryString::parse(r.query_string);
+}
+
+// Turn the answer of a route into an HTTP response.
+// A file the route opened is read into the body.
+inline
+http::response<http::string_body>
+to_beast_response(wpp::response& res, unsigned version, bool keep_alive = false)
+{
+    http::response<http::string_body> msg{
+            static_cast<http::status>(static_cast<int>(res.code)), version};
+    for(auto const& h : res.headers)
+        msg.insert(h.first, h.second);
+    if(res._file_response && res._file_response->good())
+    {
+        res._file_response->seekg(0, std::ios::beg);
+        std::ostringstream body;
+        body << res._file_response->rdbuf();
+        msg.body() = body.str();
+    }
+    else
+    {
+        msg.body() = res.body;
+    }
+    msg.prepare_payload();
+    msg.keep_alive(keep_alive);
+    return msg;
+}
+
+// Send function of a request nobody waits for
+struct discard_response
+{
+    template<bool isRequest, class Body, class Fields>
+    void
+    operator()(http::message<isRequest, Body, Fields>&&) const
+    {
+    }
+};
+
+// Send the file of the assets directory at the url of a GET or HEAD.
+// The body is written from the file, without reading it into memory.
+// Returns false if there is no such asset.
+template<class Send>
+bool
+send_asset(
+        wpp::application& app,
+        wpp::request const& r,
+        unsigned version,
+        bool keep_alive,
+        Send const& send)
+{
+    bool const head_only = r.method_requested == wpp::method::head;
+    if(! head_only && r.method_requested != wpp::method::get)
+        return false;
+    std::string const path = app.asset_path(r.url_);
+    if(path.empty())
+        return false;
+    boost::beast::error_code ec;
+    http::file_body::value_type body;
+    body.open(path.c_str(), boost::beast::file_mode::scan, ec);
+    if(ec)
+        return false;
+    auto const size = body.size();
+
+    if(head_only)
+    {
+        http::response<http::empty_body> res{http::status::ok, version};
+        res.set(http::field::content_type, wpp::asset_content_type(path));
+        res.content_length(size);
+        res.keep_alive(keep_alive);
+        send(std::move(res));
+        return true;
+    }
+    http::response<http::file_body> res{
+            std::piecewise_construct,
+            std::make_tuple(std::move(body)),
+            std::make_tuple(http::status::ok, version)};
+    res.set(http::field::content_type, wpp::asset_content_type(path));
+    res.content_length(size);
+    res.keep_alive(keep_alive);
+    send(std::move(res));
+    return true;
+}
+
+// Answer a request with the application. The route runs here, on the
+// worker pool, and the response goes to `send` from the thread that
+// completes it. Streams are not available on these connections.
+template<
+        class Body, class Allocator,
+        class Send>
+void
+handle_request(
+        boost::beast::string_view doc_root,
+        http::request<Body, http::basic_fields<Allocator>>&& req,
+        Send&& send,
+        wpp::application* app)
+{
+    // The assets are found by the application under doc_root
+    boost::ignore_unused(doc_root);
+    auto r = std::make_shared<wpp::request>();
+    auto res = std::make_shared<wpp::response>();
+    to_wpp_request(*app, req, *r);
+    r->body = std::move(req.body());
+    wpp::application::parse_posted_parameters(*r);
+
+    unsigned const version = req.version();
+    bool const keep_alive = req.keep_alive();
+    typename std::decay<Send>::type reply(std::forward<Send>(send));
+    app->serve(
+            r,
+            res,
+            [res, version, keep_alive, reply]()
+            {
+                reply(to_beast_response(*res, version, keep_alive));
+            },
+            {},
+            [app, r, version, keep_alive, reply]()
+            {
+                return send_asset(*app, *r, version, keep_alive, reply);
+            });
+}
+
+// The cached response to a GET or HEAD, if the response cache has one
+inline
+wpp::response_cache::hit
+find_cached_response(
+        wpp::application& app,
+        http::request<http::string_body> const& req)
+{
+    wpp::response_cache& cache = app.get_response_cache();
+    if(cache.empty() ||
+       (req.method() != http::verb::get && req.method() != http::verb::head))
+        return {};
+    auto header = [&req](boost::beast::string_view name)
+    {
+        return req[name];
+    };
+    if(cache.bypass(header))
+        return {};
+    auto const host = req[http::field::host];
+    auto hit = cache.lookup(
+            std::string(host.data(), host.size()),
+            std::string(req.target().data(), req.target().size()),
+            header);
+    if(hit && ! hit.response->etag.empty())
+    {
+        auto const tags = req[http::field::if_none_match];
+        hit.not_modified = ! tags.empty() && wpp::etag_matches(
+                std::string(tags.data(), tags.size()), hit.response->etag);
+    }
+    return hit;
+}
+
+// Run the route of a stale response on the worker pool,
+// its middleware stores the new version
+inline
+void
+refresh_cached_response(
+        wpp::application& app,
+        boost::beast::string_view doc_root,
+        http::request<http::string_body> const& req)
+{
+    auto r = std::make_shared<http::request<http::string_body>>(req);
+    r->method(http::verb::get);
+    app.blocking_pool().enqueue(
+            [&app, doc_root, r]()
+            {
+                handle_request(doc_root, std::move(*r), discard_response{}, &app);
+            });
+}
+
+// A connection of a WebSocket route.
 // This uses the Curiously Recurring Template Pattern so that
 // the same code works with both SSL streams and regular sockets.
+//
+// The upgrade request is routed first: if its middleware did not accept
+// it, the answer of the route is written and the connection closed.
+// Otherwise messages go to the callbacks of the route, and messages sent
+// from any thread are queued and written one after the other.
 template<class Derived>
 class websocket_session
+        : public wpp::websocket_connection
 {
     // Access the derived class, this is part of
     // the Curiously Recurring Template Pattern idiom.
@@ -103,29 +329,197 @@ class websocket_session
         return static_cast<Derived&>(*this);
     }
 
-    boost::beast::multi_buffer buffer_;
+    boost::beast::flat_buffer buffer_;
     char ping_state_ = 0;
 
+    // The route of the connection, null if the upgrade was refused
+    std::shared_ptr<wpp::websocket_endpoint const> endpoint_;
+    // Answer of the route when the upgrade was refused
+    boost::optional<http::response<http::string_body>> rejection_;
+
+    // Outbound messages, filled from any thread
+    mutable std::mutex queue_mutex_;
+    std::deque<wpp::websocket_message> queue_;
+    // Bytes of the queue and of the message being written
+    std::size_t queued_bytes_ = 0;
+    std::size_t dropped_ = 0;
+    // The queue went above the high watermark, on_drain is due
+    bool congested_ = false;
+    bool flushing_ = false;
+    bool close_requested_ = false;
+    // Only touched on the strand
+    bool writing_ = false;
+    std::size_t writing_bytes_ = 0;
+    std::atomic<bool> open_{false};
+    bool close_notified_ = false;
+
 protected:
     boost::asio::strand<
             boost::asio::io_context::executor_type> strand_;
-    boost::asio::steady_timer timer_;
+    wpp::timing_wheel::timer timer_;
+    wpp::server_timeouts timeouts_;
+    // Connection slot inherited from the http session
+    wpp::admission_control::connection_slot slot_;
 
 public:
     // Construct the session
-    explicit
-    websocket_session(boost::asio::io_context& ioc)
+    websocket_session(
+            boost::asio::io_context& ioc,
+            wpp::server_timeouts const& timeouts,
+            wpp::admission_control::connection_slot slot)
             : strand_(ioc.get_executor())
-            , timer_(ioc,
-                     (std::chrono::steady_clock::time_point::max)())
+            , timer_(ioc)
+            , timeouts_(timeouts)
+            , slot_(std::move(slot))
+    {
+    }
+
+    // Route expirations of the shared timing wheel to our strand.
+    // The wheel only keeps a weak reference to the session.
+    void
+    start_timer()
+    {
+        std::weak_ptr<Derived> weak = derived().shared_from_this();
+        timer_.on_expire([weak]()
+        {
+            if(auto self = weak.lock())
+                boost::asio::post(
+                        self->websocket_session::strand_,
+                        std::bind(
+                                &websocket_session::on_timer,
+                                self));
+        });
+    }
+
+    // Queue a message, from any thread
+    bool
+    send(wpp::websocket_message message) override
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if(! open_ || close_requested_)
+            return false;
+
+        // A client that does not keep up
+        wpp::websocket_options const& o = endpoint_->options;
+        if(queued_bytes_ + message.size() > o.high_watermark && ! queue_.empty())
+        {
+            congested_ = true;
+            switch(o.slow_consumer)
+            {
+            case wpp::websocket_options::overflow::drop_newest:
+                ++dropped_;
+                return false;
+            case wpp::websocket_options::overflow::drop_oldest:
+                while(! queue_.empty() &&
+                      queued_bytes_ + message.size() > o.high_watermark)
+                {
+                    queued_bytes_ -= queue_.front().size();
+                    queue_.pop_front();
+                    ++dropped_;
+                }
+                break;
+            case wpp::websocket_options::overflow::close:
+                ++dropped_;
+                dropped_ += queue_.size();
+                for(auto const& m : queue_)
+                    queued_bytes_ -= m.size();
+                queue_.clear();
+                close_requested_ = true;
+                schedule_flush();
+                return false;
+            }
+        }
+
+        queued_bytes_ += message.size();
+        queue_.push_back(std::move(message));
+        schedule_flush();
+        return true;
+    }
+
+    // Close once the queue is written, from any thread
+    void
+    close() override
     {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if(close_requested_)
+            return;
+        close_requested_ = true;
+        schedule_flush();
+    }
+
+    bool
+    is_open() const override
+    {
+        return open_;
+    }
+
+    std::size_t
+    queued_bytes() const override
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        return queued_bytes_;
+    }
+
+    std::size_t
+    dropped() const override
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        return dropped_;
     }
 
     // Start the asynchronous operation
     template<class Body, class Allocator>
     void
-    do_accept(http::request<Body, http::basic_fields<Allocator>> req)
+    do_accept(
+            wpp::application& app,
+            http::request<Body, http::basic_fields<Allocator>> req)
     {
+        // Routing and middleware decide if the upgrade is accepted
+        request_ = std::make_shared<wpp::request>();
+        wpp::response res;
+        to_wpp_request(app, req, *request_);
+        endpoint_ = app.websocket_upgrade(res, *request_);
+
+        // Set the timer
+        timer_.expires_after(timeouts_.handshake);
+
+        if(! endpoint_)
+        {
+            // Straight to the socket, past the write batching
+            rejection_.emplace(to_beast_response(res, req.version()));
+            http::async_write(
+                    derived().ws().next_layer().next_layer(),
+                    *rejection_,
+                    boost::asio::bind_executor(
+                            strand_,
+                            std::bind(
+                                    &websocket_session::on_rejected,
+                                    derived().shared_from_this(),
+                                    std::placeholders::_1)));
+            return;
+        }
+
+        derived().ws().read_message_max(endpoint_->max_message_size);
+
+        // Compression, if the client offers it. Beast keeps the zlib state
+        // of each connection, context takeover decides if it lives between
+        // messages.
+        wpp::websocket_options const& o = endpoint_->options;
+        websocket::permessage_deflate pmd;
+        pmd.server_enable = o.permessage_deflate;
+        pmd.server_no_context_takeover = ! o.context_takeover;
+        pmd.client_no_context_takeover = ! o.context_takeover;
+        pmd.server_max_window_bits = o.window_bits;
+        pmd.compLevel = o.compression_level;
+        pmd.memLevel = o.memory_level;
+        derived().ws().set_option(pmd);
+
+        // Frames up to the limit are batched, and the batch can grow
+        // to a few of them before the writes wait for the socket
+        derived().ws().next_layer().set_limits(
+                o.coalesce_limit,
+                (std::max)(std::size_t(64 * 1024), 4 * o.coalesce_limit));
+
         // Set the control callback. This will be called
         // on every incoming ping, pong, and close frame.
         derived().ws().control_callback(
@@ -135,9 +529,6 @@ public:
                         std::placeholders::_1,
                         std::placeholders::_2));
 
-        // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
-
         // Accept the websocket handshake
         derived().ws().async_accept(
                 req,
@@ -149,6 +540,17 @@ public:
                                 std::placeholders::_1)));
     }
 
+    void
+    on_rejected(boost::system::error_code ec)
+    {
+        boost::ignore_unused(ec);
+        timer_.cancel();
+
+        // The answer said "Connection: close"
+        derived().ws().next_layer().lowest_layer().shutdown(tcp::socket::shutdown_both, ec);
+        derived().ws().next_layer().lowest_layer().close(ec);
+    }
+
     void
     on_accept(boost::system::error_code ec)
     {
@@ -159,58 +561,53 @@ public:
         if(ec)
             return fail(ec, "accept");
 
+        // The handshake is done, now we wait for messages
+        timer_.expires_after(timeouts_.websocket_idle);
+
+        open_ = true;
+        if(endpoint_->on_open)
+            endpoint_->on_open(derived().shared_from_this());
+
         // Read a message
         do_read();
     }
 
-    // Called when the timer expires.
+    // Called on the strand when the timer expires.
     void
-    on_timer(boost::system::error_code ec)
+    on_timer()
     {
-        if(ec && ec != boost::asio::error::operation_aborted)
-            return fail(ec, "timer");
+        // Activity may have re-armed the timer while this was queued
+        if(timer_.armed())
+            return;
 
-        // See if the timer really expired since the deadline may have moved.
-        if(timer_.expiry() <= std::chrono::steady_clock::now())
+        // If this is the first time the timer expired,
+        // send a ping to see if the other end is there.
+        // Beast queues the ping behind a message being written.
+        if(derived().ws().is_open() && ping_state_ == 0)
         {
-            // If this is the first time the timer expired,
-            // send a ping to see if the other end is there.
-            if(derived().ws().is_open() && ping_state_ == 0)
-            {
-                // Note that we are sending a ping
-                ping_state_ = 1;
-
-                // Set the timer
-                timer_.expires_after(std::chrono::seconds(15));
-
-                // Now send the ping
-                derived().ws().async_ping({},
-                                          boost::asio::bind_executor(
-                                                  strand_,
-                                                  std::bind(
-                                                          &websocket_session::on_ping,
-                                                          derived().shared_from_this(),
-                                                          std::placeholders::_1)));
-            }
-            else
-            {
-                // The timer expired while trying to handshake,
-                // or we sent a ping and it never completed or
-                // we never got back a control frame, so close.
-
-                derived().do_timeout();
-                return;
-            }
+            // Note that we are sending a ping
+            ping_state_ = 1;
+
+            // Set the timer
+            timer_.expires_after(timeouts_.websocket_idle);
+
+            // Now send the ping
+            derived().ws().async_ping({},
+                                      boost::asio::bind_executor(
+                                              strand_,
+                                              std::bind(
+                                                      &websocket_session::on_ping,
+                                                      derived().shared_from_this(),
+                                                      std::placeholders::_1)));
+        }
+        else
+        {
+            // The timer expired while trying to handshake,
+            // or we sent a ping and it never completed or
+            // we never got back a control frame, so close.
+            notify_close();
+            derived().do_timeout();
         }
-
-        // Wait on the timer
-        timer_.async_wait(
-                boost::asio::bind_executor(
-                        strand_,
-                        std::bind(
-                                &websocket_session::on_timer,
-                                derived().shared_from_this(),
-                                std::placeholders::_1)));
     }
 
     // Called to indicate activity from the remote peer
@@ -220,8 +617,8 @@ public:
         // Note that the connection is alive
         ping_state_ = 0;
 
-        // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
+        // Moving the deadline in the wheel is cheap
+        timer_.expires_after(timeouts_.websocket_idle);
     }
 
     // Called after a ping is sent.
@@ -282,31 +679,102 @@ public:
     {
         boost::ignore_unused(bytes_transferred);
 
-        // Happens when the timer closes the socket
-        if(ec == boost::asio::error::operation_aborted)
-            return;
+        if(ec)
+        {
+            notify_close();
 
-        // This indicates that the websocket_session was closed
-        if(ec == websocket::error::closed)
+            // Happens when the timer closes the socket, or
+            // indicates that the websocket_session was closed
+            if(ec != boost::asio::error::operation_aborted &&
+               ec != websocket::error::closed)
+                fail(ec, "read");
             return;
-
-        if(ec)
-            fail(ec, "read");
+        }
 
         // Note that there is activity
         activity();
 
-        // Echo the message
-        derived().ws().text(derived().ws().got_text());
-        derived().ws().async_write(
-                buffer_.data(),
-                boost::asio::bind_executor(
-                        strand_,
-                        std::bind(
-                                &websocket_session::on_write,
-                                derived().shared_from_this(),
-                                std::placeholders::_1,
-                                std::placeholders::_2)));
+        if(endpoint_->on_message)
+            endpoint_->on_message(
+                    derived().shared_from_this(),
+                    wpp::websocket_message(
+                            boost::beast::buffers_to_string(buffer_.data()),
+                            derived().ws().got_text()));
+
+        // Clear the buffer
+        buffer_.consume(buffer_.size());
+
+        // Do another read
+        do_read();
+    }
+
+private:
+    // Requires the queue lock
+    void
+    schedule_flush()
+    {
+        if(flushing_)
+            return;
+        flushing_ = true;
+        boost::asio::post(
+                strand_,
+                std::bind(
+                        &websocket_session::do_write,
+                        derived().shared_from_this()));
+    }
+
+    // Write the next message of the queue, or close if asked to
+    void
+    do_write()
+    {
+        if(writing_)
+            return;
+        boost::optional<wpp::websocket_message> next;
+        bool close = false;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            if(! queue_.empty())
+            {
+                next.emplace(std::move(queue_.front()));
+                queue_.pop_front();
+            }
+            else
+            {
+                flushing_ = false;
+                close = close_requested_ && open_;
+            }
+        }
+
+        if(next)
+        {
+            writing_ = true;
+            writing_bytes_ = next->size();
+            derived().ws().text(next->is_text());
+            // The payload is shared with the other receivers of the message,
+            // only the frame header is written per connection
+            derived().ws().async_write(
+                    next->buffer(),
+                    boost::asio::bind_executor(
+                            strand_,
+                            [self = derived().shared_from_this(), message = *next](
+                                    boost::system::error_code ec,
+                                    std::size_t bytes_transferred)
+                            {
+                                self->on_write(ec, bytes_transferred);
+                            }));
+        }
+        else if(close)
+        {
+            open_ = false;
+            derived().ws().async_close(
+                    websocket::close_code::normal,
+                    boost::asio::bind_executor(
+                            strand_,
+                            [self = derived().shared_from_this()](boost::system::error_code)
+                            {
+                                self->notify_close();
+                            }));
+        }
     }
 
     void
@@ -315,19 +783,48 @@ public:
             std::size_t bytes_transferred)
     {
         boost::ignore_unused(bytes_transferred);
+        writing_ = false;
 
-        // Happens when the timer closes the socket
-        if(ec == boost::asio::error::operation_aborted)
+        if(ec)
+        {
+            notify_close();
+            if(ec != boost::asio::error::operation_aborted)
+                fail(ec, "write");
             return;
+        }
 
-        if(ec)
-            return fail(ec, "write");
+        // Tell the route once a slow client caught up
+        bool drained = false;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            queued_bytes_ -= (std::min)(queued_bytes_, writing_bytes_);
+            if(congested_ && queued_bytes_ <= endpoint_->options.low_watermark)
+            {
+                congested_ = false;
+                drained = true;
+            }
+        }
+        if(drained && endpoint_->on_drain)
+            endpoint_->on_drain(derived().shared_from_this());
 
-        // Clear the buffer
-        buffer_.consume(buffer_.size());
+        do_write();
+    }
 
-        // Do another read
-        do_read();
+    // The connection is gone: tell the route once and drop the queue
+    void
+    notify_close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            open_ = false;
+            queue_.clear();
+            queued_bytes_ = 0;
+        }
+        if(close_notified_ || ! endpoint_)
+            return;
+        close_notified_ = true;
+        if(endpoint_->on_close)
+            endpoint_->on_close(derived().shared_from_this());
     }
 };
 
@@ -336,21 +833,25 @@ class plain_websocket_session
         : public websocket_session<plain_websocket_session>
                 , public std::enable_shared_from_this<plain_websocket_session>
 {
-    websocket::stream<tcp::socket> ws_;
+    websocket::stream<wpp::coalescing_stream<tcp::socket>> ws_;
     bool close_ = false;
 
 public:
     // Create the session
-    explicit
-    plain_websocket_session(tcp::socket socket)
+    plain_websocket_session(
+            tcp::socket socket,
+            wpp::server_timeouts const& timeouts,
+            wpp::admission_control::connection_slot slot)
             : websocket_session<plain_websocket_session>(
-            socket.get_executor().context())
-            , ws_(std::move(socket))
+            socket.get_executor().context(),
+            timeouts,
+            std::move(slot))
+            , ws_(std::move(socket), strand_)
     {
     }
 
     // Called by the base class
-    websocket::stream<tcp::socket>&
+    websocket::stream<wpp::coalescing_stream<tcp::socket>>&
     ws()
     {
         return ws_;
@@ -359,26 +860,31 @@ public:
     // Start the asynchronous operation
     template<class Body, class Allocator>
     void
-    run(http::request<Body, http::basic_fields<Allocator>> req)
+    run(
+            wpp::application& app,
+            http::request<Body, http::basic_fields<Allocator>> req)
     {
-        // Run the timer. The timer is operated
-        // continuously, this simplifies the code.
-        on_timer({});
+        // Connect the session to the timing wheel
+        start_timer();
 
-        // Accept the WebSocket upgrade request
-        do_accept(std::move(req));
+        // Route and accept the WebSocket upgrade request
+        do_accept(app, std::move(req));
     }
 
     void
     do_timeout()
     {
-        // This is so the close can have a timeout
+        // The close timed out too, drop the connection
         if(close_)
+        {
+            boost::system::error_code ec;
+            ws_.next_layer().next_layer().close(ec);
             return;
+        }
         close_ = true;
 
         // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
+        timer_.expires_after(timeouts_.shutdown);
 
         // Close the WebSocket Connection
         ws_.async_close(
@@ -410,24 +916,25 @@ class ssl_websocket_session
         : public websocket_session<ssl_websocket_session>
                 , public std::enable_shared_from_this<ssl_websocket_session>
 {
-    websocket::stream<ssl_stream<tcp::socket>> ws_;
-    boost::asio::strand<
-            boost::asio::io_context::executor_type> strand_;
+    websocket::stream<wpp::coalescing_stream<ssl_stream<tcp::socket>>> ws_;
     bool eof_ = false;
 
 public:
     // Create the http_session
-    explicit
-    ssl_websocket_session(ssl_stream<tcp::socket> stream)
+    ssl_websocket_session(
+            ssl_stream<tcp::socket> stream,
+            wpp::server_timeouts const& timeouts,
+            wpp::admission_control::connection_slot slot)
             : websocket_session<ssl_websocket_session>(
-            stream.get_executor().context())
-            , ws_(std::move(stream))
-            , strand_(ws_.get_executor())
+            stream.get_executor().context(),
+            timeouts,
+            std::move(slot))
+            , ws_(std::move(stream), strand_)
     {
     }
 
     // Called by the base class
-    websocket::stream<ssl_stream<tcp::socket>>&
+    websocket::stream<wpp::coalescing_stream<ssl_stream<tcp::socket>>>&
     ws()
     {
         return ws_;
@@ -436,14 +943,15 @@ public:
     // Start the asynchronous operation
     template<class Body, class Allocator>
     void
-    run(http::request<Body, http::basic_fields<Allocator>> req)
+    run(
+            wpp::application& app,
+            http::request<Body, http::basic_fields<Allocator>> req)
     {
-        // Run the timer. The timer is operated
-        // continuously, this simplifies the code.
-        on_timer({});
+        // Connect the session to the timing wheel
+        start_timer();
 
-        // Accept the WebSocket upgrade request
-        do_accept(std::move(req));
+        // Route and accept the WebSocket upgrade request
+        do_accept(app, std::move(req));
     }
 
     void
@@ -452,10 +960,10 @@ public:
         eof_ = true;
 
         // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
+        timer_.expires_after(timeouts_.shutdown);
 
         // Perform the SSL shutdown
-        ws_.next_layer().async_shutdown(
+        ws_.next_layer().next_layer().async_shutdown(
                 boost::asio::bind_executor(
                         strand_,
                         std::bind(
@@ -482,12 +990,12 @@ public:
     {
         // If this is true it means we timed out performing the shutdown
         if(eof_)
+        {
+            boost::system::error_code ec;
+            ws_.next_layer().next_layer().next_layer().close(ec);
             return;
+        }
 
-        // Start the timer again
-        timer_.expires_at(
-                (std::chrono::steady_clock::time_point::max)());
-        on_timer({});
         do_eof();
     }
 };
@@ -496,20 +1004,30 @@ template<class Body, class Allocator>
 void
 make_websocket_session(
         tcp::socket socket,
+        wpp::application& app,
+        wpp::server_timeouts const& timeouts,
+        wpp::admission_control::connection_slot slot,
         http::request<Body, http::basic_fields<Allocator>> req)
 {
     std::make_shared<plain_websocket_session>(
-            std::move(socket))->run(std::move(req));
+            std::move(socket),
+            timeouts,
+            std::move(slot))->run(app, std::move(req));
 }
 
 template<class Body, class Allocator>
 void
 make_websocket_session(
         ssl_stream<tcp::socket> stream,
+        wpp::application& app,
+        wpp::server_timeouts const& timeouts,
+        wpp::admission_control::connection_slot slot,
         http::request<Body, http::basic_fields<Allocator>> req)
 {
     std::make_shared<ssl_websocket_session>(
-            std::move(stream))->run(std::move(req));
+            std::move(stream),
+            timeouts,
+            std::move(slot))->run(app, std::move(req));
 }
 
 //------------------------------------------------------------------------------
@@ -529,14 +1047,13 @@ class http_session
     }
 
     // This queue is used for HTTP pipelining.
+    //
+    // Handlers of pipelined requests run concurrently on the worker
+    // pool, so their responses may be ready in any order. Every request
+    // gets a slot in the order it was read, and responses are written
+    // strictly in slot order as the slots at the front are filled.
     class queue
     {
-        enum
-        {
-            // Maximum number of responses we will queue
-                    limit = 8
-        };
-
         // The type-erased, saved work item
         struct work
         {
@@ -545,150 +1062,413 @@ class http_session
         };
 
         http_session& self_;
-        std::vector<std::unique_ptr<work>> items_;
+        // Slots of the requests in flight, oldest first.
+        // An empty slot is a response that is not ready yet.
+        std::deque<std::shared_ptr<work>> items_;
+        // Sequence number of the front slot
+        std::size_t front_ = 0;
+        bool writing_ = false;
+
+        // Called on the strand: store the response and
+        // start writing if it is at the front
+        void
+        fill(std::size_t seq, std::shared_ptr<work> w)
+        {
+            BOOST_ASSERT(seq >= front_ && seq - front_ < items_.size());
+            items_[seq - front_] = std::move(w);
+            if(! writing_ && items_.front())
+            {
+                writing_ = true;
+                (*items_.front())();
+            }
+        }
 
     public:
+        // Send function of one request. Handlers may call it from
+        // any thread; the response is handed to the strand.
+        class sender
+        {
+            queue& q_;
+            std::size_t seq_;
+            // Asynchronous routes keep it after handle_request returns
+            std::shared_ptr<Derived> session_;
+
+        public:
+            sender(queue& q, std::size_t seq)
+                    : q_(q)
+                    , seq_(seq)
+                    , session_(q.self_.derived().shared_from_this())
+            {
+            }
+
+            template<bool isRequest, class Body, class Fields>
+            void
+            operator()(http::message<isRequest, Body, Fields>&& msg) const
+            {
+                // This holds a work item
+                struct work_impl : work
+                {
+                    http_session& self_;
+                    http::message<isRequest, Body, Fields> msg_;
+
+                    work_impl(
+                            http_session& self,
+                            http::message<isRequest, Body, Fields>&& msg)
+                            : self_(self)
+                            , msg_(std::move(msg))
+                    {
+                    }
+
+                    void
+                    operator()()
+                    {
+                        http::async_write(
+                                self_.derived().stream(),
+                                msg_,
+                                boost::asio::bind_executor(
+                                        self_.strand_,
+                                        std::bind(
+                                                &http_session::on_write,
+                                                self_.derived().shared_from_this(),
+                                                std::placeholders::_1,
+                                                msg_.need_eof())));
+                    }
+                };
+
+                std::shared_ptr<work> w =
+                        std::make_shared<work_impl>(q_.self_, std::move(msg));
+                queue& q = q_;
+                std::size_t const seq = seq_;
+                boost::asio::dispatch(
+                        q.self_.strand_,
+                        [&q, seq, w, self = q.self_.derived().shared_from_this()]()
+                        {
+                            q.fill(seq, w);
+                            self->on_handler_done();
+                        });
+            }
+        };
+
         explicit
         queue(http_session& self)
                 : self_(self)
         {
-            static_assert(limit > 0, "queue limit must be positive");
-            items_.reserve(limit);
         }
 
-        // Returns `true` if we have reached the queue limit
+        // Returns `true` if we have reached the pipelining depth
         bool
         is_full() const
         {
-            return items_.size() >= limit;
+            return items_.size() >= self_.app().pipeline_depth();
         }
 
-        // Called when a message finishes sending
-        // Returns `true` if the caller should initiate a read
         bool
+        empty() const
+        {
+            return items_.empty();
+        }
+
+        // Reserve the slot of the next request
+        sender
+        reserve()
+        {
+            items_.emplace_back();
+            return sender(*this, front_ + items_.size() - 1);
+        }
+
+        // Called when a message finishes sending
+        void
         on_write()
         {
             BOOST_ASSERT(! items_.empty());
-            auto const was_full = is_full();
-            items_.erase(items_.begin());
-            if(! items_.empty())
+            items_.pop_front();
+            ++front_;
+            writing_ = false;
+            if(! items_.empty() && items_.front())
+            {
+                writing_ = true;
                 (*items_.front())();
-            return was_full;
+            }
         }
 
-        // Called by the HTTP handler to send a response.
-        template<bool isRequest, class Body, class Fields>
+        // Called to send a preformatted response, such as the
+        // overload 503. The buffer must outlive the write.
+        // The connection is closed once it is written.
         void
-        operator()(http::message<isRequest, Body, Fields>&& msg)
+        send_raw(std::string const& raw)
         {
-            // This holds a work item
-            struct work_impl : work
+            struct raw_work_impl : work
             {
                 http_session& self_;
-                http::message<isRequest, Body, Fields> msg_;
+                std::string const& raw_;
 
-                work_impl(
+                raw_work_impl(
                         http_session& self,
-                        http::message<isRequest, Body, Fields>&& msg)
+                        std::string const& raw)
                         : self_(self)
-                        , msg_(std::move(msg))
+                        , raw_(raw)
                 {
                 }
 
                 void
                 operator()()
                 {
-                    http::async_write(
+                    boost::asio::async_write(
                             self_.derived().stream(),
-                            msg_,
+                            boost::asio::buffer(raw_),
                             boost::asio::bind_executor(
                                     self_.strand_,
                                     std::bind(
-                                            &http_session::on_write,
+                                            &http_session::on_shed,
                                             self_.derived().shared_from_this(),
-                                            std::placeholders::_1,
-                                            msg_.need_eof())));
+                                            std::placeholders::_1)));
                 }
             };
 
-            // Allocate and store the work
-            items_.push_back(
-                    boost::make_unique<work_impl>(self_, std::move(msg)));
-
-            // If there was no previous work, start this one
-            if(items_.size() == 1)
-                (*items_.front())();
+            items_.emplace_back();
+            fill(front_ + items_.size() - 1,
+                 std::make_shared<raw_work_impl>(self_, raw));
         }
-    };
 
-    wpp::application* _app_reference;
-    std::string const& doc_root_;
-    http::request<http::string_body> req_;
-    queue queue_;
+        // Called to send a response of the response cache. The head
+        // and the body are written from the shared entry, not copied.
+        // A client that already has it only gets the 304 head.
+        void
+        send_cached(
+                std::shared_ptr<wpp::cached_response const> response,
+                bool keep_alive,
+                bool head_only,
+                bool not_modified)
+        {
+            struct cached_work_impl : work
+            {
+                http_session& self_;
+                std::shared_ptr<wpp::cached_response const> response_;
+                bool keep_alive_;
+                bool head_only_;
+                bool not_modified_;
 
-protected:
-    boost::asio::steady_timer timer_;
-    boost::asio::strand<
-            boost::asio::io_context::executor_type> strand_;
-    boost::beast::flat_buffer buffer_;
+                cached_work_impl(
+                        http_session& self,
+                        std::shared_ptr<wpp::cached_response const> response,
+                        bool keep_alive,
+                        bool head_only,
+                        bool not_modified)
+                        : self_(self)
+                        , response_(std::move(response))
+                        , keep_alive_(keep_alive)
+                        , head_only_(head_only || not_modified)
+                        , not_modified_(not_modified)
+                {
+                }
 
-public:
-    // Construct the session
-    http_session(
+                void
+                operator()()
+                {
+                    static char const keep[] = "Connection: keep-alive\r\n\r\n";
+                    static char const close[] = "Connection: close\r\n\r\n";
+                    std::array<boost::asio::const_buffer, 3> const buffers{{
+                            boost::asio::buffer(not_modified_
+                                    ? response_->not_modified_head
+                                    : response_->head),
+                            keep_alive_
+                                    ? boost::asio::buffer(keep, sizeof(keep) - 1)
+                                    : boost::asio::buffer(close, sizeof(close) - 1),
+                            head_only_
+                                    ? boost::asio::const_buffer()
+                                    : boost::asio::buffer(response_->body)}};
+                    boost::asio::async_write(
+                            self_.derived().stream(),
+                            buffers,
+                            boost::asio::bind_executor(
+                                    self_.strand_,
+                                    std::bind(
+                                            &http_session::on_write,
+                                            self_.derived().shared_from_this(),
+                                            std::placeholders::_1,
+                                            ! keep_alive_)));
+                }
+            };
+
+            items_.emplace_back();
+            fill(front_ + items_.size() - 1,
+                 std::make_shared<cached_work_impl>(
+                         self_, std::move(response), keep_alive, head_only, not_modified));
+        }
+    };
+
+    wpp::application* _app_reference;
+    std::string const& doc_root_;
+    // The parser is rebuilt for every request so the header
+    // and the body can be read with different timeouts
+    boost::optional<http::request_parser<http::string_body>> parser_;
+    http::request<http::string_body> req_;
+    queue queue_;
+    bool first_request_ = true;
+    // Handlers running on the worker pool
+    std::size_t running_ = 0;
+    // A request that must run alone (see do_dispatch)
+    boost::optional<http::request<http::string_body>> barrier_;
+    // An upgrade waiting for the pipelined responses to be written
+    boost::optional<http::request<http::string_body>> upgrade_;
+    // A request that runs alone is in flight
+    bool exclusive_ = false;
+    bool is_reading_ = false;
+    // When the last request was read (for the load shedder)
+    wpp::admission_control::clock::time_point read_time_;
+    // Requests admitted whose responses were not written yet
+    std::size_t admitted_ = 0;
+
+protected:
+    wpp::timing_wheel::timer timer_;
+    boost::asio::strand<
+            boost::asio::io_context::executor_type> strand_;
+    boost::beast::flat_buffer buffer_;
+    wpp::admission_control::connection_slot slot_;
+
+    wpp::server_timeouts const&
+    timeouts() const
+    {
+        return _app_reference->timeouts();
+    }
+
+    wpp::application&
+    app() const
+    {
+        return *_app_reference;
+    }
+
+    std::string const&
+    doc_root() const
+    {
+        return doc_root_;
+    }
+
+    // Route expirations of the shared timing wheel to our strand.
+    // The wheel only keeps a weak reference to the session.
+    void
+    start_timer()
+    {
+        std::weak_ptr<Derived> weak = derived().shared_from_this();
+        timer_.on_expire([weak]()
+        {
+            if(auto self = weak.lock())
+                boost::asio::post(
+                        self->http_session::strand_,
+                        std::bind(
+                                &http_session::on_timer,
+                                self));
+        });
+    }
+
+public:
+    // Construct the session
+    http_session(
             wpp::application& app,
             boost::asio::io_context& ioc,
             boost::beast::flat_buffer buffer,
-            std::string const& doc_root)
+            std::string const& doc_root,
+            wpp::admission_control::connection_slot slot)
             : _app_reference(&app)
             , doc_root_(doc_root)
             , queue_(*this)
-            , timer_(ioc,
-                     (std::chrono::steady_clock::time_point::max)())
+            , timer_(ioc)
             , strand_(ioc.get_executor())
             , buffer_(std::move(buffer))
+            , slot_(std::move(slot))
+    {
+    }
+
+    ~http_session()
+    {
+        // Give back the request slots of responses we never wrote
+        while(admitted_ > 0)
+            release_request();
+    }
+
+    void
+    release_request()
+    {
+        if(admitted_ == 0)
+            return;
+        --admitted_;
+        _app_reference->get_admission_control().release_request();
+    }
+
+    // A new connection should send its request right away. Between
+    // keep-alive requests the client may stay quiet for longer.
+    void
+    arm_read_timer()
     {
+        timer_.expires_after(
+                first_request_ || buffer_.size() > 0
+                ? timeouts().header_read
+                : timeouts().idle);
     }
 
     void
     do_read()
     {
-        // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
+        // While handlers run or responses wait to be written, the write
+        // deadline stays armed. on_write arms ours when they are done.
+        if(queue_.empty())
+            arm_read_timer();
 
         // Make the request empty before reading,
         // otherwise the operation behavior is undefined.
-        req_ = {};
+        parser_.emplace();
+        parser_->body_limit(app().body_limit());
+        is_reading_ = true;
 
-        // Read a request
-        http::async_read(
+        // Read the request header
+        http::async_read_header(
                 derived().stream(),
                 buffer_,
-                req_,
+                *parser_,
                 boost::asio::bind_executor(
                         strand_,
                         std::bind(
-                                &http_session::on_read,
+                                &http_session::on_read_header,
                                 derived().shared_from_this(),
                                 std::placeholders::_1)));
     }
 
-    // Called when the timer expires.
+    // Called on the strand when the timer expires.
+    void
+    on_timer()
+    {
+        // The deadline was moved while this was queued
+        if(timer_.armed())
+            return;
+
+        derived().do_timeout();
+    }
+
     void
-    on_timer(boost::system::error_code ec)
+    on_read_header(boost::system::error_code ec)
     {
-        if(ec && ec != boost::asio::error::operation_aborted)
-            return fail(ec, "timer");
+        // Happens when the timer closes the socket
+        if(ec == boost::asio::error::operation_aborted)
+            return;
 
-        // Verify that the timer really expired since the deadline may have moved.
-        if(timer_.expiry() <= std::chrono::steady_clock::now())
-            return derived().do_timeout();
+        // This means they closed the connection
+        if(ec == http::error::end_of_stream)
+            return derived().do_eof();
+
+        if(ec)
+            return fail(ec, "read");
 
-        // Wait on the timer
-        timer_.async_wait(
+        // Read the body, if any
+        if(queue_.empty())
+            timer_.expires_after(timeouts().body_read);
+        http::async_read(
+                derived().stream(),
+                buffer_,
+                *parser_,
                 boost::asio::bind_executor(
                         strand_,
                         std::bind(
-                                &http_session::on_timer,
+                                &http_session::on_read,
                                 derived().shared_from_this(),
                                 std::placeholders::_1)));
     }
@@ -706,26 +1486,165 @@ public:
         if(ec)
             return fail(ec, "read");
 
+        first_request_ = false;
+        is_reading_ = false;
+        req_ = parser_->release();
+
         // See if it is a WebSocket Upgrade
         if(websocket::is_upgrade(req_))
         {
-            // Transfer the stream to a new WebSocket session
-            return make_websocket_session(
-                    derived().release_stream(),
-                    std::move(req_));
+            // Earlier responses are written first
+            if(! queue_.empty())
+            {
+                upgrade_.emplace(std::move(req_));
+                return;
+            }
+            return do_upgrade(std::move(req_));
         }
 
-        // Send the response
-        handle_request(doc_root_, std::move(req_), queue_, this->_app_reference);
+        // Handling and writing the response
+        timer_.expires_after(timeouts().write);
 
-        // If we aren't at the queue limit, try to pipeline another request
-        if(! queue_.is_full())
-            do_read();
+        // Dispatch through the executor so the load shedder sees
+        // how long requests are waiting when the server is busy
+        read_time_ = wpp::admission_control::clock::now();
+        boost::asio::post(
+                boost::asio::bind_executor(
+                        strand_,
+                        std::bind(
+                                &http_session::do_dispatch,
+                                derived().shared_from_this())));
+    }
+
+    void
+    do_upgrade(http::request<http::string_body>&& req)
+    {
+        // Our timer dies with this session, the
+        // websocket session arms its own
+        timer_.cancel();
+
+        // Transfer the stream to a new WebSocket session
+        make_websocket_session(
+                derived().release_stream(),
+                app(),
+                timeouts(),
+                std::move(slot_),
+                std::move(req));
+    }
+
+    // Safe methods can run in any order. Other requests run alone:
+    // after the handlers before them and before the ones after them.
+    static
+    bool
+    is_reorderable(http::request<http::string_body> const& req)
+    {
+        return req.method() == http::verb::get ||
+               req.method() == http::verb::head ||
+               req.method() == http::verb::options;
+    }
+
+    void
+    do_dispatch()
+    {
+        wpp::admission_control& admission = _app_reference->get_admission_control();
+        if(! admission.admit_request(read_time_))
+        {
+            // Overloaded: answer with the precomputed 503 and stop reading
+            queue_.send_raw(admission.overloaded_response());
+            return;
+        }
+        ++admitted_;
+
+        // Answered from the response cache, without a handler
+        if(serve_cached(req_))
+            return;
+
+        if(exclusive_ || (! is_reorderable(req_) && running_ > 0))
+        {
+            // Wait for the handlers in flight, on_handler_done resumes
+            barrier_.emplace(std::move(req_));
+            return;
+        }
+        run_handler(std::move(req_));
+    }
+
+    // Write the cached response to a GET or HEAD, if there is one.
+    // A stale one is written while its route runs in the background.
+    bool
+    serve_cached(http::request<http::string_body> const& req)
+    {
+        if(req.version() != 11)
+            return false;
+        auto hit = find_cached_response(app(), req);
+        if(! hit)
+            return false;
+        if(hit.refresh)
+            refresh_cached_response(app(), doc_root(), req);
+        queue_.send_cached(
+                std::move(hit.response),
+                req.keep_alive(),
+                req.method() == http::verb::head,
+                hit.not_modified);
+        maybe_read();
+        return true;
+    }
+
+    // Run the handler on the worker pool. Its response takes the next
+    // slot of the queue and is written when the slots before it are.
+    void
+    run_handler(http::request<http::string_body>&& req)
+    {
+        exclusive_ = ! is_reorderable(req);
+        auto send = queue_.reserve();
+        ++running_;
+        auto r = std::make_shared<http::request<http::string_body>>(std::move(req));
+        _app_reference->blocking_pool().enqueue(
+                [self = derived().shared_from_this(), r, send]()
+                {
+                    handle_request(self->doc_root(), std::move(*r), send, &self->app());
+                });
+
+        // Try to pipeline another request
+        maybe_read();
+    }
+
+    // Read the next request unless the pipeline is at its depth
+    // or waiting for handlers or writes to finish
+    void
+    maybe_read()
+    {
+        if(is_reading_ || exclusive_ || barrier_ || upgrade_ || queue_.is_full())
+            return;
+        do_read();
+    }
+
+    // Called on the strand after a handler sent its response
+    void
+    on_handler_done()
+    {
+        BOOST_ASSERT(running_ > 0);
+        --running_;
+        if(running_ > 0)
+            return;
+        exclusive_ = false;
+
+        if(barrier_)
+        {
+            auto req = std::move(*barrier_);
+            barrier_.reset();
+            return run_handler(std::move(req));
+        }
+
+        // The request that ran alone is done
+        maybe_read();
     }
 
     void
     on_write(boost::system::error_code ec, bool close)
     {
+        // The response of an admitted request is done
+        release_request();
+
         // Happens when the timer closes the socket
         if(ec == boost::asio::error::operation_aborted)
             return;
@@ -741,11 +1660,38 @@ public:
         }
 
         // Inform the queue that a write completed
-        if(queue_.on_write())
+        queue_.on_write();
+
+        // The next response gets the write deadline, and a pipelined
+        // read that waited behind the responses gets its own
+        if(! queue_.empty())
+            timer_.expires_after(timeouts().write);
+        else if(is_reading_)
+            arm_read_timer();
+
+        // The upgrade waited for this response
+        if(upgrade_ && queue_.empty())
         {
-            // Read another request
-            do_read();
+            auto req = std::move(*upgrade_);
+            upgrade_.reset();
+            return do_upgrade(std::move(req));
         }
+
+        // Read another request
+        maybe_read();
+    }
+
+    // Called when the overload response was written
+    void
+    on_shed(boost::system::error_code ec)
+    {
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        if(ec)
+            return fail(ec, "write");
+
+        derived().do_eof();
     }
 };
 
@@ -764,12 +1710,14 @@ public:
             wpp::application& app,
             tcp::socket socket,
             boost::beast::flat_buffer buffer,
-            std::string const& doc_root)
+            std::string const& doc_root,
+            wpp::admission_control::connection_slot slot)
             : http_session<plain_http_session>(
             app,
             socket.get_executor().context(),
             std::move(buffer),
-            doc_root)
+            doc_root,
+            std::move(slot))
             , socket_(std::move(socket))
             , strand_(socket_.get_executor())
     {
@@ -793,9 +1741,8 @@ public:
     void
     run()
     {
-        // Run the timer. The timer is operated
-        // continuously, this simplifies the code.
-        on_timer({});
+        // Connect the session to the timing wheel
+        start_timer();
 
         do_read();
     }
@@ -821,6 +1768,665 @@ public:
     }
 };
 
+#ifdef WPP_ENABLE_HTTP2
+//------------------------------------------------------------------------------
+
+// Prefix of the HTTP/2 connection preface. Clients that know the server
+// speaks HTTP/2 (h2c with prior knowledge) start with it instead of a request.
+static constexpr char http2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// Returns true if what was read so far can only be the HTTP/2 preface
+inline
+bool
+is_http2_preface(boost::asio::const_buffer data)
+{
+    auto const n = (std::min)(data.size(), sizeof(http2_preface) - 1);
+    return n >= 3 && std::memcmp(data.data(), http2_preface, n) == 0;
+}
+
+// Returns true if the TLS handshake selected h2
+inline
+bool
+negotiated_http2(ssl_stream<tcp::socket>& stream)
+{
+    unsigned char const* protocol = nullptr;
+    unsigned int length = 0;
+    SSL_get0_alpn_selected(stream.native_handle(), &protocol, &length);
+    return length == 2 && std::memcmp(protocol, "h2", 2) == 0;
+}
+
+// Handles an HTTP/2 connection, plain (h2c) or over TLS (h2).
+//
+// nghttp2 does the framing, HPACK and flow control. Every stream is turned
+// into the same http::request the HTTP/1 sessions read, and goes through the
+// same handle_request, so routes do not know which protocol was used.
+//
+// Complete streams are dispatched once nghttp2 returns from the bytes read,
+// never from its callbacks, and their handlers run on the worker pool, so a
+// slow handler does not hold up the other streams of the connection.
+template<class Stream>
+class http2_session
+        : public std::enable_shared_from_this<http2_session<Stream>>
+{
+    // A request/response exchange
+    struct stream_data
+    {
+        http::request<http::string_body> req;
+        std::string body;
+        // Set instead of body for a response of the response cache
+        std::shared_ptr<wpp::cached_response const> cached;
+        std::size_t offset = 0;
+        bool admitted = false;
+        bool dispatched = false;
+        // The body went over the limit and is being discarded
+        bool too_large = false;
+    };
+
+    // Passed to handle_request as the send function of a stream.
+    // Handlers may call it from any thread; the response is
+    // submitted on the strand.
+    struct send_response
+    {
+        std::shared_ptr<http2_session> self_;
+        std::int32_t stream_id_;
+
+        template<bool isRequest, class Body, class Fields>
+        void
+        operator()(http::message<isRequest, Body, Fields>&& msg) const
+        {
+            auto m = std::make_shared<http::message<isRequest, Body, Fields>>(std::move(msg));
+            boost::asio::dispatch(
+                    self_->strand_,
+                    [self = self_, stream_id = stream_id_, m]()
+                    {
+                        self->submit(stream_id, std::move(*m));
+                    });
+        }
+    };
+
+    wpp::application& app_;
+    std::string const& doc_root_;
+    Stream stream_;
+    boost::asio::strand<
+            boost::asio::io_context::executor_type> strand_;
+    wpp::timing_wheel::timer timer_;
+    wpp::admission_control::connection_slot slot_;
+    boost::beast::flat_buffer buffer_;
+    std::array<char, 16 * 1024> read_buffer_;
+    std::string write_buffer_;
+    bool writing_ = false;
+    nghttp2_session* session_ = nullptr;
+    std::map<std::int32_t, stream_data> streams_;
+    // Streams completed (or refused) while nghttp2 was reading
+    std::vector<std::int32_t> ready_;
+
+public:
+    http2_session(
+            wpp::application& app,
+            Stream stream,
+            boost::beast::flat_buffer buffer,
+            std::string const& doc_root,
+            wpp::admission_control::connection_slot slot)
+            : app_(app)
+            , doc_root_(doc_root)
+            , stream_(std::move(stream))
+            , strand_(stream_.get_executor())
+            , timer_(stream_.get_executor().context())
+            , slot_(std::move(slot))
+            , buffer_(std::move(buffer))
+    {
+        nghttp2_session_callbacks* callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_begin_headers_callback(
+                callbacks, &http2_session::on_begin_headers);
+        nghttp2_session_callbacks_set_on_header_callback(
+                callbacks, &http2_session::on_header);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(
+                callbacks, &http2_session::on_data_chunk);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(
+                callbacks, &http2_session::on_frame);
+        nghttp2_session_callbacks_set_on_stream_close_callback(
+                callbacks, &http2_session::on_stream_close);
+        nghttp2_session_server_new(&session_, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+    }
+
+    ~http2_session()
+    {
+        for(auto& s : streams_)
+            if(s.second.admitted)
+                app_.get_admission_control().release_request();
+        nghttp2_session_del(session_);
+    }
+
+    void
+    run()
+    {
+        std::weak_ptr<http2_session> weak = this->shared_from_this();
+        timer_.on_expire([weak]()
+        {
+            if(auto self = weak.lock())
+                boost::asio::post(
+                        self->strand_,
+                        std::bind(
+                                &http2_session::on_timer,
+                                self));
+        });
+        timer_.expires_after(app_.timeouts().idle);
+
+        nghttp2_settings_entry settings[] = {
+                {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 100}};
+        nghttp2_submit_settings(
+                session_, NGHTTP2_FLAG_NONE, settings, 1);
+
+        // The detector (h2c) or the handshake (h2) may have read the
+        // beginning of the connection already
+        auto const data = buffer_.data();
+        if(! feed(
+                static_cast<char const*>(data.data()),
+                data.size()))
+            return;
+        buffer_.consume(buffer_.size());
+
+        do_write();
+        do_read();
+    }
+
+private:
+    void
+    do_read()
+    {
+        stream_.async_read_some(
+                boost::asio::buffer(read_buffer_),
+                boost::asio::bind_executor(
+                        strand_,
+                        std::bind(
+                                &http2_session::on_read,
+                                this->shared_from_this(),
+                                std::placeholders::_1,
+                                std::placeholders::_2)));
+    }
+
+    void
+    on_read(boost::system::error_code ec, std::size_t bytes_transferred)
+    {
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        if(ec)
+            return close();
+
+        timer_.expires_after(app_.timeouts().idle);
+
+        if(! feed(read_buffer_.data(), bytes_transferred))
+            return;
+
+        do_write();
+
+        if(nghttp2_session_want_read(session_))
+            do_read();
+    }
+
+    // Give the bytes to nghttp2, which calls back for frames and headers
+    bool
+    feed(char const* data, std::size_t size)
+    {
+        if(size == 0)
+            return true;
+        auto const rv = nghttp2_session_mem_recv(
+                session_,
+                reinterpret_cast<std::uint8_t const*>(data),
+                size);
+        if(rv < 0)
+        {
+            close();
+            return false;
+        }
+
+        // Out of nghttp2 now, so responses can be submitted. Streams are
+        // dispatched through the executor, like the requests of
+        // http_session, so the load shedder sees how long they wait.
+        auto const read_time = wpp::admission_control::clock::now();
+        std::vector<std::int32_t> ready;
+        ready.swap(ready_);
+        for(auto const stream_id : ready)
+            boost::asio::post(
+                    strand_,
+                    std::bind(
+                            &http2_session::dispatch,
+                            this->shared_from_this(),
+                            stream_id,
+                            read_time));
+        return true;
+    }
+
+    // Send the frames nghttp2 has ready, one write at a time
+    void
+    do_write()
+    {
+        if(writing_)
+            return;
+
+        write_buffer_.clear();
+        for(;;)
+        {
+            std::uint8_t const* data = nullptr;
+            auto const n = nghttp2_session_mem_send(session_, &data);
+            if(n < 0)
+                return close();
+            if(n == 0)
+                break;
+            write_buffer_.append(
+                    reinterpret_cast<char const*>(data),
+                    static_cast<std::size_t>(n));
+            // Leave the rest for the next write
+            if(write_buffer_.size() >= 64 * 1024)
+                break;
+        }
+
+        if(write_buffer_.empty())
+        {
+            if(! nghttp2_session_want_read(session_) &&
+               ! nghttp2_session_want_write(session_))
+                close();
+            return;
+        }
+
+        writing_ = true;
+        boost::asio::async_write(
+                stream_,
+                boost::asio::buffer(write_buffer_),
+                boost::asio::bind_executor(
+                        strand_,
+                        std::bind(
+                                &http2_session::on_write,
+                                this->shared_from_this(),
+                                std::placeholders::_1)));
+    }
+
+    void
+    on_write(boost::system::error_code ec)
+    {
+        writing_ = false;
+
+        if(ec == boost::asio::error::operation_aborted)
+            return;
+
+        if(ec)
+            return close();
+
+        do_write();
+    }
+
+    void
+    on_timer()
+    {
+        // The deadline was moved while this was queued
+        if(timer_.armed())
+            return;
+
+        // Say goodbye and give the GOAWAY a moment to leave
+        nghttp2_session_terminate_session(session_, NGHTTP2_NO_ERROR);
+        do_write();
+        close_after_shutdown();
+    }
+
+    void
+    close_after_shutdown()
+    {
+        std::weak_ptr<http2_session> weak = this->shared_from_this();
+        timer_.on_expire([weak]()
+        {
+            if(auto self = weak.lock())
+                boost::asio::post(
+                        self->strand_,
+                        std::bind(
+                                &http2_session::close,
+                                self));
+        });
+        timer_.expires_after(app_.timeouts().shutdown);
+    }
+
+    void
+    close()
+    {
+        timer_.cancel();
+        boost::system::error_code ec;
+        stream_.lowest_layer().close(ec);
+    }
+
+    // Turn a complete stream into a request and dispatch it
+    void
+    dispatch(
+            std::int32_t stream_id,
+            wpp::admission_control::clock::time_point read_time)
+    {
+        auto it = streams_.find(stream_id);
+        if(it == streams_.end() || it->second.dispatched)
+            return;
+        stream_data& s = it->second;
+        s.dispatched = true;
+
+        if(s.too_large)
+        {
+            // The reset stops the client from sending the rest of the
+            // body. The 413 has no body, the reset would cut it short.
+            http::response<http::empty_body> res{
+                    http::status::payload_too_large, s.req.version()};
+            submit(stream_id, std::move(res));
+            nghttp2_submit_rst_stream(
+                    session_, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+            return do_write();
+        }
+        s.req.prepare_payload();
+
+        wpp::admission_control& admission = app_.get_admission_control();
+        if(! admission.admit_request(read_time))
+        {
+            http::response<http::string_body> res{
+                    http::status::service_unavailable, s.req.version()};
+            res.set(http::field::retry_after,
+                    std::to_string(admission.get_settings().retry_after.count()));
+            res.body() = "Service Unavailable";
+            return submit(stream_id, std::move(res));
+        }
+        s.admitted = true;
+
+        if(auto hit = find_cached_response(app_, s.req))
+        {
+            if(hit.refresh)
+                refresh_cached_response(app_, doc_root_, s.req);
+            return submit_cached(
+                    stream_id,
+                    std::move(hit.response),
+                    s.req.method() == http::verb::head,
+                    hit.not_modified);
+        }
+
+        auto r = std::make_shared<http::request<http::string_body>>(std::move(s.req));
+        app_.blocking_pool().enqueue(
+                [self = this->shared_from_this(), r, stream_id]()
+                {
+                    handle_request(
+                            self->doc_root_,
+                            std::move(*r),
+                            send_response{self, stream_id},
+                            &self->app_);
+                });
+    }
+
+    // Submit the response of a stream. Connection-specific headers
+    // do not exist in HTTP/2 and are left out.
+    template<bool isRequest, class Body, class Fields>
+    void
+    submit(std::int32_t stream_id, http::message<isRequest, Body, Fields>&& msg)
+    {
+        auto it = streams_.find(stream_id);
+        if(it == streams_.end())
+            return;
+        stream_data& s = it->second;
+        s.body = body_of(msg);
+        s.offset = 0;
+
+        std::vector<std::string> storage;
+        storage.reserve(2 * 32);
+        storage.push_back(":status");
+        storage.push_back(std::to_string(msg.result_int()));
+        for(auto const& field : msg)
+        {
+            switch(field.name())
+            {
+            case http::field::connection:
+            case http::field::keep_alive:
+            case http::field::proxy_connection:
+            case http::field::transfer_encoding:
+            case http::field::upgrade:
+                continue;
+            default:
+                break;
+            }
+            auto const name = field.name_string();
+            auto const value = field.value();
+            storage.push_back(boost::algorithm::to_lower_copy(std::string(name.data(), name.size())));
+            storage.push_back(std::string(value.data(), value.size()));
+        }
+        std::vector<nghttp2_nv> nva;
+        nva.reserve(storage.size() / 2);
+        for(std::size_t i = 0; i < storage.size(); i += 2)
+            nva.push_back({
+                    reinterpret_cast<std::uint8_t*>(&storage[i][0]),
+                    reinterpret_cast<std::uint8_t*>(&storage[i + 1][0]),
+                    storage[i].size(),
+                    storage[i + 1].size(),
+                    NGHTTP2_NV_FLAG_NONE});
+
+        nghttp2_data_provider provider;
+        provider.source.ptr = &s;
+        provider.read_callback = &http2_session::read_body;
+        nghttp2_submit_response(
+                session_,
+                stream_id,
+                nva.data(),
+                nva.size(),
+                s.body.empty() ? nullptr : &provider);
+        do_write();
+    }
+
+    // Submit a response of the response cache. Its header fields are
+    // already lowercase and its body is read from the shared entry.
+    void
+    submit_cached(
+            std::int32_t stream_id,
+            std::shared_ptr<wpp::cached_response const> response,
+            bool head_only,
+            bool not_modified)
+    {
+        auto it = streams_.find(stream_id);
+        if(it == streams_.end())
+            return;
+        stream_data& s = it->second;
+        s.cached = std::move(response);
+        s.offset = 0;
+
+        auto const nv = [](std::string const& name, std::string const& value)
+        {
+            return nghttp2_nv{
+                    const_cast<std::uint8_t*>(reinterpret_cast<std::uint8_t const*>(name.data())),
+                    const_cast<std::uint8_t*>(reinterpret_cast<std::uint8_t const*>(value.data())),
+                    name.size(),
+                    value.size(),
+                    NGHTTP2_NV_FLAG_NONE};
+        };
+        static std::string const status_name = ":status";
+        static std::string const length_name = "content-length";
+        static std::string const etag_name = "etag";
+        static std::string const not_modified_status = "304";
+        std::string const status = std::to_string(s.cached->status);
+        std::string const length = std::to_string(s.cached->body.size());
+        std::vector<nghttp2_nv> nva;
+        nva.reserve(s.cached->headers.size() + 2);
+        if(not_modified)
+        {
+            nva.push_back(nv(status_name, not_modified_status));
+            nva.push_back(nv(etag_name, s.cached->etag));
+        }
+        else
+        {
+            nva.push_back(nv(status_name, status));
+            for(auto const& h : s.cached->headers)
+                nva.push_back(nv(h.first, h.second));
+            nva.push_back(nv(length_name, length));
+        }
+
+        nghttp2_data_provider provider;
+        provider.source.ptr = &s;
+        provider.read_callback = &http2_session::read_body;
+        nghttp2_submit_response(
+                session_,
+                stream_id,
+                nva.data(),
+                nva.size(),
+                head_only || not_modified || s.cached->body.empty() ? nullptr : &provider);
+        do_write();
+    }
+
+    // Serialize the body of any beast message into a string
+    template<bool isRequest, class Body, class Fields>
+    static
+    std::string
+    body_of(http::message<isRequest, Body, Fields>& msg)
+    {
+        std::string out;
+        msg.chunked(false);
+        http::serializer<isRequest, Body, Fields> sr{msg};
+        sr.split(true);
+        boost::system::error_code ec;
+        while(! ec && ! sr.is_header_done())
+            sr.next(ec, [&sr](boost::system::error_code&, auto const& buffers)
+            {
+                sr.consume(boost::asio::buffer_size(buffers));
+            });
+        while(! ec && ! sr.is_done())
+            sr.next(ec, [&sr, &out](boost::system::error_code&, auto const& buffers)
+            {
+                out += boost::beast::buffers_to_string(buffers);
+                sr.consume(boost::asio::buffer_size(buffers));
+            });
+        return out;
+    }
+
+    // nghttp2 callbacks
+
+    static
+    int
+    on_begin_headers(
+            nghttp2_session*,
+            nghttp2_frame const* frame,
+            void* user_data)
+    {
+        auto& self = *static_cast<http2_session*>(user_data);
+        if(frame->hd.type == NGHTTP2_HEADERS &&
+           frame->headers.cat == NGHTTP2_HCAT_REQUEST)
+        {
+            stream_data& s = self.streams_[frame->hd.stream_id];
+            s.req.version(20);
+        }
+        return 0;
+    }
+
+    static
+    int
+    on_header(
+            nghttp2_session*,
+            nghttp2_frame const* frame,
+            std::uint8_t const* name, std::size_t namelen,
+            std::uint8_t const* value, std::size_t valuelen,
+            std::uint8_t,
+            void* user_data)
+    {
+        auto& self = *static_cast<http2_session*>(user_data);
+        auto it = self.streams_.find(frame->hd.stream_id);
+        if(it == self.streams_.end())
+            return 0;
+        auto& req = it->second.req;
+        boost::beast::string_view const n(reinterpret_cast<char const*>(name), namelen);
+        boost::beast::string_view const v(reinterpret_cast<char const*>(value), valuelen);
+        if(n == ":method")
+            req.method_string(v);
+        else if(n == ":path")
+            req.target(v);
+        else if(n == ":authority")
+            req.set(http::field::host, v);
+        else if(! n.empty() && n.front() != ':')
+            req.insert(n, v);
+        return 0;
+    }
+
+    static
+    int
+    on_data_chunk(
+            nghttp2_session*,
+            std::uint8_t,
+            std::int32_t stream_id,
+            std::uint8_t const* data, std::size_t len,
+            void* user_data)
+    {
+        auto& self = *static_cast<http2_session*>(user_data);
+        auto it = self.streams_.find(stream_id);
+        if(it == self.streams_.end() || it->second.too_large)
+            return 0;
+        auto& body = it->second.req.body();
+        if(body.size() + len > self.app_.body_limit())
+        {
+            // Answer 413 right away and drop the rest of the body
+            it->second.too_large = true;
+            std::string().swap(body);
+            self.ready_.push_back(stream_id);
+            return 0;
+        }
+        body.append(reinterpret_cast<char const*>(data), len);
+        return 0;
+    }
+
+    static
+    int
+    on_frame(
+            nghttp2_session*,
+            nghttp2_frame const* frame,
+            void* user_data)
+    {
+        auto& self = *static_cast<http2_session*>(user_data);
+        if((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+           (frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+        {
+            // Dispatched when nghttp2_session_mem_recv returns
+            auto it = self.streams_.find(frame->hd.stream_id);
+            if(it != self.streams_.end() && ! it->second.too_large)
+                self.ready_.push_back(frame->hd.stream_id);
+        }
+        return 0;
+    }
+
+    static
+    int
+    on_stream_close(
+            nghttp2_session*,
+            std::int32_t stream_id,
+            std::uint32_t,
+            void* user_data)
+    {
+        auto& self = *static_cast<http2_session*>(user_data);
+        auto it = self.streams_.find(stream_id);
+        if(it == self.streams_.end())
+            return 0;
+        if(it->second.admitted)
+            self.app_.get_admission_control().release_request();
+        self.streams_.erase(it);
+        return 0;
+    }
+
+    static
+    ssize_t
+    read_body(
+            nghttp2_session*,
+            std::int32_t,
+            std::uint8_t* buf, std::size_t length,
+            std::uint32_t* data_flags,
+            nghttp2_data_source* source,
+            void*)
+    {
+        auto& s = *static_cast<stream_data*>(source->ptr);
+        std::string const& body = s.cached ? s.cached->body : s.body;
+        auto const n = (std::min)(length, body.size() - s.offset);
+        std::memcpy(buf, body.data() + s.offset, n);
+        s.offset += n;
+        if(s.offset == body.size())
+            *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        return static_cast<ssize_t>(n);
+    }
+};
+#endif
+
 // Handles an SSL HTTP connection
 class ssl_http_session
         : public http_session<ssl_http_session>
@@ -829,6 +2435,10 @@ class ssl_http_session
     ssl_stream<tcp::socket> stream_;
     boost::asio::strand<
             boost::asio::io_context::executor_type> strand_;
+    // Set while the handshake runs on the handshake threads
+    boost::optional<boost::asio::strand<
+            boost::asio::io_context::executor_type>> handshake_strand_;
+    std::chrono::steady_clock::time_point handshake_start_;
     bool eof_ = false;
 
 public:
@@ -838,12 +2448,14 @@ public:
             tcp::socket socket,
             ssl::context& ctx,
             boost::beast::flat_buffer buffer,
-            std::string const& doc_root)
+            std::string const& doc_root,
+            wpp::admission_control::connection_slot slot)
             : http_session<ssl_http_session>(
             app,
             socket.get_executor().context(),
             std::move(buffer),
-            doc_root)
+            doc_root,
+            std::move(slot))
             , stream_(std::move(socket), ctx)
             , strand_(stream_.get_executor())
     {
@@ -867,12 +2479,47 @@ public:
     void
     run()
     {
-        // Run the timer. The timer is operated
-        // continuously, this simplifies the code.
-        on_timer({});
+        // Connect the session to the timing wheel
+        start_timer();
 
         // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
+        timer_.expires_after(timeouts().handshake);
+
+        handshake_start_ = std::chrono::steady_clock::now();
+
+        // The whole handshake runs on the handshake threads: it is started
+        // there, so the first step (with the buffered ClientHello) does the
+        // key exchange off the I/O threads, and the intermediate steps run
+        // on the executor of its handler. Until it is over, only the
+        // handshake strand touches the stream. We come back to our strand
+        // once it is over.
+        if(auto* handshake_context = app().get_tls().handshake_context())
+        {
+            handshake_strand_.emplace(handshake_context->get_executor());
+            boost::asio::post(
+                    *handshake_strand_,
+                    [self = shared_from_this(), handshake_strand = *handshake_strand_]()
+                    {
+                        self->stream_.async_handshake(
+                                ssl::stream_base::server,
+                                self->buffer_.data(),
+                                boost::asio::bind_executor(
+                                        handshake_strand,
+                                        [self](
+                                                boost::system::error_code ec,
+                                                std::size_t bytes_used)
+                                        {
+                                            boost::asio::post(
+                                                    self->strand_,
+                                                    [self, ec, bytes_used]()
+                                                    {
+                                                        self->handshake_strand_.reset();
+                                                        self->on_handshake(ec, bytes_used);
+                                                    });
+                                        }));
+                    });
+            return;
+        }
 
         // Perform the SSL handshake
         // Note, this is the buffered version of the handshake.
@@ -892,6 +2539,11 @@ public:
             boost::system::error_code ec,
             std::size_t bytes_used)
     {
+        app().get_tls().record_handshake(
+                stream_.native_handle(),
+                !ec,
+                std::chrono::steady_clock::now() - handshake_start_);
+
         // Happens when the handshake times out
         if(ec == boost::asio::error::operation_aborted)
             return;
@@ -902,6 +2554,21 @@ public:
         // Consume the portion of the buffer used by the handshake
         buffer_.consume(bytes_used);
 
+#ifdef WPP_ENABLE_HTTP2
+        // The client chose h2 during the handshake
+        if(negotiated_http2(stream_))
+        {
+            timer_.cancel();
+            std::make_shared<http2_session<ssl_stream<tcp::socket>>>(
+                    app(),
+                    release_stream(),
+                    std::move(buffer_),
+                    doc_root(),
+                    std::move(slot_))->run();
+            return;
+        }
+#endif
+
         do_read();
     }
 
@@ -911,7 +2578,7 @@ public:
         eof_ = true;
 
         // Set the timer
-        timer_.expires_after(std::chrono::seconds(15));
+        timer_.expires_after(timeouts().shutdown);
 
         // Perform the SSL shutdown
         stream_.async_shutdown(
@@ -939,14 +2606,28 @@ public:
     void
     do_timeout()
     {
+        // The handshake is still running on the handshake threads,
+        // the socket has to be closed from there
+        if(handshake_strand_)
+        {
+            boost::asio::post(
+                    *handshake_strand_,
+                    [self = shared_from_this()]()
+                    {
+                        boost::system::error_code ec;
+                        self->stream_.next_layer().close(ec);
+                    });
+            return;
+        }
+
         // If this is true it means we timed out performing the shutdown
         if(eof_)
+        {
+            boost::system::error_code ec;
+            stream_.next_layer().close(ec);
             return;
+        }
 
-        // Start the timer again
-        timer_.expires_at(
-                (std::chrono::steady_clock::time_point::max)());
-        on_timer({});
         do_eof();
     }
 };
@@ -963,19 +2644,23 @@ class detect_session : public std::enable_shared_from_this<detect_session>
             boost::asio::io_context::executor_type> strand_;
     std::string const& doc_root_;
     boost::beast::flat_buffer buffer_;
+    wpp::admission_control::connection_slot slot_;
+    wpp::timing_wheel::timer timer_;
 
 public:
-    explicit
     detect_session(
             wpp::application& app,
             tcp::socket socket,
             ssl::context& ctx,
-            std::string const& doc_root)
+            std::string const& doc_root,
+            wpp::admission_control::connection_slot slot)
             : app_(app)
             , socket_(std::move(socket))
             , ctx_(ctx)
             , strand_(socket_.get_executor())
             , doc_root_(doc_root)
+            , slot_(std::move(slot))
+            , timer_(socket_.get_executor().context())
     {
     }
 
@@ -983,6 +2668,19 @@ public:
     void
     run()
     {
+        // Clients that connect and send nothing are dropped
+        std::weak_ptr<detect_session> weak = shared_from_this();
+        timer_.on_expire([weak]()
+        {
+            if(auto self = weak.lock())
+                boost::asio::post(
+                        self->strand_,
+                        std::bind(
+                                &detect_session::on_timer,
+                                self));
+        });
+        timer_.expires_after(app_.timeouts().handshake);
+
         async_detect_ssl(
                 socket_,
                 buffer_,
@@ -996,9 +2694,19 @@ public:
 
     }
 
+    void
+    on_timer()
+    {
+        boost::system::error_code ec;
+        socket_.close(ec);
+    }
+
     void
     on_detect(boost::system::error_code ec, boost::tribool result)
     {
+        // The sessions arm their own timers
+        timer_.cancel();
+
         if(ec)
             return fail(ec, "detect");
 
@@ -1010,16 +2718,32 @@ public:
                     std::move(socket_),
                     ctx_,
                     std::move(buffer_),
-                    doc_root_)->run();
+                    doc_root_,
+                    std::move(slot_))->run();
+            return;
+        }
+
+#ifdef WPP_ENABLE_HTTP2
+        // h2c with prior knowledge
+        if(app_.http2() && is_http2_preface(buffer_.data()))
+        {
+            std::make_shared<http2_session<tcp::socket>>(
+                    app_,
+                    std::move(socket_),
+                    std::move(buffer_),
+                    doc_root_,
+                    std::move(slot_))->run();
             return;
         }
+#endif
 
         // Launch plain session
         std::make_shared<plain_http_session>(
                 app_,
                 std::move(socket_),
                 std::move(buffer_),
-                doc_root_)->run();
+                doc_root_,
+                std::move(slot_))->run();
     }
 };
 
@@ -1032,6 +2756,8 @@ class listener : public std::enable_shared_from_this<listener>
     tcp::acceptor acceptor_;
     tcp::socket socket_;
     std::string const& doc_root_;
+    // Holds the acceptor back when the accept rate is exceeded
+    boost::asio::steady_timer accept_timer_;
 
 public:
 
@@ -1047,9 +2773,17 @@ public:
             , socket_(ioc)
 
             , doc_root_(doc_root)
+            , accept_timer_(ioc)
     {
         boost::system::error_code ec;
 
+        // Session cache, ticket keys, cipher preference and ALPN
+#ifdef WPP_ENABLE_HTTP2
+        app_.get_tls().setup(ctx_, app_.http2());
+#else
+        app_.get_tls().setup(ctx_);
+#endif
+
         // Open the acceptor
         acceptor_.open(endpoint.protocol(), ec);
         if(ec)
@@ -1096,6 +2830,19 @@ public:
     void
     do_accept()
     {
+        // Leave the connections in the backlog if we are accepting too fast
+        auto const delay = app_.get_admission_control().accept_delay();
+        if(delay > std::chrono::steady_clock::duration::zero())
+        {
+            accept_timer_.expires_after(delay);
+            accept_timer_.async_wait(
+                    std::bind(
+                            &listener::on_accept_delay,
+                            shared_from_this(),
+                            std::placeholders::_1));
+            return;
+        }
+
         acceptor_.async_accept(
                 socket_,
                 std::bind(
@@ -1111,7 +2858,7 @@ public:
         {
             fail(ec, "accept");
         }
-        else
+        else if(auto slot = app_.get_admission_control().try_acquire_connection())
         {
             // Create the detector http_session and run it
             std::make_shared<detect_session>(
@@ -1119,15 +2866,58 @@ public:
                     app_,
                     std::move(socket_),
                     ctx_,
-                    doc_root_)->run();
+                    doc_root_,
+                    std::move(slot))->run();
+        }
+        else
+        {
+            // Too many connections: close it before spending anything on it
+            boost::system::error_code ignored;
+            socket_.close(ignored);
         }
 
         // Accept another connection
         do_accept();
     }
 
+    void
+    on_accept_delay(boost::system::error_code ec)
+    {
+        if(ec)
+            return fail(ec, "accept_delay");
+
+        do_accept();
+    }
+
 };
 
+// Listen on the port of the application. TLS connections use the
+// certificate of secure(); the listener adds the TLS settings.
+inline
+wpp::application&
+wpp::application::start()
+{
+    std::cout << this->web_root_path() << std::endl;
+    prepare_routes();
+
+    ssl::context ctx{ssl::context::tls_server};
+    if(this->secure())
+    {
+        ctx.use_certificate_chain_file(this->_certificate_file);
+        ctx.use_private_key_file(this->_key_file, ssl::context::pem);
+    }
+
+    std::make_shared<listener>(
+            *this,
+            *this->_io_context,
+            ctx,
+            tcp::endpoint{tcp::v4(), static_cast<unsigned short>(this->_port)},
+            this->_assets_root_path)->run();
+
+    run_io_context();
+    return *this;
+}
+
 //};
 
 
@@ -0,0 +1,210 @@
+//
+// I/O backend of the server (epoll or io_uring) and asynchronous file reads.
+//
+
+#ifndef WPP_IO_BACKEND_H
+#define WPP_IO_BACKEND_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <strings.h>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+
+// Building with WPP_ENABLE_IO_URING defines BOOST_ASIO_HAS_IO_URING and
+// BOOST_ASIO_DISABLE_EPOLL, so asio runs accept, recv/send, timers and file
+// operations through io_uring. Asio collects the submissions of all
+// connections of an io_context and submits them as one batch per turn of
+// the event loop. File support needs Boost >= 1.78 (BOOST_ASIO_HAS_FILE).
+#ifdef BOOST_ASIO_HAS_FILE
+#include <boost/asio/random_access_file.hpp>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "chunked_writer.h"
+
+namespace wpp {
+
+    // Name of the backend the server was built with
+    inline const char *io_backend_name() {
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+        return "io_uring";
+#elif defined(BOOST_ASIO_HAS_IO_URING)
+        return "epoll+io_uring files";
+#else
+        return "epoll";
+#endif
+    }
+
+    // Content-Type of a static file by its extension
+    inline const char *asset_content_type(const std::string &path) {
+        static const char *const types[][2] = {
+                {".html", "text/html; charset=utf-8"},
+                {".htm", "text/html; charset=utf-8"},
+                {".css", "text/css; charset=utf-8"},
+                {".js", "application/javascript"},
+                {".json", "application/json"},
+                {".txt", "text/plain; charset=utf-8"},
+                {".xml", "application/xml"},
+                {".svg", "image/svg+xml"},
+                {".png", "image/png"},
+                {".jpg", "image/jpeg"},
+                {".jpeg", "image/jpeg"},
+                {".gif", "image/gif"},
+                {".ico", "image/vnd.microsoft.icon"},
+                {".webp", "image/webp"},
+                {".woff", "font/woff"},
+                {".woff2", "font/woff2"},
+                {".pdf", "application/pdf"},
+        };
+        const size_t dot = path.rfind('.');
+        if (dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+            for (const auto &t : types) {
+                if (strcasecmp(path.c_str() + dot, t[0]) == 0) {
+                    return t[1];
+                }
+            }
+        }
+        return "application/octet-stream";
+    }
+
+    // A file read with the backend of the io_context. With io_uring the reads
+    // are submitted to the ring and do not block the thread. Otherwise they
+    // are plain pread calls on the executor, as blocking as reading the file
+    // in the route.
+    class file_reader : public std::enable_shared_from_this<file_reader> {
+        public:
+            using handler = std::function<void(const boost::system::error_code &, size_t)>;
+
+            file_reader(boost::asio::io_context &ioc, const std::string &path)
+                    : ioc_(ioc)
+#ifdef BOOST_ASIO_HAS_FILE
+                    , file_(ioc)
+#endif
+            {
+#ifdef BOOST_ASIO_HAS_FILE
+                boost::system::error_code ec;
+                file_.open(path, boost::asio::random_access_file::read_only, ec);
+                if (!ec) {
+                    size_ = file_.size(ec);
+                }
+                open_ = !ec;
+#else
+                fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                struct stat st{};
+                open_ = fd_ >= 0 && ::fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+                size_ = open_ ? static_cast<std::uint64_t>(st.st_size) : 0;
+#endif
+            }
+
+            file_reader(const file_reader &) = delete;
+            file_reader &operator=(const file_reader &) = delete;
+
+            ~file_reader() {
+#ifndef BOOST_ASIO_HAS_FILE
+                if (fd_ >= 0) {
+                    ::close(fd_);
+                }
+#endif
+            }
+
+            bool is_open() const {
+                return open_;
+            }
+
+            std::uint64_t size() const {
+                return size_;
+            }
+
+            // Read up to n bytes at offset. The handler runs on the executor.
+            void async_read_at(std::uint64_t offset, char *data, size_t n, handler h) {
+#ifdef BOOST_ASIO_HAS_FILE
+                file_.async_read_some_at(offset, boost::asio::buffer(data, n),
+                                         [self = shared_from_this(), h = std::move(h)](
+                                                 const boost::system::error_code &ec, size_t read) {
+                                             h(ec, read);
+                                         });
+#else
+                boost::asio::post(ioc_, [self = shared_from_this(), offset, data, n, h = std::move(h)]() {
+                    const ssize_t read = ::pread(self->fd_, data, n, static_cast<off_t>(offset));
+                    if (read < 0) {
+                        h(boost::system::error_code(errno, boost::system::system_category()), 0);
+                    } else if (read == 0 && n != 0) {
+                        h(boost::asio::error::eof, 0);
+                    } else {
+                        h(boost::system::error_code{}, static_cast<size_t>(read));
+                    }
+                });
+#endif
+            }
+
+        private:
+            boost::asio::io_context &ioc_;
+#ifdef BOOST_ASIO_HAS_FILE
+            boost::asio::random_access_file file_;
+#else
+            int fd_{-1};
+#endif
+            bool open_{false};
+            std::uint64_t size_{0};
+    };
+
+    // Stream a static file through a chunked_writer. The next block is read
+    // while the previous one is being sent, and reading pauses while the
+    // writer is above its watermark.
+    //
+    //     auto file = std::make_shared<wpp::file_reader>(app.io_context(), path);
+    //     if (file->is_open()) {
+    //         wpp::send_file(req.stream(), file);
+    //     }
+    inline void send_file(std::shared_ptr<chunked_writer> writer, std::shared_ptr<file_reader> file,
+                          size_t block_size = 128 * 1024) {
+        struct transfer : std::enable_shared_from_this<transfer> {
+            std::shared_ptr<chunked_writer> writer;
+            std::shared_ptr<file_reader> file;
+            std::vector<char> block;
+            std::uint64_t offset{0};
+
+            void read_next() {
+                if (offset >= file->size() || !writer->good()) {
+                    writer->end();
+                    return;
+                }
+                file->async_read_at(offset, block.data(), block.size(),
+                                    [self = shared_from_this()](const boost::system::error_code &ec, size_t n) {
+                                        self->on_read(ec, n);
+                                    });
+            }
+
+            void on_read(const boost::system::error_code &ec, size_t n) {
+                if (ec || n == 0) {
+                    writer->end();
+                    return;
+                }
+                offset += n;
+                if (writer->write(block.data(), n)) {
+                    read_next();
+                } else {
+                    writer->on_writable([self = shared_from_this()]() { self->read_next(); });
+                }
+            }
+        };
+        auto t = std::make_shared<transfer>();
+        t->writer = std::move(writer);
+        t->file = std::move(file);
+        t->block.resize(block_size);
+        t->read_next();
+    }
+
+}
+
+#endif //WPP_IO_BACKEND_H
@@ -11,6 +11,7 @@
 #include <boost/algorithm/string/trim.hpp>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 
 #include "utility.hpp"
@@ -19,7 +20,10 @@
 #include "query_string.h"
 #include "routing_parameters.h"
 #include "encryption.h"
+#include "access_control.h"
 #include "UaParser.h"
+#include "async.h"
+#include "websocket.h"
 #include "application.hpp"
 
 
@@ -28,6 +32,7 @@ namespace wpp {
     class application;
     class response;
     class guard;
+    struct websocket_endpoint;
 
     using reque = boost::beast::http::request<boost::beast::http::string_body>;
     using respo = boost::beast::http::response<boost::beast::http::string_body>;
@@ -56,8 +61,22 @@ namespace wpp {
 
         application *parent_application{nullptr};
         wpp::guard *auth{nullptr};
+        // The user resolved for this request by application::resolve_user
+        std::shared_ptr<const wpp::principal> _principal;
         json session_data;
+        // Whether session_data changed since it was loaded, so the cookie
+        // is only sealed and sent again when it has to be
+        bool _session_dirty{false};
+        // ID of the session in the server-side session store, if any
+        std::string _session_id;
+        // The session gets a new ID when it is saved
+        bool _session_regenerate{false};
         json view_bag;
+        // Set by the server while the request is being handled
+        std::weak_ptr<completion::state> _completion;
+        bool _deferred{false};
+        // Set by the handler of a WebSocket route when the upgrade is accepted
+        std::shared_ptr<const websocket_endpoint> _websocket;
 
         request() : method_requested(method::get) {}
 
@@ -88,8 +107,59 @@ namespace wpp {
             return get_header_value(key,default_);
         }
 
+        // Whatever the case of the name: HTTP/2 clients send it in lowercase
+        std::string get_header_value_icase(const std::string &key, std::string default_ = "") const {
+            for (auto &h : headers) {
+                if (boost::iequals(h.first, key)) {
+                    return h.second;
+                }
+            }
+            return default_;
+        }
+
         void parse_cookies();
 
+        ///////////////////////////////////////////////////////////////
+        //                    ASYNCHRONOUS RESPONSE                  //
+        ///////////////////////////////////////////////////////////////
+
+        // The response will not be sent when the handler returns, but when
+        // the completion is called. The request and the response stay alive
+        // until then.
+        completion defer() {
+            _deferred = true;
+            return completion(_completion.lock());
+        }
+
+        bool deferred() const {
+            return _deferred;
+        }
+
+        // Stream the body with chunked encoding instead of sending res.body.
+        // Status and headers are taken from the response on the first write.
+        // Returns nullptr if the request is not running inside the server.
+        std::shared_ptr<chunked_writer> stream() {
+            std::shared_ptr<completion::state> state = _completion.lock();
+            chunked_writer::sink s = take_connection();
+            if (!state || !s.write) {
+                return nullptr;
+            }
+            return std::make_shared<chunked_writer>(*state->executor, std::move(s));
+        }
+
+        // Lower level: the raw connection, for writers such as sse_stream.
+        // The sink is empty if the request is not running inside the server.
+        chunked_writer::sink take_connection() {
+            _deferred = true;
+            std::shared_ptr<completion::state> state = _completion.lock();
+            if (!state || !state->open_sink) {
+                return {};
+            }
+            // the writer sends the response from now on
+            state->done = true;
+            return state->open_sink();
+        }
+
         ///////////////////////////////////////////////////////////////
         //                    COOKIES                                //
         ///////////////////////////////////////////////////////////////
@@ -326,22 +396,59 @@ namespace wpp {
             return session_data;
         }
 
+        bool session_modified() const {
+            return _session_dirty;
+        }
+
+        // For changes made to session_data directly
+        request& session_mark_modified() {
+            _session_dirty = true;
+            return *this;
+        }
+
+        // Called once the session is loaded: data flashed by the last
+        // request is dropped and data flashed by the one before becomes
+        // available to this one
+        request& session_age_flashed() {
+            bool aged = session_data.erase("flashed_data_from_last_request") > 0;
+            auto flashed = session_data.find("flashed_data_from_this_request");
+            if (flashed != session_data.end()) {
+                session_data["flashed_data_from_last_request"] = std::move(*flashed);
+                session_data.erase("flashed_data_from_this_request");
+                aged = true;
+            }
+            if (aged) {
+                _session_dirty = true;
+            }
+            return *this;
+        }
+
         // Modifying methods for insertion
         request& session_put(const std::string &key, const json& value) {
             if (key!="id"){
                 session_data[key] = value;
+                _session_dirty = true;
             }
             return *this;
         }
 
         request& session_regenerate(response& res);
 
+        // Give the session a new ID when it is saved, as after a login,
+        // so an ID the client had before is worthless after it
+        request& session_regenerate() {
+            _session_regenerate = true;
+            _session_dirty = true;
+            return *this;
+        }
+
         request& session_flash(const std::string &key, const json& value) {
             json::iterator iter = session_data.find("flashed_data_from_this_request");
             if (iter == session_data.end()){
                 session_data["flashed_data_from_this_request"] = json::object();
             }
             session_data["flashed_data_from_this_request"][key] = value;
+            _session_dirty = true;
             return *this;
         }
 
@@ -364,6 +471,7 @@ namespace wpp {
                      iterobj != iter->end(); ++iterobj) {
                     (*iter)[iterobj.key()] = iterobj.value();
                 }
+                _session_dirty = true;
             }
             return *this;
         }
@@ -385,6 +493,7 @@ namespace wpp {
                             if (session_data["flashed_data_from_last_request"].find(*iter_keep) != session_data["flashed_data_from_last_request"].end()){
                                 const string field_name = *iter_keep;
                                 (*iter)[field_name] = session_data["flashed_data_from_last_request"][field_name];
+                                _session_dirty = true;
                             }
                         }
                     }
@@ -404,12 +513,15 @@ namespace wpp {
                 iter = session_data.find(key);
             }
             iter->push_back(value);
+            _session_dirty = true;
             return *this;
         }
 
         // Modifying methods for removal
         request& session_erase(const std::string &key){
-            session_data.erase(key);
+            if (session_data.erase(key)) {
+                _session_dirty = true;
+            }
             return *this;
         }
 
@@ -423,6 +535,7 @@ namespace wpp {
             if (iter != session_data.end()){
                 result = std::move(*iter);
                 session_data.erase(key);
+                _session_dirty = true;
             } else {
                 result = default_;
             }
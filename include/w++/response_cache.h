@@ -0,0 +1,489 @@
+//
+// Cache of complete responses for the http server.
+//
+
+#ifndef WPP_RESPONSE_CACHE_H
+#define WPP_RESPONSE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/beast/http/status.hpp>
+
+namespace wpp {
+
+    // A response as the cache keeps it: status, header fields already
+    // serialized and the body. It is never modified once stored, so hits
+    // on any thread share it and are written straight from it.
+    struct cached_response {
+        using clock = std::chrono::steady_clock;
+
+        int status{200};
+        // Header fields one by one with lowercase names, for HTTP/2
+        std::vector<std::pair<std::string, std::string>> headers;
+        // Status line and header fields of HTTP/1.1, with Content-Length.
+        // The Connection field and the blank line are added when written.
+        std::string head;
+        std::string body;
+        // ETag of the response, if it has one, and the head of the 304
+        // sent to clients that already have it
+        std::string etag;
+        std::string not_modified_head;
+        std::vector<std::string> tags;
+        clock::time_point fresh_until;
+        clock::time_point stale_until;
+        // Set by the first request that finds it stale
+        mutable std::atomic<bool> refreshing{false};
+
+        size_t bytes() const {
+            size_t n = head.size() + body.size() + etag.size() + not_modified_head.size();
+            for (auto &h : headers) {
+                n += h.first.size() + h.second.size();
+            }
+            return n;
+        }
+    };
+
+    // Responses of the routes that use the "cache" middleware, keyed by
+    // host, path and query. Hits are answered by the server before routing,
+    // so neither middleware nor handler run for them.
+    //
+    // A route can vary its response on request headers or cookies: the
+    // names are kept for the path and the values become part of the key.
+    // Requests with an Authorization header or one of the bypass cookies
+    // always go to the handler, and responses that set cookies or are
+    // marked private are never stored. The session cookie of the
+    // application is always a bypass cookie, and the middleware never
+    // stores the response to a request with a session or a user.
+    //
+    // After their ttl, responses are served stale for up to
+    // stale_while_revalidate while one request refreshes them in the
+    // background. Responses can be dropped by path or by tag, which a
+    // route sets in its parameter or in a Surrogate-Key header.
+    class response_cache {
+        public:
+            using clock = cached_response::clock;
+
+            struct settings {
+                size_t max_entries{10000};
+                size_t max_bytes{64 << 20};
+                std::chrono::seconds ttl{60};
+                std::chrono::seconds stale_while_revalidate{0};
+                // headers and cookies every cached route varies on
+                std::vector<std::string> vary;
+                std::vector<std::string> vary_cookies;
+                // requests with one of these cookies are not served from the
+                // cache. The application adds its session cookie.
+                std::vector<std::string> bypass_cookies;
+            };
+
+            // The settings of a route: "cache" or "cache:60", or items like
+            // "cache:ttl=60,swr=30,tag=posts,vary=Accept-Language,vary_cookie=locale"
+            struct policy {
+                std::chrono::seconds ttl{60};
+                std::chrono::seconds stale_while_revalidate{0};
+                std::vector<std::string> vary;
+                std::vector<std::string> vary_cookies;
+                std::vector<std::string> tags;
+
+                static policy parse(const std::string &parameter, const settings &defaults) {
+                    policy p;
+                    p.ttl = defaults.ttl;
+                    p.stale_while_revalidate = defaults.stale_while_revalidate;
+                    p.vary = defaults.vary;
+                    p.vary_cookies = defaults.vary_cookies;
+                    size_t begin = 0;
+                    while (begin < parameter.size()) {
+                        size_t end = parameter.find(',', begin);
+                        if (end == std::string::npos) {
+                            end = parameter.size();
+                        }
+                        const std::string item = parameter.substr(begin, end - begin);
+                        begin = end + 1;
+                        const size_t eq = item.find('=');
+                        const std::string name = eq == std::string::npos ? "ttl" : item.substr(0, eq);
+                        const std::string value = eq == std::string::npos ? item : item.substr(eq + 1);
+                        if (name == "ttl") {
+                            p.ttl = std::chrono::seconds(std::atol(value.c_str()));
+                        } else if (name == "swr") {
+                            p.stale_while_revalidate = std::chrono::seconds(std::atol(value.c_str()));
+                        } else if (name == "tag") {
+                            p.tags.push_back(value);
+                        } else if (name == "vary") {
+                            p.vary.push_back(value);
+                        } else if (name == "vary_cookie") {
+                            p.vary_cookies.push_back(value);
+                        }
+                    }
+                    return p;
+                }
+            };
+
+            struct hit {
+                std::shared_ptr<const cached_response> response;
+                // the ttl has passed
+                bool stale{false};
+                // this request should refresh it in the background
+                bool refresh{false};
+                // the client has it: answer 304
+                bool not_modified{false};
+
+                explicit operator bool() const {
+                    return response != nullptr;
+                }
+            };
+
+            struct statistics {
+                size_t hits;
+                size_t stale_hits;
+                size_t misses;
+                size_t stores;
+                size_t evictions;
+                size_t entries;
+                size_t bytes;
+            };
+
+            response_cache() {
+                configure(settings());
+            }
+
+            response_cache(const response_cache &) = delete;
+            response_cache &operator=(const response_cache &) = delete;
+
+            // Before the server starts: requests read the settings without a lock
+            void configure(settings s) {
+                settings_ = std::move(s);
+                max_entries_ = std::max<size_t>(1, settings_.max_entries / shard_count);
+                max_bytes_ = std::max<size_t>(1, settings_.max_bytes / shard_count);
+            }
+
+            // Before the server starts, as configure()
+            void bypass_cookie(const std::string &name) {
+                if (std::find(settings_.bypass_cookies.begin(), settings_.bypass_cookies.end(), name) ==
+                    settings_.bypass_cookies.end()) {
+                    settings_.bypass_cookies.push_back(name);
+                }
+            }
+
+            const settings &get_settings() const {
+                return settings_;
+            }
+
+            // Nothing stored: the server does not even build a key
+            bool empty() const {
+                return entries_.load(std::memory_order_relaxed) == 0;
+            }
+
+            // header(name) returns the value of a request header, or an empty
+            // string, as anything with data() and size()
+            template<class Header>
+            bool bypass(Header &&header) const {
+                if (!header("Authorization").empty()) {
+                    return true;
+                }
+                if (settings_.bypass_cookies.empty()) {
+                    return false;
+                }
+                const auto cookies = header("Cookie");
+                const std::string cookie_header(cookies.data(), cookies.size());
+                for (const std::string &name : settings_.bypass_cookies) {
+                    if (!cookie_value(cookie_header, name).empty()) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            template<class Header>
+            hit lookup(const std::string &host, const std::string &target, Header &&header) {
+                const std::string primary = primary_key(host, target);
+                shard &s = shard_of(primary);
+                const clock::time_point now = clock::now();
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto v = s.variants.find(primary);
+                if (v == s.variants.end()) {
+                    misses_.fetch_add(1, std::memory_order_relaxed);
+                    return {};
+                }
+                const std::string key = primary + '\n' + secondary_key(v->second, header);
+                auto it = s.entries.find(key);
+                if (it == s.entries.end() || it->second.response->stale_until <= now) {
+                    if (it != s.entries.end()) {
+                        erase(s, key);
+                    }
+                    misses_.fetch_add(1, std::memory_order_relaxed);
+                    return {};
+                }
+                s.lru.splice(s.lru.begin(), s.lru, it->second.position);
+                hit h;
+                h.response = it->second.response;
+                if (h.response->fresh_until <= now) {
+                    stale_hits_.fetch_add(1, std::memory_order_relaxed);
+                    h.stale = true;
+                    h.refresh = !h.response->refreshing.exchange(true);
+                } else {
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                }
+                return h;
+            }
+
+            // Keep a response the route of target answered. Header fields
+            // are given in the order they are sent.
+            template<class Header>
+            void store(const std::string &host, const std::string &target, const policy &p, Header &&header,
+                       int status, std::vector<std::pair<std::string, std::string>> fields, std::string body,
+                       std::vector<std::string> tags) {
+                if (p.ttl.count() <= 0) {
+                    return;
+                }
+                auto r = std::make_shared<cached_response>();
+                r->status = status;
+                r->head = "HTTP/1.1 " + std::to_string(status) + " " +
+                          std::string(boost::beast::http::obsolete_reason(boost::beast::http::int_to_status(status))) + "\r\n";
+                for (auto &f : fields) {
+                    r->head += f.first + ": " + f.second + "\r\n";
+                }
+                r->head += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+                for (auto &f : fields) {
+                    boost::algorithm::to_lower(f.first);
+                    if (f.first == "etag") {
+                        r->etag = f.second;
+                        r->not_modified_head = "HTTP/1.1 304 Not Modified\r\nETag: " + f.second + "\r\n";
+                    }
+                }
+                r->headers = std::move(fields);
+                r->body = std::move(body);
+                r->tags = std::move(tags);
+                r->tags.insert(r->tags.end(), p.tags.begin(), p.tags.end());
+                const clock::time_point now = clock::now();
+                r->fresh_until = now + p.ttl;
+                r->stale_until = r->fresh_until + p.stale_while_revalidate;
+                const size_t bytes = r->bytes();
+                if (bytes > max_bytes_) {
+                    return;
+                }
+
+                const std::string primary = primary_key(host, target);
+                shard &s = shard_of(primary);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto v = s.variants.find(primary);
+                if (v == s.variants.end() || v->second.headers != p.vary || v->second.cookies != p.vary_cookies) {
+                    // the route changed what it varies on: older variants are unreachable
+                    if (v != s.variants.end()) {
+                        erase_variants(s, primary);
+                    }
+                    v = s.variants.emplace(primary, vary_spec{p.vary, p.vary_cookies, 0}).first;
+                }
+                const std::string key = primary + '\n' + secondary_key(v->second, header);
+                auto it = s.entries.find(key);
+                if (it != s.entries.end()) {
+                    s.bytes -= it->second.response->bytes();
+                    it->second.response = r;
+                    s.lru.splice(s.lru.begin(), s.lru, it->second.position);
+                } else {
+                    s.lru.push_front(key);
+                    s.entries.emplace(key, entry{r, s.lru.begin()});
+                    ++v->second.count;
+                    entries_.fetch_add(1, std::memory_order_relaxed);
+                }
+                s.bytes += bytes;
+                stores_.fetch_add(1, std::memory_order_relaxed);
+                while (s.entries.size() > max_entries_ || s.bytes > max_bytes_) {
+                    const std::string oldest = s.lru.back();
+                    erase(s, oldest);
+                    evictions_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            // Drop every variant of a path, on any host
+            void invalidate(const std::string &target) {
+                const std::string suffix = ' ' + normalize(target);
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    std::vector<std::string> primaries;
+                    for (auto &v : s.variants) {
+                        if (boost::algorithm::ends_with(v.first, suffix)) {
+                            primaries.push_back(v.first);
+                        }
+                    }
+                    for (const std::string &p : primaries) {
+                        erase_variants(s, p);
+                    }
+                }
+            }
+
+            // Drop the responses stored with a tag
+            void invalidate_tag(const std::string &tag) {
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    std::vector<std::string> keys;
+                    for (auto &e : s.entries) {
+                        const std::vector<std::string> &tags = e.second.response->tags;
+                        if (std::find(tags.begin(), tags.end(), tag) != tags.end()) {
+                            keys.push_back(e.first);
+                        }
+                    }
+                    for (const std::string &k : keys) {
+                        erase(s, k);
+                    }
+                }
+            }
+
+            void clear() {
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    entries_.fetch_sub(s.entries.size(), std::memory_order_relaxed);
+                    s.entries.clear();
+                    s.variants.clear();
+                    s.lru.clear();
+                    s.bytes = 0;
+                }
+            }
+
+            statistics stats() const {
+                statistics st{hits_.load(), stale_hits_.load(), misses_.load(), stores_.load(), evictions_.load(),
+                              entries_.load(), 0};
+                for (const shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    st.bytes += s.bytes;
+                }
+                return st;
+            }
+
+            // Value of a cookie in a Cookie header
+            static std::string cookie_value(const std::string &cookie_header, const std::string &name) {
+                size_t pos = 0;
+                while (pos < cookie_header.size()) {
+                    while (pos < cookie_header.size() && (cookie_header[pos] == ' ' || cookie_header[pos] == ';')) {
+                        ++pos;
+                    }
+                    size_t end = cookie_header.find(';', pos);
+                    if (end == std::string::npos) {
+                        end = cookie_header.size();
+                    }
+                    const size_t eq = cookie_header.find('=', pos);
+                    if (eq < end && eq - pos == name.size() && cookie_header.compare(pos, name.size(), name) == 0) {
+                        return cookie_header.substr(eq + 1, end - eq - 1);
+                    }
+                    pos = end;
+                }
+                return std::string();
+            }
+
+        private:
+            static constexpr size_t shard_count = 16;
+
+            struct vary_spec {
+                std::vector<std::string> headers;
+                std::vector<std::string> cookies;
+                // entries stored under it
+                size_t count;
+            };
+
+            struct entry {
+                std::shared_ptr<const cached_response> response;
+                std::list<std::string>::iterator position;
+            };
+
+            struct shard {
+                mutable std::mutex mutex;
+                std::unordered_map<std::string, vary_spec> variants;
+                std::unordered_map<std::string, entry> entries;
+                // keys of the entries, most recently used first
+                std::list<std::string> lru;
+                size_t bytes{0};
+            };
+
+            // The target as the routes see it: the server and the middleware
+            // do not agree on the leading slash
+            static std::string normalize(const std::string &target) {
+                return !target.empty() && target[0] == '/' ? target.substr(1) : target;
+            }
+
+            static std::string primary_key(const std::string &host, const std::string &target) {
+                return host + ' ' + normalize(target);
+            }
+
+            template<class Header>
+            static std::string secondary_key(const vary_spec &v, Header &&header) {
+                std::string key;
+                for (const std::string &name : v.headers) {
+                    const auto value = header(name);
+                    key.append(value.data(), value.size());
+                    key += '\0';
+                }
+                if (!v.cookies.empty()) {
+                    const auto cookies = header("Cookie");
+                    const std::string cookie_header(cookies.data(), cookies.size());
+                    for (const std::string &name : v.cookies) {
+                        key += cookie_value(cookie_header, name);
+                        key += '\0';
+                    }
+                }
+                return key;
+            }
+
+            shard &shard_of(const std::string &primary) {
+                return shards_[std::hash<std::string>()(primary) % shard_count];
+            }
+
+            // Requires the shard lock
+            void erase(shard &s, const std::string &key) {
+                auto it = s.entries.find(key);
+                if (it == s.entries.end()) {
+                    return;
+                }
+                s.bytes -= it->second.response->bytes();
+                s.lru.erase(it->second.position);
+                const std::string primary = key.substr(0, key.find('\n'));
+                s.entries.erase(it);
+                entries_.fetch_sub(1, std::memory_order_relaxed);
+                auto v = s.variants.find(primary);
+                if (v != s.variants.end() && --v->second.count == 0) {
+                    s.variants.erase(v);
+                }
+            }
+
+            // Requires the shard lock
+            void erase_variants(shard &s, const std::string &primary) {
+                const std::string prefix = primary + '\n';
+                std::vector<std::string> keys;
+                for (auto &e : s.entries) {
+                    if (boost::algorithm::starts_with(e.first, prefix)) {
+                        keys.push_back(e.first);
+                    }
+                }
+                for (const std::string &k : keys) {
+                    erase(s, k);
+                }
+                s.variants.erase(primary);
+            }
+
+            settings settings_;
+            size_t max_entries_{1};
+            size_t max_bytes_{1};
+            shard shards_[shard_count];
+            std::atomic<size_t> entries_{0};
+            std::atomic<size_t> hits_{0};
+            std::atomic<size_t> stale_hits_{0};
+            std::atomic<size_t> misses_{0};
+            std::atomic<size_t> stores_{0};
+            std::atomic<size_t> evictions_{0};
+    };
+
+}
+
+#endif //WPP_RESPONSE_CACHE_H
@@ -0,0 +1,31 @@
+//
+// Connection timeouts of the http server.
+//
+
+#ifndef WPP_SERVER_TIMEOUTS_H
+#define WPP_SERVER_TIMEOUTS_H
+
+#include <chrono>
+
+namespace wpp {
+
+    struct server_timeouts {
+        // Keep-alive connection waiting for its next request
+        std::chrono::steady_clock::duration idle{std::chrono::seconds(15)};
+        // Reading the request line and headers once the client started sending
+        std::chrono::steady_clock::duration header_read{std::chrono::seconds(10)};
+        // Reading the request body
+        std::chrono::steady_clock::duration body_read{std::chrono::seconds(30)};
+        // Writing a response
+        std::chrono::steady_clock::duration write{std::chrono::seconds(30)};
+        // TLS and WebSocket handshakes
+        std::chrono::steady_clock::duration handshake{std::chrono::seconds(10)};
+        // Silence on a WebSocket before we ping (and then close) it
+        std::chrono::steady_clock::duration websocket_idle{std::chrono::seconds(15)};
+        // Graceful TLS shutdown or WebSocket close
+        std::chrono::steady_clock::duration shutdown{std::chrono::seconds(5)};
+    };
+
+}
+
+#endif //WPP_SERVER_TIMEOUTS_H
@@ -0,0 +1,236 @@
+//
+// Session cookies: CBOR sealed with AES-256-GCM, in base64url.
+//
+
+#ifndef WPP_SESSION_CODEC_H
+#define WPP_SESSION_CODEC_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "utils/json.hpp"
+
+namespace wpp {
+    using json = nlohmann::json;
+
+    // base64url without padding (RFC 4648 §5): safe in cookie values
+    inline void base64url_encode(const unsigned char *data, size_t n, std::string &out) {
+        static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        out.reserve(out.size() + (n * 4 + 2) / 3);
+        size_t i = 0;
+        for (; i + 3 <= n; i += 3) {
+            const uint32_t v = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+            out += digits[v >> 18];
+            out += digits[(v >> 12) & 63];
+            out += digits[(v >> 6) & 63];
+            out += digits[v & 63];
+        }
+        if (n - i == 1) {
+            const uint32_t v = uint32_t(data[i]) << 16;
+            out += digits[v >> 18];
+            out += digits[(v >> 12) & 63];
+        } else if (n - i == 2) {
+            const uint32_t v = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8);
+            out += digits[v >> 18];
+            out += digits[(v >> 12) & 63];
+            out += digits[(v >> 6) & 63];
+        }
+    }
+
+    // False if s is not base64url
+    inline bool base64url_decode(const char *s, size_t n, std::vector<unsigned char> &out) {
+        static const struct table {
+            signed char values[256];
+
+            table() : values() {
+                for (int c = 0; c < 256; ++c) {
+                    values[c] = -1;
+                }
+                const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+                for (int i = 0; i < 64; ++i) {
+                    values[static_cast<unsigned char>(digits[i])] = static_cast<signed char>(i);
+                }
+            }
+        } t;
+        if (n % 4 == 1) {
+            return false;
+        }
+        out.reserve(out.size() + n * 3 / 4);
+        uint32_t v = 0;
+        int bits = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const signed char d = t.values[static_cast<unsigned char>(s[i])];
+            if (d < 0) {
+                return false;
+            }
+            v = (v << 6) | static_cast<uint32_t>(d);
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                out.push_back(static_cast<unsigned char>(v >> bits));
+            }
+        }
+        return true;
+    }
+
+    // Seals sessions into cookie values and opens them again.
+    //
+    // The session is encoded as CBOR (or MessagePack), which is smaller
+    // and faster to read than json text, and encrypted with AES-256-GCM,
+    // which also authenticates it: a cookie that was tampered with does
+    // not open. The value is
+    //
+    //     base64url(format | issued (4) | nonce (12) | ciphertext | tag (16))
+    //
+    // with a random nonce per cookie. The header (format and issue time,
+    // in seconds) is authenticated too, so expired cookies cannot be
+    // refreshed by the client. Each thread keeps its cipher contexts,
+    // so sealing allocates nothing in OpenSSL.
+    class session_codec {
+        public:
+            enum class format : unsigned char {
+                cbor = 1,
+                msgpack = 2
+            };
+
+            using clock = std::chrono::system_clock;
+
+            static constexpr size_t key_size = 32;
+            static constexpr size_t header_size = 5;
+            static constexpr size_t nonce_size = 12;
+            static constexpr size_t tag_size = 16;
+
+            session_codec() = default;
+
+            // key has key_size bytes
+            explicit session_codec(const std::vector<unsigned char> &key, format f = format::cbor)
+                    : key_(key), format_(f) {
+                key_.resize(key_size);
+            }
+
+            ~session_codec() {
+                OPENSSL_cleanse(key_.data(), key_.size());
+            }
+
+            session_codec(const session_codec &) = default;
+            session_codec &operator=(const session_codec &) = default;
+
+            bool has_key() const {
+                return !key_.empty();
+            }
+
+            // An empty string if there is no key or OpenSSL fails
+            std::string seal(const json &session, clock::time_point issued = clock::now()) const {
+                std::vector<uint8_t> plain = format_ == format::cbor ? json::to_cbor(session) : json::to_msgpack(session);
+                std::vector<unsigned char> sealed(header_size + nonce_size + plain.size() + tag_size);
+                sealed[0] = static_cast<unsigned char>(format_);
+                const auto seconds = static_cast<uint32_t>(
+                        std::chrono::duration_cast<std::chrono::seconds>(issued.time_since_epoch()).count());
+                for (size_t i = 0; i < 4; ++i) {
+                    sealed[1 + i] = static_cast<unsigned char>(seconds >> (24 - 8 * i));
+                }
+                unsigned char *nonce = &sealed[header_size];
+                unsigned char *cipher = nonce + nonce_size;
+                unsigned char *tag = cipher + plain.size();
+                std::string out;
+                if (!has_key() || RAND_bytes(nonce, nonce_size) != 1) {
+                    OPENSSL_cleanse(plain.data(), plain.size());
+                    return out;
+                }
+                EVP_CIPHER_CTX *ctx = context(encrypting);
+                int n = 0;
+                bool ok = EVP_EncryptInit_ex(ctx, nullptr, nullptr, key_.data(), nonce) == 1 &&
+                          EVP_EncryptUpdate(ctx, nullptr, &n, sealed.data(), header_size) == 1 &&
+                          EVP_EncryptUpdate(ctx, cipher, &n, plain.data(), static_cast<int>(plain.size())) == 1 &&
+                          EVP_EncryptFinal_ex(ctx, cipher + n, &n) == 1 &&
+                          EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tag_size, tag) == 1;
+                OPENSSL_cleanse(plain.data(), plain.size());
+                if (ok) {
+                    base64url_encode(sealed.data(), sealed.size(), out);
+                }
+                return out;
+            }
+
+            // False if the cookie was not sealed with our key or was modified
+            bool open(const std::string &cookie, json &session, clock::time_point *issued = nullptr) const {
+                std::vector<unsigned char> sealed;
+                if (!has_key() || !base64url_decode(cookie.data(), cookie.size(), sealed) ||
+                    sealed.size() < header_size + nonce_size + tag_size) {
+                    return false;
+                }
+                const auto f = static_cast<format>(sealed[0]);
+                if (f != format::cbor && f != format::msgpack) {
+                    return false;
+                }
+                const unsigned char *nonce = &sealed[header_size];
+                const unsigned char *cipher = nonce + nonce_size;
+                const size_t cipher_size = sealed.size() - header_size - nonce_size - tag_size;
+                unsigned char *tag = &sealed[header_size + nonce_size + cipher_size];
+                std::vector<uint8_t> plain(cipher_size);
+                EVP_CIPHER_CTX *ctx = context(decrypting);
+                int n = 0;
+                const bool ok = EVP_DecryptInit_ex(ctx, nullptr, nullptr, key_.data(), nonce) == 1 &&
+                                EVP_DecryptUpdate(ctx, nullptr, &n, sealed.data(), header_size) == 1 &&
+                                EVP_DecryptUpdate(ctx, plain.data(), &n, cipher, static_cast<int>(cipher_size)) == 1 &&
+                                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tag_size, tag) == 1 &&
+                                EVP_DecryptFinal_ex(ctx, plain.data() + n, &n) == 1;
+                if (ok && issued) {
+                    uint32_t seconds = 0;
+                    for (size_t i = 0; i < 4; ++i) {
+                        seconds = (seconds << 8) | sealed[1 + i];
+                    }
+                    *issued = clock::time_point(std::chrono::seconds(seconds));
+                }
+                if (ok) {
+                    try {
+                        session = f == format::cbor ? json::from_cbor(plain) : json::from_msgpack(plain);
+                    } catch (const std::exception &) {
+                        session = json();
+                    }
+                }
+                OPENSSL_cleanse(plain.data(), plain.size());
+                return ok && !session.is_null();
+            }
+
+        private:
+            enum direction {
+                encrypting,
+                decrypting
+            };
+
+            // Contexts of this thread with the cipher already set up. Only
+            // the key and the nonce change between calls.
+            static EVP_CIPHER_CTX *context(direction d) {
+                struct contexts {
+                    EVP_CIPHER_CTX *encrypt{EVP_CIPHER_CTX_new()};
+                    EVP_CIPHER_CTX *decrypt{EVP_CIPHER_CTX_new()};
+
+                    contexts() {
+                        EVP_EncryptInit_ex(encrypt, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+                        EVP_DecryptInit_ex(decrypt, EVP_aes_256_gcm(), nullptr, nullptr, nullptr);
+                    }
+
+                    ~contexts() {
+                        EVP_CIPHER_CTX_free(encrypt);
+                        EVP_CIPHER_CTX_free(decrypt);
+                    }
+                };
+                thread_local contexts c;
+                return d == encrypting ? c.encrypt : c.decrypt;
+            }
+
+            std::vector<unsigned char> key_;
+            format format_{format::cbor};
+    };
+
+}
+
+#endif //WPP_SESSION_CODEC_H
@@ -0,0 +1,385 @@
+//
+// Server-side sessions: the cookie only carries an opaque ID.
+//
+
+#ifndef WPP_SESSION_STORE_H
+#define WPP_SESSION_STORE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+
+#include <openssl/rand.h>
+
+#include "utils/json.hpp"
+#include "session_codec.h"
+#include "timing_wheel.h"
+
+namespace wpp {
+    using json = nlohmann::json;
+
+    // Sessions kept in memory by ID, in shards with a lock each. A session
+    // expires after idle time without requests: each one has a timer on
+    // the timing wheel of the io_context, which is re-armed (lazily, so
+    // almost for free) whenever the session is loaded.
+    //
+    // With a backend, sessions are also written behind to storage: changed
+    // sessions are marked and a background thread hands them to the
+    // backend in batches, so requests never wait for the disk. Sessions of
+    // the backend are loaded when it is attached, so they survive restarts.
+    class session_store {
+        public:
+            using clock = std::chrono::steady_clock;
+            using system_clock = std::chrono::system_clock;
+
+            struct settings {
+                // Sessions without requests for this long expire
+                std::chrono::milliseconds idle{std::chrono::minutes(5)};
+                // How often changes are written behind to the backend
+                std::chrono::milliseconds write_behind_interval{std::chrono::seconds(1)};
+            };
+
+            // A session as the backend sees it. data is CBOR.
+            struct record {
+                std::string id;
+                std::vector<uint8_t> data;
+                system_clock::time_point last_activity;
+            };
+
+            // Storage of the write-behind. Called from a single thread.
+            class backend {
+                public:
+                    virtual ~backend() = default;
+
+                    // Calls f with every session stored
+                    virtual bool load(const std::function<void(record &&)> &f) = 0;
+
+                    // Writes or replaces these sessions and removes the others
+                    virtual bool write(const std::vector<record> &changed, const std::vector<std::string> &removed) = 0;
+            };
+
+            struct statistics {
+                size_t sessions{0};
+                size_t expired{0};
+                size_t writes{0};
+                size_t write_failures{0};
+            };
+
+            session_store() = default;
+
+            explicit session_store(settings s) : settings_(s) {}
+
+            session_store(const session_store &) = delete;
+            session_store &operator=(const session_store &) = delete;
+
+            ~session_store() {
+                stop_writing();
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    s.sessions.clear();
+                }
+            }
+
+            // Expire sessions with the timing wheel of ioc. Without an
+            // io_context, expired sessions are only dropped when loaded.
+            void attach(boost::asio::io_context &ioc) {
+                ioc_ = &ioc;
+            }
+
+            // Loads the sessions of b and starts writing behind to it
+            void persist(std::shared_ptr<backend> b) {
+                stop_writing();
+                backend_ = std::move(b);
+                if (!backend_) {
+                    return;
+                }
+                const auto now = system_clock::now();
+                backend_->load([this, now](record &&r) {
+                    const auto idle_for = now - r.last_activity;
+                    if (idle_for >= settings_.idle) {
+                        std::lock_guard<std::mutex> lock(writer_mutex_);
+                        removed_.push_back(std::move(r.id));
+                        return;
+                    }
+                    json data;
+                    try {
+                        data = json::from_cbor(r.data);
+                    } catch (const std::exception &) {
+                        return;
+                    }
+                    shard &s = shard_of(r.id);
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    entry &e = insert(s, r.id);
+                    e.data = std::move(data);
+                    e.expires = clock::now() + std::chrono::duration_cast<clock::duration>(settings_.idle - idle_for);
+                    e.persisted_at = r.last_activity;
+                    arm(e, r.id);
+                });
+                stopping_ = false;
+                writer_ = std::thread([this]() {
+                    std::unique_lock<std::mutex> lock(writer_mutex_);
+                    while (!stopping_) {
+                        writer_cv_.wait_for(lock, settings_.write_behind_interval);
+                        lock.unlock();
+                        flush();
+                        lock.lock();
+                    }
+                });
+            }
+
+            // A new, unguessable session ID (256 bits, base64url)
+            static std::string new_id() {
+                unsigned char bytes[32];
+                if (RAND_bytes(bytes, sizeof(bytes)) != 1) {
+                    throw std::runtime_error("RAND_bytes session id failed");
+                }
+                std::string id;
+                base64url_encode(bytes, sizeof(bytes), id);
+                return id;
+            }
+
+            // Copies the session id into data and counts it as activity.
+            // False if there is no such session or it expired.
+            bool load(const std::string &id, json &data) {
+                shard &s = shard_of(id);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto it = s.sessions.find(id);
+                if (it == s.sessions.end()) {
+                    return false;
+                }
+                entry &e = it->second;
+                const auto now = clock::now();
+                if (e.expires <= now) {
+                    expire(s, it);
+                    return false;
+                }
+                data = e.data;
+                e.expires = now + settings_.idle;
+                if (e.timer) {
+                    e.timer->expires_after(settings_.idle);
+                }
+                // Keep the activity in storage from lagging too far behind
+                if (backend_ && system_clock::now() - e.persisted_at > settings_.idle / 2) {
+                    s.dirty.insert(id);
+                }
+                return true;
+            }
+
+            void save(const std::string &id, json data) {
+                shard &s = shard_of(id);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                entry &e = insert(s, id);
+                e.data = std::move(data);
+                e.expires = clock::now() + settings_.idle;
+                arm(e, id);
+                if (backend_) {
+                    s.dirty.insert(id);
+                    s.removed.erase(id);
+                }
+            }
+
+            void erase(const std::string &id) {
+                shard &s = shard_of(id);
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto it = s.sessions.find(id);
+                if (it != s.sessions.end()) {
+                    remove(s, it);
+                }
+            }
+
+            // Moves the session to a new ID, as after a login, and returns it
+            std::string regenerate(const std::string &id) {
+                json data = json::object();
+                {
+                    shard &s = shard_of(id);
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    auto it = s.sessions.find(id);
+                    if (it != s.sessions.end()) {
+                        data = std::move(it->second.data);
+                        remove(s, it);
+                    }
+                }
+                std::string fresh = new_id();
+                save(fresh, std::move(data));
+                return fresh;
+            }
+
+            // Hands the changes since the last flush to the backend
+            bool flush() {
+                if (!backend_) {
+                    return true;
+                }
+                std::lock_guard<std::mutex> flushing(flush_mutex_);
+                std::vector<record> changed;
+                std::vector<std::string> removed;
+                {
+                    std::lock_guard<std::mutex> lock(writer_mutex_);
+                    removed.swap(removed_);
+                }
+                const auto now = system_clock::now();
+                for (shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    for (const std::string &id : s.dirty) {
+                        auto it = s.sessions.find(id);
+                        if (it != s.sessions.end()) {
+                            changed.push_back({id, json::to_cbor(it->second.data), now});
+                            it->second.persisted_at = now;
+                        }
+                    }
+                    s.dirty.clear();
+                    removed.insert(removed.end(), s.removed.begin(), s.removed.end());
+                    s.removed.clear();
+                }
+                if (changed.empty() && removed.empty()) {
+                    return true;
+                }
+                if (backend_->write(changed, removed)) {
+                    writes_.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                // Try again on the next flush, unless a newer change is pending
+                write_failures_.fetch_add(1, std::memory_order_relaxed);
+                for (record &r : changed) {
+                    shard &s = shard_of(r.id);
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    if (s.sessions.count(r.id)) {
+                        s.dirty.insert(r.id);
+                    }
+                }
+                std::lock_guard<std::mutex> lock(writer_mutex_);
+                removed_.insert(removed_.end(), removed.begin(), removed.end());
+                return false;
+            }
+
+            const settings &get_settings() const {
+                return settings_;
+            }
+
+            size_t size() const {
+                size_t n = 0;
+                for (const shard &s : shards_) {
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    n += s.sessions.size();
+                }
+                return n;
+            }
+
+            statistics stats() const {
+                statistics r;
+                r.sessions = size();
+                r.expired = expired_.load(std::memory_order_relaxed);
+                r.writes = writes_.load(std::memory_order_relaxed);
+                r.write_failures = write_failures_.load(std::memory_order_relaxed);
+                return r;
+            }
+
+        private:
+            static constexpr size_t shard_count = 32;
+
+            struct entry {
+                json data;
+                clock::time_point expires;
+                system_clock::time_point persisted_at;
+                std::unique_ptr<timing_wheel::timer> timer;
+            };
+
+            struct shard {
+                mutable std::mutex mutex;
+                std::unordered_map<std::string, entry> sessions;
+                // Write-behind: sessions to write and to remove
+                std::unordered_set<std::string> dirty;
+                std::unordered_set<std::string> removed;
+            };
+
+            shard &shard_of(const std::string &id) {
+                return shards_[std::hash<std::string>()(id) % shard_count];
+            }
+
+            entry &insert(shard &s, const std::string &id) {
+                return s.sessions[id];
+            }
+
+            // Arms the expiry of a session. The timer re-checks the deadline,
+            // since loads only move it.
+            void arm(entry &e, const std::string &id) {
+                if (!ioc_) {
+                    return;
+                }
+                if (!e.timer) {
+                    e.timer = std::make_unique<timing_wheel::timer>(*ioc_);
+                    e.timer->on_expire([this, id]() {
+                        shard &s = shard_of(id);
+                        std::lock_guard<std::mutex> lock(s.mutex);
+                        auto it = s.sessions.find(id);
+                        if (it == s.sessions.end()) {
+                            return;
+                        }
+                        const auto now = clock::now();
+                        if (it->second.expires > now) {
+                            it->second.timer->expires_after(it->second.expires - now);
+                        } else {
+                            expire(s, it);
+                        }
+                    });
+                }
+                e.timer->expires_after(e.expires - clock::now());
+            }
+
+            void expire(shard &s, std::unordered_map<std::string, entry>::iterator it) {
+                expired_.fetch_add(1, std::memory_order_relaxed);
+                remove(s, it);
+            }
+
+            void remove(shard &s, std::unordered_map<std::string, entry>::iterator it) {
+                if (backend_) {
+                    s.dirty.erase(it->first);
+                    s.removed.insert(it->first);
+                }
+                s.sessions.erase(it);
+            }
+
+            void stop_writing() {
+                if (!writer_.joinable()) {
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(writer_mutex_);
+                    stopping_ = true;
+                }
+                writer_cv_.notify_all();
+                writer_.join();
+                flush();
+            }
+
+            const settings settings_;
+            shard shards_[shard_count];
+            boost::asio::io_context *ioc_{nullptr};
+            std::shared_ptr<backend> backend_;
+            // Write-behind thread
+            std::thread writer_;
+            std::mutex writer_mutex_;
+            std::mutex flush_mutex_;
+            std::condition_variable writer_cv_;
+            bool stopping_{false};
+            std::vector<std::string> removed_;
+            std::atomic<size_t> expired_{0};
+            std::atomic<size_t> writes_{0};
+            std::atomic<size_t> write_failures_{0};
+    };
+
+}
+
+#endif //WPP_SESSION_STORE_H
@@ -0,0 +1,307 @@
+//
+// Server-Sent Events streams and broadcast hub.
+//
+
+#ifndef WPP_SSE_H
+#define WPP_SSE_H
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include "chunked_writer.h"
+#include "timing_wheel.h"
+
+namespace wpp {
+
+    // An event serialized once, already framed as a chunk of the response.
+    // The same buffer is queued for every subscriber.
+    using sse_buffer = std::shared_ptr<const std::string>;
+
+    // Field values without the CR and LF that would end the field. A name
+    // or ID from the client could otherwise add fields to the event.
+    inline std::string sse_field_value(const std::string &value) {
+        std::string clean;
+        clean.reserve(value.size());
+        for (char c : value) {
+            if (c != '\r' && c != '\n') {
+                clean += c;
+            }
+        }
+        return clean;
+    }
+
+    inline sse_buffer sse_frame(const std::string &data, const std::string &event = "", const std::string &id = "") {
+        std::string message;
+        message.reserve(data.size() + event.size() + id.size() + 32);
+        if (!event.empty()) {
+            message += "event: " + sse_field_value(event) + "\n";
+        }
+        if (!id.empty()) {
+            message += "id: " + sse_field_value(id) + "\n";
+        }
+        // every line of the payload needs its own field. Browsers end
+        // lines at CRLF, CR or LF.
+        size_t begin = 0;
+        do {
+            size_t end = data.find_first_of("\r\n", begin);
+            if (end == std::string::npos) {
+                end = data.size();
+            }
+            message += "data: ";
+            message.append(data, begin, end - begin);
+            message += '\n';
+            if (end + 1 < data.size() && data[end] == '\r' && data[end + 1] == '\n') {
+                ++end;
+            }
+            begin = end + 1;
+        } while (begin <= data.size());
+        message += '\n';
+        auto framed = std::make_shared<std::string>();
+        chunked_writer::frame(message.data(), message.size(), *framed);
+        return framed;
+    }
+
+    // Comment line, ignored by the browser. Keeps proxies from closing idle streams.
+    inline sse_buffer sse_comment(const std::string &text) {
+        const std::string message = ": " + text + "\n\n";
+        auto framed = std::make_shared<std::string>();
+        chunked_writer::frame(message.data(), message.size(), *framed);
+        return framed;
+    }
+
+    // One client of an event stream.
+    //
+    // Events are queued as shared buffers and sent one batch at a time. A client
+    // that does not read fast enough fills its queue, and then, depending on the
+    // policy, new events are dropped or the queue is replaced by the newest event
+    // (for streams where only the latest state matters).
+    class sse_stream : public std::enable_shared_from_this<sse_stream> {
+        public:
+            enum class overflow {
+                drop,
+                coalesce
+            };
+
+            sse_stream(boost::asio::io_context &ioc, chunked_writer::sink s,
+                       overflow policy = overflow::drop, size_t max_queued = 64)
+                    : ioc_(ioc), sink_(std::move(s)), policy_(policy), max_queued_(max_queued),
+                      closed_(!sink_.write) {}
+
+            sse_stream(const sse_stream &) = delete;
+            sse_stream &operator=(const sse_stream &) = delete;
+
+            // The last reference can go on any thread, so the rest of the
+            // stream is written on the executor
+            ~sse_stream() {
+                if (!closed_ && sink_.write) {
+                    boost::asio::post(ioc_, [s = std::move(sink_), queue = std::move(queue_),
+                                             write_head = !head_written_]() {
+                        if (write_head) {
+                            s.write_head();
+                        }
+                        for (auto &&b : queue) {
+                            s.write(*b);
+                        }
+                        s.write(chunked_writer::last_chunk());
+                    });
+                }
+            }
+
+            // Returns false if the event was dropped or the client is gone
+            bool send(const sse_buffer &frame) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (closed_ || closing_) {
+                    return false;
+                }
+                if (queue_.size() >= max_queued_) {
+                    ++dropped_;
+                    if (policy_ == overflow::drop) {
+                        return false;
+                    }
+                    dropped_ += queue_.size() - 1;
+                    queue_.clear();
+                }
+                queue_.push_back(frame);
+                schedule_flush();
+                return true;
+            }
+
+            bool send(const std::string &data, const std::string &event = "", const std::string &id = "") {
+                return send(sse_frame(data, event, id));
+            }
+
+            // End the stream
+            void close() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (closed_) {
+                    return;
+                }
+                closing_ = true;
+                schedule_flush();
+            }
+
+            bool is_open() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return !closed_ && !closing_;
+            }
+
+            // Events lost because the client was too slow
+            size_t dropped() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return dropped_;
+            }
+
+        private:
+            // Requires the lock
+            void schedule_flush() {
+                if (flushing_) {
+                    return;
+                }
+                flushing_ = true;
+                boost::asio::post(ioc_, [self = shared_from_this()]() { self->do_flush(); });
+            }
+
+            void do_flush() {
+                std::deque<sse_buffer> batch;
+                bool write_head = false;
+                bool last = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    batch.swap(queue_);
+                    write_head = !head_written_;
+                    head_written_ = true;
+                    last = closing_;
+                }
+                if (write_head) {
+                    sink_.write_head();
+                }
+                for (auto &&b : batch) {
+                    sink_.write(*b);
+                }
+                if (last) {
+                    sink_.write(chunked_writer::last_chunk());
+                }
+                sink_.send([self = shared_from_this(), last](bool ok) { self->on_sent(ok, last); });
+            }
+
+            void on_sent(bool ok, bool last) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                flushing_ = false;
+                if (!ok || last) {
+                    closed_ = true;
+                    queue_.clear();
+                    // releasing the connection finishes the response
+                    sink_ = chunked_writer::sink{};
+                    return;
+                }
+                if (!queue_.empty() || closing_) {
+                    schedule_flush();
+                }
+            }
+
+            boost::asio::io_context &ioc_;
+            chunked_writer::sink sink_;
+            const overflow policy_;
+            const size_t max_queued_;
+
+            mutable std::mutex mutex_;
+            std::deque<sse_buffer> queue_;
+            size_t dropped_{0};
+            bool flushing_{false};
+            bool head_written_{false};
+            bool closing_{false};
+            bool closed_;
+    };
+
+    // Fans events out to every subscribed stream. Each event is serialized
+    // once and the same immutable buffer goes to all subscribers. While the
+    // hub has subscribers, it sends a heartbeat comment on the timing wheel.
+    //
+    //     auto hub = std::make_shared<wpp::sse_hub>(app.io_context());
+    //     app.sse("events", [hub](wpp::request&, std::shared_ptr<wpp::sse_stream> s) {
+    //         hub->subscribe(s);
+    //     });
+    //     hub->broadcast(j.dump(), "price");
+    class sse_hub : public std::enable_shared_from_this<sse_hub> {
+        public:
+            explicit sse_hub(boost::asio::io_context &ioc,
+                             std::chrono::steady_clock::duration heartbeat = std::chrono::seconds(15))
+                    : timer_(ioc), heartbeat_interval_(heartbeat), heartbeat_(sse_comment("heartbeat")) {}
+
+            void subscribe(std::shared_ptr<sse_stream> s) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                subscribers_.push_back(std::move(s));
+                if (!heartbeat_armed_ && heartbeat_interval_.count() > 0) {
+                    std::weak_ptr<sse_hub> weak = weak_from_this();
+                    timer_.on_expire([weak]() {
+                        if (auto self = weak.lock()) {
+                            self->on_heartbeat();
+                        }
+                    });
+                    timer_.expires_after(heartbeat_interval_);
+                    heartbeat_armed_ = true;
+                }
+            }
+
+            // Returns the number of subscribers that accepted the event
+            size_t broadcast(const sse_buffer &frame) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return send_all(frame);
+            }
+
+            size_t broadcast(const std::string &data, const std::string &event = "", const std::string &id = "") {
+                return broadcast(sse_frame(data, event, id));
+            }
+
+            size_t size() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return subscribers_.size();
+            }
+
+        private:
+            // Requires the lock. Forgets streams that were closed.
+            size_t send_all(const sse_buffer &frame) {
+                size_t delivered = 0;
+                size_t kept = 0;
+                for (size_t i = 0; i < subscribers_.size(); ++i) {
+                    if (!subscribers_[i]->is_open()) {
+                        continue;
+                    }
+                    if (subscribers_[i]->send(frame)) {
+                        ++delivered;
+                    }
+                    subscribers_[kept++] = std::move(subscribers_[i]);
+                }
+                subscribers_.resize(kept);
+                return delivered;
+            }
+
+            void on_heartbeat() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                send_all(heartbeat_);
+                if (subscribers_.empty()) {
+                    heartbeat_armed_ = false;
+                    return;
+                }
+                timer_.expires_after(heartbeat_interval_);
+            }
+
+            mutable std::mutex mutex_;
+            std::vector<std::shared_ptr<sse_stream>> subscribers_;
+            timing_wheel::timer timer_;
+            const std::chrono::steady_clock::duration heartbeat_interval_;
+            const sse_buffer heartbeat_;
+            bool heartbeat_armed_{false};
+    };
+
+}
+
+#endif //WPP_SSE_H
@@ -0,0 +1,260 @@
+//
+// Hashed timing wheel shared by all connections of an io_context.
+//
+
+#ifndef WPP_TIMING_WHEEL_H
+#define WPP_TIMING_WHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace wpp {
+
+    // One steady_timer per io_context drives a wheel of slots, and every
+    // connection timeout is an intrusive node in one of the slots. Arming,
+    // re-arming and cancelling are O(1) and do not touch the asio timer heap.
+    //
+    // Re-arming to a later deadline is lazy: it only moves the deadline of
+    // the node. When the slot of a node comes around and its deadline has
+    // moved, the node is put back in the slot of the new deadline instead of
+    // expiring. This makes the re-arm on every read or activity almost free.
+    // A deadline that comes before the slot is visited again is relinked
+    // right away, so shortening a timeout never makes it fire late.
+    //
+    // Expiration callbacks run on whichever thread runs the io_context, so
+    // they should post to the strand of their connection.
+    class timing_wheel : public boost::asio::io_context::service {
+        public:
+            using clock = std::chrono::steady_clock;
+            using duration = clock::duration;
+
+            static inline boost::asio::io_context::id id;
+
+            // Number of slots in the wheel and duration of each tick.
+            // Deadlines beyond one revolution wait for more rounds in their slot.
+            static constexpr std::size_t number_of_slots = 512;
+            static constexpr std::chrono::milliseconds tick{100};
+
+        private:
+            struct node {
+                node* prev{nullptr};
+                node* next{nullptr};
+                std::size_t slot{0};
+                std::uint64_t deadline{0};
+                bool linked{false};
+                std::function<void()> on_expire;
+            };
+
+        public:
+            // A timeout owned by a connection. It is cancelled when destroyed.
+            class timer {
+                public:
+                    explicit timer(boost::asio::io_context& ioc)
+                            : wheel_(&boost::asio::use_service<timing_wheel>(ioc)) {}
+
+                    timer(const timer&) = delete;
+                    timer& operator=(const timer&) = delete;
+
+                    ~timer() {
+                        cancel();
+                    }
+
+                    // Function called when the timer expires
+                    void on_expire(std::function<void()> f) {
+                        std::lock_guard<std::mutex> lock(wheel_->mutex_);
+                        node_.on_expire = std::move(f);
+                    }
+
+                    // Arm or re-arm the timer
+                    void expires_after(duration d) {
+                        wheel_->schedule(node_, d);
+                    }
+
+                    void cancel() {
+                        wheel_->unschedule(node_);
+                    }
+
+                    // False once the timer expired or was cancelled
+                    bool armed() const {
+                        std::lock_guard<std::mutex> lock(wheel_->mutex_);
+                        return node_.linked;
+                    }
+
+                private:
+                    timing_wheel* wheel_;
+                    node node_;
+            };
+
+            explicit timing_wheel(boost::asio::io_context& ioc)
+                    : boost::asio::io_context::service(ioc)
+                    , timer_(ioc)
+                    , slots_(number_of_slots, nullptr) {}
+
+            // Number of armed timers
+            std::size_t size() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return size_;
+            }
+
+        private:
+            void shutdown() override {
+                std::lock_guard<std::mutex> lock(mutex_);
+                boost::system::error_code ignored;
+                timer_.cancel(ignored);
+                for (node*& head : slots_) {
+                    while (head) {
+                        node* n = head;
+                        head = n->next;
+                        n->prev = n->next = nullptr;
+                        n->linked = false;
+                    }
+                }
+                size_ = 0;
+                shut_down_ = true;
+            }
+
+            static std::uint64_t ticks_in(duration d) {
+                const auto t = std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+                return t <= 0 ? 1 : static_cast<std::uint64_t>((t + tick.count() - 1) / tick.count());
+            }
+
+            void schedule(node& n, duration d) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (shut_down_) {
+                    return;
+                }
+                n.deadline = current_tick_ + ticks_in(d);
+                if (!n.linked) {
+                    link(n, n.deadline);
+                    ++size_;
+                    start();
+                } else if (n.deadline < next_visit(n)) {
+                    // Shortened: the current slot would be visited too late
+                    unlink(n);
+                    link(n, n.deadline);
+                }
+                // Otherwise the node will be relinked when its current slot
+                // comes around.
+            }
+
+            // The next tick at which collect() looks at the slot of n
+            std::uint64_t next_visit(const node& n) const {
+                const std::uint64_t first = current_tick_ + 1;
+                return first + (n.slot + number_of_slots - first % number_of_slots) % number_of_slots;
+            }
+
+            void unschedule(node& n) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (n.linked) {
+                    unlink(n);
+                    --size_;
+                }
+            }
+
+            void link(node& n, std::uint64_t at) {
+                n.slot = static_cast<std::size_t>(at % number_of_slots);
+                n.prev = nullptr;
+                n.next = slots_[n.slot];
+                if (n.next) {
+                    n.next->prev = &n;
+                }
+                slots_[n.slot] = &n;
+                n.linked = true;
+            }
+
+            void unlink(node& n) {
+                if (n.prev) {
+                    n.prev->next = n.next;
+                } else {
+                    slots_[n.slot] = n.next;
+                }
+                if (n.next) {
+                    n.next->prev = n.prev;
+                }
+                n.prev = n.next = nullptr;
+                n.linked = false;
+            }
+
+            // Start ticking if we are not already
+            void start() {
+                if (running_) {
+                    return;
+                }
+                running_ = true;
+                next_tick_ = clock::now() + tick;
+                arm();
+            }
+
+            void arm() {
+                timer_.expires_at(next_tick_);
+                timer_.async_wait([this](boost::system::error_code ec) {
+                    if (ec == boost::asio::error::operation_aborted) {
+                        return;
+                    }
+                    on_tick();
+                });
+            }
+
+            void on_tick() {
+                std::vector<std::function<void()>> expired;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    // Catch up if the io_context was busy
+                    const clock::time_point now = clock::now();
+                    while (next_tick_ <= now) {
+                        ++current_tick_;
+                        next_tick_ += tick;
+                        collect(expired);
+                    }
+                    if (size_ == 0) {
+                        // Nothing to wait for, stop until the next timer is armed
+                        running_ = false;
+                    } else {
+                        arm();
+                    }
+                }
+                // Run the callbacks without holding the lock so they can re-arm
+                for (auto& f : expired) {
+                    if (f) {
+                        f();
+                    }
+                }
+            }
+
+            void collect(std::vector<std::function<void()>>& expired) {
+                node* n = slots_[current_tick_ % number_of_slots];
+                while (n) {
+                    node* next = n->next;
+                    if (n->deadline <= current_tick_) {
+                        unlink(*n);
+                        --size_;
+                        expired.push_back(n->on_expire);
+                    } else if (n->deadline % number_of_slots != n->slot) {
+                        // The deadline moved: relink in its new slot
+                        unlink(*n);
+                        link(*n, n->deadline);
+                    }
+                    // else: the deadline is in a later round of this slot
+                    n = next;
+                }
+            }
+
+            mutable std::mutex mutex_;
+            boost::asio::steady_timer timer_;
+            std::vector<node*> slots_;
+            std::size_t size_{0};
+            std::uint64_t current_tick_{0};
+            clock::time_point next_tick_;
+            bool running_{false};
+            bool shut_down_{false};
+    };
+
+}
+
+#endif //WPP_TIMING_WHEEL_H
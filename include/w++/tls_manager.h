@@ -0,0 +1,350 @@
+//
+// TLS handshake cost reduction: session cache, ticket keys and handshake metrics.
+//
+
+#ifndef WPP_TLS_MANAGER_H
+#define WPP_TLS_MANAGER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+namespace wpp {
+
+    // Counters of the TLS handshakes of the server
+    struct tls_stats {
+        size_t full_handshakes{0};
+        size_t resumed_handshakes{0};
+        size_t failed_handshakes{0};
+        size_t ticket_key_rotations{0};
+        std::chrono::microseconds handshake_time{0};
+        std::chrono::steady_clock::time_point taken_at;
+
+        // Fraction of the successful handshakes that were resumed
+        double resumption_ratio() const {
+            const size_t total = full_handshakes + resumed_handshakes;
+            return total == 0 ? 0.0 : static_cast<double>(resumed_handshakes) / total;
+        }
+
+        std::chrono::microseconds average_handshake_time() const {
+            const size_t total = full_handshakes + resumed_handshakes + failed_handshakes;
+            return total == 0 ? std::chrono::microseconds{0} : handshake_time / static_cast<long>(total);
+        }
+    };
+
+    // Handshakes per second between two snapshots
+    struct tls_rates {
+        double handshakes_per_second{0.0};
+        double resumptions_per_second{0.0};
+        double failures_per_second{0.0};
+
+        static tls_rates between(const tls_stats &before, const tls_stats &after) {
+            tls_rates r;
+            const double seconds = std::chrono::duration<double>(after.taken_at - before.taken_at).count();
+            if (seconds <= 0.0) {
+                return r;
+            }
+            r.handshakes_per_second = (after.full_handshakes + after.resumed_handshakes -
+                                       before.full_handshakes - before.resumed_handshakes) / seconds;
+            r.resumptions_per_second = (after.resumed_handshakes - before.resumed_handshakes) / seconds;
+            r.failures_per_second = (after.failed_handshakes - before.failed_handshakes) / seconds;
+            return r;
+        }
+    };
+
+    // Configures the ssl::context of the server so clients can skip the
+    // expensive part of the handshake, and keeps the metrics of the handshakes.
+    //
+    // - Session cache: clients reconnecting with a session id resume it.
+    // - Session tickets: the session state is encrypted with a ticket key and
+    //   kept by the client. Keys rotate every `ticket_key_lifetime` and the
+    //   previous keys are still accepted (the ticket is then renewed), so a
+    //   stolen key only exposes a limited window of traffic.
+    // - ECDSA: with an ECDSA certificate next to the RSA one, clients that
+    //   support it get the (much cheaper to sign) ECDSA handshake.
+    // - Handshake threads: the CPU work of the handshakes can run on a
+    //   separate group of threads so it does not stall request processing.
+    class tls_manager {
+        public:
+            struct settings {
+                // 0 disables the session cache
+                size_t session_cache_size{20 * 1024};
+                std::chrono::seconds session_lifetime{std::chrono::hours(2)};
+                bool session_tickets{true};
+                std::chrono::seconds ticket_key_lifetime{std::chrono::hours(1)};
+                // tickets encrypted with the last N keys are accepted
+                size_t ticket_keys_kept{3};
+                // optional second certificate, preferred for clients that support it
+                std::string ecdsa_certificate_file;
+                std::string ecdsa_key_file;
+                // 0 runs handshakes on the I/O threads
+                size_t handshake_threads{0};
+            };
+
+            tls_manager() = default;
+
+            tls_manager(const tls_manager &) = delete;
+            tls_manager &operator=(const tls_manager &) = delete;
+
+            ~tls_manager() {
+                stop_handshake_threads();
+            }
+
+            // Should be called before the server starts
+            void configure(settings s) {
+                stop_handshake_threads();
+                settings_ = std::move(s);
+                if (settings_.handshake_threads > 0) {
+                    handshake_context_ = std::make_unique<boost::asio::io_context>();
+                    handshake_work_ = std::make_unique<work_guard>(handshake_context_->get_executor());
+                    for (size_t i = 0; i < settings_.handshake_threads; ++i) {
+                        handshake_threads_.emplace_back([this]() { handshake_context_->run(); });
+                    }
+                }
+            }
+
+            const settings &get_settings() const {
+                return settings_;
+            }
+
+            // Apply the settings to the context of the listener
+            void setup(boost::asio::ssl::context &ctx, bool http2 = false) {
+                SSL_CTX *native = ctx.native_handle();
+                SSL_CTX_set_ex_data(native, ex_data_index(), this);
+
+                // Prefer our cipher order: ECDHE with ECDSA first, then RSA
+                SSL_CTX_set_options(native, SSL_OP_CIPHER_SERVER_PREFERENCE);
+                SSL_CTX_set_cipher_list(native,
+                                        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-ECDSA-CHACHA20-POLY1305:"
+                                        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES128-GCM-SHA256:"
+                                        "ECDHE-RSA-CHACHA20-POLY1305:ECDHE-RSA-AES256-GCM-SHA384");
+                SSL_CTX_set1_curves_list(native, "X25519:P-256:P-384");
+                if (!settings_.ecdsa_certificate_file.empty() && !settings_.ecdsa_key_file.empty()) {
+                    ctx.use_certificate_chain_file(settings_.ecdsa_certificate_file);
+                    ctx.use_private_key_file(settings_.ecdsa_key_file, boost::asio::ssl::context::pem);
+                }
+
+                // Session cache
+                if (settings_.session_cache_size > 0) {
+                    static const unsigned char id_context[] = "wpp";
+                    SSL_CTX_set_session_id_context(native, id_context, sizeof(id_context) - 1);
+                    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+                    SSL_CTX_sess_set_cache_size(native, static_cast<long>(settings_.session_cache_size));
+                    SSL_CTX_set_timeout(native, static_cast<long>(settings_.session_lifetime.count()));
+                } else {
+                    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_OFF);
+                }
+
+                // Session tickets with our own rotating keys
+                if (settings_.session_tickets) {
+                    SSL_CTX_clear_options(native, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+                    SSL_CTX_set_tlsext_ticket_key_evp_cb(native, &tls_manager::ticket_key_callback);
+#else
+                    SSL_CTX_set_tlsext_ticket_key_cb(native, &tls_manager::ticket_key_callback);
+#endif
+                } else {
+                    SSL_CTX_set_options(native, SSL_OP_NO_TICKET);
+                }
+
+                // ALPN
+                SSL_CTX_set_alpn_select_cb(native, http2 ? &tls_manager::select_h2 : &tls_manager::select_http11, nullptr);
+            }
+
+            // Executor for the handshakes, or nullptr if they run on the I/O threads
+            boost::asio::io_context *handshake_context() {
+                return handshake_context_.get();
+            }
+
+            // Called by the sessions when a handshake is over
+            void record_handshake(SSL *ssl, bool ok, std::chrono::steady_clock::duration took) {
+                if (!ok) {
+                    failed_handshakes_.fetch_add(1, std::memory_order_relaxed);
+                } else if (SSL_session_reused(ssl)) {
+                    resumed_handshakes_.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    full_handshakes_.fetch_add(1, std::memory_order_relaxed);
+                }
+                handshake_time_us_.fetch_add(
+                        static_cast<size_t>(std::chrono::duration_cast<std::chrono::microseconds>(took).count()),
+                        std::memory_order_relaxed);
+            }
+
+            tls_stats stats() const {
+                tls_stats s;
+                s.full_handshakes = full_handshakes_.load(std::memory_order_relaxed);
+                s.resumed_handshakes = resumed_handshakes_.load(std::memory_order_relaxed);
+                s.failed_handshakes = failed_handshakes_.load(std::memory_order_relaxed);
+                s.handshake_time = std::chrono::microseconds(handshake_time_us_.load(std::memory_order_relaxed));
+                {
+                    std::lock_guard<std::mutex> lock(keys_mutex_);
+                    s.ticket_key_rotations = rotations_;
+                }
+                s.taken_at = std::chrono::steady_clock::now();
+                return s;
+            }
+
+        private:
+            using work_guard = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+
+            struct ticket_key {
+                unsigned char name[16];
+                unsigned char aes_key[32];
+                unsigned char hmac_key[32];
+                std::chrono::steady_clock::time_point created;
+            };
+
+            void stop_handshake_threads() {
+                handshake_work_.reset();
+                if (handshake_context_) {
+                    handshake_context_->stop();
+                }
+                for (auto &&t : handshake_threads_) {
+                    t.join();
+                }
+                handshake_threads_.clear();
+                handshake_context_.reset();
+            }
+
+            // Slot of the manager in the SSL_CTX (asio owns the app data)
+            static int ex_data_index() {
+                static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+                return index;
+            }
+
+            // Requires the lock. Keys are rotated lazily when a ticket is issued.
+            const ticket_key &current_key() {
+                const auto now = std::chrono::steady_clock::now();
+                if (keys_.empty() || now - keys_.front().created >= settings_.ticket_key_lifetime) {
+                    ticket_key k;
+                    RAND_bytes(k.name, sizeof(k.name));
+                    RAND_bytes(k.aes_key, sizeof(k.aes_key));
+                    RAND_bytes(k.hmac_key, sizeof(k.hmac_key));
+                    k.created = now;
+                    keys_.push_front(k);
+                    while (keys_.size() > std::max<size_t>(1, settings_.ticket_keys_kept)) {
+                        OPENSSL_cleanse(&keys_.back(), sizeof(ticket_key));
+                        keys_.pop_back();
+                    }
+                    ++rotations_;
+                }
+                return keys_.front();
+            }
+
+            // The MAC of tickets: EVP_MAC since OpenSSL 3, where HMAC_CTX
+            // and its callback are deprecated
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            using ticket_mac = EVP_MAC_CTX;
+
+            static bool init_mac(ticket_mac *mac, const ticket_key &k) {
+                OSSL_PARAM params[] = {
+                        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(k.hmac_key),
+                                                          sizeof(k.hmac_key)),
+                        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+                        OSSL_PARAM_construct_end()};
+                return EVP_MAC_CTX_set_params(mac, params) == 1;
+            }
+#else
+            using ticket_mac = HMAC_CTX;
+
+            static bool init_mac(ticket_mac *mac, const ticket_key &k) {
+                return HMAC_Init_ex(mac, k.hmac_key, sizeof(k.hmac_key), EVP_sha256(), nullptr) == 1;
+            }
+#endif
+
+            // Returns 1 to use the key, 2 to accept the ticket but issue a
+            // new one (old key), 0 if the ticket is unknown, -1 on error
+            static int ticket_key_callback(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+                                           EVP_CIPHER_CTX *cipher, ticket_mac *mac, int enc) {
+                auto *self = static_cast<tls_manager *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+                if (!self) {
+                    return -1;
+                }
+                std::lock_guard<std::mutex> lock(self->keys_mutex_);
+                if (enc) {
+                    const ticket_key &k = self->current_key();
+                    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+                        return -1;
+                    }
+                    std::memcpy(key_name, k.name, sizeof(k.name));
+                    if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, k.aes_key, iv) != 1 ||
+                        !init_mac(mac, k)) {
+                        return -1;
+                    }
+                    return 1;
+                }
+                for (size_t i = 0; i < self->keys_.size(); ++i) {
+                    const ticket_key &k = self->keys_[i];
+                    if (std::memcmp(key_name, k.name, sizeof(k.name)) == 0) {
+                        if (!init_mac(mac, k) ||
+                            EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, k.aes_key, iv) != 1) {
+                            return -1;
+                        }
+                        return i == 0 ? 1 : 2;
+                    }
+                }
+                return 0;
+            }
+
+            static int select_protocol(const unsigned char **out, unsigned char *outlen,
+                                       const unsigned char *in, unsigned int inlen,
+                                       const unsigned char *protocols, unsigned int protocols_len) {
+                if (SSL_select_next_proto(const_cast<unsigned char **>(out), outlen,
+                                          protocols, protocols_len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+                    return SSL_TLSEXT_ERR_NOACK;
+                }
+                return SSL_TLSEXT_ERR_OK;
+            }
+
+            static int select_h2(SSL *, const unsigned char **out, unsigned char *outlen,
+                                 const unsigned char *in, unsigned int inlen, void *) {
+                static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+                return select_protocol(out, outlen, in, inlen, protocols, sizeof(protocols) - 1);
+            }
+
+            static int select_http11(SSL *, const unsigned char **out, unsigned char *outlen,
+                                     const unsigned char *in, unsigned int inlen, void *) {
+                static const unsigned char protocols[] = "\x08http/1.1";
+                return select_protocol(out, outlen, in, inlen, protocols, sizeof(protocols) - 1);
+            }
+
+            settings settings_;
+
+            // ticket keys, newest first
+            mutable std::mutex keys_mutex_;
+            std::deque<ticket_key> keys_;
+            size_t rotations_{0};
+
+            std::unique_ptr<boost::asio::io_context> handshake_context_;
+            std::unique_ptr<work_guard> handshake_work_;
+            std::vector<std::thread> handshake_threads_;
+
+            std::atomic<size_t> full_handshakes_{0};
+            std::atomic<size_t> resumed_handshakes_{0};
+            std::atomic<size_t> failed_handshakes_{0};
+            std::atomic<size_t> handshake_time_us_{0};
+    };
+
+}
+
+#endif //WPP_TLS_MANAGER_H
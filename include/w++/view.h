@@ -0,0 +1,29 @@
+//
+// Compiled templates.
+//
+
+#ifndef WPP_VIEW_H
+#define WPP_VIEW_H
+
+// Escaping of variables
+#include "view/html_escape.h"
+// Where pages are rendered to
+#include "view/output_sink.h"
+// The data of a page
+#include "view/render_context.h"
+// Templates compiled into plans
+#include "view/render_plan.h"
+// Memoized view data
+#include "view/data_provider.h"
+// Rendered fragments of {{#@cache}} sections
+#include "view/fragment_cache.h"
+// Results of pure lambdas
+#include "view/lambda_cache.h"
+// Templates compiled into C++ at build time
+#include "view/compiled_template.h"
+// Rendering plans
+#include "view/renderer.h"
+// The templates of an application, with hot reload
+#include "view/plan_registry.h"
+
+#endif //WPP_VIEW_H
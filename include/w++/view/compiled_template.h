@@ -0,0 +1,50 @@
+//
+// Templates compiled into C++ at build time.
+//
+
+#ifndef WPP_VIEW_COMPILED_TEMPLATE_H
+#define WPP_VIEW_COMPILED_TEMPLATE_H
+
+#include <map>
+#include <string>
+
+namespace wpp {
+    namespace views {
+        class render_scope;
+
+        // A template turned into a function by wpp_template_compiler
+        using compiled_render = void (*)(render_scope &);
+
+        // The functions generated into this binary, by template name. Every
+        // registry links them when it loads and uses them in place of the
+        // plans of the same name.
+        class compiled_templates {
+            public:
+                static void add(const std::string &name, compiled_render f) {
+                    table()[name] = f;
+                }
+
+                static const std::map<std::string, compiled_render> &all() {
+                    return table();
+                }
+
+            private:
+                // Registrars run during static initialization of other
+                // translation units, so the table is built on first use
+                static std::map<std::string, compiled_render> &table() {
+                    static std::map<std::string, compiled_render> t;
+                    return t;
+                }
+        };
+
+        // Generated sources register each function with a static registrar
+        struct compiled_registrar {
+            compiled_registrar(const char *name, compiled_render f) {
+                compiled_templates::add(name, f);
+            }
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_COMPILED_TEMPLATE_H
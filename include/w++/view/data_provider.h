@@ -0,0 +1,145 @@
+//
+// Memoized view data.
+//
+
+#ifndef WPP_VIEW_DATA_PROVIDER_H
+#define WPP_VIEW_DATA_PROVIDER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "utils/json.hpp"
+
+namespace wpp {
+    using json = nlohmann::json;
+
+    namespace views {
+
+        // The data a view_data function returns, computed once per ttl
+        // instead of once per render.
+        //
+        // - Within ttl, renders get the value as it is.
+        // - Within ttl + stale, renders still get the old value while one
+        //   background task computes the new one (stale-while-revalidate).
+        // - After that, or after invalidate(), the next render computes it.
+        //   Renders that arrive meanwhile wait for that computation instead
+        //   of running the function again (single flight).
+        //
+        // A ttl of zero computes the value on every render.
+        class data_provider : public std::enable_shared_from_this<data_provider> {
+            public:
+                using clock = std::chrono::steady_clock;
+                using scheduler = std::function<void(std::function<void()>)>;
+
+                data_provider(std::function<json()> compute, std::chrono::milliseconds ttl,
+                              std::chrono::milliseconds stale, scheduler schedule)
+                        : compute_(std::move(compute)), ttl_(ttl), stale_(stale), schedule_(std::move(schedule)) {}
+
+                std::shared_ptr<const json> get() {
+                    if (ttl_.count() <= 0) {
+                        return std::make_shared<const json>(compute_());
+                    }
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    while (true) {
+                        const clock::time_point now = clock::now();
+                        if (value_ && now < computed_at_ + ttl_) {
+                            return value_;
+                        }
+                        if (value_ && now < computed_at_ + ttl_ + stale_) {
+                            if (!computing_ && schedule_) {
+                                computing_ = true;
+                                const uint64_t epoch = epoch_;
+                                std::shared_ptr<data_provider> self = shared_from_this();
+                                lock.unlock();
+                                schedule_([self, epoch]() { self->refresh(epoch); });
+                                lock.lock();
+                            }
+                            return value_;
+                        }
+                        if (!computing_) {
+                            break;
+                        }
+                        // someone else is computing it
+                        done_.wait(lock);
+                        if (failed_ && !value_) {
+                            std::exception_ptr e = failed_;
+                            std::rethrow_exception(e);
+                        }
+                    }
+                    computing_ = true;
+                    failed_ = nullptr;
+                    const uint64_t epoch = epoch_;
+                    lock.unlock();
+                    try {
+                        auto v = std::make_shared<const json>(compute_());
+                        lock.lock();
+                        store(std::move(v), epoch);
+                        return value_;
+                    } catch (...) {
+                        lock.lock();
+                        computing_ = false;
+                        failed_ = std::current_exception();
+                        done_.notify_all();
+                        throw;
+                    }
+                }
+
+                // The next render computes the value again
+                void invalidate() {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    value_.reset();
+                    ++epoch_;
+                }
+
+            private:
+                void refresh(uint64_t epoch) {
+                    try {
+                        auto v = std::make_shared<const json>(compute_());
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        store(std::move(v), epoch);
+                    } catch (...) {
+                        // keep serving the stale value until it expires
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        computing_ = false;
+                        done_.notify_all();
+                    }
+                }
+
+                // Requires the lock. A value computed before an invalidation is not kept.
+                void store(std::shared_ptr<const json> v, uint64_t epoch) {
+                    computing_ = false;
+                    if (epoch == epoch_) {
+                        value_ = std::move(v);
+                        computed_at_ = clock::now();
+                    } else if (!value_) {
+                        // still better than nothing for the renders waiting on it
+                        value_ = std::move(v);
+                        computed_at_ = clock::time_point{};
+                    }
+                    done_.notify_all();
+                }
+
+                const std::function<json()> compute_;
+                const std::chrono::milliseconds ttl_;
+                const std::chrono::milliseconds stale_;
+                const scheduler schedule_;
+
+                std::mutex mutex_;
+                std::condition_variable done_;
+                std::shared_ptr<const json> value_;
+                clock::time_point computed_at_;
+                bool computing_{false};
+                std::exception_ptr failed_;
+                uint64_t epoch_{0};
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_DATA_PROVIDER_H
@@ -0,0 +1,111 @@
+//
+// Rendered fragments of templates, kept for a while.
+//
+
+#ifndef WPP_VIEW_FRAGMENT_CACHE_H
+#define WPP_VIEW_FRAGMENT_CACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "../cache.h"
+
+namespace wpp {
+    namespace views {
+
+        // Fragments rendered by {{#@cache key ttl}}...{{/@cache}}. A fragment
+        // is kept for its ttl or until it is invalidated, and the sections in
+        // it are not rendered again in the meantime. Keys are prefixed with
+        // the name of the template of the section (see key_of).
+        //
+        // The application keeps them in its own cache (get_cache()) under a
+        // key prefix, so fragments and the other values share one bound and
+        // one eviction. A registry used on its own has a cache of its own.
+        class fragment_cache {
+            public:
+                using clock = std::chrono::steady_clock;
+
+                explicit fragment_cache(size_t max_entries = 10000)
+                        : own_(std::make_unique<wpp::cache>(std::chrono::hours(24), max_entries)), cache_(own_.get()) {}
+
+                fragment_cache(const fragment_cache &) = delete;
+                fragment_cache &operator=(const fragment_cache &) = delete;
+
+                // Keep the fragments in a shared cache, under prefix.
+                // Call before the server starts.
+                void store_in(wpp::cache &shared, std::string prefix) {
+                    cache_ = &shared;
+                    prefix_ = std::move(prefix);
+                    own_.reset();
+                }
+
+                // The key of a fragment of a template
+                static std::string key_of(const std::string &view, const std::string &key) {
+                    return view + ":" + key;
+                }
+
+                // The fragment, or nullptr if it is missing or expired
+                std::shared_ptr<const std::string> get(const std::string &key) {
+                    std::shared_ptr<const std::string> fragment = cache_->get(prefix_ + key);
+                    (fragment ? hits_ : misses_).fetch_add(1, std::memory_order_relaxed);
+                    return fragment;
+                }
+
+                void put(const std::string &key, std::string fragment, std::chrono::seconds ttl) {
+                    cache_->put(prefix_ + key, std::move(fragment), ttl);
+                }
+
+                void invalidate(const std::string &key) {
+                    cache_->erase(prefix_ + key);
+                }
+
+                // Every fragment whose key starts with prefix
+                void invalidate_prefix(const std::string &prefix) {
+                    const std::string full = prefix_ + prefix;
+                    cache_->erase_if([&full](const std::string &key) {
+                        return key.compare(0, full.size(), full) == 0;
+                    });
+                }
+
+                // A fragment of a template, or those whose key starts with prefix
+                void invalidate(const std::string &view, const std::string &key) {
+                    invalidate(key_of(view, key));
+                }
+
+                void invalidate_prefix(const std::string &view, const std::string &prefix) {
+                    invalidate_prefix(key_of(view, prefix));
+                }
+
+                // Every fragment, and nothing else of a shared cache
+                void clear() {
+                    if (own_) {
+                        own_->clear();
+                    } else {
+                        invalidate_prefix("");
+                    }
+                }
+
+                size_t hits() const {
+                    return hits_.load(std::memory_order_relaxed);
+                }
+
+                size_t misses() const {
+                    return misses_.load(std::memory_order_relaxed);
+                }
+
+            private:
+                std::unique_ptr<wpp::cache> own_;
+                wpp::cache *cache_;
+                std::string prefix_;
+                std::atomic<size_t> hits_{0};
+                std::atomic<size_t> misses_{0};
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_FRAGMENT_CACHE_H
@@ -0,0 +1,274 @@
+//
+// HTML escaping of template variables.
+//
+
+#ifndef WPP_VIEW_HTML_ESCAPE_H
+#define WPP_VIEW_HTML_ESCAPE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// SSE2 and NEON are always there on x86-64 and AArch64. AVX2 is used if
+// the CPU has it.
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define WPP_HTML_ESCAPE_SSE2
+#define WPP_HTML_ESCAPE_AVX2
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define WPP_HTML_ESCAPE_NEON
+#include <arm_neon.h>
+#endif
+
+namespace wpp {
+    namespace views {
+
+        namespace detail {
+            // & < > " ' /
+            inline bool needs_escape(char c) {
+                switch (c) {
+                    case '&': case '<': case '>': case '"': case '\'': case '/':
+                        return true;
+                    default:
+                        return false;
+                }
+            }
+
+            // What escaping adds to the size: &amp; is 4 bytes more than &
+            inline size_t escape_growth(char c) {
+                switch (c) {
+                    case '&': case '\'': return 4;
+                    case '<': case '>': return 3;
+                    case '"': case '/': return 5;
+                    default: return 0;
+                }
+            }
+
+            // Index of the first character to escape in [s, s + n), or n
+            inline size_t find_escape_scalar(const char *s, size_t n) {
+                size_t i = 0;
+                while (i < n && !needs_escape(s[i])) {
+                    ++i;
+                }
+                return i;
+            }
+
+            // Size of [s, s + n) once escaped
+            inline size_t escaped_size_scalar(const char *s, size_t n) {
+                size_t size = n;
+                for (size_t i = 0; i < n; ++i) {
+                    size += escape_growth(s[i]);
+                }
+                return size;
+            }
+
+#ifdef WPP_HTML_ESCAPE_SSE2
+            inline size_t find_escape_sse2(const char *s, size_t n) {
+                const __m128i amp = _mm_set1_epi8('&');
+                const __m128i lt = _mm_set1_epi8('<');
+                const __m128i gt = _mm_set1_epi8('>');
+                const __m128i quot = _mm_set1_epi8('"');
+                const __m128i apos = _mm_set1_epi8('\'');
+                const __m128i slash = _mm_set1_epi8('/');
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+                    const __m128i hit = _mm_or_si128(
+                            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, quot))),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, apos), _mm_cmpeq_epi8(v, slash)));
+                    const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+                    if (mask) {
+                        return i + __builtin_ctz(mask);
+                    }
+                }
+                return i + find_escape_scalar(s + i, n - i);
+            }
+
+            inline size_t escaped_size_sse2(const char *s, size_t n) {
+                size_t size = n;
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+                    const unsigned by4 = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(
+                            _mm_cmpeq_epi8(v, _mm_set1_epi8('&')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')))));
+                    const unsigned by3 = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(
+                            _mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_cmpeq_epi8(v, _mm_set1_epi8('>')))));
+                    const unsigned by5 = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(
+                            _mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))));
+                    size += 4 * __builtin_popcount(by4) + 3 * __builtin_popcount(by3) + 5 * __builtin_popcount(by5);
+                }
+                return size + escaped_size_scalar(s + i, n - i) - (n - i);
+            }
+#endif
+
+#ifdef WPP_HTML_ESCAPE_AVX2
+            __attribute__((target("avx2")))
+            inline size_t find_escape_avx2(const char *s, size_t n) {
+                const __m256i amp = _mm256_set1_epi8('&');
+                const __m256i lt = _mm256_set1_epi8('<');
+                const __m256i gt = _mm256_set1_epi8('>');
+                const __m256i quot = _mm256_set1_epi8('"');
+                const __m256i apos = _mm256_set1_epi8('\'');
+                const __m256i slash = _mm256_set1_epi8('/');
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+                    const __m256i hit = _mm256_or_si256(
+                            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+                                            _mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, quot))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, apos), _mm256_cmpeq_epi8(v, slash)));
+                    const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+                    if (mask) {
+                        return i + __builtin_ctz(mask);
+                    }
+                }
+                return i + find_escape_sse2(s + i, n - i);
+            }
+
+            __attribute__((target("avx2,popcnt")))
+            inline size_t escaped_size_avx2(const char *s, size_t n) {
+                size_t size = n;
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+                    const unsigned by4 = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')))));
+                    const unsigned by3 = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')))));
+                    const unsigned by5 = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')))));
+                    size += 4 * __builtin_popcount(by4) + 3 * __builtin_popcount(by3) + 5 * __builtin_popcount(by5);
+                }
+                return size + escaped_size_sse2(s + i, n - i) - (n - i);
+            }
+#endif
+
+#ifdef WPP_HTML_ESCAPE_NEON
+            inline size_t find_escape_neon(const char *s, size_t n) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(s + i));
+                    const uint8x16_t hit = vorrq_u8(
+                            vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('&')), vceqq_u8(v, vdupq_n_u8('<'))),
+                                     vorrq_u8(vceqq_u8(v, vdupq_n_u8('>')), vceqq_u8(v, vdupq_n_u8('"')))),
+                            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\'')), vceqq_u8(v, vdupq_n_u8('/'))));
+                    // one nibble per byte
+                    const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+                    if (mask) {
+                        return i + (__builtin_ctzll(mask) >> 2);
+                    }
+                }
+                return i + find_escape_scalar(s + i, n - i);
+            }
+#endif
+
+            using find_escape_function = size_t (*)(const char *, size_t);
+            using escaped_size_function = size_t (*)(const char *, size_t);
+
+            struct escape_isa {
+                find_escape_function find;
+                escaped_size_function size;
+                const char *name;
+            };
+
+            // The widest scanner the CPU supports, chosen once per process
+            inline const escape_isa &selected_escape_isa() {
+                static const escape_isa isa = []() -> escape_isa {
+#ifdef WPP_HTML_ESCAPE_AVX2
+                    __builtin_cpu_init();
+                    if (__builtin_cpu_supports("avx2")) {
+                        return {find_escape_avx2, escaped_size_avx2, "avx2"};
+                    }
+#endif
+#if defined(WPP_HTML_ESCAPE_SSE2)
+                    return {find_escape_sse2, escaped_size_sse2, "sse2"};
+#elif defined(WPP_HTML_ESCAPE_NEON)
+                    return {find_escape_neon, escaped_size_scalar, "neon"};
+#else
+                    return {find_escape_scalar, escaped_size_scalar, "scalar"};
+#endif
+                }();
+                return isa;
+            }
+
+            inline void escape_replacement(char c, const char *&replacement, size_t &length) {
+                switch (c) {
+                    case '&': replacement = "&amp;"; length = 5; break;
+                    case '<': replacement = "&lt;"; length = 4; break;
+                    case '>': replacement = "&gt;"; length = 4; break;
+                    case '"': replacement = "&quot;"; length = 6; break;
+                    case '\'': replacement = "&#39;"; length = 5; break;
+                    default: replacement = "&#x2F;"; length = 6; break;
+                }
+            }
+        }
+
+        // The instruction set the escaper uses, for logs and benchmarks
+        inline const char *html_escape_isa() {
+            return detail::selected_escape_isa().name;
+        }
+
+        // Escape the characters mustache escapes. Runs of clean characters
+        // and replacements are passed to append(const char *, size_t).
+        //
+        // Clean runs are found 16 or 32 bytes at a time, with the widest
+        // instructions the CPU has, and passed on in one piece.
+        template<class Append>
+        inline void html_escape(const char *s, size_t n, Append &&append) {
+            const detail::find_escape_function find = detail::selected_escape_isa().find;
+            size_t clean = 0;
+            while (clean < n) {
+                // In markup the next one is usually close: a few bytes are
+                // cheaper to look at one by one than to start a scan
+                const size_t probe = clean + 8 < n ? clean + 8 : n;
+                size_t i = clean;
+                while (i < probe && !detail::needs_escape(s[i])) {
+                    ++i;
+                }
+                if (i == probe && i < n) {
+                    i += find(s + i, n - i);
+                }
+                if (i != clean) {
+                    append(s + clean, i - clean);
+                }
+                if (i == n) {
+                    return;
+                }
+                const char *replacement;
+                size_t length;
+                detail::escape_replacement(s[i], replacement, length);
+                append(replacement, length);
+                clean = i + 1;
+            }
+        }
+
+        // Append s to out, escaped. The escaped size is counted first, so
+        // the string grows once and the runs are copied straight into it.
+        inline void html_escape(const char *s, size_t n, std::string &out) {
+            const detail::escape_isa &isa = detail::selected_escape_isa();
+            const size_t size = isa.size(s, n);
+            if (size == n) {
+                out.append(s, n);
+                return;
+            }
+            const size_t start = out.size();
+            out.resize(start + size);
+            char *dst = &out[start];
+            html_escape(s, n, [&dst](const char *p, size_t k) {
+                std::memcpy(dst, p, k);
+                dst += k;
+            });
+        }
+
+        inline std::string html_escape(const std::string &s) {
+            std::string out;
+            html_escape(s.data(), s.size(), out);
+            return out;
+        }
+
+    }
+}
+
+#endif //WPP_VIEW_HTML_ESCAPE_H
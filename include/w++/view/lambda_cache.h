@@ -0,0 +1,99 @@
+//
+// Results of pure view lambdas.
+//
+
+#ifndef WPP_VIEW_LAMBDA_CACHE_H
+#define WPP_VIEW_LAMBDA_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace wpp {
+    namespace views {
+
+        // The results of a lambda registered as pure, by argument. The map
+        // is split in shards with a lock each, so renders on different
+        // threads rarely wait for each other, and holds at most
+        // max_entries results: a full shard drops one of its results,
+        // which only costs calling the lambda again.
+        class lambda_cache {
+            public:
+                explicit lambda_cache(size_t max_entries = 4096)
+                        : max_per_shard_(max_entries / shard_count ? max_entries / shard_count : 1) {}
+
+                // The result for arg, or nullptr
+                std::shared_ptr<const std::string> get(const std::string &arg) {
+                    shard &s = shard_of(arg);
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    auto it = s.results.find(arg);
+                    if (it == s.results.end()) {
+                        misses_.fetch_add(1, std::memory_order_relaxed);
+                        return nullptr;
+                    }
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                    return it->second;
+                }
+
+                std::shared_ptr<const std::string> put(const std::string &arg, std::string result) {
+                    auto r = std::make_shared<const std::string>(std::move(result));
+                    shard &s = shard_of(arg);
+                    std::lock_guard<std::mutex> lock(s.mutex);
+                    if (s.results.size() >= max_per_shard_ && !s.results.count(arg)) {
+                        s.results.erase(s.results.begin());
+                    }
+                    s.results[arg] = r;
+                    return r;
+                }
+
+                void clear() {
+                    for (shard &s : shards_) {
+                        std::lock_guard<std::mutex> lock(s.mutex);
+                        s.results.clear();
+                    }
+                }
+
+                size_t size() const {
+                    size_t n = 0;
+                    for (const shard &s : shards_) {
+                        std::lock_guard<std::mutex> lock(s.mutex);
+                        n += s.results.size();
+                    }
+                    return n;
+                }
+
+                size_t hits() const {
+                    return hits_.load(std::memory_order_relaxed);
+                }
+
+                size_t misses() const {
+                    return misses_.load(std::memory_order_relaxed);
+                }
+
+            private:
+                static constexpr size_t shard_count = 16;
+
+                struct shard {
+                    mutable std::mutex mutex;
+                    std::unordered_map<std::string, std::shared_ptr<const std::string>> results;
+                };
+
+                shard &shard_of(const std::string &arg) {
+                    return shards_[std::hash<std::string>()(arg) % shard_count];
+                }
+
+                const size_t max_per_shard_;
+                shard shards_[shard_count];
+                std::atomic<size_t> hits_{0};
+                std::atomic<size_t> misses_{0};
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_LAMBDA_CACHE_H
@@ -0,0 +1,128 @@
+//
+// Where rendered templates are written.
+//
+
+#ifndef WPP_VIEW_OUTPUT_SINK_H
+#define WPP_VIEW_OUTPUT_SINK_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "../chunked_writer.h"
+#include "html_escape.h"
+
+namespace wpp {
+    namespace views {
+
+        // The renderer writes the page here piece by piece instead of
+        // building it in a string of its own
+        class output_sink {
+            public:
+                virtual ~output_sink() = default;
+
+                virtual void write(const char *data, size_t n) = 0;
+
+                void write(const std::string &s) {
+                    write(s.data(), s.size());
+                }
+
+                virtual void write_escaped(const char *data, size_t n) {
+                    html_escape(data, n, [this](const char *p, size_t k) { write(p, k); });
+                }
+
+                // A hint of the size of the page, from previous renders
+                virtual void reserve(size_t) {}
+
+                // Everything was rendered
+                virtual void finish() {}
+        };
+
+        // Render into a string, usually the body of the response, so the
+        // page is written once where it is sent from
+        class string_sink : public output_sink {
+            public:
+                explicit string_sink(std::string &out) : out_(out) {}
+
+                void write(const char *data, size_t n) override {
+                    out_.append(data, n);
+                }
+
+                using output_sink::write;
+
+                void write_escaped(const char *data, size_t n) override {
+                    html_escape(data, n, out_);
+                }
+
+                void reserve(size_t n) override {
+                    out_.reserve(out_.size() + n);
+                }
+
+            private:
+                std::string &out_;
+        };
+
+        // Render into a chunked response. Pieces are gathered into chunks of
+        // chunk_size bytes, and each chunk goes to the connection while the
+        // rest of the page is still being rendered.
+        class chunked_sink : public output_sink {
+            public:
+                explicit chunked_sink(std::shared_ptr<chunked_writer> writer, size_t chunk_size = 16 * 1024)
+                        : writer_(std::move(writer)), chunk_size_(chunk_size) {
+                    buffer_.reserve(chunk_size_);
+                }
+
+                ~chunked_sink() override {
+                    finish();
+                }
+
+                void write(const char *data, size_t n) override {
+                    if (buffer_.size() + n > chunk_size_) {
+                        push();
+                        if (n >= chunk_size_) {
+                            writer_->write(data, n);
+                            return;
+                        }
+                    }
+                    buffer_.append(data, n);
+                }
+
+                using output_sink::write;
+
+                void write_escaped(const char *data, size_t n) override {
+                    if (buffer_.size() + n > chunk_size_) {
+                        push();
+                    }
+                    html_escape(data, n, buffer_);
+                    if (buffer_.size() >= chunk_size_) {
+                        push();
+                    }
+                }
+
+                void finish() override {
+                    if (!writer_) {
+                        return;
+                    }
+                    push();
+                    writer_->end();
+                    writer_.reset();
+                }
+
+            private:
+                void push() {
+                    if (!buffer_.empty()) {
+                        writer_->write(buffer_.data(), buffer_.size());
+                        buffer_.clear();
+                    }
+                }
+
+                std::shared_ptr<chunked_writer> writer_;
+                const size_t chunk_size_;
+                std::string buffer_;
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_OUTPUT_SINK_H
@@ -0,0 +1,471 @@
+//
+// The compiled templates of an application, with hot reload.
+//
+
+#ifndef WPP_VIEW_PLAN_REGISTRY_H
+#define WPP_VIEW_PLAN_REGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "renderer.h"
+
+namespace wpp {
+    namespace views {
+
+        // Every template under the root is compiled when the registry is
+        // loaded and published as one immutable plan_set. Partials and
+        // parents are linked by slot, so rebuilding a template replaces one
+        // entry of the set and the templates that include it see the new
+        // version at once.
+        //
+        // Rendering never locks: each thread keeps the set it last used and
+        // only takes a new one after the generation counter moves. In
+        // development, watch() rebuilds the templates that change on disk.
+        //
+        // Templates compiled into the binary by wpp_template_compiler are
+        // linked into the same slots and render instead of their plans, so
+        // they need not ship with it. While watching, the files on disk win.
+        class plan_registry {
+            public:
+                plan_registry() : id_(next_id()), fragments_(std::make_shared<fragment_cache>()) {
+                    auto empty = std::make_shared<plan_set>();
+                    empty->fragments = fragments_;
+                    publish(std::move(empty));
+                }
+
+                plan_registry(const plan_registry &) = delete;
+                plan_registry &operator=(const plan_registry &) = delete;
+
+                ~plan_registry() {
+                    watch(false);
+                }
+
+                // Compile all templates under root. Templates that do not
+                // compile are reported and left out. Returns false if any
+                // of them failed.
+                bool load(const std::string &root) {
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    root_ = root;
+                    auto next = std::make_shared<plan_set>();
+                    next->lambdas = current()->lambdas;
+                    next->fragments = fragments_;
+                    const bool ok = build_all(*next);
+                    link(*next);
+                    publish(std::move(next));
+                    fragments_->clear();
+                    return ok;
+                }
+
+                // Rebuild templates when they change on disk. Linux only.
+                bool watch(bool on_off = true) {
+                    if (!on_off) {
+                        stop_watching();
+                        return true;
+                    }
+                    if (!start_watching()) {
+                        return false;
+                    }
+                    // what is on disk is newer than what was compiled in
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    use_compiled_ = false;
+                    auto next = std::make_shared<plan_set>(*current());
+                    link(*next);
+                    publish(std::move(next));
+                    return true;
+                }
+
+                void lambda(const std::string &name, text_lambda f) {
+                    set_lambda(name, view_lambda{std::move(f), nullptr, nullptr});
+                }
+
+                void lambda(const std::string &name, scoped_lambda f) {
+                    set_lambda(name, view_lambda{nullptr, std::move(f), nullptr});
+                }
+
+                // A lambda whose result only depends on its argument. Results
+                // are memoized, up to max_entries of them, and lambdas with
+                // literal text are replaced by their result in the plans.
+                void pure_lambda(const std::string &name, text_lambda f, size_t max_entries = 4096) {
+                    set_lambda(name, view_lambda{std::move(f), nullptr, std::make_shared<lambda_cache>(max_entries)});
+                }
+
+                // The current set. Lock free unless templates changed since
+                // this thread last looked.
+                std::shared_ptr<const plan_set> current() const {
+                    struct cached {
+                        uint64_t owner{0};
+                        uint64_t generation{0};
+                        std::shared_ptr<const plan_set> set;
+                    };
+                    thread_local cached c;
+                    if (c.owner != id_ || c.generation != generation_.load(std::memory_order_acquire)) {
+                        std::lock_guard<std::mutex> lock(publish_mutex_);
+                        c.set = set_;
+                        c.generation = generation_.load(std::memory_order_relaxed);
+                        c.owner = id_;
+                    }
+                    return c.set;
+                }
+
+                bool contains(const std::string &name) const {
+                    std::shared_ptr<const plan_set> set = current();
+                    return set->contains(set->slot(name));
+                }
+
+                // Render a template into out. False if there is no such template.
+                bool render(const std::string &name, const render_context &data, std::string &out) const {
+                    std::shared_ptr<const plan_set> set = current();
+                    return views::render(*set, set->slot(name), data, out);
+                }
+
+                bool render(const std::string &name, const render_context &data, output_sink &out) const {
+                    std::shared_ptr<const plan_set> set = current();
+                    if (!views::render(*set, set->slot(name), data, out)) {
+                        return false;
+                    }
+                    out.finish();
+                    return true;
+                }
+
+                template<class Out>
+                bool render(const std::string &name, const json &data, Out &out) const {
+                    render_context context;
+                    context.merge(data);
+                    return render(name, context, out);
+                }
+
+                // Fragments of {{#@cache}} sections
+                fragment_cache &fragments() {
+                    return *fragments_;
+                }
+
+                // Incremented by every publish
+                uint64_t generation() const {
+                    return generation_.load(std::memory_order_acquire);
+                }
+
+            private:
+                static uint64_t next_id() {
+                    static std::atomic<uint64_t> id{0};
+                    return ++id;
+                }
+
+                void publish(std::shared_ptr<const plan_set> next) {
+                    std::lock_guard<std::mutex> lock(publish_mutex_);
+                    set_ = std::move(next);
+                    generation_.fetch_add(1, std::memory_order_release);
+                }
+
+                std::string relative_name(const boost::filesystem::path &p) const {
+                    return p.lexically_relative(root_).generic_string();
+                }
+
+                // Requires the write lock
+                uint32_t slot(const std::string &name) {
+                    auto it = slots_.find(name);
+                    if (it != slots_.end()) {
+                        return it->second;
+                    }
+                    const uint32_t s = static_cast<uint32_t>(slots_.size());
+                    slots_.emplace(name, s);
+                    return s;
+                }
+
+                // Requires the write lock. Compile every file under the root.
+                bool build_all(plan_set &next) {
+                    bool ok = true;
+                    boost::system::error_code ec;
+                    if (boost::filesystem::is_directory(root_, ec)) {
+                        for (boost::filesystem::recursive_directory_iterator it(root_, ec), end; !ec && it != end; it.increment(ec)) {
+                            if (boost::filesystem::is_regular_file(it->path(), ec)) {
+                                ok = build(relative_name(it->path()), next) && ok;
+                            }
+                        }
+                    }
+                    return ok;
+                }
+
+                // Requires the write lock. Compile one file into the set.
+                bool build(const std::string &name, plan_set &next) {
+                    std::ifstream in((boost::filesystem::path(root_) / name).string(), std::ios::binary);
+                    if (!in) {
+                        return false;
+                    }
+                    std::stringstream source;
+                    source << in.rdbuf();
+                    // pure lambdas with literal text become text, unless
+                    // what they return is a template itself
+                    const lambda_table *lambdas = next.lambdas.get();
+                    auto fold = [lambdas](const std::string &lambda, const std::string &raw, std::string &out) {
+                        if (!lambdas) {
+                            return false;
+                        }
+                        auto it = lambdas->find(lambda);
+                        if (it == lambdas->end() || !it->second.pure()) {
+                            return false;
+                        }
+                        const std::shared_ptr<const std::string> result = it->second.call(raw);
+                        if (result->find("{{") != std::string::npos) {
+                            return false;
+                        }
+                        out = *result;
+                        return true;
+                    };
+                    try {
+                        std::shared_ptr<const render_plan> plan = render_plan::compile(
+                                name, source.str(), [this](const std::string &partial) { return slot(partial); }, fold);
+                        const uint32_t s = slot(name);
+                        if (next.plans.size() <= s) {
+                            next.plans.resize(s + 1);
+                        }
+                        next.plans[s] = std::move(plan);
+                        return true;
+                    } catch (const template_error &e) {
+                        std::cerr << "template error: " << e.what() << std::endl;
+                        return false;
+                    }
+                }
+
+                // Requires the write lock
+                void link(plan_set &next) {
+                    next.compiled.clear();
+                    if (use_compiled_) {
+                        for (auto &f : compiled_templates::all()) {
+                            const uint32_t s = slot(f.first);
+                            next.compiled.resize(slots_.size());
+                            next.compiled[s] = f.second;
+                        }
+                    }
+                    next.plans.resize(slots_.size());
+                    next.slots = std::make_shared<const std::unordered_map<std::string, uint32_t>>(slots_);
+                    std::vector<std::string> names(slots_.size());
+                    for (auto &s : slots_) {
+                        names[s.second] = s.first;
+                    }
+                    for (auto &plan : next.plans) {
+                        if (!plan) {
+                            continue;
+                        }
+                        for (uint32_t d : plan->dependencies()) {
+                            if (!next.contains(d)) {
+                                std::cerr << "template " << plan->name() << ": \"" << names[d] << "\" not found" << std::endl;
+                            }
+                        }
+                        // lambdas are registered before the templates load
+                        for (const render_plan::instruction &ins : plan->code()) {
+                            if (ins.code == render_plan::op::lambda &&
+                                (!next.lambdas || !next.lambdas->count(plan->text(ins.arg)))) {
+                                std::cerr << "template " << plan->name() << ": lambda \"" << plan->text(ins.arg)
+                                          << "\" not found" << std::endl;
+                            }
+                        }
+                    }
+                }
+
+                void set_lambda(const std::string &name, view_lambda f) {
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    std::shared_ptr<const plan_set> now = current();
+                    auto lambdas = now->lambdas ? std::make_shared<lambda_table>(*now->lambdas)
+                                                : std::make_shared<lambda_table>();
+                    auto previous = lambdas->find(name);
+                    // plans may have folded the old one or can fold the new one
+                    const bool refold = f.pure() || (previous != lambdas->end() && previous->second.pure());
+                    (*lambdas)[name] = std::move(f);
+                    auto next = std::make_shared<plan_set>(*now);
+                    next->lambdas = std::move(lambdas);
+                    if (refold && !root_.empty()) {
+                        build_all(*next);
+                        link(*next);
+                        publish(std::move(next));
+                        fragments_->clear();
+                        return;
+                    }
+                    publish(std::move(next));
+                }
+
+                // Rebuild the templates that changed and forget the removed ones
+                void rebuild(const std::set<std::string> &changed, const std::set<std::string> &removed) {
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    auto next = std::make_shared<plan_set>(*current());
+                    for (const std::string &name : removed) {
+                        auto it = slots_.find(name);
+                        if (it != slots_.end() && it->second < next->plans.size()) {
+                            next->plans[it->second].reset();
+                        }
+                    }
+                    size_t built = 0;
+                    for (const std::string &name : changed) {
+                        built += build(name, *next);
+                    }
+                    link(*next);
+                    publish(std::move(next));
+                    // fragments rendered by the old versions
+                    fragments_->clear();
+                    std::cout << "templates: " << built << " rebuilt, " << removed.size() << " removed" << std::endl;
+                }
+
+#ifdef __linux__
+                bool start_watching() {
+                    std::lock_guard<std::mutex> lock(watch_mutex_);
+                    if (watcher_.joinable()) {
+                        return true;
+                    }
+                    if (root_.empty()) {
+                        return false;
+                    }
+                    inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                    if (inotify_fd_ < 0) {
+                        return false;
+                    }
+                    if (::pipe2(stop_pipe_, O_CLOEXEC) != 0) {
+                        ::close(inotify_fd_);
+                        inotify_fd_ = -1;
+                        return false;
+                    }
+                    std::set<std::string> ignored;
+                    add_watches(root_, ignored);
+                    watcher_ = std::thread([this]() { watch_loop(); });
+                    return true;
+                }
+
+                void stop_watching() {
+                    std::lock_guard<std::mutex> lock(watch_mutex_);
+                    if (!watcher_.joinable()) {
+                        return;
+                    }
+                    const char c = 0;
+                    while (::write(stop_pipe_[1], &c, 1) < 0 && errno == EINTR) {
+                    }
+                    watcher_.join();
+                    ::close(inotify_fd_);
+                    ::close(stop_pipe_[0]);
+                    ::close(stop_pipe_[1]);
+                    inotify_fd_ = -1;
+                    watched_.clear();
+                }
+
+                // Watch dir and its subdirectories and list the files in them
+                void add_watches(const boost::filesystem::path &dir, std::set<std::string> &files) {
+                    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+                    const int wd = ::inotify_add_watch(inotify_fd_, dir.string().c_str(), mask);
+                    if (wd < 0) {
+                        return;
+                    }
+                    watched_[wd] = dir;
+                    boost::system::error_code ec;
+                    for (boost::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+                        if (boost::filesystem::is_directory(it->path(), ec)) {
+                            add_watches(it->path(), files);
+                        } else if (boost::filesystem::is_regular_file(it->path(), ec)) {
+                            files.insert(relative_name(it->path()));
+                        }
+                    }
+                }
+
+                void watch_loop() {
+                    alignas(struct inotify_event) char buffer[16 * 1024];
+                    while (true) {
+                        pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+                        if (::poll(fds, 2, -1) < 0) {
+                            if (errno == EINTR) {
+                                continue;
+                            }
+                            return;
+                        }
+                        if (fds[1].revents) {
+                            return;
+                        }
+                        std::set<std::string> changed;
+                        std::set<std::string> removed;
+                        bool reload_all = false;
+                        ssize_t n;
+                        while ((n = ::read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+                            for (char *p = buffer; p < buffer + n;) {
+                                const auto *e = reinterpret_cast<const struct inotify_event *>(p);
+                                p += sizeof(struct inotify_event) + e->len;
+                                if (e->mask & IN_Q_OVERFLOW) {
+                                    reload_all = true;
+                                    continue;
+                                }
+                                auto dir = watched_.find(e->wd);
+                                if (dir == watched_.end() || e->len == 0) {
+                                    if (e->mask & IN_IGNORED) {
+                                        watched_.erase(e->wd);
+                                    }
+                                    continue;
+                                }
+                                const boost::filesystem::path path = dir->second / e->name;
+                                if (e->mask & IN_ISDIR) {
+                                    if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+                                        add_watches(path, changed);
+                                    }
+                                } else if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                                    removed.erase(relative_name(path));
+                                    changed.insert(relative_name(path));
+                                } else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                                    changed.erase(relative_name(path));
+                                    removed.insert(relative_name(path));
+                                }
+                            }
+                        }
+                        if (reload_all) {
+                            load(root_);
+                        } else if (!changed.empty() || !removed.empty()) {
+                            rebuild(changed, removed);
+                        }
+                    }
+                }
+
+                int inotify_fd_{-1};
+                int stop_pipe_[2]{-1, -1};
+                std::unordered_map<int, boost::filesystem::path> watched_;
+#else
+                bool start_watching() {
+                    return false;
+                }
+
+                void stop_watching() {}
+#endif
+
+                const uint64_t id_;
+                const std::shared_ptr<fragment_cache> fragments_;
+
+                // Published set, replaced as a whole
+                mutable std::mutex publish_mutex_;
+                std::shared_ptr<const plan_set> set_;
+                std::atomic<uint64_t> generation_{0};
+
+                // Serializes compilation
+                std::mutex write_mutex_;
+                std::string root_;
+                std::unordered_map<std::string, uint32_t> slots_;
+                bool use_compiled_{true};
+
+                std::mutex watch_mutex_;
+                std::thread watcher_;
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_PLAN_REGISTRY_H
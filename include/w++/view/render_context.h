@@ -0,0 +1,576 @@
+//
+// The data of a page, flat and arena allocated.
+//
+
+#ifndef WPP_VIEW_RENDER_CONTEXT_H
+#define WPP_VIEW_RENDER_CONTEXT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "utils/json.hpp"
+
+namespace wpp {
+    using json = nlohmann::json;
+
+    namespace views {
+
+        // FNV-1a. Keys are hashed when templates are compiled and when
+        // objects are built, so lookups compare hashes before strings.
+        constexpr uint64_t key_hash(std::string_view key) {
+            uint64_t h = 14695981039346656037ull;
+            for (char c : key) {
+                h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+            }
+            return h;
+        }
+
+        // A dotted name split into keys and hashed. Empty for {{.}}.
+        struct key_path {
+            std::vector<std::string> names;
+            std::vector<uint64_t> hashes;
+
+            key_path() = default;
+
+            explicit key_path(std::vector<std::string> n) : names(std::move(n)) {
+                hashes.reserve(names.size());
+                for (const std::string &name : names) {
+                    hashes.push_back(key_hash(name));
+                }
+            }
+
+            // Hashed in advance by wpp_template_compiler
+            key_path(std::vector<std::string> n, std::vector<uint64_t> h) : names(std::move(n)), hashes(std::move(h)) {}
+
+            // Split a dotted name
+            static key_path parse(std::string_view name) {
+                std::vector<std::string> names;
+                if (name != ".") {
+                    size_t b = 0;
+                    while (true) {
+                        const size_t dot = name.find('.', b);
+                        names.emplace_back(name.substr(b, dot == std::string_view::npos ? std::string_view::npos : dot - b));
+                        if (dot == std::string_view::npos) {
+                            break;
+                        }
+                        b = dot + 1;
+                    }
+                }
+                return key_path(std::move(names));
+            }
+
+            size_t size() const {
+                return names.size();
+            }
+
+            bool empty() const {
+                return names.empty();
+            }
+        };
+
+        // Memory for the values of one page. Allocations are bumped out of
+        // blocks that are all released with the arena; the first block is
+        // part of the arena itself, so small pages never touch the heap.
+        class arena {
+            public:
+                arena() = default;
+                arena(const arena &) = delete;
+                arena &operator=(const arena &) = delete;
+
+                void *allocate(size_t n, size_t align) {
+                    size_t offset = (used_ + align - 1) & ~(align - 1);
+                    if (offset + n > capacity_) {
+                        const size_t size = std::max(n + align, capacity_ * 2);
+                        blocks_.emplace_back(new char[size]);
+                        current_ = blocks_.back().get();
+                        capacity_ = size;
+                        // new[] is aligned for any fundamental type
+                        offset = 0;
+                    }
+                    used_ = offset + n;
+                    return current_ + offset;
+                }
+
+                template<class T>
+                T *allocate_array(size_t n) {
+                    static_assert(std::is_trivially_destructible<T>::value, "arena values are never destroyed");
+                    return static_cast<T *>(allocate(sizeof(T) * n, alignof(T)));
+                }
+
+                std::string_view copy(std::string_view s) {
+                    if (s.empty()) {
+                        return {};
+                    }
+                    char *p = allocate_array<char>(s.size());
+                    std::memcpy(p, s.data(), s.size());
+                    return {p, s.size()};
+                }
+
+            private:
+                alignas(std::max_align_t) char first_[2048];
+                char *current_{first_};
+                size_t capacity_{sizeof(first_)};
+                size_t used_{0};
+                std::vector<std::unique_ptr<char[]>> blocks_;
+        };
+
+        struct context_member;
+
+        // A value of the page. Strings, arrays and objects point into the
+        // arena of a render_context (or to storage that outlives it).
+        // Object members are sorted by key hash.
+        class context_value {
+            public:
+                enum class kind : uint8_t {
+                    null, boolean, integer, unsigned_integer, number, string, array, object
+                };
+
+                context_value() : integer_(0) {}
+
+                context_value(bool b) : type_(kind::boolean), boolean_(b) {}
+
+                template<class T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                                          std::is_signed<T>::value, int>::type = 0>
+                context_value(T i) : type_(kind::integer), integer_(i) {}
+
+                template<class T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                                          std::is_unsigned<T>::value, int>::type = 0>
+                context_value(T u) : type_(kind::unsigned_integer), unsigned_(u) {}
+
+                context_value(double d) : type_(kind::number), number_(d) {}
+
+                // Would be a boolean. Use render_context::string() or literal().
+                context_value(const char *) = delete;
+
+                // Not copied: the characters must outlive the context
+                static context_value literal(std::string_view s) {
+                    context_value v;
+                    v.type_ = kind::string;
+                    v.size_ = static_cast<uint32_t>(s.size());
+                    v.string_ = s.data();
+                    return v;
+                }
+
+                static context_value array(const context_value *items, size_t n) {
+                    context_value v;
+                    v.type_ = kind::array;
+                    v.size_ = static_cast<uint32_t>(n);
+                    v.items_ = items;
+                    return v;
+                }
+
+                // The members must be sorted by hash (see sort_members)
+                static context_value object(const context_member *members, size_t n) {
+                    context_value v;
+                    v.type_ = kind::object;
+                    v.size_ = static_cast<uint32_t>(n);
+                    v.members_ = members;
+                    return v;
+                }
+
+                kind type() const {
+                    return type_;
+                }
+
+                bool is_null() const {
+                    return type_ == kind::null;
+                }
+
+                bool is_boolean() const {
+                    return type_ == kind::boolean;
+                }
+
+                bool is_number() const {
+                    return type_ == kind::integer || type_ == kind::unsigned_integer || type_ == kind::number;
+                }
+
+                bool is_string() const {
+                    return type_ == kind::string;
+                }
+
+                bool is_array() const {
+                    return type_ == kind::array;
+                }
+
+                bool is_object() const {
+                    return type_ == kind::object;
+                }
+
+                bool boolean() const {
+                    return boolean_;
+                }
+
+                int64_t integer() const {
+                    return type_ == kind::integer ? integer_ : type_ == kind::unsigned_integer
+                                                               ? static_cast<int64_t>(unsigned_)
+                                                               : static_cast<int64_t>(number_);
+                }
+
+                uint64_t unsigned_integer() const {
+                    return type_ == kind::unsigned_integer ? unsigned_ : static_cast<uint64_t>(integer());
+                }
+
+                double number() const {
+                    return type_ == kind::number ? number_ : type_ == kind::integer ? static_cast<double>(integer_)
+                                                                                     : static_cast<double>(unsigned_);
+                }
+
+                std::string_view string() const {
+                    return type_ == kind::string ? std::string_view(string_, size_) : std::string_view();
+                }
+
+                // Items of an array, members of an object, bytes of a string
+                size_t size() const {
+                    return type_ == kind::string || type_ == kind::array || type_ == kind::object ? size_ : 0;
+                }
+
+                bool empty() const {
+                    return size() == 0;
+                }
+
+                const context_value *begin() const {
+                    return type_ == kind::array ? items_ : nullptr;
+                }
+
+                const context_value *end() const {
+                    return type_ == kind::array ? items_ + size_ : nullptr;
+                }
+
+                const context_value &operator[](size_t i) const {
+                    return items_[i];
+                }
+
+                const context_member *members() const {
+                    return type_ == kind::object ? members_ : nullptr;
+                }
+
+                // A member of an object, or nullptr
+                inline const context_value *find(std::string_view key, uint64_t hash) const;
+
+                const context_value *find(std::string_view key) const {
+                    return find(key, key_hash(key));
+                }
+
+                // For lambdas and code that still works with json
+                inline json to_json() const;
+
+            private:
+                kind type_{kind::null};
+                uint32_t size_{0};
+                union {
+                    bool boolean_;
+                    int64_t integer_;
+                    uint64_t unsigned_;
+                    double number_;
+                    const char *string_;
+                    const context_value *items_;
+                    const context_member *members_;
+                };
+        };
+
+        struct context_member {
+            uint64_t hash;
+            std::string_view key;
+            context_value value;
+        };
+
+        // Sort the members of an object for lookup. Of equal keys, the
+        // last one stays. Returns the new number of members.
+        inline size_t sort_members(context_member *members, size_t n) {
+            std::stable_sort(members, members + n, [](const context_member &a, const context_member &b) {
+                return a.hash < b.hash;
+            });
+            size_t out = 0;
+            for (size_t i = 0; i < n; ++i) {
+                bool replaced = false;
+                for (size_t j = out; j > 0 && members[j - 1].hash == members[i].hash; --j) {
+                    if (members[j - 1].key == members[i].key) {
+                        members[j - 1].value = members[i].value;
+                        replaced = true;
+                        break;
+                    }
+                }
+                if (!replaced) {
+                    members[out++] = members[i];
+                }
+            }
+            return out;
+        }
+
+        // The members of an object while it is being built, grown in an
+        // arena instead of on the heap
+        struct member_list {
+            context_member *data{nullptr};
+            size_t size{0};
+            size_t capacity{0};
+
+            void push(arena &a, const context_member &m) {
+                if (size == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    context_member *grown = a.allocate_array<context_member>(capacity);
+                    std::uninitialized_copy(data, data + size, grown);
+                    data = grown;
+                }
+                new(data + size++) context_member(m);
+            }
+
+            // Sort for lookup
+            context_value object() {
+                size = sort_members(data, size);
+                return context_value::object(data, size);
+            }
+        };
+
+        inline const context_value *context_value::find(std::string_view key, uint64_t hash) const {
+            if (type_ != kind::object) {
+                return nullptr;
+            }
+            const context_member *first = members_;
+            const context_member *last = members_ + size_;
+            // most objects of a page are small
+            if (size_ > 8) {
+                first = std::lower_bound(first, last, hash, [](const context_member &m, uint64_t h) {
+                    return m.hash < h;
+                });
+            }
+            for (; first != last; ++first) {
+                if (first->hash == hash && first->key == key) {
+                    return &first->value;
+                }
+                if (size_ > 8 && first->hash > hash) {
+                    break;
+                }
+            }
+            return nullptr;
+        }
+
+        inline json context_value::to_json() const {
+            switch (type_) {
+                case kind::null:
+                    return nullptr;
+                case kind::boolean:
+                    return boolean_;
+                case kind::integer:
+                    return integer_;
+                case kind::unsigned_integer:
+                    return unsigned_;
+                case kind::number:
+                    return number_;
+                case kind::string:
+                    return std::string(string_, size_);
+                case kind::array: {
+                    json j = json::array();
+                    for (const context_value &item : *this) {
+                        j.push_back(item.to_json());
+                    }
+                    return j;
+                }
+                case kind::object: {
+                    json j = json::object();
+                    for (size_t i = 0; i < size_; ++i) {
+                        j[std::string(members_[i].key)] = members_[i].value.to_json();
+                    }
+                    return j;
+                }
+            }
+            return nullptr;
+        }
+
+        // The data a template is rendered with. Values set here are copied
+        // into the arena of the context, keys are hashed once, and objects
+        // are flat arrays of members instead of trees of nodes:
+        //
+        //     views::render_context page;
+        //     page.set("title", title).set("user", page.object({{"name", page.string(name)}}));
+        //     app.render("home.html", page);
+        //
+        // object_builder builds objects whose members are only known at
+        // runtime.
+        //
+        // merge() adds json (the view bag, view data) under the values set
+        // here, the way json_data.emplace() did: keys set here win.
+        class render_context {
+            public:
+                render_context() = default;
+                render_context(const render_context &) = delete;
+                render_context &operator=(const render_context &) = delete;
+
+                render_context &set(std::string_view key, context_value v) {
+                    root_.push(arena_, context_member{key_hash(key), arena_.copy(key), v});
+                    sorted_ = false;
+                    return *this;
+                }
+
+                template<class T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+                render_context &set(std::string_view key, T v) {
+                    return set(key, context_value(v));
+                }
+
+                render_context &set(std::string_view key, std::string_view s) {
+                    return set(key, string(s));
+                }
+
+                render_context &set(std::string_view key, const char *s) {
+                    return set(key, string(s));
+                }
+
+                render_context &set(std::string_view key, const std::string &s) {
+                    return set(key, string(s));
+                }
+
+                render_context &set(std::string_view key, const json &j) {
+                    return set(key, value(j));
+                }
+
+                // Values with the lowest priority so far
+                render_context &merge(const json &j) {
+                    merged_.push_back(value(j));
+                    return *this;
+                }
+
+                // Values to put in the context
+                context_value string(std::string_view s) {
+                    return context_value::literal(arena_.copy(s));
+                }
+
+                context_value array(std::initializer_list<context_value> items) {
+                    context_value *p = arena_.allocate_array<context_value>(items.size());
+                    std::copy(items.begin(), items.end(), p);
+                    return context_value::array(p, items.size());
+                }
+
+                context_value object(std::initializer_list<std::pair<std::string_view, context_value>> members) {
+                    context_member *p = arena_.allocate_array<context_member>(members.size());
+                    size_t n = 0;
+                    for (const auto &m : members) {
+                        p[n++] = context_member{key_hash(m.first), arena_.copy(m.first), m.second};
+                    }
+                    return context_value::object(p, sort_members(p, n));
+                }
+
+                // A copy of json in the arena
+                context_value value(const json &j) {
+                    switch (j.type()) {
+                        case json::value_t::boolean:
+                            return j.get<bool>();
+                        case json::value_t::number_integer:
+                            return j.get<int64_t>();
+                        case json::value_t::number_unsigned:
+                            return j.get<uint64_t>();
+                        case json::value_t::number_float:
+                            return j.get<double>();
+                        case json::value_t::string:
+                            return string(j.get_ref<const std::string &>());
+                        case json::value_t::array: {
+                            context_value *p = arena_.allocate_array<context_value>(j.size());
+                            size_t n = 0;
+                            for (const json &item : j) {
+                                p[n++] = value(item);
+                            }
+                            return context_value::array(p, n);
+                        }
+                        case json::value_t::object: {
+                            context_member *p = arena_.allocate_array<context_member>(j.size());
+                            size_t n = 0;
+                            for (json::const_iterator it = j.begin(); it != j.end(); ++it) {
+                                const std::string &key = it.key();
+                                p[n++] = context_member{key_hash(key), arena_.copy(key), value(it.value())};
+                            }
+                            return context_value::object(p, sort_members(p, n));
+                        }
+                        default:
+                            return {};
+                    }
+                }
+
+                // The objects a lookup goes through, innermost last
+                template<class Push>
+                void frames(Push &&push) const {
+                    for (auto it = merged_.rbegin(); it != merged_.rend(); ++it) {
+                        push(*it);
+                    }
+                    push(root());
+                }
+
+                const context_value &root() const {
+                    if (!sorted_) {
+                        root_value_ = root_.object();
+                        sorted_ = true;
+                    }
+                    return root_value_;
+                }
+
+                arena &memory() {
+                    return arena_;
+                }
+
+            private:
+                arena arena_;
+                mutable member_list root_;
+                mutable context_value root_value_;
+                mutable bool sorted_{true};
+                std::vector<context_value> merged_;
+        };
+
+        // An object of a render_context, member by member:
+        //
+        //     views::object_builder user(page);
+        //     for (auto &field : fields) {
+        //         user.set(field.name, field.value);
+        //     }
+        //     page.set("user", user.value());
+        class object_builder {
+            public:
+                explicit object_builder(render_context &context) : context_(context) {}
+
+                object_builder &set(std::string_view key, context_value v) {
+                    arena &a = context_.memory();
+                    members_.push(a, context_member{key_hash(key), a.copy(key), v});
+                    return *this;
+                }
+
+                template<class T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+                object_builder &set(std::string_view key, T v) {
+                    return set(key, context_value(v));
+                }
+
+                object_builder &set(std::string_view key, std::string_view s) {
+                    return set(key, context_.string(s));
+                }
+
+                object_builder &set(std::string_view key, const char *s) {
+                    return set(key, context_.string(s));
+                }
+
+                object_builder &set(std::string_view key, const std::string &s) {
+                    return set(key, context_.string(s));
+                }
+
+                object_builder &set(std::string_view key, const json &j) {
+                    return set(key, context_.value(j));
+                }
+
+                // The object, ready for lookups
+                context_value value() {
+                    return members_.object();
+                }
+
+            private:
+                render_context &context_;
+                member_list members_;
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_RENDER_CONTEXT_H
@@ -0,0 +1,427 @@
+//
+// Mustache templates compiled into render plans.
+//
+
+#ifndef WPP_VIEW_RENDER_PLAN_H
+#define WPP_VIEW_RENDER_PLAN_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fragment_cache.h"
+#include "render_context.h"
+
+namespace wpp {
+    namespace views {
+
+        // A template that does not parse
+        class template_error : public std::runtime_error {
+            public:
+                template_error(const std::string &name, size_t line, const std::string &what)
+                        : std::runtime_error(name + ":" + std::to_string(line) + ": " + what), line_(line) {}
+
+                size_t line() const {
+                    return line_;
+                }
+
+            private:
+                size_t line_;
+        };
+
+        // Partials and parents are linked by slot, an index in the table of
+        // templates, so a template can be rebuilt without touching the
+        // templates that include it
+        constexpr uint32_t no_slot = 0xffffffff;
+        using slot_resolver = std::function<uint32_t(const std::string &)>;
+
+        // Asked for the output of {{@name}}raw text{{/name}} when the plan
+        // is built. Returns false to leave the lambda to the render.
+        using lambda_folder = std::function<bool(const std::string &name, const std::string &raw, std::string &out)>;
+
+        // A template parsed once into a flat list of instructions. Tags are
+        // found, names split and sections matched when the plan is built, so
+        // rendering only walks the list. Plans never change after they are
+        // built and can be rendered by any number of threads.
+        class render_plan {
+            public:
+                enum class op : uint8_t {
+                    // text(arg)
+                    text,
+                    // {{name}} and {{{name}}}, path(arg)
+                    escaped,
+                    unescaped,
+                    // {{#name}} and {{^name}}, path(arg)
+                    section,
+                    inverted,
+                    // {{@name}}raw text{{/name}}, lambda text(arg), raw text(extra)
+                    lambda,
+                    // {{>name}}, slot arg
+                    partial,
+                    // {{<name}} with {{$block}} overrides, slot arg
+                    parent,
+                    // {{$name}}, text(arg)
+                    block,
+                    // {{#@cache key ttl}}, key text(arg), ttl in seconds (extra)
+                    cache
+                };
+
+                struct instruction {
+                    op code;
+                    uint32_t arg;
+                    // Index after the instruction and its body
+                    uint32_t jump;
+                    uint32_t extra;
+                };
+
+                const std::string &name() const {
+                    return name_;
+                }
+
+                const std::vector<instruction> &code() const {
+                    return code_;
+                }
+
+                const std::string &text(uint32_t i) const {
+                    return texts_[i];
+                }
+
+                // Keys of a dotted name, hashed. Empty for {{.}}.
+                const key_path &path(uint32_t i) const {
+                    return paths_[i];
+                }
+
+                // Slots of the partials and parents this plan uses
+                const std::vector<uint32_t> &dependencies() const {
+                    return dependencies_;
+                }
+
+                // Size of the last page rendered from the plan, so the
+                // output can be reserved once instead of growing
+                size_t size_hint() const {
+                    return size_hint_.load(std::memory_order_relaxed);
+                }
+
+                void record_size(size_t n) const {
+                    size_hint_.store(n, std::memory_order_relaxed);
+                }
+
+                // Lambdas fold accepts are replaced by their output as text
+                static std::shared_ptr<const render_plan>
+                compile(const std::string &name, const std::string &source, const slot_resolver &resolve,
+                        const lambda_folder &fold = nullptr) {
+                    std::shared_ptr<render_plan> plan(new render_plan());
+                    plan->name_ = name;
+                    compiler c{*plan, source, resolve, fold};
+                    c.run();
+                    return plan;
+                }
+
+            private:
+                render_plan() = default;
+
+                class compiler {
+                    public:
+                        compiler(render_plan &plan, const std::string &source, const slot_resolver &resolve,
+                                 const lambda_folder &fold)
+                                : plan_(plan), src_(source), resolve_(resolve), fold_(fold) {}
+
+                        void run() {
+                            size_t pos = 0;
+                            while (true) {
+                                const size_t tag = src_.find(open_, pos);
+                                if (tag == std::string::npos) {
+                                    emit_text(pos, src_.size());
+                                    break;
+                                }
+                                pos = tag_at(pos, tag);
+                            }
+                            if (!sections_.empty()) {
+                                throw template_error(plan_.name_, sections_.back().line,
+                                                     "unclosed section \"" + sections_.back().name + "\"");
+                            }
+                        }
+
+                    private:
+                        struct open_section {
+                            std::string name;
+                            size_t index;
+                            size_t line;
+                            // where the raw text of a lambda starts
+                            size_t body;
+                            // dependencies of the plan before the section
+                            size_t dependencies;
+                        };
+
+                        static bool is_blank(char c) {
+                            return c == ' ' || c == '\t';
+                        }
+
+                        static std::string trim(const std::string &s) {
+                            size_t b = 0, e = s.size();
+                            while (b < e && (is_blank(s[b]) || s[b] == '\n' || s[b] == '\r')) {
+                                ++b;
+                            }
+                            while (e > b && (is_blank(s[e - 1]) || s[e - 1] == '\n' || s[e - 1] == '\r')) {
+                                --e;
+                            }
+                            return s.substr(b, e - b);
+                        }
+
+                        size_t line_of(size_t pos) const {
+                            size_t line = 1;
+                            for (size_t i = 0; i < pos && i < src_.size(); ++i) {
+                                line += src_[i] == '\n';
+                            }
+                            return line;
+                        }
+
+                        uint32_t add_text(std::string s) {
+                            plan_.texts_.push_back(std::move(s));
+                            return static_cast<uint32_t>(plan_.texts_.size() - 1);
+                        }
+
+                        uint32_t add_path(const std::string &name) {
+                            plan_.paths_.push_back(key_path::parse(name));
+                            return static_cast<uint32_t>(plan_.paths_.size() - 1);
+                        }
+
+                        uint32_t add_slot(const std::string &name) {
+                            const uint32_t slot = resolve_(name);
+                            if (slot != no_slot) {
+                                plan_.dependencies_.push_back(slot);
+                            }
+                            return slot;
+                        }
+
+                        void emit(op code, uint32_t arg, uint32_t extra = 0) {
+                            const uint32_t next = static_cast<uint32_t>(plan_.code_.size() + 1);
+                            plan_.code_.push_back(instruction{code, arg, next, extra});
+                        }
+
+                        void emit_text(size_t begin, size_t end) {
+                            if (end > begin) {
+                                emit(op::text, add_text(src_.substr(begin, end - begin)));
+                            }
+                        }
+
+                        // Parse the tag at `tag` and return where the text after it starts
+                        size_t tag_at(size_t pos, size_t tag) {
+                            const size_t inner = tag + open_.size();
+                            const char kind = inner < src_.size() ? src_[inner] : '\0';
+                            std::string close = close_;
+                            size_t content = inner;
+                            if (kind == '{' && open_ == "{{") {
+                                close = "}}}";
+                                ++content;
+                            } else if (kind == '=') {
+                                close = "=" + close_;
+                                ++content;
+                            } else if (kind == '#' || kind == '^' || kind == '/' || kind == '!' || kind == '>' ||
+                                       kind == '<' || kind == '$' || kind == '&' || kind == '@') {
+                                ++content;
+                            }
+                            // The {names} of a directive may end right before the
+                            // delimiter, as in {{#@cache post-{id}}}
+                            const bool is_directive = kind == '#' && content < src_.size() && src_[content] == '@';
+                            const size_t close_at = is_directive ? find_outside_braces(close, content)
+                                                                 : src_.find(close, content);
+                            if (close_at == std::string::npos) {
+                                throw template_error(plan_.name_, line_of(tag), "unclosed tag");
+                            }
+                            const std::string name = trim(src_.substr(content, close_at - content));
+                            size_t text_end = tag;
+                            size_t next = close_at + close.size();
+
+                            // A section, comment or partial alone on its line takes the line with it
+                            const bool may_stand_alone = kind == '#' || kind == '^' || kind == '/' || kind == '!' ||
+                                                         kind == '>' || kind == '<' || kind == '$' || kind == '=' ||
+                                                         kind == '@';
+                            if (may_stand_alone) {
+                                const size_t nl = tag == 0 ? std::string::npos : src_.rfind('\n', tag - 1);
+                                const size_t line_start = nl == std::string::npos ? 0 : nl + 1;
+                                bool alone = line_start >= pos;
+                                for (size_t i = line_start; alone && i < tag; ++i) {
+                                    alone = is_blank(src_[i]);
+                                }
+                                size_t e = next;
+                                while (alone && e < src_.size() && is_blank(src_[e])) {
+                                    ++e;
+                                }
+                                if (alone && e < src_.size() && src_[e] == '\r' && e + 1 < src_.size() && src_[e + 1] == '\n') {
+                                    ++e;
+                                }
+                                if (alone && (e == src_.size() || src_[e] == '\n')) {
+                                    text_end = line_start;
+                                    next = e == src_.size() ? e : e + 1;
+                                }
+                            }
+                            emit_text(pos, text_end);
+
+                            switch (kind) {
+                                case '!':
+                                    break;
+                                case '=':
+                                    set_delimiters(name, tag);
+                                    break;
+                                case '#':
+                                    if (!name.empty() && name[0] == '@') {
+                                        directive(name, tag, next);
+                                        break;
+                                    }
+                                    open(name, tag, next);
+                                    emit(op::section, add_path(name));
+                                    break;
+                                case '^':
+                                    open(name, tag, next);
+                                    emit(op::inverted, add_path(name));
+                                    break;
+                                case '@':
+                                    open(name, tag, next);
+                                    emit(op::lambda, add_text(name));
+                                    break;
+                                case '$':
+                                    open(name, tag, next);
+                                    emit(op::block, add_text(name));
+                                    break;
+                                case '<':
+                                    open(name, tag, next);
+                                    emit(op::parent, add_slot(name));
+                                    break;
+                                case '/':
+                                    close_section(name, tag, text_end);
+                                    break;
+                                case '>':
+                                    emit(op::partial, add_slot(name));
+                                    break;
+                                case '&':
+                                case '{':
+                                    emit(op::unescaped, add_path(name));
+                                    break;
+                                default:
+                                    emit(op::escaped, add_path(name));
+                            }
+                            return next;
+                        }
+
+                        size_t find_outside_braces(const std::string &close, size_t from) const {
+                            size_t depth = 0;
+                            for (size_t i = from; i < src_.size(); ++i) {
+                                if (depth == 0 && src_.compare(i, close.size(), close) == 0) {
+                                    return i;
+                                }
+                                if (src_[i] == '{') {
+                                    ++depth;
+                                } else if (src_[i] == '}' && depth > 0) {
+                                    --depth;
+                                }
+                            }
+                            return std::string::npos;
+                        }
+
+                        void open(const std::string &name, size_t tag, size_t body) {
+                            sections_.push_back(open_section{name, plan_.code_.size(), line_of(tag), body,
+                                                             plan_.dependencies_.size()});
+                        }
+
+                        // {{#@cache key ttl}}: the key may contain {names} of the context,
+                        // the ttl is in seconds or ends with s, m or h. Keys belong to
+                        // the template, so two templates can use the same one.
+                        void directive(const std::string &spec, size_t tag, size_t body) {
+                            const size_t space = spec.find_first_of(" \t");
+                            const std::string directive = spec.substr(0, space);
+                            if (directive != "@cache") {
+                                throw template_error(plan_.name_, line_of(tag), "unknown directive \"" + directive + "\"");
+                            }
+                            std::string args = space == std::string::npos ? std::string() : trim(spec.substr(space));
+                            const size_t split = args.find_first_of(" \t");
+                            const std::string key = args.substr(0, split);
+                            const std::string ttl = split == std::string::npos ? std::string() : trim(args.substr(split));
+                            if (key.empty()) {
+                                throw template_error(plan_.name_, line_of(tag), "@cache needs a key");
+                            }
+                            uint32_t seconds = 60;
+                            if (!ttl.empty()) {
+                                size_t used = 0;
+                                unsigned long n = 0;
+                                try {
+                                    n = std::stoul(ttl, &used);
+                                } catch (const std::exception &) {
+                                    used = 0;
+                                }
+                                const std::string unit = ttl.substr(used);
+                                if (used == 0 || (unit != "" && unit != "s" && unit != "m" && unit != "h")) {
+                                    throw template_error(plan_.name_, line_of(tag), "invalid ttl \"" + ttl + "\"");
+                                }
+                                seconds = static_cast<uint32_t>(unit == "h" ? n * 3600 : unit == "m" ? n * 60 : n);
+                            }
+                            open(directive, tag, body);
+                            emit(op::cache, add_text(fragment_cache::key_of(plan_.name_, key)), seconds);
+                        }
+
+                        void close_section(const std::string &name, size_t tag, size_t raw_end) {
+                            if (sections_.empty() || sections_.back().name != name) {
+                                throw template_error(plan_.name_, line_of(tag),
+                                                     "unexpected \"" + name + "\" section end" +
+                                                     (sections_.empty() ? std::string() : ", \"" + sections_.back().name + "\" is open"));
+                            }
+                            const open_section s = sections_.back();
+                            sections_.pop_back();
+                            instruction &i = plan_.code_[s.index];
+                            i.jump = static_cast<uint32_t>(plan_.code_.size());
+                            if (i.code == op::lambda) {
+                                std::string raw = src_.substr(s.body, raw_end > s.body ? raw_end - s.body : 0);
+                                std::string out;
+                                if (fold_ && fold_(plan_.texts_[i.arg], raw, out)) {
+                                    // the body is never rendered, drop it and the
+                                    // partials it would have needed
+                                    plan_.code_.resize(s.index);
+                                    plan_.dependencies_.resize(s.dependencies);
+                                    if (!out.empty()) {
+                                        emit(op::text, add_text(std::move(out)));
+                                    }
+                                    return;
+                                }
+                                i.extra = add_text(std::move(raw));
+                            }
+                        }
+
+                        void set_delimiters(const std::string &spec, size_t tag) {
+                            const size_t space = spec.find_first_of(" \t");
+                            if (space == std::string::npos) {
+                                throw template_error(plan_.name_, line_of(tag), "invalid delimiters \"" + spec + "\"");
+                            }
+                            open_ = spec.substr(0, space);
+                            close_ = trim(spec.substr(space));
+                            if (open_.empty() || close_.empty()) {
+                                throw template_error(plan_.name_, line_of(tag), "invalid delimiters \"" + spec + "\"");
+                            }
+                        }
+
+                        render_plan &plan_;
+                        const std::string &src_;
+                        const slot_resolver &resolve_;
+                        const lambda_folder &fold_;
+                        std::string open_{"{{"};
+                        std::string close_{"}}"};
+                        std::vector<open_section> sections_;
+                };
+
+                std::string name_;
+                std::vector<instruction> code_;
+                std::vector<std::string> texts_;
+                std::vector<key_path> paths_;
+                std::vector<uint32_t> dependencies_;
+                mutable std::atomic<size_t> size_hint_{0};
+        };
+
+    }
+}
+
+#endif //WPP_VIEW_RENDER_PLAN_H
@@ -0,0 +1,527 @@
+//
+// Rendering of compiled templates.
+//
+
+#ifndef WPP_VIEW_RENDERER_H
+#define WPP_VIEW_RENDERER_H
+
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils/json.hpp"
+
+#include "compiled_template.h"
+#include "fragment_cache.h"
+#include "html_escape.h"
+#include "lambda_cache.h"
+#include "output_sink.h"
+#include "render_context.h"
+#include "render_plan.h"
+
+namespace wpp {
+    using json = nlohmann::json;
+
+    namespace views {
+        // {{@name}}text{{/name}} calls the lambda with the raw text. The
+        // result of a text lambda is rendered as a template. A scoped lambda
+        // renders what it needs itself through the scope.
+        using text_lambda = std::function<std::string(const std::string &)>;
+        using scoped_lambda = std::function<std::string(const std::string &, render_scope &)>;
+
+        //
+        // A pure text lambda only depends on its argument: its results are
+        // kept in memo, and a literal argument is replaced by the result
+        // when the template is built.
+        struct view_lambda {
+            text_lambda text;
+            scoped_lambda scoped;
+            std::shared_ptr<lambda_cache> memo;
+
+            bool pure() const {
+                return text && memo;
+            }
+
+            std::shared_ptr<const std::string> call(const std::string &raw) const {
+                std::shared_ptr<const std::string> result = memo->get(raw);
+                return result ? result : memo->put(raw, text(raw));
+            }
+        };
+
+        using lambda_table = std::unordered_map<std::string, view_lambda>;
+
+        // The templates of a registry at one point in time, linked by slot.
+        // A set is never modified once published: a change builds a new set
+        // that shares the plans that did not change.
+        struct plan_set {
+            std::vector<std::shared_ptr<const render_plan>> plans;
+            // Render functions generated at build time, by slot. They take
+            // the place of the plan in the same slot.
+            std::vector<compiled_render> compiled;
+            std::shared_ptr<const std::unordered_map<std::string, uint32_t>> slots;
+            std::shared_ptr<const lambda_table> lambdas;
+            // Not part of the snapshot: shared by every set of a registry
+            std::shared_ptr<fragment_cache> fragments;
+
+            const render_plan *plan(uint32_t slot) const {
+                return slot < plans.size() ? plans[slot].get() : nullptr;
+            }
+
+            compiled_render function(uint32_t slot) const {
+                return slot < compiled.size() ? compiled[slot] : nullptr;
+            }
+
+            uint32_t slot(const std::string &name) const {
+                if (!slots) {
+                    return no_slot;
+                }
+                auto it = slots->find(name);
+                return it == slots->end() ? no_slot : it->second;
+            }
+
+            const render_plan *find(const std::string &name) const {
+                return plan(slot(name));
+            }
+
+            bool contains(uint32_t slot) const {
+                return function(slot) || plan(slot);
+            }
+        };
+
+        // A {{$block}} override inside a {{<parent}} of a generated template
+        struct compiled_block {
+            std::string_view name;
+            std::function<void()> body;
+        };
+
+        // The state of one render: the context stack, the block overrides of
+        // the parents being rendered, and the output.
+        //
+        // The plan interpreter and the generated render functions share the
+        // operations below; a generated function is what run() would do for
+        // its plan, unrolled.
+        class render_scope {
+            public:
+                render_scope(const plan_set &set, output_sink &out) : set_(set), out_(&out) {}
+
+                void render(const render_plan &plan, const render_context &data) {
+                    out_->reserve(plan.size_hint());
+                    const size_t mark = stack_.size();
+                    data.frames([this](const context_value &frame) { push(frame); });
+                    run(plan, 0, plan.code().size());
+                    stack_.resize(mark);
+                }
+
+                void render(compiled_render f, const render_context &data) {
+                    const size_t mark = stack_.size();
+                    data.frames([this](const context_value &frame) { push(frame); });
+                    f(*this);
+                    stack_.resize(mark);
+                }
+
+                void write(std::string_view text) {
+                    out_->write(text.data(), text.size());
+                }
+
+                // {{name}}, {{{name}}} and {{&name}}
+                void variable(const key_path &path, bool escape) {
+                    const context_value *v = lookup(path);
+                    if (v) {
+                        append(*v, escape);
+                    }
+                }
+
+                // {{#name}}body{{/name}}
+                template<class Body>
+                void section(const key_path &path, Body &&body) {
+                    const context_value *v = lookup(path);
+                    if (!v || is_falsey(*v)) {
+                        return;
+                    }
+                    if (v->is_array()) {
+                        for (const context_value &item : *v) {
+                            push(item);
+                            body();
+                            pop();
+                        }
+                    } else {
+                        push(*v);
+                        body();
+                        pop();
+                    }
+                }
+
+                // {{^name}}body{{/name}}
+                template<class Body>
+                void inverted(const key_path &path, Body &&body) {
+                    const context_value *v = lookup(path);
+                    if (!v || is_falsey(*v)) {
+                        body();
+                    }
+                }
+
+                // {{@name}}raw{{/name}}
+                void lambda(const std::string &name, const std::string &raw) {
+                    if (!set_.lambdas) {
+                        return;
+                    }
+                    auto it = set_.lambdas->find(name);
+                    if (it == set_.lambdas->end()) {
+                        return;
+                    }
+                    if (it->second.scoped) {
+                        out_->write(it->second.scoped(raw, *this));
+                    } else if (it->second.pure()) {
+                        const std::shared_ptr<const std::string> result = it->second.call(raw);
+                        write_lambda_result(*result);
+                    } else if (it->second.text) {
+                        write_lambda_result(it->second.text(raw));
+                    }
+                }
+
+                // {{>name}}
+                void partial(uint32_t slot) {
+                    include(slot);
+                }
+
+                void partial(const std::string &name) {
+                    include(set_.slot(name));
+                }
+
+                // {{<name}}{{$block}}...{{/block}}{{/name}}
+                void parent(const std::string &name, std::initializer_list<compiled_block> overrides) {
+                    const size_t mark = blocks_.size();
+                    for (const compiled_block &b : overrides) {
+                        blocks_.push_back(block_override{b.name, nullptr, 0, 0, &b.body});
+                    }
+                    include(set_.slot(name));
+                    blocks_.resize(mark);
+                }
+
+                // {{$name}}default{{/name}}
+                template<class Body>
+                void block(std::string_view name, Body &&default_body) {
+                    const block_override *o = find_block(name);
+                    if (!o) {
+                        default_body();
+                    } else if (o->body) {
+                        (*o->body)();
+                    } else {
+                        run(*o->plan, o->begin, o->end);
+                    }
+                }
+
+                // {{#@cache key ttl}}body{{/@cache}}
+                template<class Body>
+                void cached(const std::string &key_pattern, uint32_t ttl_seconds, Body &&body) {
+                    if (!set_.fragments) {
+                        body();
+                        return;
+                    }
+                    const std::string key = fragment_key(key_pattern);
+                    std::shared_ptr<const std::string> hit = set_.fragments->get(key);
+                    if (hit) {
+                        out_->write(*hit);
+                        return;
+                    }
+                    std::string fragment;
+                    string_sink sink(fragment);
+                    output_sink *out = out_;
+                    out_ = &sink;
+                    body();
+                    out_ = out;
+                    out_->write(fragment);
+                    set_.fragments->put(key, std::move(fragment), std::chrono::seconds(ttl_seconds));
+                }
+
+                // Look a name up in the context, innermost first
+                const context_value *get(std::string_view name) const {
+                    return lookup(key_path::parse(name));
+                }
+
+                // Render template text in the current context
+                std::string render(const std::string &text) {
+                    return render(*compile(text));
+                }
+
+                // Template text a lambda renders more than once, as the
+                // body of a loop, is compiled once
+                std::shared_ptr<const render_plan> compile(const std::string &text) const {
+                    return render_plan::compile("lambda", text, [this](const std::string &name) { return set_.slot(name); });
+                }
+
+                std::string render(const render_plan &plan) {
+                    std::string result;
+                    string_sink sink(result);
+                    output_sink *out = out_;
+                    out_ = &sink;
+                    run(plan, 0, plan.code().size());
+                    out_ = out;
+                    return result;
+                }
+
+                // Values the lambdas of one render share, such as a token
+                // made for the first form of a page and reused by the others
+                std::string &state(const std::string &key) {
+                    return state_[key];
+                }
+
+                // The value must outlive the matching pop
+                void push(const context_value &value) {
+                    stack_.push_back(&value);
+                }
+
+                void pop() {
+                    stack_.pop_back();
+                }
+
+            private:
+                using op = render_plan::op;
+
+                // Either a range of a plan or the body of a generated block
+                struct block_override {
+                    std::string_view name;
+                    const render_plan *plan;
+                    size_t begin;
+                    size_t end;
+                    const std::function<void()> *body;
+                };
+
+                void write_lambda_result(const std::string &result) {
+                    if (result.find("{{") == std::string::npos) {
+                        out_->write(result);
+                    } else {
+                        out_->write(render(result));
+                    }
+                }
+
+                static bool is_falsey(const context_value &v) {
+                    return v.is_null() || (v.is_boolean() && !v.boolean()) ||
+                           ((v.is_array() || v.is_string()) && v.empty());
+                }
+
+                const context_value *lookup(const key_path &path) const {
+                    if (path.empty()) {
+                        return stack_.empty() ? nullptr : stack_.back();
+                    }
+                    const context_value *v = nullptr;
+                    for (auto frame = stack_.rbegin(); frame != stack_.rend() && !v; ++frame) {
+                        v = (*frame)->find(path.names[0], path.hashes[0]);
+                    }
+                    for (size_t i = 1; v && i < path.size(); ++i) {
+                        v = v->find(path.names[i], path.hashes[i]);
+                    }
+                    return v;
+                }
+
+                void append(const context_value &v, bool escape) {
+                    char digits[24];
+                    std::string_view s;
+                    std::string dumped;
+                    switch (v.type()) {
+                        case context_value::kind::null:
+                            return;
+                        case context_value::kind::boolean:
+                            s = v.boolean() ? "true" : "false";
+                            break;
+                        case context_value::kind::integer:
+                            s = std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), v.integer()).ptr - digits);
+                            break;
+                        case context_value::kind::unsigned_integer:
+                            s = std::string_view(digits, std::to_chars(digits, digits + sizeof(digits), v.unsigned_integer()).ptr - digits);
+                            break;
+                        case context_value::kind::string:
+                            s = v.string();
+                            break;
+                        default:
+                            // the way json prints them
+                            dumped = v.to_json().dump();
+                            s = dumped;
+                            break;
+                    }
+                    // numbers and booleans have nothing to escape
+                    if (escape && (v.is_string() || !dumped.empty())) {
+                        out_->write_escaped(s.data(), s.size());
+                    } else {
+                        out_->write(s.data(), s.size());
+                    }
+                }
+
+                // The override closest to the template being rendered wins
+                const block_override *find_block(std::string_view name) const {
+                    for (const block_override &b : blocks_) {
+                        if (b.name == name) {
+                            return &b;
+                        }
+                    }
+                    return nullptr;
+                }
+
+                // A partial or parent: the generated function if there is one
+                void include(uint32_t slot) {
+                    if (depth_ >= max_depth) {
+                        return;
+                    }
+                    ++depth_;
+                    if (compiled_render f = set_.function(slot)) {
+                        f(*this);
+                    } else if (const render_plan *plan = set_.plan(slot)) {
+                        run(*plan, 0, plan->code().size());
+                    }
+                    --depth_;
+                }
+
+                void run(const render_plan &plan, size_t begin, size_t end) {
+                    const std::vector<render_plan::instruction> &code = plan.code();
+                    size_t i = begin;
+                    while (i < end) {
+                        const render_plan::instruction &ins = code[i];
+                        const auto body = [this, &plan, &ins, i]() { run(plan, i + 1, ins.jump); };
+                        switch (ins.code) {
+                            case op::text:
+                                out_->write(plan.text(ins.arg));
+                                break;
+                            case op::escaped:
+                            case op::unescaped:
+                                variable(plan.path(ins.arg), ins.code == op::escaped);
+                                break;
+                            case op::section:
+                                section(plan.path(ins.arg), body);
+                                break;
+                            case op::inverted:
+                                inverted(plan.path(ins.arg), body);
+                                break;
+                            case op::lambda:
+                                lambda(plan.text(ins.arg), plan.text(ins.extra));
+                                break;
+                            case op::partial:
+                                include(ins.arg);
+                                break;
+                            case op::parent: {
+                                const size_t mark = blocks_.size();
+                                for (size_t j = i + 1; j < ins.jump; j = code[j].jump) {
+                                    if (code[j].code == op::block) {
+                                        blocks_.push_back(block_override{plan.text(code[j].arg), &plan, j + 1,
+                                                                         code[j].jump, nullptr});
+                                    }
+                                }
+                                include(ins.arg);
+                                blocks_.resize(mark);
+                                break;
+                            }
+                            case op::cache:
+                                cached(plan.text(ins.arg), ins.extra, body);
+                                break;
+                            case op::block:
+                                block(plan.text(ins.arg), body);
+                                break;
+                        }
+                        i = ins.jump;
+                    }
+                }
+
+                // The key with each {name} replaced by its value in the context
+                std::string fragment_key(const std::string &pattern) const {
+                    std::string key;
+                    size_t pos = 0;
+                    while (true) {
+                        const size_t open = pattern.find('{', pos);
+                        const size_t close = open == std::string::npos ? open : pattern.find('}', open);
+                        if (close == std::string::npos) {
+                            key.append(pattern, pos, std::string::npos);
+                            return key;
+                        }
+                        key.append(pattern, pos, open - pos);
+                        const context_value *v = get(std::string_view(pattern).substr(open + 1, close - open - 1));
+                        if (v && v->is_string()) {
+                            key.append(v->string());
+                        } else if (v && !v->is_null()) {
+                            key.append(v->to_json().dump());
+                        }
+                        pos = close + 1;
+                    }
+                }
+
+                // Partials that include themselves stop here
+                static constexpr int max_depth = 64;
+
+                const plan_set &set_;
+                output_sink *out_;
+                std::vector<const context_value *> stack_;
+                std::vector<block_override> blocks_;
+                std::unordered_map<std::string, std::string> state_;
+                int depth_{0};
+        };
+
+        // Render a plan of the set into out
+        inline void render(const plan_set &set, const render_plan &plan, const render_context &data, output_sink &out) {
+            render_scope scope(set, out);
+            scope.render(plan, data);
+        }
+
+        inline void render(const plan_set &set, const render_plan &plan, const render_context &data, std::string &out) {
+            const size_t before = out.size();
+            string_sink sink(out);
+            render(set, plan, data, sink);
+            plan.record_size(out.size() - before);
+        }
+
+        // Render the template in a slot of the set, with its generated
+        // function if there is one. False if the slot has no template.
+        inline bool render(const plan_set &set, uint32_t slot, const render_context &data, output_sink &out) {
+            if (compiled_render f = set.function(slot)) {
+                render_scope scope(set, out);
+                scope.render(f, data);
+                return true;
+            }
+            const render_plan *plan = set.plan(slot);
+            if (!plan) {
+                return false;
+            }
+            render(set, *plan, data, out);
+            return true;
+        }
+
+        inline bool render(const plan_set &set, uint32_t slot, const render_context &data, std::string &out) {
+            if (compiled_render f = set.function(slot)) {
+                string_sink sink(out);
+                render_scope scope(set, sink);
+                scope.render(f, data);
+                return true;
+            }
+            const render_plan *plan = set.plan(slot);
+            if (!plan) {
+                return false;
+            }
+            render(set, *plan, data, out);
+            return true;
+        }
+
+        // The same with json, copied into a render_context first
+        template<class Out>
+        inline bool render(const plan_set &set, uint32_t slot, const json &data, Out &out) {
+            render_context context;
+            context.merge(data);
+            return render(set, slot, context, out);
+        }
+
+        template<class Out>
+        inline void render(const plan_set &set, const render_plan &plan, const json &data, Out &out) {
+            render_context context;
+            context.merge(data);
+            render(set, plan, context, out);
+        }
+
+    }
+}
+
+#endif //WPP_VIEW_RENDERER_H
@@ -0,0 +1,329 @@
+//
+// WebSocket routes, connections and rooms.
+//
+
+#ifndef WPP_WEBSOCKET_H
+#define WPP_WEBSOCKET_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/asio/buffer.hpp>
+
+namespace wpp {
+    struct request;
+    struct route_properties;
+
+    // A message serialized once. Copies share the same payload, so the same
+    // message can be queued to any number of connections without copying it.
+    class websocket_message {
+        public:
+            websocket_message() : payload_(std::make_shared<const std::string>()) {}
+
+            websocket_message(std::string data, bool text = true)
+                    : payload_(std::make_shared<const std::string>(std::move(data))), text_(text) {}
+
+            const std::string &data() const {
+                return *payload_;
+            }
+
+            bool is_text() const {
+                return text_;
+            }
+
+            size_t size() const {
+                return payload_->size();
+            }
+
+            boost::asio::const_buffer buffer() const {
+                return boost::asio::buffer(*payload_);
+            }
+
+        private:
+            std::shared_ptr<const std::string> payload_;
+            bool text_{true};
+    };
+
+    // One client of a WebSocket route. It can be used from any thread.
+    class websocket_connection {
+        public:
+            virtual ~websocket_connection() = default;
+
+            // Queue a message. Returns false if the connection is closed.
+            virtual bool send(websocket_message message) = 0;
+
+            bool send(std::string data, bool text = true) {
+                return send(websocket_message(std::move(data), text));
+            }
+
+            // Close the connection once the queued messages are sent
+            virtual void close() = 0;
+
+            virtual bool is_open() const = 0;
+
+            // Bytes queued and not written yet
+            virtual size_t queued_bytes() const = 0;
+
+            // Messages lost because the client did not read fast enough
+            virtual size_t dropped() const = 0;
+
+            // The upgrade request, after the middleware of the route ran on
+            // it (session data, authenticated user, route parameters)
+            wpp::request &upgrade_request() {
+                return *request_;
+            }
+
+        protected:
+            std::shared_ptr<wpp::request> request_;
+    };
+
+    using websocket_connection_ptr = std::shared_ptr<websocket_connection>;
+
+    // Outbound queue and compression of the connections of a route
+    struct websocket_options {
+        // What happens to a message sent while more than high_watermark
+        // bytes are queued for a client that does not keep up
+        enum class overflow {
+            // the new message is dropped
+            drop_newest,
+            // older messages are dropped to make room
+            drop_oldest,
+            // the client is disconnected
+            close
+        };
+
+        size_t high_watermark{1024 * 1024};
+        // on_drain is called when the queue goes back below this
+        size_t low_watermark{256 * 1024};
+        overflow slow_consumer{overflow::close};
+
+        // Small frames are copied and sent in batches. Larger ones are
+        // written from the shared message buffer.
+        size_t coalesce_limit{16 * 1024};
+
+        // permessage-deflate, if the client offers it. Each connection
+        // compresses its own frames (beast owns the deflate stream), so a
+        // room broadcast is compressed once per member: the CPU cost grows
+        // with the audience, and for large rooms of small messages it is
+        // usually better left off.
+        bool permessage_deflate{false};
+        // Keep the compression window between messages. Better ratios,
+        // but each connection keeps its zlib state.
+        bool context_takeover{true};
+        int window_bits{15};
+        int compression_level{6};
+        int memory_level{4};
+    };
+
+    // The callbacks of a WebSocket route. They run on the strand of the connection.
+    struct websocket_endpoint {
+        std::function<void(const websocket_connection_ptr &)> on_open;
+        std::function<void(const websocket_connection_ptr &, const websocket_message &)> on_message;
+        std::function<void(const websocket_connection_ptr &)> on_close;
+        // The queue of a slow client went back below the low watermark
+        std::function<void(const websocket_connection_ptr &)> on_drain;
+        // Larger messages close the connection
+        size_t max_message_size{1024 * 1024};
+        websocket_options options;
+    };
+
+    // Returned by application::websocket to set up the route:
+    //
+    //     auto chat = std::make_shared<wpp::websocket_room>();
+    //     app.websocket("chat")
+    //        .middleware("auth")
+    //        .on_open([chat](const wpp::websocket_connection_ptr& c) { chat->join(c); })
+    //        .on_message([chat](const wpp::websocket_connection_ptr& c, const wpp::websocket_message& m) {
+    //            chat->broadcast(m);
+    //        })
+    //        .on_close([chat](const wpp::websocket_connection_ptr& c) { chat->leave(c); });
+    //
+    // The upgrade request goes through routing and middleware like any GET
+    // request. If a middleware answers instead of calling the next handler
+    // (a redirect to the login page, a 403), that answer is sent and the
+    // connection is not upgraded.
+    class websocket_route {
+        public:
+            websocket_route(std::shared_ptr<websocket_endpoint> endpoint, route_properties &route)
+                    : endpoint_(std::move(endpoint)), route_(&route) {}
+
+            websocket_route &on_open(std::function<void(const websocket_connection_ptr &)> f) {
+                endpoint_->on_open = std::move(f);
+                return *this;
+            }
+
+            websocket_route &on_message(std::function<void(const websocket_connection_ptr &, const websocket_message &)> f) {
+                endpoint_->on_message = std::move(f);
+                return *this;
+            }
+
+            websocket_route &on_close(std::function<void(const websocket_connection_ptr &)> f) {
+                endpoint_->on_close = std::move(f);
+                return *this;
+            }
+
+            websocket_route &max_message_size(size_t n) {
+                endpoint_->max_message_size = n;
+                return *this;
+            }
+
+            websocket_route &on_drain(std::function<void(const websocket_connection_ptr &)> f) {
+                endpoint_->on_drain = std::move(f);
+                return *this;
+            }
+
+            websocket_route &watermarks(size_t high, size_t low) {
+                endpoint_->options.high_watermark = high;
+                endpoint_->options.low_watermark = std::min(low, high);
+                return *this;
+            }
+
+            websocket_route &slow_consumer(websocket_options::overflow policy) {
+                endpoint_->options.slow_consumer = policy;
+                return *this;
+            }
+
+            websocket_route &permessage_deflate(bool context_takeover = true, int compression_level = 6) {
+                endpoint_->options.permessage_deflate = true;
+                endpoint_->options.context_takeover = context_takeover;
+                endpoint_->options.compression_level = compression_level;
+                return *this;
+            }
+
+            websocket_route &options(websocket_options o) {
+                endpoint_->options = o;
+                return *this;
+            }
+
+            websocket_route &middleware(std::string name);
+
+            websocket_route &name(std::string route_name);
+
+        private:
+            std::shared_ptr<websocket_endpoint> endpoint_;
+            route_properties *route_;
+    };
+
+    // A group of connections that receive the same messages. A broadcast
+    // serializes the payload once and queues the same buffer to every member.
+    // With permessage-deflate each member still compresses it on its own.
+    class websocket_room {
+        public:
+            void join(const websocket_connection_ptr &c) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                members_.emplace(c.get(), c);
+            }
+
+            void leave(const websocket_connection_ptr &c) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                members_.erase(c.get());
+            }
+
+            bool contains(const websocket_connection_ptr &c) const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return members_.count(c.get()) != 0;
+            }
+
+            // Returns the number of members that accepted the message.
+            // Members that closed are forgotten.
+            size_t broadcast(const websocket_message &m, const websocket_connection *except = nullptr) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                size_t delivered = 0;
+                for (auto it = members_.begin(); it != members_.end();) {
+                    if (!it->second->is_open()) {
+                        it = members_.erase(it);
+                        continue;
+                    }
+                    if (it->first != except && it->second->send(m)) {
+                        ++delivered;
+                    }
+                    ++it;
+                }
+                return delivered;
+            }
+
+            size_t broadcast(std::string data, bool text = true) {
+                return broadcast(websocket_message(std::move(data), text));
+            }
+
+            size_t size() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return members_.size();
+            }
+
+        private:
+            mutable std::mutex mutex_;
+            std::unordered_map<const websocket_connection *, websocket_connection_ptr> members_;
+    };
+
+    // Rooms by name (topics, chat channels, document ids)
+    class websocket_hub {
+        public:
+            // The room is created on first use
+            std::shared_ptr<websocket_room> room(const std::string &name) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<websocket_room> &r = rooms_[name];
+                if (!r) {
+                    r = std::make_shared<websocket_room>();
+                }
+                return r;
+            }
+
+            void join(const std::string &name, const websocket_connection_ptr &c) {
+                // under our lock so leave_all cannot drop the room in between
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<websocket_room> &r = rooms_[name];
+                if (!r) {
+                    r = std::make_shared<websocket_room>();
+                }
+                r->join(c);
+            }
+
+            void leave(const std::string &name, const websocket_connection_ptr &c) {
+                std::shared_ptr<websocket_room> r = find(name);
+                if (r) {
+                    r->leave(c);
+                }
+            }
+
+            // Remove the connection from every room (from on_close). Empty
+            // rooms are dropped unless someone still holds one from room():
+            // new handles only come from us, under our lock.
+            void leave_all(const websocket_connection_ptr &c) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto it = rooms_.begin(); it != rooms_.end();) {
+                    it->second->leave(c);
+                    if (it->second->size() == 0 && it->second.use_count() == 1) {
+                        it = rooms_.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+
+            size_t broadcast(const std::string &name, const websocket_message &m,
+                             const websocket_connection *except = nullptr) {
+                std::shared_ptr<websocket_room> r = find(name);
+                return r ? r->broadcast(m, except) : 0;
+            }
+
+        private:
+            std::shared_ptr<websocket_room> find(const std::string &name) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = rooms_.find(name);
+                return it == rooms_.end() ? nullptr : it->second;
+            }
+
+            std::mutex mutex_;
+            std::unordered_map<std::string, std::shared_ptr<websocket_room>> rooms_;
+    };
+
+}
+
+#endif //WPP_WEBSOCKET_H
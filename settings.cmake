@@ -11,6 +11,12 @@ set(ENABLE_LOGGING 1)
 
 set(WPP_ENABLE_SSL 1)
 
+# HTTP/2 requires nghttp2
+option(WPP_ENABLE_HTTP2 "Serve HTTP/2 (h2 and h2c) with nghttp2" OFF)
+
+# io_uring instead of epoll on Linux (requires liburing and Boost >= 1.78)
+option(WPP_ENABLE_IO_URING "Use io_uring for sockets, files and timers" OFF)
+
 set(_MSC_VERSION 0)
 
 find_package(Threads)
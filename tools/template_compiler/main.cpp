@@ -0,0 +1,254 @@
+//
+// Turns a directory of templates into C++ render functions.
+//
+// wpp_template_compiler <templates dir> <output.cpp>
+//
+// Every template is parsed with the same compiler the registry uses at
+// runtime, and its plan is written out as straight-line code: text becomes
+// string_view literals, variables and sections become calls on the scope
+// with their paths already split and hashed. The generated file registers one function
+// per template, which the registry then renders in place of the plan.
+//
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "w++/view/render_plan.h"
+
+using wpp::views::render_plan;
+using op = render_plan::op;
+
+class generator {
+    public:
+        // Compile one template into a function named fn. There is no fold
+        // callback: the lambdas are registered by the application when it
+        // runs, so pure lambdas stay calls here. They give the same text,
+        // memoized after the first call, instead of being folded into it.
+        void add(const std::string &name, const std::string &source, const std::string &fn) {
+            std::shared_ptr<const render_plan> plan = render_plan::compile(
+                    name, source, [this](const std::string &partial) { return slot(partial); });
+            body_ << "// " << name << "\n";
+            body_ << "void " << fn << "(wpp::views::render_scope &s) {\n";
+            emit(*plan, 0, plan->code().size(), 1);
+            body_ << "}\n\n";
+            registrars_ << "const wpp::views::compiled_registrar r_" << fn << "(" << quote(name) << ", " << fn << ");\n";
+        }
+
+        std::string source() const {
+            std::ostringstream out;
+            out << "// Generated by wpp_template_compiler. Do not edit.\n\n"
+                << "#include <string>\n"
+                << "#include <string_view>\n"
+                << "#include <vector>\n\n"
+                << "#include \"w++/view/renderer.h\"\n\n"
+                << "namespace {\n\n"
+                << literals_.str() << "\n"
+                << body_.str()
+                << registrars_.str() << "\n"
+                << "}\n";
+            return out.str();
+        }
+
+    private:
+        uint32_t slot(const std::string &name) {
+            auto it = slots_.find(name);
+            if (it != slots_.end()) {
+                return it->second;
+            }
+            const uint32_t s = static_cast<uint32_t>(slot_names_.size());
+            slots_.emplace(name, s);
+            slot_names_.push_back(name);
+            return s;
+        }
+
+        static std::string quote(const std::string &text) {
+            static const char digits[] = "01234567";
+            std::string q = "\"";
+            for (size_t i = 0; i < text.size(); ++i) {
+                const auto c = static_cast<unsigned char>(text[i]);
+                if (c == '"' || c == '\\') {
+                    q += '\\';
+                    q += static_cast<char>(c);
+                } else if (c == '\n') {
+                    q += "\\n";
+                } else if (c == '\t') {
+                    q += "\\t";
+                } else if (c >= 0x20 && c < 0x7f && c != '?') {
+                    q += static_cast<char>(c);
+                } else {
+                    q += '\\';
+                    q += digits[c >> 6];
+                    q += digits[(c >> 3) & 7];
+                    q += digits[c & 7];
+                }
+                // keep long literals readable
+                if ((c == '\n' || (i + 1) % 96 == 0) && i + 1 < text.size()) {
+                    q += "\"\n        \"";
+                }
+            }
+            return q + "\"";
+        }
+
+        // A literal for text, shared by every template that uses the same text
+        std::string text(const std::string &t) {
+            auto it = texts_.find(t);
+            if (it != texts_.end()) {
+                return it->second;
+            }
+            const std::string id = "t" + std::to_string(texts_.size());
+            literals_ << "constexpr std::string_view " << id << "{" << quote(t) << ", " << t.size() << "};\n";
+            texts_.emplace(t, id);
+            return id;
+        }
+
+        std::string constant(const std::string &t) {
+            auto it = strings_.find(t);
+            if (it != strings_.end()) {
+                return it->second;
+            }
+            const std::string id = "n" + std::to_string(strings_.size());
+            literals_ << "const std::string " << id << "{" << quote(t) << ", " << t.size() << "};\n";
+            strings_.emplace(t, id);
+            return id;
+        }
+
+        // A key path with its hashes computed here instead of at startup
+        std::string path(const wpp::views::key_path &p) {
+            std::string key;
+            for (const std::string &s : p.names) {
+                key += s;
+                key += '\0';
+            }
+            auto it = paths_.find(key);
+            if (it != paths_.end()) {
+                return it->second;
+            }
+            const std::string id = "p" + std::to_string(paths_.size());
+            literals_ << "const wpp::views::key_path " << id << "{{";
+            for (size_t i = 0; i < p.size(); ++i) {
+                literals_ << (i ? ", " : "") << quote(p.names[i]);
+            }
+            literals_ << "}, {";
+            for (size_t i = 0; i < p.size(); ++i) {
+                literals_ << (i ? ", " : "") << "0x" << std::hex << p.hashes[i] << std::dec << "ull";
+            }
+            literals_ << "}};\n";
+            paths_.emplace(key, id);
+            return id;
+        }
+
+        void emit(const render_plan &plan, size_t begin, size_t end, int depth) {
+            const std::vector<render_plan::instruction> &code = plan.code();
+            const std::string indent(depth * 4, ' ');
+            for (size_t i = begin; i < end; i = code[i].jump) {
+                const render_plan::instruction &ins = code[i];
+                switch (ins.code) {
+                    case op::text:
+                        body_ << indent << "s.write(" << text(plan.text(ins.arg)) << ");\n";
+                        break;
+                    case op::escaped:
+                    case op::unescaped:
+                        body_ << indent << "s.variable(" << path(plan.path(ins.arg)) << ", "
+                              << (ins.code == op::escaped ? "true" : "false") << ");\n";
+                        break;
+                    case op::section:
+                    case op::inverted:
+                        body_ << indent << "s." << (ins.code == op::section ? "section(" : "inverted(")
+                              << path(plan.path(ins.arg)) << ", [&]() {\n";
+                        emit(plan, i + 1, ins.jump, depth + 1);
+                        body_ << indent << "});\n";
+                        break;
+                    case op::lambda:
+                        body_ << indent << "s.lambda(" << constant(plan.text(ins.arg)) << ", "
+                              << constant(plan.text(ins.extra)) << ");\n";
+                        break;
+                    case op::partial:
+                        body_ << indent << "s.partial(" << constant(slot_names_[ins.arg]) << ");\n";
+                        break;
+                    case op::parent:
+                        body_ << indent << "s.parent(" << constant(slot_names_[ins.arg]) << ", {\n";
+                        for (size_t j = i + 1; j < ins.jump; j = code[j].jump) {
+                            if (code[j].code == op::block) {
+                                body_ << indent << "    {" << text(plan.text(code[j].arg)) << ", [&]() {\n";
+                                emit(plan, j + 1, code[j].jump, depth + 2);
+                                body_ << indent << "    }},\n";
+                            }
+                        }
+                        body_ << indent << "});\n";
+                        break;
+                    case op::block:
+                        body_ << indent << "s.block(" << text(plan.text(ins.arg)) << ", [&]() {\n";
+                        emit(plan, i + 1, ins.jump, depth + 1);
+                        body_ << indent << "});\n";
+                        break;
+                    case op::cache:
+                        body_ << indent << "s.cached(" << constant(plan.text(ins.arg)) << ", " << ins.extra << ", [&]() {\n";
+                        emit(plan, i + 1, ins.jump, depth + 1);
+                        body_ << indent << "});\n";
+                        break;
+                }
+            }
+        }
+
+        std::unordered_map<std::string, uint32_t> slots_;
+        std::vector<std::string> slot_names_;
+        std::unordered_map<std::string, std::string> texts_;
+        std::unordered_map<std::string, std::string> strings_;
+        std::unordered_map<std::string, std::string> paths_;
+        std::ostringstream literals_;
+        std::ostringstream body_;
+        std::ostringstream registrars_;
+};
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <templates dir> <output.cpp>" << std::endl;
+        return 2;
+    }
+    const boost::filesystem::path root(argv[1]);
+    if (!boost::filesystem::is_directory(root)) {
+        std::cerr << root.string() << ": not a directory" << std::endl;
+        return 1;
+    }
+
+    // sorted, so the output only changes when the templates do
+    std::map<std::string, boost::filesystem::path> files;
+    for (boost::filesystem::recursive_directory_iterator it(root), end; it != end; ++it) {
+        if (boost::filesystem::is_regular_file(it->path())) {
+            files.emplace(it->path().lexically_relative(root).generic_string(), it->path());
+        }
+    }
+
+    generator g;
+    size_t n = 0;
+    for (auto &f : files) {
+        std::ifstream in(f.second.string(), std::ios::binary);
+        std::stringstream source;
+        source << in.rdbuf();
+        try {
+            g.add(f.first, source.str(), "render_" + std::to_string(n++));
+        } catch (const wpp::views::template_error &e) {
+            std::cerr << "template error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    const std::string out = g.source();
+    std::ifstream previous(argv[2], std::ios::binary);
+    std::stringstream old;
+    old << previous.rdbuf();
+    if (previous && old.str() == out) {
+        // leave it alone so what depends on it is not rebuilt
+        return 0;
+    }
+    std::ofstream(argv[2], std::ios::binary) << out;
+    std::cout << "templates: " << files.size() << " compiled into " << argv[2] << std::endl;
+    return 0;
+}
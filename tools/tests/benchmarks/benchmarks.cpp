@@ -141,4 +141,461 @@ static void CustomArguments_insert_int_container(benchmark::internal::Benchmark*
 //BENCHMARK(insert_int_container)->Ranges({{0, 5}, {8, 8<<10}, {0,1}});
 BENCHMARK(insert_int_container)->Apply(CustomArguments_insert_int_container)->Iterations(10);
 
-BENCHMARK_MAIN();
\ No newline at end of file
+// I/O backend: build once with and once without WPP_ENABLE_IO_URING and
+// compare the two runs on the same machine. The label shows the backend.
+
+// Loopback server that answers every request of a keep-alive connection
+// with `response`. Reads and writes go through the io_context backend.
+class loopback_server {
+public:
+    loopback_server(boost::asio::io_context& ioc, std::function<void(std::shared_ptr<boost::asio::ip::tcp::socket>)> on_request)
+            : acceptor_(ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}), on_request_(std::move(on_request)) {
+        accept();
+    }
+
+    boost::asio::ip::tcp::endpoint endpoint() const {
+        return acceptor_.local_endpoint();
+    }
+
+    // Read the next request of the connection
+    void read(std::shared_ptr<boost::asio::ip::tcp::socket> s, std::shared_ptr<std::string> buffer) {
+        boost::asio::async_read_until(*s, boost::asio::dynamic_buffer(*buffer), "\r\n\r\n",
+                                      [this, s, buffer](boost::system::error_code ec, size_t n) {
+                                          if (ec) {
+                                              return;
+                                          }
+                                          buffer->erase(0, n);
+                                          on_request_(s);
+                                          read(s, buffer);
+                                      });
+    }
+
+private:
+    void accept() {
+        acceptor_.async_accept([this](boost::system::error_code ec, boost::asio::ip::tcp::socket s) {
+            if (ec) {
+                return;
+            }
+            s.set_option(boost::asio::ip::tcp::no_delay(true));
+            read(std::make_shared<boost::asio::ip::tcp::socket>(std::move(s)), std::make_shared<std::string>());
+            accept();
+        });
+    }
+
+    boost::asio::ip::tcp::acceptor acceptor_;
+    std::function<void(std::shared_ptr<boost::asio::ip::tcp::socket>)> on_request_;
+};
+
+// Small responses on keep-alive connections: state.range(0) clients send a
+// request and wait for the response in a loop
+void io_backend_keep_alive(benchmark::State& state) {
+    const size_t number_of_clients = state.range(0);
+    static const std::string response = "HTTP/1.1 200 OK\r\nContent-Length: 13\r\nContent-Type: text/plain\r\n\r\nHello, World!";
+    static const std::string request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    boost::asio::io_context ioc;
+    loopback_server server(ioc, [](std::shared_ptr<boost::asio::ip::tcp::socket> s) {
+        boost::asio::async_write(*s, boost::asio::buffer(response), [s](boost::system::error_code, size_t) {});
+    });
+    auto guard = boost::asio::make_work_guard(ioc);
+    std::thread server_thread([&ioc]() { ioc.run(); });
+
+    boost::asio::io_context client_ioc;
+    std::vector<boost::asio::ip::tcp::socket> clients;
+    for (size_t i = 0; i < number_of_clients; ++i) {
+        clients.emplace_back(client_ioc);
+        clients.back().connect(server.endpoint());
+        clients.back().set_option(boost::asio::ip::tcp::no_delay(true));
+    }
+    std::vector<char> reply(response.size());
+
+    for (auto _ : state) {
+        for (auto&& c : clients) {
+            boost::asio::write(c, boost::asio::buffer(request));
+        }
+        for (auto&& c : clients) {
+            boost::asio::read(c, boost::asio::buffer(reply));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * number_of_clients);
+    state.SetLabel(wpp::io_backend_name());
+
+    for (auto&& c : clients) {
+        c.close();
+    }
+    guard.reset();
+    ioc.stop();
+    server_thread.join();
+}
+BENCHMARK(io_backend_keep_alive)->Arg(1)->Arg(16)->Arg(64)->UseRealTime();
+
+// Large static file: the server reads the file with file_reader (io_uring
+// reads or pread) and sends it in blocks of 128KB
+void io_backend_static_file(benchmark::State& state) {
+    const size_t file_size = state.range(0);
+    const std::string path = "io_backend_benchmark.bin";
+    {
+        std::ofstream out(path, std::ios::binary);
+        std::string block(64 * 1024, 'x');
+        for (size_t written = 0; written < file_size; written += block.size()) {
+            out.write(block.data(), std::min(block.size(), file_size - written));
+        }
+    }
+    static const std::string request = "GET /file HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    boost::asio::io_context ioc;
+    std::function<void(std::shared_ptr<boost::asio::ip::tcp::socket>, std::shared_ptr<wpp::file_reader>,
+                       std::shared_ptr<std::vector<char>>, uint64_t)> send_block;
+    send_block = [&send_block](std::shared_ptr<boost::asio::ip::tcp::socket> s, std::shared_ptr<wpp::file_reader> f,
+                               std::shared_ptr<std::vector<char>> block, uint64_t offset) {
+        if (offset >= f->size()) {
+            return;
+        }
+        f->async_read_at(offset, block->data(), block->size(),
+                         [&send_block, s, f, block, offset](const boost::system::error_code& ec, size_t n) {
+            if (ec) {
+                return;
+            }
+            boost::asio::async_write(*s, boost::asio::buffer(block->data(), n),
+                                     [&send_block, s, f, block, offset, n](boost::system::error_code ec, size_t) {
+                if (!ec) {
+                    send_block(s, f, block, offset + n);
+                }
+            });
+        });
+    };
+    loopback_server server(ioc, [&ioc, &path, &send_block](std::shared_ptr<boost::asio::ip::tcp::socket> s) {
+        auto f = std::make_shared<wpp::file_reader>(ioc, path);
+        send_block(s, f, std::make_shared<std::vector<char>>(128 * 1024), 0);
+    });
+    auto guard = boost::asio::make_work_guard(ioc);
+    std::thread server_thread([&ioc]() { ioc.run(); });
+
+    boost::asio::io_context client_ioc;
+    boost::asio::ip::tcp::socket client(client_ioc);
+    client.connect(server.endpoint());
+    std::vector<char> reply(file_size);
+
+    for (auto _ : state) {
+        boost::asio::write(client, boost::asio::buffer(request));
+        boost::asio::read(client, boost::asio::buffer(reply));
+    }
+    state.SetBytesProcessed(state.iterations() * file_size);
+    state.SetLabel(wpp::io_backend_name());
+
+    client.close();
+    guard.reset();
+    ioc.stop();
+    server_thread.join();
+    std::remove(path.c_str());
+}
+BENCHMARK(io_backend_static_file)->Arg(1 << 20)->Arg(16 << 20)->Arg(64 << 20)->UseRealTime();
+
+// HTML escaping of template variables. state.range(0) picks the content:
+// 0 prose with the odd apostrophe, 1 user content full of markup and
+// links, 2 plain text with nothing to escape.
+std::string html_escape_content(int64_t kind, size_t size) {
+    static const std::vector<std::string> samples = {
+            "It's been a long week, but the new release finally shipped to everyone on the team. ",
+            "<a href=\"https://example.com/a/b?x=1&y=2\">Tom's \"link\"</a> & <b>more</b> ",
+            "Lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor incididunt "};
+    std::string content;
+    while (content.size() < size) {
+        content += samples[kind];
+    }
+    content.resize(size);
+    return content;
+}
+
+// What the renderers did before: one switch and one append per character
+void html_escape_per_character(const std::string &in, std::string &out) {
+    for (char c : in) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            case '\'': out += "&#39;"; break;
+            case '/': out += "&#x2F;"; break;
+            default: out += c; break;
+        }
+    }
+}
+
+void html_escape_switch(benchmark::State& state) {
+    const std::string content = html_escape_content(state.range(0), state.range(1));
+    std::string out;
+    while (state.KeepRunning()) {
+        out.clear();
+        html_escape_per_character(content, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * content.size());
+}
+BENCHMARK(html_escape_switch)->Ranges({{0, 2}, {64, 64 << 10}});
+
+void html_escape_vectorized(benchmark::State& state) {
+    const std::string content = html_escape_content(state.range(0), state.range(1));
+    std::string out;
+    while (state.KeepRunning()) {
+        out.clear();
+        wpp::views::html_escape(content.data(), content.size(), out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * content.size());
+    state.SetLabel(wpp::views::html_escape_isa());
+}
+BENCHMARK(html_escape_vectorized)->Ranges({{0, 2}, {64, 64 << 10}});
+
+// A page with 200 variables, half strings and half numbers, some of them
+// nested. Each iteration builds the data the way a handler would and
+// renders it.
+std::shared_ptr<const wpp::views::render_plan> view_200_variables_plan() {
+    std::string source = "<html><body>\n";
+    for (int i = 0; i < 200; ++i) {
+        source += i % 4 == 3 ? "<p>{{group.v" + std::to_string(i) + "}}</p>\n" : "<p>{{v" + std::to_string(i) + "}}</p>\n";
+    }
+    source += "</body></html>\n";
+    return wpp::views::render_plan::compile("page.html", source, [](const std::string &) { return wpp::views::no_slot; });
+}
+
+void view_200_variables_json(benchmark::State& state) {
+    const std::shared_ptr<const wpp::views::render_plan> plan = view_200_variables_plan();
+    const wpp::views::plan_set set;
+    std::string out;
+    while (state.KeepRunning()) {
+        wpp::json data;
+        wpp::json &group = data["group"];
+        for (int i = 0; i < 200; ++i) {
+            wpp::json &parent = i % 4 == 3 ? group : data;
+            if (i % 2) {
+                parent["v" + std::to_string(i)] = i;
+            } else {
+                parent["v" + std::to_string(i)] = "value <" + std::to_string(i) + ">";
+            }
+        }
+        out.clear();
+        wpp::views::render(set, *plan, data, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(view_200_variables_json);
+
+void view_200_variables_context(benchmark::State& state) {
+    const std::shared_ptr<const wpp::views::render_plan> plan = view_200_variables_plan();
+    const wpp::views::plan_set set;
+    std::string out;
+    while (state.KeepRunning()) {
+        wpp::views::render_context data;
+        wpp::views::object_builder group(data);
+        for (int i = 0; i < 200; ++i) {
+            const std::string key = "v" + std::to_string(i);
+            if (i % 4 == 3) {
+                group.set(key, i);
+            } else if (i % 2) {
+                data.set(key, i);
+            } else {
+                data.set(key, "value <" + std::to_string(i) + ">");
+            }
+        }
+        data.set("group", group.value());
+        out.clear();
+        wpp::views::render(set, *plan, data, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(view_200_variables_context);
+
+// A page with 100 {{@route}} links. Arg 0 calls the lambda every time,
+// 1 registers it as pure and renders from the memo, 2 also folds the
+// literal arguments into the plan.
+void view_pure_lambda(benchmark::State& state) {
+    std::map<std::string, std::string> routes;
+    std::string source = "<ul>\n";
+    for (int i = 0; i < 100; ++i) {
+        routes["page" + std::to_string(i)] = "/pages/" + std::to_string(i) + "/{slug}";
+        source += "<li><a href=\"{{@route}}page" + std::to_string(i) + "{{/route}}\">{{title}}</a></li>\n";
+    }
+    source += "</ul>\n";
+    wpp::views::text_lambda route = [&routes](const std::string &name) {
+        auto it = routes.find(name);
+        return it == routes.end() ? std::string() : "https://example.com" + it->second.substr(0, it->second.find('{'));
+    };
+    wpp::views::plan_set set;
+    auto lambdas = std::make_shared<wpp::views::lambda_table>();
+    (*lambdas)["route"] = state.range(0) ? wpp::views::view_lambda{route, nullptr, std::make_shared<wpp::views::lambda_cache>()}
+                                         : wpp::views::view_lambda{route, nullptr};
+    set.lambdas = lambdas;
+    const wpp::views::view_lambda &f = (*lambdas)["route"];
+    const std::shared_ptr<const wpp::views::render_plan> plan = wpp::views::render_plan::compile(
+            "page.html", source, [](const std::string &) { return wpp::views::no_slot; },
+            [&](const std::string &, const std::string &raw, std::string &out) {
+                if (state.range(0) < 2) {
+                    return false;
+                }
+                out = *f.call(raw);
+                return true;
+            });
+    wpp::views::render_context data;
+    data.set("title", "a page");
+    std::string out;
+    while (state.KeepRunning()) {
+        out.clear();
+        wpp::views::render(set, *plan, data, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+}
+BENCHMARK(view_pure_lambda)->Arg(0)->Arg(1)->Arg(2);
+
+// The ETag of a body of state.range(0) bytes
+void etag_of_body(benchmark::State& state) {
+    const std::string body(state.range(0), 'x');
+    while (state.KeepRunning()) {
+        benchmark::DoNotOptimize(wpp::etag_of(body));
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(body.size()));
+}
+BENCHMARK(etag_of_body)->Range(1 << 10, 1 << 20);
+
+// A session cookie written and read back. 0: json text in AES-CBC and hex
+// with a new cipher context per call, 1: CBOR in AES-GCM and base64url
+void session_cookie(benchmark::State& state) {
+    const wpp::json session = {{"user_id", 1234},
+                               {"name", "Alan Turing"},
+                               {"roles", {"admin", "editor"}},
+                               {"flashed_data_from_this_request", {{"status", "Profile updated!"}}}};
+    std::vector<wpp::byte> key, iv;
+    wpp::gen_params(key, iv);
+    const wpp::session_codec codec(key);
+    size_t cookie_size = 0;
+    while (state.KeepRunning()) {
+        if (state.range(0) == 0) {
+            wpp::secure_string text = session.dump().c_str();
+            wpp::secure_string cyphered;
+            wpp::aes_encrypt(key.data(), iv.data(), text, cyphered);
+            static const char *const lut = "0123456789abcdef";
+            std::string cookie;
+            for (unsigned char c : cyphered) {
+                cookie.push_back(lut[c >> 4]);
+                cookie.push_back(lut[c & 15]);
+            }
+            wpp::secure_string unhexed;
+            for (size_t i = 0; i < cookie.size(); i += 2) {
+                const char *p = std::lower_bound(lut, lut + 16, cookie[i]);
+                const char *q = std::lower_bound(lut, lut + 16, cookie[i + 1]);
+                unhexed.push_back(((p - lut) << 4) | (q - lut));
+            }
+            wpp::secure_string plain;
+            bool success = false;
+            wpp::aes_decrypt(key.data(), iv.data(), unhexed, plain, success);
+            benchmark::DoNotOptimize(wpp::json::parse(plain.c_str()));
+            cookie_size = cookie.size();
+        } else {
+            const std::string cookie = codec.seal(session);
+            wpp::json opened;
+            benchmark::DoNotOptimize(codec.open(cookie, opened));
+            cookie_size = cookie.size();
+        }
+    }
+    state.counters["cookie_bytes"] = cookie_size;
+}
+BENCHMARK(session_cookie)->Arg(0)->Arg(1);
+
+// The same session kept on the server: load it by ID and save it back
+void session_store_round_trip(benchmark::State& state) {
+    const wpp::json session = {{"user_id", 1234},
+                               {"name", "Alan Turing"},
+                               {"roles", {"admin", "editor"}},
+                               {"flashed_data_from_this_request", {{"status", "Profile updated!"}}}};
+    wpp::session_store store;
+    const std::string id = wpp::session_store::new_id();
+    store.save(id, session);
+    while (state.KeepRunning()) {
+        wpp::json loaded;
+        store.load(id, loaded);
+        store.save(id, std::move(loaded));
+    }
+    state.counters["cookie_bytes"] = id.size();
+}
+BENCHMARK(session_store_round_trip);
+
+// A role check. 0: scanning the json of the user, as the guard did,
+// 1: testing the interned role of a resolved user
+void guard_has_role(benchmark::State& state) {
+    wpp::access_registry roles, permissions;
+    for (const char *name : {"guest", "member", "author", "editor", "moderator", "admin"}) {
+        roles.intern(name);
+    }
+    wpp::json user = {{"id", 1}, {"role", {"member", "author", "editor"}}};
+    const wpp::principal resolved(user, roles, permissions);
+    wpp::access_set mask;
+    roles.mask("moderator|editor", mask);
+    while (state.KeepRunning()) {
+        if (state.range(0) == 0) {
+            bool found = false;
+            std::vector<std::string> names = {"moderator", "editor"};
+            for (std::string &name : names) {
+                boost::algorithm::trim(name);
+                for (wpp::json &r : user["role"]) {
+                    if (r.is_string() && r.get<std::string>() == name) {
+                        found = true;
+                    }
+                }
+            }
+            benchmark::DoNotOptimize(found);
+        } else {
+            benchmark::DoNotOptimize(resolved.has_any_role(mask));
+        }
+    }
+}
+BENCHMARK(guard_has_role)->Arg(0)->Arg(1);
+
+// The application cache from 1 to 32 threads, 95% reads of 10000 hot keys.
+// 0: one mutex around an unordered_map, 1: wpp::cache
+void cache_concurrent(benchmark::State& state) {
+    static std::vector<std::string> keys = [] {
+        std::vector<std::string> k;
+        for (int i = 0; i < 10000; ++i) {
+            k.push_back("posts/" + std::to_string(i));
+        }
+        return k;
+    }();
+    static wpp::cache shared_cache{std::chrono::hours(24), 20000};
+    static std::mutex map_mutex;
+    static std::unordered_map<std::string, std::shared_ptr<const std::string>> map = [] {
+        std::unordered_map<std::string, std::shared_ptr<const std::string>> m;
+        for (const std::string &key : keys) {
+            shared_cache.put(key, std::string(256, 'x'));
+            m[key] = std::make_shared<const std::string>(256, 'x');
+        }
+        return m;
+    }();
+    uint64_t x = 88172645463325252ull ^ std::hash<std::thread::id>()(std::this_thread::get_id());
+    while (state.KeepRunning()) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        const std::string &key = keys[x % keys.size()];
+        const bool write = x % 20 == 0;
+        if (state.range(0) == 0) {
+            std::lock_guard<std::mutex> lock(map_mutex);
+            if (write) {
+                map[key] = std::make_shared<const std::string>(256, 'y');
+            } else {
+                auto it = map.find(key);
+                std::shared_ptr<const std::string> value = it != map.end() ? it->second : nullptr;
+                benchmark::DoNotOptimize(value);
+            }
+        } else {
+            if (write) {
+                shared_cache.put(key, std::string(256, 'y'));
+            } else {
+                benchmark::DoNotOptimize(shared_cache.get(key));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(cache_concurrent)->Arg(0)->Arg(1)->ThreadRange(1, 32)->UseRealTime();
+
+BENCHMARK_MAIN();
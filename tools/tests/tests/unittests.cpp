@@ -0,0 +1,158 @@
+//
+// Unit tests of the parts of w++ that run without a server.
+//
+
+#define CATCH_CONFIG_MAIN
+// Catch 1 sizes a stack with SIGSTKSZ, which is not a constant on newer glibc
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
+#include "catch.hpp"
+
+#include <fstream>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "w++/sse.h"
+#include "w++/view.h"
+
+namespace {
+    // A directory of templates that is removed with the object
+    struct template_dir {
+        boost::filesystem::path root;
+
+        template_dir() : root(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()) {
+            boost::filesystem::create_directories(root);
+        }
+
+        ~template_dir() {
+            boost::system::error_code ec;
+            boost::filesystem::remove_all(root, ec);
+        }
+
+        void add(const std::string &name, const std::string &text) const {
+            std::ofstream((root / name).string(), std::ios::binary) << text;
+        }
+    };
+}
+
+TEST_CASE("Templates render from their plans", "[views]") {
+    template_dir dir;
+    dir.add("page.html", "<h1>{{title}}</h1>{{#items}}<i>{{.}}</i>{{/items}}{{^none}}-{{/none}}{{>footer.html}}");
+    dir.add("footer.html", "<footer>{{{raw}}}</footer>");
+    wpp::views::plan_registry views;
+    REQUIRE(views.load(dir.root.string()));
+
+    std::string out;
+    wpp::json data = {{"title", "<a&b>"}, {"items", {1, 2}}, {"raw", "<b>"}};
+    REQUIRE(views.render("page.html", data, out));
+    CHECK(out == "<h1>&lt;a&amp;b&gt;</h1><i>1</i><i>2</i>-<footer><b></footer>");
+
+    out.clear();
+    CHECK_FALSE(views.render("missing.html", data, out));
+}
+
+TEST_CASE("Pure lambdas with literal text are folded into the plan", "[views]") {
+    template_dir dir;
+    dir.add("page.html", "{{@route}}home{{/route}}|{{@route}}home{{/route}}");
+    wpp::views::plan_registry views;
+    int calls = 0;
+    views.pure_lambda("route", [&calls](const std::string &name) {
+        ++calls;
+        return "/" + name;
+    });
+    REQUIRE(views.load(dir.root.string()));
+    const int after_load = calls;
+
+    std::string out;
+    for (int i = 0; i < 3; ++i) {
+        out.clear();
+        REQUIRE(views.render("page.html", wpp::json::object(), out));
+    }
+    CHECK(out == "/home|/home");
+    // Folded when the plan was built, memoized after the first call
+    CHECK(after_load == 1);
+    CHECK(calls == after_load);
+}
+
+TEST_CASE("Scoped lambdas render in the context of the template", "[views]") {
+    template_dir dir;
+    dir.add("page.html", "{{@twice}}{{name}}{{/twice}}");
+    wpp::views::plan_registry views;
+    views.lambda("twice", wpp::views::scoped_lambda([](const std::string &text, wpp::views::render_scope &scope) {
+        return scope.render(text) + scope.render(text);
+    }));
+    REQUIRE(views.load(dir.root.string()));
+
+    std::string out;
+    REQUIRE(views.render("page.html", wpp::json{{"name", "ab"}}, out));
+    CHECK(out == "abab");
+}
+
+TEST_CASE("Cached fragments are kept until invalidated", "[views]") {
+    template_dir dir;
+    dir.add("page.html", "{{#@cache user-{id} 60}}{{name}}{{/@cache}}");
+    wpp::views::plan_registry views;
+    REQUIRE(views.load(dir.root.string()));
+
+    std::string out;
+    REQUIRE(views.render("page.html", wpp::json{{"id", 7}, {"name", "first"}}, out));
+    CHECK(out == "first");
+
+    out.clear();
+    REQUIRE(views.render("page.html", wpp::json{{"id", 7}, {"name", "second"}}, out));
+    CHECK(out == "first");
+
+    views.fragments().invalidate_prefix("page.html", "user-");
+    out.clear();
+    REQUIRE(views.render("page.html", wpp::json{{"id", 7}, {"name", "second"}}, out));
+    CHECK(out == "second");
+}
+
+TEST_CASE("Fragment keys belong to their template", "[views]") {
+    template_dir dir;
+    dir.add("a.html", "{{#@cache post-{id}}}a{{name}}{{/@cache}}");
+    dir.add("b.html", "{{#@cache post-{id}}}b{{name}}{{/@cache}}");
+    wpp::views::plan_registry views;
+    REQUIRE(views.load(dir.root.string()));
+
+    std::string a, b;
+    REQUIRE(views.render("a.html", wpp::json{{"id", 1}, {"name", "x"}}, a));
+    REQUIRE(views.render("b.html", wpp::json{{"id", 1}, {"name", "x"}}, b));
+    CHECK(a == "ax");
+    CHECK(b == "bx");
+
+    views.fragments().invalidate("a.html", "post-1");
+    a.clear();
+    b.clear();
+    REQUIRE(views.render("a.html", wpp::json{{"id", 1}, {"name", "y"}}, a));
+    REQUIRE(views.render("b.html", wpp::json{{"id", 1}, {"name", "y"}}, b));
+    CHECK(a == "ay");
+    CHECK(b == "bx");
+}
+
+TEST_CASE("Event fields cannot be split into other fields", "[sse]") {
+    auto body = [](const wpp::sse_buffer &framed) {
+        // the text inside the chunk framing
+        const size_t begin = framed->find("\r\n") + 2;
+        return framed->substr(begin, framed->size() - begin - 2);
+    };
+    CHECK(body(wpp::sse_frame("a\nb", "tick", "7")) == "event: tick\nid: 7\ndata: a\ndata: b\n\n");
+    CHECK(body(wpp::sse_frame("x", "tick\ndata: forged", "1\r\nretry: 1")) ==
+          "event: tickdata: forged\nid: 1retry: 1\ndata: x\n\n");
+    CHECK(body(wpp::sse_frame("a\r\nb\rc")) == "data: a\ndata: b\ndata: c\n\n");
+}
+
+TEST_CASE("Folded sections drop the partials of their body", "[views]") {
+    std::vector<std::string> resolved;
+    auto resolve = [&resolved](const std::string &partial) {
+        resolved.push_back(partial);
+        return static_cast<uint32_t>(resolved.size() - 1);
+    };
+    auto fold = [](const std::string &, const std::string &, std::string &out) {
+        out = "folded";
+        return true;
+    };
+    auto plan = wpp::views::render_plan::compile("page.html", "{{@f}}{{>a.html}}{{/f}}{{>b.html}}", resolve, fold);
+    REQUIRE(plan->dependencies().size() == 1);
+    CHECK(resolved[plan->dependencies()[0]] == "b.html");
+}
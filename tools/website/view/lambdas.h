@@ -22,30 +22,31 @@ using namespace wpp;
 
 wpp::json get_parameters(const string& s);
 std::string csrf_token(application &app);
+std::string page_csrf_token(application &app, views::render_scope &scope);
 
 void register_view_lambdas(application &app) {
 
     ////////////////////////////////////////////////////////////////
-    //                         Lambdas                            //
+    //                    Lambdas (pure)                          //
     ////////////////////////////////////////////////////////////////
 
     // return url to route
-    app.lambda("route",[&app](const std::string & s) {
+    app.pure_lambda("route",[&app](const std::string & s) {
         return app.url_for(s);
     });
 
     // return url to asset
-    app.lambda("asset",[&app](const std::string & s) {
+    app.pure_lambda("asset",[&app](const std::string & s) {
         return app.asset(s);
     });
 
     // form field to define method
-    app.lambda("method_field",[&app](const std::string & s) {
+    app.pure_lambda("method_field",[&app](const std::string & s) {
         return string("<input type=\"hidden\" name=\"_method\" value=\"") + boost::algorithm::to_upper_copy(s) + "\">";
     });
 
     // return link component
-    app.lambda("link",[&app](const std::string & s) {
+    app.pure_lambda("link",[&app](const std::string & s) {
         wpp::json parameters = get_parameters(s);
         if (parameters.size() < 2) {
             return "<a href=\"" + s + "\">" + s + "</a>";
@@ -55,27 +56,26 @@ void register_view_lambdas(application &app) {
     });
 
     // return nothing
-    app.lambda("comment",[&app](const std::string & s) {
+    app.pure_lambda("comment",[&app](const std::string & s) {
         return string();
     });
 
     ////////////////////////////////////////////////////////////////
-    //                  Lambdas with renderer                     //
+    //                  Lambdas with render scope                 //
     ////////////////////////////////////////////////////////////////
 
     // return non rendered text
-    app.lambda("verbatim",[&app](const std::string & s, renderer&) {
+    app.view_lambda("verbatim",[](const std::string & s, views::render_scope&) {
         return s;
     });
 
     ////////////////////////////////////////////////////////////////
-    //            Lambdas with renderer + context data            //
+    //          Lambdas with render scope + context data          //
     ////////////////////////////////////////////////////////////////
 
     // return number of elements
-    app.lambda("count",[](const std::string & s, renderer& r) {
-        renderer_internal& ri = static_cast<renderer_internal&>(r);
-        auto element = ri.ctx->ctx.get(s);
+    app.view_lambda("count",[](const std::string & s, views::render_scope& scope) {
+        const views::context_value *element = scope.get(s);
         if (element != nullptr){
             return std::to_string(element->size());
         } else {
@@ -84,117 +84,69 @@ void register_view_lambdas(application &app) {
     });
 
     // return csrf token field
-    app.lambda("csrf_field",[&app](const std::string & s, renderer& r) {
-        renderer_internal& ri = static_cast<renderer_internal&>(r);
-        auto element = ri.ctx->ctx.get("_csrfmiddlewaretoken");
-        if (element == nullptr){
-            string csrf_token_string = csrf_token(app);
-            mustache_data csrf_token_data{mustache_data::type::object};
-            csrf_token_data.set("_csrfmiddlewaretoken",csrf_token_string);
-            ri.ctx->ctx.push_copy(&csrf_token_data);
-            return string("<input type=\"hidden\" name=\"_csrfmiddlewaretoken\" value=\"")+csrf_token_string+"\" />";
-        } else {
-            return string("<input type=\"hidden\" name=\"_csrfmiddlewaretoken\" value=\"")+element->string_value()+"\" />";
-        }
+    app.view_lambda("csrf_field",[&app](const std::string & s, views::render_scope& scope) {
+        return string("<input type=\"hidden\" name=\"_csrfmiddlewaretoken\" value=\"") + page_csrf_token(app, scope) + "\" />";
     });
 
-    // return csrf token field
-    app.lambda("csrf_token",[&app](const std::string & s, renderer& r) {
-        renderer_internal& ri = static_cast<renderer_internal&>(r);
-        auto element = ri.ctx->ctx.get("_csrfmiddlewaretoken");
-        if (element == nullptr){
-            string csrf_token_string = csrf_token(app);
-            mustache_data csrf_token_data{mustache_data::type::object};
-            csrf_token_data.set("_csrfmiddlewaretoken",csrf_token_string);
-            ri.ctx->ctx.push_copy(&csrf_token_data);
-            return csrf_token_string;
-        } else {
-            return element->string_value();
-        }
+    // return csrf token
+    app.view_lambda("csrf_token",[&app](const std::string & s, views::render_scope& scope) {
+        return page_csrf_token(app, scope);
     });
 
     // print each element of a list or object
-    app.lambda("foreach",[](const std::string & s, renderer& r) {
+    app.view_lambda("foreach",[](const std::string & s, views::render_scope& scope) {
         // get parameters
         wpp::json parameters = get_parameters(s);
-        // get context
-        renderer_internal &ri = static_cast<renderer_internal &>(r);
         if (parameters.size() == 2 && parameters[0].is_string() && parameters[1].is_string()) {
             // if there is only text string + one string parameter, try to loop the variable
-            const mustache_data *var = ri.ctx->ctx.get(parameters[1].get<string>());
-            if (var && var->is_non_empty_list()) {
+            const views::context_value *var = scope.get(parameters[1].get<string>());
+            if (var && var->is_array() && !var->empty()) {
+                // the body is compiled once for all items
+                std::shared_ptr<const views::render_plan> body = scope.compile(parameters[0].get<string>());
+                const size_t n = var->size();
                 string result;
-                for (int i = 0; i < var->list_value().size(); ++i) {
-                    const mustache_data& item = (var->list_value())[i];
-                    mustache_data loopdata{mustache_data::type::object};
-                    loopdata.set("is_first",(i==0 ? true : false));
-                    loopdata.set("is_last",(i==var->list_value().size()-1 ? true : false));
-                    loopdata.set("loop_index",to_string(i));
-                    loopdata.set("loop_iteration",to_string(i+1));
-                    loopdata.set("loop_remaining",to_string(var->list_value().size()-i-1));
-                    loopdata.set("loop_count",to_string(var->list_value().size()));
-                    ri.ctx->ctx.push(&loopdata);
-                    ri.ctx->ctx.push(&item);
-                    result += r(parameters[0].get<string>());
-                    ri.ctx->ctx.pop();
-                    ri.ctx->ctx.pop();
+                for (size_t i = 0; i < n; ++i) {
+                    views::render_context loop;
+                    const views::context_value loopdata = loop.object({
+                            {"is_first", i == 0},
+                            {"is_last", i == n - 1},
+                            {"loop_index", loop.string(to_string(i))},
+                            {"loop_iteration", loop.string(to_string(i + 1))},
+                            {"loop_remaining", loop.string(to_string(n - i - 1))},
+                            {"loop_count", loop.string(to_string(n))}});
+                    scope.push(loopdata);
+                    scope.push((*var)[i]);
+                    result += scope.render(*body);
+                    scope.pop();
+                    scope.pop();
                 }
                 return result;
             }
         } else if (parameters.size() == 3  && parameters[0].is_string() && parameters[1].is_string() && parameters[2].is_number_integer()) {
             // if there is text + string parameter + int parameter, loop in chunks
-            const mustache_data *var = ri.ctx->ctx.get(parameters[1].get<string>());
-            if (var && var->is_non_empty_list()) {
-                int chunk_size = parameters[2].get<int>();
-                int n_of_chunks = var->size()/chunk_size;
-                int rest_of_chunks = var->size()%chunk_size;
+            const views::context_value *var = scope.get(parameters[1].get<string>());
+            const int chunk_size = parameters[2].get<int>();
+            if (var && var->is_array() && !var->empty() && chunk_size > 0) {
+                std::shared_ptr<const views::render_plan> body = scope.compile(parameters[0].get<string>());
+                const size_t size = var->size();
+                const size_t n_of_chunks = (size + chunk_size - 1) / chunk_size;
                 string result;
-                for (int i = 0; i < n_of_chunks; ++i) {
-                    mustache_data chunk_list{mustache_data::type::list};
-                    for (int j = 0; j < chunk_size; ++j) {
-                        chunk_list.push_back(var->list_value()[i * chunk_size + j]);
-                    }
-                    mustache_data chunk{mustache_data::type::object};
-                    chunk.set("chunk",chunk_list);
-                    if (i == 0){
-                        chunk.set("is_first",true);
-                    } else {
-                        chunk.set("is_first",false);
-                    }
-                    if (i == n_of_chunks+(rest_of_chunks != 0?1:0)-1){
-                        chunk.set("is_last",true);
-                    } else {
-                        chunk.set("is_last",false);
-                    }
-                    chunk.set("loop_index",to_string(i));
-                    chunk.set("loop_iteration",to_string(i+1));
-                    chunk.set("loop_remaining",to_string(n_of_chunks+(rest_of_chunks != 0?1:0)-i-1));
-                    chunk.set("loop_count",to_string(n_of_chunks+(rest_of_chunks != 0?1:0)));
-                    ri.ctx->ctx.push(&chunk);
-                    result += r(parameters[0].get<string>());
-                    ri.ctx->ctx.pop();
-                }
-                if (rest_of_chunks != 0) {
-                    mustache_data chunk_list{mustache_data::type::list};
-                    for (int j = 0; j < rest_of_chunks; ++j) {
-                        chunk_list.push_back(var->list_value()[var->size() - rest_of_chunks + j]);
-                    }
-                    mustache_data chunk{mustache_data::type::object};
-                    chunk.set("chunk",chunk_list);
-                    if (n_of_chunks == 0){
-                        chunk.set("is_first",true);
-                        chunk.set("is_last",true);
-                    } else {
-                        chunk.set("is_first",false);
-                        chunk.set("is_last",true);
-                    }
-                    chunk.set("loop_index",to_string(n_of_chunks+1));
-                    chunk.set("loop_iteration",to_string(n_of_chunks+2));
-                    chunk.set("loop_remaining",to_string((int)0));
-                    chunk.set("loop_count",to_string(n_of_chunks+1));
-                    ri.ctx->ctx.push(&chunk);
-                    result += r(parameters[0].get<string>());
-                    ri.ctx->ctx.pop();
+                for (size_t i = 0; i < n_of_chunks; ++i) {
+                    // the items of the chunk are a slice of the list
+                    const size_t first = i * chunk_size;
+                    const size_t count = std::min<size_t>(chunk_size, size - first);
+                    views::render_context loop;
+                    const views::context_value chunk = loop.object({
+                            {"chunk", views::context_value::array(var->begin() + first, count)},
+                            {"is_first", i == 0},
+                            {"is_last", i == n_of_chunks - 1},
+                            {"loop_index", loop.string(to_string(i))},
+                            {"loop_iteration", loop.string(to_string(i + 1))},
+                            {"loop_remaining", loop.string(to_string(n_of_chunks - i - 1))},
+                            {"loop_count", loop.string(to_string(n_of_chunks))}});
+                    scope.push(chunk);
+                    result += scope.render(*body);
+                    scope.pop();
                 }
                 return result;
             }
@@ -205,34 +157,24 @@ void register_view_lambdas(application &app) {
     });
 
 
-    app.lambda("if",[&app](const std::string & s, renderer& r) {
-        renderer_internal& ri = static_cast<renderer_internal&>(r);
+    app.view_lambda("if",[](const std::string & s, views::render_scope& scope) {
         wpp::json parameters = get_parameters(s);
         if (parameters.size() < 2) {
             return string();
         } else if (parameters.size() == 2) {
             if (parameters[0].is_string() && parameters[1].is_string()){
-                const json varname = parameters[1];
-                const string varnamestring = varname.get<string>();
-                const auto elem = ri.ctx->ctx.get(varnamestring);
-                if (elem != nullptr){
-                    json text = parameters[0];
-                    return r(text.get<std::string>());
+                if (scope.get(parameters[1].get<string>()) != nullptr){
+                    return scope.render(parameters[0].get<string>());
                 } else {
                     return string();
                 }
             }
         } else if (parameters.size() == 3) {
             if (parameters[0].is_string() && parameters[1].is_string() && parameters[2].is_string()){
-                const json varname1 = parameters[1];
-                const json varname2 = parameters[2];
-                const string varnamestring1 = varname1.get<string>();
-                const string varnamestring2 = varname2.get<string>();
-                const string s1 = r(string("{{") + varnamestring1 + "}}");
-                const string s2 = r(string("{{") + varnamestring2 + "}}");
+                const string s1 = scope.render(string("{{") + parameters[1].get<string>() + "}}");
+                const string s2 = scope.render(string("{{") + parameters[2].get<string>() + "}}");
                 if (!s1.empty() && s1 == s2){
-                    json text = parameters[0];
-                    return r(text.get<std::string>());
+                    return scope.render(parameters[0].get<string>());
                 }
             }
 
@@ -240,49 +182,16 @@ void register_view_lambdas(application &app) {
         return string();
     });
 
-    //app.lambda("push",[&app](const std::string & s, renderer& r) {
-    //    renderer_internal& ri = static_cast<renderer_internal&>(r);
-    //    vector<string> parameters;
-    //    if (get_parameters(s,parameters)) {
-    //        if (parameters.size() >= 2) {
-    //            auto stack_iter = ri.ctx->stacks.find(parameters[0]);
-    //            if (stack_iter != ri.ctx->stacks.end()){
-    //                stack_iter->second += parameters[1];
-    //            } else {
-    //                ri.ctx->stacks[parameters[0]] = parameters[1];
-    //            }
-    //        }
-    //    }
-    //    return string();
-    //});
-
-    //app.lambda("push_once",[&app](const std::string & s, renderer& r) {
-    //    renderer_internal& ri = static_cast<renderer_internal&>(r);
-    //    vector<string> parameters;
-    //    if (get_parameters(s,parameters)) {
-    //        if (parameters.size() >= 2) {
-    //            auto stack_iter = ri.ctx->stacks.find(parameters[0]);
-    //            if (stack_iter != ri.ctx->stacks.end()){
-    //                if (stack_iter->second.find(parameters[1]) == std::string::npos ){
-    //                    stack_iter->second += parameters[1];
-    //                }
-    //            } else {
-    //                ri.ctx->stacks[parameters[0]] = parameters[1];
-    //            }
-    //        }
+    //app.view_lambda("push",[](const std::string & s, views::render_scope& scope) {
+    //    wpp::json parameters = get_parameters(s);
+    //    if (parameters.size() >= 2) {
+    //        scope.state("stack:" + parameters[1].get<string>()) += parameters[0].get<string>();
     //    }
     //    return string();
     //});
 
-    app.lambda("stack",[&app](const std::string & s, renderer& r) {
-        renderer_internal& ri = static_cast<renderer_internal&>(r);
-        auto stack_iter = ri.ctx->stacks.find(s);
-        if (stack_iter != ri.ctx->stacks.end()){
-            return stack_iter->second;
-        } else {
-            return string();
-        }
-
+    app.view_lambda("stack",[](const std::string & s, views::render_scope& scope) {
+        return scope.state("stack:" + s);
     });
 
 } // end (void register_view_lambdas(application &app))
@@ -304,6 +213,19 @@ std::string csrf_token(application &app){
     return app.digest(total);
 }
 
+// the token of the context, or one made once per page
+std::string page_csrf_token(application &app, views::render_scope &scope){
+    const views::context_value *element = scope.get("_csrfmiddlewaretoken");
+    if (element != nullptr && element->is_string()){
+        return string(element->string());
+    }
+    string &token = scope.state("_csrfmiddlewaretoken");
+    if (token.empty()){
+        token = csrf_token(app);
+    }
+    return token;
+}
+
 wpp::json get_parameters(const string& s){
     const std::size_t start = 0;
     bool the_text_started_with_an_opening = s.substr(start,1) == "(";